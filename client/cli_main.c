@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,7 +8,10 @@
 #include <strings.h>
 #include <errno.h>
 #include <time.h>
+#include <poll.h>
+#include <signal.h>
 #include "../common/net_proto.h"
+#include "../common/tickets.h"
 
 // Forward declaration for reuse in REPL
 static int client_handle_oneshot(int argc, char **argv, const char *username);
@@ -184,6 +188,21 @@ static void format_time_hr(int t, char *out, size_t out_sz) {
     strftime(out, out_sz, "%Y-%m-%d %H:%M:%S", ptm);
 }
 
+// Between pages of a listing on a terminal: Enter fetches the next page, q stops. Non-interactive
+// output gets every page.
+static int more_prompt(void) {
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) return 1;
+    printf("-- more (Enter: next page, q: stop) -- "); fflush(stdout);
+    char ans[16];
+    if (!fgets(ans, sizeof(ans), stdin)) return 0;
+    return ans[0] != 'q' && ans[0] != 'Q';
+}
+
+// Paged listings (VIEW, VIEWFOLDER, LISTTRASH) arrive in several replies; table headers go with the
+// first page and footers with the last. Set by the paging loop in client_handle_oneshot.
+static int g_page_first = 1, g_page_last = 1;
+#define CLI_PAGE_SIZE 100
+
 static void print_human(const char *who, const char *json) {
     if (!json) { fprintf(stderr, "%s: (no response)\n", who); return; }
     int color = isatty(STDOUT_FILENO) && getenv("NO_COLOR") == NULL;
@@ -253,10 +272,12 @@ static void print_human(const char *who, const char *json) {
         // LISTTRASH: trashed items
         if (strstr(json, "\"trash\":")) {
             const char *p = strstr(json, "["); if (!p) { printf("%sOK%s\n", G, Z); return; }
-            if (color) printf("%sTrash:%s\n", C, Z); else printf("Trash:\n");
-            printf("┌──────────────┬────────┬───────┬──────────────────┬────────┐\n");
-            printf("│ File         │ Owner  │ SS ID │ Time             │ Status │\n");
-            printf("├──────────────┼────────┼───────┼──────────────────┼────────┤\n");
+            if (g_page_first) {
+                if (color) printf("%sTrash:%s\n", C, Z); else printf("Trash:\n");
+                printf("┌──────────────┬────────┬───────┬──────────────────┬────────┐\n");
+                printf("│ File         │ Owner  │ SS ID │ Time             │ Status │\n");
+                printf("├──────────────┼────────┼───────┼──────────────────┼────────┤\n");
+            }
             p++;
             int count = 0;
             while (*p && *p != ']') {
@@ -279,12 +300,9 @@ static void print_human(const char *who, const char *json) {
                 if (*p == ',') p++;
                 count++;
             }
-            if (count > 0) {
-                printf("└──────────────┴────────┴───────┴──────────────────┴────────┘\n");
-            } else {
-                printf("│ (empty)      │        │       │                  │        │\n");
-                printf("└──────────────┴────────┴───────┴──────────────────┴────────┘\n");
-            }
+            if (!g_page_last) return;
+            if (count == 0 && g_page_first) printf("│ (empty)      │        │       │                  │        │\n");
+            printf("└──────────────┴────────┴───────┴──────────────────┴────────┘\n");
             return;
         }
     // LIST_USERS: users list with active and inactive sections
@@ -463,7 +481,7 @@ static void print_human(const char *who, const char *json) {
             if (strstr(json, "\"folders\":[")) {
                 // Optional header: show folder path (use ~/ for root)
                 char vpath[256]; vpath[0]='\0';
-                if (json_get_string_field(json, "path", vpath, sizeof(vpath)) == 0) {
+                if (g_page_first && json_get_string_field(json, "path", vpath, sizeof(vpath)) == 0) {
                     if (strcmp(vpath, "~") == 0) printf("~/\n"); else printf("%s/\n", vpath);
                 }
                 // Print folders
@@ -523,9 +541,11 @@ static void print_human(const char *who, const char *json) {
         }
         if (strstr(json, "\"details\":[")) {
             // VIEW -l: print table
-            printf("┌────────────┬───────┬───────┬──────────────────┬───────┐\n");
-            printf("│  Filename  │ Words │ Chars │ Last Access Time │ Owner │\n");
-            printf("├────────────┼───────┼───────┼──────────────────┼───────┤\n");
+            if (g_page_first) {
+                printf("┌────────────┬───────┬───────┬──────────────────┬───────┐\n");
+                printf("│  Filename  │ Words │ Chars │ Last Access Time │ Owner │\n");
+                printf("├────────────┼───────┼───────┼──────────────────┼───────┤\n");
+            }
             const char *p = strstr(json, "["); if (!p) { printf("---------------------------------------------------------\n"); return; }
             p++;
             while (*p && *p!=']') {
@@ -547,7 +567,7 @@ static void print_human(const char *who, const char *json) {
                 while (*p && *p!=',' && *p!=']') p++;
                 if (*p==',') p++;
             }
-            printf("---------------------------------------------------------\n");
+            if (g_page_last) printf("---------------------------------------------------------\n");
             return;
         }
         // RENAME/MIGRATE/UNDO/CREATE/DELETE generic success
@@ -582,6 +602,308 @@ static void print_human(const char *who, const char *json) {
     else { if (color) printf("%sERROR:%s unrecognized server response\n", R, Z); else printf("ERROR: unrecognized server response\n"); }
 }
 
+// Session connections: the shell keeps one NM connection and a few SS connections open across
+// commands instead of dialing per command (both servers serve any number of requests on one
+// connection). A cached socket is checked before each reuse; if the peer closed it, or a previous
+// command left a reply unread, it is replaced by a fresh connection.
+#define CLI_SS_CONNS 4
+typedef struct { int fd; char host[64]; int port; unsigned long used; } sess_conn_t;
+static sess_conn_t g_nm_conn = { -1, "", 0, 0 };
+static sess_conn_t g_ss_conns[CLI_SS_CONNS];
+static unsigned long g_conn_tick = 0;
+
+// Idle and healthy: nothing to read, no hangup or error pending
+static int conn_idle(int fd) {
+    struct pollfd p = { .fd = fd, .events = POLLIN, .revents = 0 };
+    return poll(&p, 1, 0) == 0;
+}
+
+static int conn_get(sess_conn_t *c, const char *host, int port, int *reused) {
+    if (reused) *reused = 0;
+    if (c->fd > 0 && strcmp(c->host, host) == 0 && c->port == port && conn_idle(c->fd)) {
+        c->used = ++g_conn_tick;
+        if (reused) *reused = 1;
+        return c->fd;
+    }
+    if (c->fd > 0) close(c->fd);
+    c->fd = tcp_connect(host, (uint16_t)port);
+    if (c->fd < 0) { c->fd = -1; c->host[0] = '\0'; return -1; }
+    snprintf(c->host, sizeof(c->host), "%s", host);
+    c->port = port;
+    c->used = ++g_conn_tick;
+    return c->fd;
+}
+
+static void conn_drop(sess_conn_t *c) {
+    if (c->fd > 0) close(c->fd);
+    c->fd = -1; c->host[0] = '\0';
+}
+
+static int nm_conn(const char *host, uint16_t port, int *reused) { return conn_get(&g_nm_conn, host, port, reused); }
+
+// Connection to the SS at addr:port, reusing a cached one; the least recently used slot makes room
+static int ss_conn(const char *addr, int port) {
+    sess_conn_t *slot = &g_ss_conns[0];
+    for (int i = 0; i < CLI_SS_CONNS; ++i) {
+        sess_conn_t *c = &g_ss_conns[i];
+        if (c->fd > 0 && strcmp(c->host, addr) == 0 && c->port == port) { slot = c; break; }
+        if (c->fd <= 0) { if (slot->fd > 0) slot = c; }
+        else if (slot->fd > 0 && c->used < slot->used) slot = c;
+    }
+    return conn_get(slot, addr, port, NULL);
+}
+
+// Requests the NM answers without changing anything, so sending one twice is harmless
+static int nm_req_readonly(const char *req) {
+    static const char *const ro[] = { "LOOKUP", "INFO", "VIEW", "VIEWFOLDER", "LIST_USERS", "LISTTRASH", "VIEWREQUESTS" };
+    char type[32];
+    if (json_get_string_field(req, "type", type, sizeof(type)) != 0) return 0;
+    for (size_t i = 0; i < sizeof(ro) / sizeof(ro[0]); ++i) if (strcmp(type, ro[i]) == 0) return 1;
+    return 0;
+}
+
+// Send req on the session NM connection and wait for the reply. A reused connection that fails
+// (the NM restarted since the last command) is replaced and the request sent once more, but only
+// if the NM cannot have acted on it: the send itself failed, so no whole frame reached it, or the
+// request is read-only. A mutation whose reply was lost is reported as a failure, not repeated.
+static int nm_call(const char *host, uint16_t port, const char *req, char **resp, uint32_t *rlen) {
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        int reused = 0;
+        int fd = nm_conn(host, port, &reused);
+        if (fd < 0) return -1;
+        int sent = (send_msg(fd, req, (uint32_t)strlen(req)) == 0);
+        if (sent && recv_msg(fd, resp, rlen) == 0) return 0;
+        conn_drop(&g_nm_conn);
+        if (!reused || (sent && !nm_req_readonly(req))) break;
+    }
+    return -1;
+}
+
+// Route cache: LOOKUP results (SS address and ticket) reused until shortly before the ticket expires,
+// so repeated operations on a file go straight to the SS. Everything except a plain READ asks the NM
+// for a session capability (all ops the user may run on the file, op "*" here), so one LOOKUP covers
+// a read-write-checkpoint sequence; plain READs keep single tickets that may point at a replica. Entries are only trusted
+// while the watch connection is up: the NM pushes route changes on it (moves, renames, deletes, access
+// changes, replicas falling behind) and a closed watch forgets everything. An SS that turns a cached
+// ticket down, or cannot be reached, costs one fresh LOOKUP and a retry.
+#define ROUTE_SLOTS 64
+#define ROUTE_SLACK_SEC 10
+#define WATCH_RETRY_SEC 5
+typedef struct { char file[128]; char op[24]; int perms; char addr[64]; int port; char ticket[256]; long exp; unsigned long used; } route_t;
+static route_t g_routes[ROUTE_SLOTS];
+static unsigned long g_route_tick = 0;
+static int g_watch_fd = -1;
+static time_t g_watch_retry = 0;
+
+static void route_forget(const char *file, int reads_only) {
+    for (int i = 0; i < ROUTE_SLOTS; ++i) {
+        route_t *r = &g_routes[i];
+        if (!r->file[0]) continue;
+        if (file && strcmp(r->file, file) != 0) continue;
+        if (reads_only && strcmp(r->op, "READ") != 0) continue; // capabilities point at the primary
+        r->file[0] = '\0';
+    }
+}
+
+static void watch_close(void) {
+    if (g_watch_fd >= 0) close(g_watch_fd);
+    g_watch_fd = -1;
+    route_forget(NULL, 0);
+}
+
+// Apply the route changes the NM pushed since the last command
+static void route_sync(void) {
+    while (g_watch_fd >= 0) {
+        struct pollfd p = { .fd = g_watch_fd, .events = POLLIN, .revents = 0 };
+        if (poll(&p, 1, 0) <= 0) return;
+        char *m = NULL; uint32_t ml = 0;
+        if (recv_msg(g_watch_fd, &m, &ml) != 0 || !m) { free(m); watch_close(); return; }
+        int all = 0; char file[128]; char scope[8] = {0};
+        (void)json_get_int_field(m, "all", &all);
+        if (all) route_forget(NULL, 0);
+        else if (json_get_string_field(m, "file", file, sizeof(file)) == 0) {
+            (void)json_get_string_field(m, "scope", scope, sizeof(scope));
+            route_forget(file, scope[0] == 'R');
+        }
+        free(m);
+    }
+}
+
+// Open the watch if it is down (not more often than every WATCH_RETRY_SEC); returns 1 when it is up
+static int watch_ensure(const char *host, uint16_t port) {
+    if (g_watch_fd >= 0) return 1;
+    time_t now = time(NULL);
+    if (now < g_watch_retry) return 0;
+    g_watch_retry = now + WATCH_RETRY_SEC;
+    int fd = tcp_connect(host, port);
+    if (fd < 0) return 0;
+    const char *req = "{\"type\":\"WATCH\"}";
+    char *r = NULL; uint32_t rl = 0;
+    if (send_msg(fd, req, (uint32_t)strlen(req)) != 0 || recv_msg(fd, &r, &rl) != 0 || !r || !strstr(r, "\"status\":\"OK\"")) { free(r); close(fd); return 0; }
+    free(r);
+    g_watch_fd = fd;
+    return 1;
+}
+
+// A cached route for op on file: a capability granting op, or (unless primary) a single READ ticket
+static route_t *route_find(const char *file, const char *op, int primary) {
+    long now = (long)time(NULL);
+    int bit = ticket_op_bit(op);
+    for (int i = 0; i < ROUTE_SLOTS; ++i) {
+        route_t *r = &g_routes[i];
+        if (!r->file[0] || strcmp(r->file, file) != 0) continue;
+        if (!(strcmp(r->op, "*") == 0 && (r->perms & bit)) && (primary || strcmp(r->op, op) != 0)) continue;
+        if (r->exp - ROUTE_SLACK_SEC <= now) { r->file[0] = '\0'; continue; }
+        r->used = ++g_route_tick;
+        return r;
+    }
+    return NULL;
+}
+
+static void route_store(const route_t *nr) {
+    route_t *slot = &g_routes[0];
+    for (int i = 0; i < ROUTE_SLOTS; ++i) {
+        route_t *r = &g_routes[i];
+        if (r->file[0] && strcmp(r->file, nr->file) == 0 && strcmp(r->op, nr->op) == 0) { slot = r; break; }
+        if (!r->file[0]) { if (slot->file[0]) slot = r; }
+        else if (slot->file[0] && r->used < slot->used) slot = r;
+    }
+    *slot = *nr;
+    slot->used = ++g_route_tick;
+}
+
+// Expiry of a "file|op|ssid|exp|sig" ticket (parsed from the right: file names may contain '|')
+static long ticket_expiry(const char *ticket) {
+    const char *sig = strrchr(ticket, '|');
+    if (!sig || sig == ticket) return 0;
+    const char *p = sig - 1;
+    while (p > ticket && *p != '|') p--;
+    return *p == '|' ? atol(p + 1) : 0;
+}
+
+// Where to send op on file: a cached route unless fresh is set, else a LOOKUP whose answer is cached
+// for next time (only while the watch is up). Prints why and returns -1 when the NM says no.
+static int route_resolve(const char *nm_host, uint16_t nm_port, const char *user, const char *file, const char *op, int primary, int fresh, route_t *out, int *cached) {
+    int session = primary || strcmp(op, "READ") != 0;
+    route_sync();
+    int watching = watch_ensure(nm_host, nm_port);
+    *cached = 0;
+    if (!fresh && watching) {
+        route_t *r = route_find(file, op, primary);
+        if (r) { *out = *r; *cached = 1; return 0; }
+    }
+    char payload[512]; payload[0] = '\0';
+    json_put_string_field(payload, sizeof(payload), "type", "LOOKUP", 1);
+    json_put_string_field(payload, sizeof(payload), "op", op, 0);
+    json_put_string_field(payload, sizeof(payload), "file", file, 0);
+    json_put_string_field(payload, sizeof(payload), "user", user, 0);
+    if (primary) json_put_string_field(payload, sizeof(payload), "consistency", "primary", 0);
+    if (session) json_put_int_field(payload, sizeof(payload), "session", 1, 0);
+    strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
+    char *resp = NULL; uint32_t rlen = 0;
+    if (nm_call(nm_host, nm_port, payload, &resp, &rlen) != 0) { fprintf(stderr, "ERROR: failed to receive LOOKUP from NM\n"); return -1; }
+    char st[32] = {0}; (void)json_get_string_field(resp, "status", st, sizeof(st));
+    if (st[0] && strcmp(st, "OK") != 0) { print_human("NM", resp); free(resp); return -1; }
+    memset(out, 0, sizeof(*out));
+    int ok = (json_get_int_field(resp, "ssDataPort", &out->port) == 0 && json_get_string_field(resp, "ssAddr", out->addr, sizeof(out->addr)) == 0 && json_get_string_field(resp, "ticket", out->ticket, sizeof(out->ticket)) == 0);
+    // A new file's first WRITE is provisioned with a single ticket: no "perms" in the answer
+    if (!session || json_get_int_field(resp, "perms", &out->perms) != 0) out->perms = 0;
+    free(resp);
+    if (!ok || out->port <= 0) { fprintf(stderr, "ERROR: LOOKUP failed (no storage server available)\n"); return -1; }
+    snprintf(out->file, sizeof(out->file), "%s", file);
+    snprintf(out->op, sizeof(out->op), "%s", out->perms ? "*" : op);
+    out->exp = ticket_expiry(out->ticket);
+    // Store, then apply what was pushed while the LOOKUP was in flight: such a change may postdate the
+    // answer, so it is allowed to drop the entry just stored (as in route_prefetch)
+    if (watching && g_watch_fd >= 0) route_store(out);
+    route_sync();
+    return 0;
+}
+
+// Warm the cache for op on files[0..n) with LOOKUP_BATCH: one NM round trip for every file not cached
+// yet. Files the NM turns down are left out and resolved (and reported) one by one later.
+static void route_prefetch(const char *nm_host, uint16_t nm_port, const char *user, char **files, int n, const char *op, int primary) {
+    int session = primary || strcmp(op, "READ") != 0;
+    route_sync();
+    if (!watch_ensure(nm_host, nm_port)) return;
+    int *want = (int *)malloc(sizeof(int) * (size_t)(n > 0 ? n : 1)); int nw = 0;
+    size_t cap = 256 + (size_t)n * 300; char *req = (char *)malloc(cap);
+    if (!want || !req) { free(want); free(req); return; }
+    size_t w = (size_t)snprintf(req, cap, "{\"type\":\"LOOKUP_BATCH\",\"user\":\"%s\",\"session\":%d%s,\"items\":\"", user, session, primary ? ",\"consistency\":\"primary\"" : "");
+    for (int i = 0; i < n && nw < ROUTE_SLOTS && w < cap; ++i) {
+        if (route_find(files[i], op, primary)) continue;
+        char *h = hex_encode(files[i], strlen(files[i])); if (!h) continue;
+        w += (size_t)snprintf(req + w, cap - w, "%s%s:%s", nw ? "," : "", h, op); free(h);
+        want[nw++] = i;
+    }
+    if (w < cap) snprintf(req + w, cap - w, "\"}");
+    char *resp = NULL; uint32_t rlen = 0;
+    if (nw == 0 || w >= cap || nm_call(nm_host, nm_port, req, &resp, &rlen) != 0 || !resp) { free(want); free(req); free(resp); return; }
+    free(req);
+    // "routes":[{...},{...}] in request order; each item is a LOOKUP reply
+    char *it = strstr(resp, "\"routes\":[");
+    for (int k = 0; it && k < nw; ++k) {
+        char *b = strchr(it, '{'), *e = b ? strchr(b, '}') : NULL;
+        if (!e) break;
+        *e = '\0';
+        route_t rt; memset(&rt, 0, sizeof(rt));
+        char st[32] = {0}; (void)json_get_string_field(b, "status", st, sizeof(st));
+        if (strcmp(st, "OK") == 0 && json_get_int_field(b, "ssDataPort", &rt.port) == 0 && rt.port > 0 &&
+            json_get_string_field(b, "ssAddr", rt.addr, sizeof(rt.addr)) == 0 && json_get_string_field(b, "ticket", rt.ticket, sizeof(rt.ticket)) == 0) {
+            if (!session || json_get_int_field(b, "perms", &rt.perms) != 0) rt.perms = 0;
+            snprintf(rt.file, sizeof(rt.file), "%s", files[want[k]]);
+            snprintf(rt.op, sizeof(rt.op), "%s", rt.perms ? "*" : op);
+            rt.exp = ticket_expiry(rt.ticket);
+            route_store(&rt);
+        }
+        it = e + 1;
+    }
+    free(resp); free(want);
+    // Changes pushed meanwhile may postdate these answers: let them drop what was just stored
+    route_sync();
+}
+
+// Send req (a JSON object left open; the ticket and closing brace are appended here) to the SS serving
+// op on file and receive its first reply into *resp. A cached route that the SS turns down
+// (ERR_NOAUTH/ERR_NOTFOUND) or that no longer connects is dropped and the request repeated once after
+// a fresh LOOKUP. Returns the SS connection for follow-up messages, or -1 after printing why.
+static int ss_route_call(const char *nm_host, uint16_t nm_port, const char *user, const char *file, const char *op, int primary, const char *req, char **resp) {
+    *resp = NULL;
+    for (int fresh = 0; fresh < 2; ++fresh) {
+        route_t rt; int cached = 0;
+        if (route_resolve(nm_host, nm_port, user, file, op, primary, fresh, &rt, &cached) != 0) return -1;
+        int sfd = ss_conn(rt.addr, rt.port);
+        if (sfd < 0) {
+            if (cached) { route_forget(file, 0); continue; }
+            perror("connect SS"); return -1;
+        }
+        char full[1400]; snprintf(full, sizeof(full), "%s", req);
+        json_put_string_field(full, sizeof(full), "ticket", rt.ticket, 0);
+        strncat(full, "}", sizeof(full) - strlen(full) - 1);
+        uint32_t rl = 0;
+        if (send_msg(sfd, full, (uint32_t)strlen(full)) != 0 || recv_msg(sfd, resp, &rl) != 0 || !*resp) {
+            free(*resp); *resp = NULL;
+            if (cached) { route_forget(file, 0); continue; }
+            perror("SS request"); return -1;
+        }
+        char st[32] = {0}; (void)json_get_string_field(*resp, "status", st, sizeof(st));
+        if (cached && (strcmp(st, "ERR_NOAUTH") == 0 || strcmp(st, "ERR_NOTFOUND") == 0)) {
+            free(*resp); *resp = NULL;
+            route_forget(file, 0);
+            continue;
+        }
+        return sfd;
+    }
+    return -1;
+}
+
+static void conns_close_all(void) {
+    conn_drop(&g_nm_conn);
+    for (int i = 0; i < CLI_SS_CONNS; ++i) conn_drop(&g_ss_conns[i]);
+    if (g_watch_fd >= 0) close(g_watch_fd);
+    g_watch_fd = -1;
+}
+
 int main(int argc, char **argv) {
     // Interactive REPL mode only; optional host/port override
     char nm_host[64]; snprintf(nm_host, sizeof(nm_host), "%s", "127.0.0.1");
@@ -591,6 +913,10 @@ int main(int argc, char **argv) {
         fprintf(stderr, "[CLI] One-shot mode has been removed. Starting interactive shell. To set host/port, run: %s <host> <port>\n", argv[0]);
     }
 
+    // Session connections may have been closed by the server since the last command; a write to
+    // one must fail with EPIPE (and trigger a reconnect), not kill the shell
+    signal(SIGPIPE, SIG_IGN);
+
     char username[128];
     for (;;) {
         fprintf(stdout, "Enter username: "); fflush(stdout);
@@ -598,23 +924,21 @@ int main(int argc, char **argv) {
         rstrip(username);
         if (!username[0]) continue; // Empty username, try again
         
-        // Say hello once
-        int hfd = tcp_connect(nm_host, nm_port);
+        // Say hello once; this opens the session's NM connection
+        int hfd = nm_conn(nm_host, nm_port, NULL);
         if (hfd >= 0) {
             char hello[256]; hello[0]='\0'; json_put_string_field(hello, sizeof(hello), "type", "CLIENT_HELLO", 1); json_put_string_field(hello, sizeof(hello), "user", username, 0); strncat(hello, "}", sizeof(hello)-strlen(hello)-1);
-            (void)send_msg(hfd, hello, (uint32_t)strlen(hello)); 
             char *hr=NULL; uint32_t hrl=0; 
-            if (recv_msg(hfd, &hr, &hrl) == 0 && hr) {
+            if (nm_call(nm_host, nm_port, hello, &hr, &hrl) == 0 && hr) {
                 char status[32] = {0};
                 json_get_string_field(hr, "status", status, sizeof(status));
                 if (strcmp(status, "ERR_CONFLICT") == 0) {
                     fprintf(stderr, "ERROR: User already exists. Create new.\n");
-                    free(hr); close(hfd);
+                    free(hr);
                     continue; // Ask for username again
                 }
                 free(hr);
             }
-            close(hfd);
             break; // Successfully registered
         } else {
             fprintf(stderr, "[CLI] Could not connect to NM at %s:%u (will try per command)\n", nm_host, (unsigned)nm_port);
@@ -639,7 +963,7 @@ int main(int argc, char **argv) {
         if (CMDEQ(line, "help")) {
             printf("Commands:\n");
             printf("  VIEW [-a] [-l]\n");
-            printf("  READ <file>\n");
+            printf("  READ <file>... [-p]\n");
             printf("  CREATE <file> [-r] [-w]\n");
             printf("  WRITE <file> <sentenceIndex>\n");
             printf("  UNDO <file>\n");
@@ -648,7 +972,7 @@ int main(int argc, char **argv) {
             printf("  LISTTRASH\n");
             printf("  RESTORE <file>\n");
             printf("  EMPTYTRASH [<file>]\n");
-            printf("  STREAM <file>\n");
+            printf("  STREAM <file> [-p]\n");
             printf("  LIST\n");
             printf("  ADDACCESS -r|-w <file> <user>\n");
             printf("  REMACCESS <file> <user>\n");
@@ -677,11 +1001,9 @@ int main(int argc, char **argv) {
         free_tokens(tokv, tn);
     }
     // On exit, try to notify NM to mark this user inactive
-    int lfd = tcp_connect(nm_host, nm_port);
-    if (lfd >= 0) {
-        char bye[256]; bye[0]='\0'; json_put_string_field(bye, sizeof(bye), "type", "LOGOUT", 1); json_put_string_field(bye, sizeof(bye), "user", username, 0); strncat(bye, "}", sizeof(bye)-strlen(bye)-1);
-        (void)send_msg(lfd, bye, (uint32_t)strlen(bye)); char *br=NULL; uint32_t bl=0; (void)recv_msg(lfd, &br, &bl); if (br) free(br); close(lfd);
-    }
+    char bye[256]; bye[0]='\0'; json_put_string_field(bye, sizeof(bye), "type", "LOGOUT", 1); json_put_string_field(bye, sizeof(bye), "user", username, 0); strncat(bye, "}", sizeof(bye)-strlen(bye)-1);
+    char *br=NULL; uint32_t bl=0; if (nm_call(nm_host, nm_port, bye, &br, &bl) == 0) free(br);
+    conns_close_all();
     return 0;
 }
 
@@ -690,9 +1012,8 @@ static int client_handle_oneshot(int argc, char **argv, const char *username) {
     const char *nm_host = argv[1];
     uint16_t nm_port = (uint16_t)atoi(argv[2]);
     const char *cmd = argv[3];
-    int fd = tcp_connect(nm_host, nm_port);
+    int fd = nm_conn(nm_host, nm_port, NULL);
     if (CMDEQ(cmd, "CLEAR")) {
-        if (fd >= 0) close(fd);
         fputs("\x1b[2J\x1b[H", stdout);
         fflush(stdout);
         return 0;
@@ -709,7 +1030,7 @@ static int client_handle_oneshot(int argc, char **argv, const char *username) {
         json_put_string_field(payload, sizeof(payload), "user", username, 0);
         strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
     } else if (CMDEQ(cmd, "RESTORE")) {
-        if (argc < 5) { fprintf(stderr, "RESTORE requires <file>\n"); close(fd); return 1; }
+        if (argc < 5) { fprintf(stderr, "RESTORE requires <file>\n"); return 1; }
         const char *file = argv[4];
         json_put_string_field(payload, sizeof(payload), "type", "RESTORE", 1);
         json_put_string_field(payload, sizeof(payload), "file", file, 0);
@@ -733,24 +1054,24 @@ static int client_handle_oneshot(int argc, char **argv, const char *username) {
         json_put_string_field(payload, sizeof(payload), "user", username, 0);
         strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
     } else if (CMDEQ(cmd, "INFO")) {
-        if (argc < 5) { fprintf(stderr, "INFO requires <file>\n"); close(fd); return 1; }
+        if (argc < 5) { fprintf(stderr, "INFO requires <file>\n"); return 1; }
         const char *file = argv[4];
         json_put_string_field(payload, sizeof(payload), "type", "INFO", 1);
         json_put_string_field(payload, sizeof(payload), "file", file, 0);
         json_put_string_field(payload, sizeof(payload), "user", username, 0);
         strncat(payload, "}", sizeof(payload)-strlen(payload)-1);
     } else if (CMDEQ(cmd, "EXEC")) {
-        if (argc < 5) { fprintf(stderr, "EXEC requires <file>\n"); close(fd); return 1; }
+        if (argc < 5) { fprintf(stderr, "EXEC requires <file>\n"); return 1; }
         const char *file = argv[4];
         json_put_string_field(payload, sizeof(payload), "type", "EXEC", 1);
         json_put_string_field(payload, sizeof(payload), "file", file, 0);
         json_put_string_field(payload, sizeof(payload), "user", username, 0);
         strncat(payload, "}", sizeof(payload)-strlen(payload)-1);
         // Send request then stream frames until STOP
-        if (send_msg(fd, payload, (uint32_t)strlen(payload)) != 0) { perror("send EXEC"); close(fd); return 1; }
+        if (send_msg(fd, payload, (uint32_t)strlen(payload)) != 0) { perror("send EXEC"); return 1; }
         int started=0;
         for (;;) {
-            char *fr=NULL; uint32_t fl=0; if (recv_msg(fd, &fr, &fl) != 0) { fprintf(stderr, "ERROR: EXEC stream interrupted\n"); close(fd); return 1; }
+            char *fr=NULL; uint32_t fl=0; if (recv_msg(fd, &fr, &fl) != 0) { fprintf(stderr, "ERROR: EXEC stream interrupted\n"); return 1; }
             char st[32]={0}; (void)json_get_string_field(fr, "status", st, sizeof(st));
             if (strcmp(st, "STOP") == 0) {
                 int ec=0; (void)json_get_int_field(fr, "exit", &ec);
@@ -778,74 +1099,54 @@ static int client_handle_oneshot(int argc, char **argv, const char *username) {
             // Any other status -> print via print_human and abort
             print_human("NM", fr); free(fr); break;
         }
-        close(fd); return 0;
-    } else if (CMDEQ(cmd, "READ")) {
-        if (argc < 5) { fprintf(stderr, "read requires <file>\n"); close(fd); return 1; }
-        const char *file = argv[4];
-        // First LOOKUP
-        json_put_string_field(payload, sizeof(payload), "type", "LOOKUP", 1);
-        json_put_string_field(payload, sizeof(payload), "op", "READ", 0);
-        json_put_string_field(payload, sizeof(payload), "file", file, 0);
-        json_put_string_field(payload, sizeof(payload), "user", username, 0);
-        strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
-        if (send_msg(fd, payload, (uint32_t)strlen(payload)) < 0) { perror("send"); close(fd); return 1; }
-        char *resp = NULL; uint32_t rlen = 0;
-    if (recv_msg(fd, &resp, &rlen) < 0) { fprintf(stderr, "ERROR: failed to receive LOOKUP from NM\n"); close(fd); return 1; }
-        // Check status first
-        char st[32]={0}; (void)json_get_string_field(resp, "status", st, sizeof(st));
-        if (st[0] && strcmp(st, "OK") != 0) { print_human("NM", resp); free(resp); close(fd); return 1; }
-        // Parse ssDataPort
-    int dport = 0; char ssaddr[64] = {0}; char ticket[256] = {0};
-    int ok = (json_get_int_field(resp, "ssDataPort", &dport) == 0 && json_get_string_field(resp, "ssAddr", ssaddr, sizeof(ssaddr)) == 0 && json_get_string_field(resp, "ticket", ticket, sizeof(ticket)) == 0);
-        free(resp); close(fd);
-    if (!ok || dport <= 0) { fprintf(stderr, "ERROR: LOOKUP failed (no storage server available)\n"); return 1; }
-        // Connect to SS and READ
-        int sfd = tcp_connect(ssaddr, (uint16_t)dport);
-        if (sfd < 0) { perror("connect SS"); return 1; }
-        char req[256]; req[0] = '\0';
-        json_put_string_field(req, sizeof(req), "type", "READ", 1);
-        json_put_string_field(req, sizeof(req), "file", file, 0);
-    json_put_string_field(req, sizeof(req), "ticket", ticket, 0);
-        strncat(req, "}", sizeof(req) - strlen(req) - 1);
-        if (send_msg(sfd, req, (uint32_t)strlen(req)) < 0) { perror("send READ"); close(sfd); return 1; }
-        char *r2 = NULL; uint32_t r2len = 0;
-        if (recv_msg(sfd, &r2, &r2len) < 0) { perror("recv READ"); close(sfd); return 1; }
-    print_human("SS", r2);
-        free(r2); close(sfd);
         return 0;
+    } else if (CMDEQ(cmd, "READ")) {
+        if (argc < 5) { fprintf(stderr, "read requires <file>... [-p]\n"); return 1; }
+        // -p pins the read to the primary so it sees our own latest write
+        int primary = 0; char *files[64]; int nf = 0;
+        for (int i = 4; i < argc; ++i) {
+            if (strcmp(argv[i], "-p") == 0) primary = 1;
+            else if (nf < 64) files[nf++] = argv[i];
+        }
+        if (nf == 0) { fprintf(stderr, "read requires <file>... [-p]\n"); return 1; }
+        // Several files: route them all with one LOOKUP_BATCH, then read each
+        if (nf > 1) route_prefetch(nm_host, nm_port, username, files, nf, "READ", primary);
+        int rc = 0;
+        for (int i = 0; i < nf; ++i) {
+            if (nf > 1) printf("%s==> %s <==\n", i ? "\n" : "", files[i]);
+            char req[256]; req[0] = '\0';
+            json_put_string_field(req, sizeof(req), "type", "READ", 1);
+            json_put_string_field(req, sizeof(req), "file", files[i], 0);
+            char *r2 = NULL;
+            if (ss_route_call(nm_host, nm_port, username, files[i], "READ", primary, req, &r2) < 0) { rc = 1; continue; }
+            print_human("SS", r2);
+            free(r2);
+        }
+        return rc;
     } else if (CMDEQ(cmd, "STREAM")) {
-        if (argc < 5) { fprintf(stderr, "STREAM requires <file>\n"); close(fd); return 1; }
+        if (argc < 5) { fprintf(stderr, "STREAM requires <file> [-p]\n"); return 1; }
         const char *file = argv[4];
-        // LOOKUP READ
-        json_put_string_field(payload, sizeof(payload), "type", "LOOKUP", 1);
-        json_put_string_field(payload, sizeof(payload), "op", "READ", 0);
-        json_put_string_field(payload, sizeof(payload), "file", file, 0);
-        json_put_string_field(payload, sizeof(payload), "user", username, 0);
-        strncat(payload, "}", sizeof(payload)-strlen(payload)-1);
-        if (send_msg(fd, payload, (uint32_t)strlen(payload)) < 0) { perror("send"); close(fd); return 1; }
-        char *resp=NULL; uint32_t rlen=0; if (recv_msg(fd, &resp, &rlen) < 0) { perror("recv"); close(fd); return 1; }
-        // Check status first
-        char st[32]={0}; (void)json_get_string_field(resp, "status", st, sizeof(st));
-        if (st[0] && strcmp(st, "OK") != 0) { print_human("NM", resp); free(resp); close(fd); return 1; }
-    int dport=0; char ssaddr[64]={0}; char ticket[256]={0}; int ok = (json_get_int_field(resp, "ssDataPort", &dport)==0 && json_get_string_field(resp, "ssAddr", ssaddr, sizeof(ssaddr))==0 && json_get_string_field(resp, "ticket", ticket, sizeof(ticket))==0); free(resp); close(fd); if (!ok || dport<=0) { fprintf(stderr, "ERROR: LOOKUP failed (no storage server available)\n"); return 1; }
-        int sfd = tcp_connect(ssaddr, (uint16_t)dport); if (sfd < 0) { perror("connect SS"); return 1; }
-        char req[512]; req[0]='\0'; json_put_string_field(req, sizeof(req), "type", "STREAM", 1); json_put_string_field(req, sizeof(req), "file", file, 0); json_put_string_field(req, sizeof(req), "ticket", ticket, 0); strncat(req, "}", sizeof(req)-strlen(req)-1);
-        if (send_msg(sfd, req, (uint32_t)strlen(req)) != 0) { perror("send STREAM"); close(sfd); return 1; }
+        int primary = 0; for (int i = 5; i < argc; ++i) if (strcmp(argv[i], "-p") == 0) primary = 1;
+        char req[512]; req[0]='\0'; json_put_string_field(req, sizeof(req), "type", "STREAM", 1); json_put_string_field(req, sizeof(req), "file", file, 0);
+        char *fr = NULL;
+        int sfd = ss_route_call(nm_host, nm_port, username, file, "READ", primary, req, &fr);
+        if (sfd < 0) return 1;
         // receive frames until STOP
         int first=1; for (;;) {
-            char *fr=NULL; uint32_t fl=0; if (recv_msg(sfd, &fr, &fl) != 0 || !fr || fl==0) { fprintf(stderr, "\nERROR: service unavailable (stream interrupted)\n"); close(sfd); return 1; }
+            uint32_t fl=0; if (!fr && (recv_msg(sfd, &fr, &fl) != 0 || !fr)) { fprintf(stderr, "\nERROR: service unavailable (stream interrupted)\n"); return 1; }
             char st[16]={0}; (void)json_get_string_field(fr, "status", st, sizeof(st));
             if (strcmp(st, "STOP")==0) { free(fr); break; }
+            if (st[0] && strcmp(st, "OK") != 0) { if (!first) printf("\n"); print_human("SS", fr); free(fr); return 1; }
             char word[260]={0}; if (json_get_string_field(fr, "word", word, sizeof(word)) == 0) {
                 if (!first) { printf(" "); }
                 first = 0;
                 printf("%s", word); fflush(stdout);
             }
-            free(fr);
+            free(fr); fr = NULL;
         }
-        printf("\n"); close(sfd); return 0;
+        printf("\n"); return 0;
     } else if (CMDEQ(cmd, "CREATE")) {
-        if (argc < 5) { fprintf(stderr, "create requires <file> [-r] [-w]\n"); close(fd); return 1; }
+        if (argc < 5) { fprintf(stderr, "create requires <file> [-r] [-w]\n"); return 1; }
         const char *file = argv[4];
         int pubR = 0, pubW = 0;
         for (int i = 5; i < argc; ++i) {
@@ -859,32 +1160,20 @@ static int client_handle_oneshot(int argc, char **argv, const char *username) {
         if (pubW) json_put_int_field(payload, sizeof(payload), "publicWrite", 1, 0);
         strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
     } else if (CMDEQ(cmd, "DELETE")) {
-        if (argc < 5) { fprintf(stderr, "delete requires <file>\n"); close(fd); return 1; }
+        if (argc < 5) { fprintf(stderr, "delete requires <file>\n"); return 1; }
         const char *file = argv[4];
         json_put_string_field(payload, sizeof(payload), "type", "DELETE", 1);
         json_put_string_field(payload, sizeof(payload), "file", file, 0);
         json_put_string_field(payload, sizeof(payload), "user", username, 0);
         strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
     } else if (CMDEQ(cmd, "WRITE")) {
-        if (argc < 6) { fprintf(stderr, "WRITE requires <file> <sentenceIndex>\n"); close(fd); return 1; }
+        if (argc < 6) { fprintf(stderr, "WRITE requires <file> <sentenceIndex>\n"); return 1; }
         const char *file = argv[4]; int sidx = atoi(argv[5]);
-        // LOOKUP WRITE
-        json_put_string_field(payload, sizeof(payload), "type", "LOOKUP", 1);
-        json_put_string_field(payload, sizeof(payload), "op", "WRITE", 0);
-        json_put_string_field(payload, sizeof(payload), "file", file, 0);
-        json_put_string_field(payload, sizeof(payload), "user", username, 0);
-        strncat(payload, "}", sizeof(payload)-strlen(payload)-1);
-        if (send_msg(fd, payload, (uint32_t)strlen(payload)) != 0) { perror("send"); close(fd); return 1; }
-        char *resp=NULL; uint32_t rlen=0; if (recv_msg(fd, &resp, &rlen) != 0) { perror("recv"); close(fd); return 1; }
-        char st_lookup[32]={0}; (void)json_get_string_field(resp, "status", st_lookup, sizeof(st_lookup));
-        if (st_lookup[0] && strcmp(st_lookup, "OK") != 0) { print_human("NM", resp); free(resp); close(fd); return 1; }
-        int dport=0; char ssaddr[64]={0}; char ticket[256]={0}; int ok=(json_get_int_field(resp, "ssDataPort", &dport)==0 && json_get_string_field(resp, "ssAddr", ssaddr, sizeof(ssaddr))==0 && json_get_string_field(resp, "ticket", ticket, sizeof(ticket))==0);
-        if (!ok || dport<=0) { print_human("NM", resp); free(resp); close(fd); return 1; }
-        free(resp); close(fd);
-        int sfd = tcp_connect(ssaddr, (uint16_t)dport); if (sfd<0){ perror("connect SS"); return 1; }
-        char req[512]; req[0]='\0'; json_put_string_field(req, sizeof(req), "type", "BEGIN_WRITE", 1); json_put_string_field(req, sizeof(req), "file", file, 0); json_put_int_field(req, sizeof(req), "sentenceIndex", sidx, 0); json_put_string_field(req, sizeof(req), "ticket", ticket, 0); strncat(req, "}", sizeof(req)-strlen(req)-1);
-        if (send_msg(sfd, req, (uint32_t)strlen(req)) != 0) { perror("send BEGIN_WRITE"); close(sfd); return 1; }
-        char *r1=NULL; uint32_t r1l=0; if (recv_msg(sfd, &r1, &r1l) != 0 || !r1 || !strstr(r1, "\"status\":\"OK\"")) { print_human("SS", r1); free(r1); close(sfd); return 1; }
+        char req[512]; req[0]='\0'; json_put_string_field(req, sizeof(req), "type", "BEGIN_WRITE", 1); json_put_string_field(req, sizeof(req), "file", file, 0); json_put_int_field(req, sizeof(req), "sentenceIndex", sidx, 0);
+        char *r1=NULL;
+        int sfd = ss_route_call(nm_host, nm_port, username, file, "WRITE", 0, req, &r1);
+        if (sfd < 0) return 1;
+        if (!strstr(r1, "\"status\":\"OK\"")) { print_human("SS", r1); free(r1); return 1; }
         free(r1);
         // interactive APPLYs
         fprintf(stdout, "Enter <word_index> <content> lines; finish with ETIRW on its own line\n"); fflush(stdout);
@@ -908,9 +1197,9 @@ static int client_handle_oneshot(int argc, char **argv, const char *username) {
         }
         // end write
         char ereq[64]; ereq[0]='\0'; json_put_string_field(ereq, sizeof(ereq), "type", "END_WRITE", 1); strncat(ereq, "}", sizeof(ereq)-strlen(ereq)-1);
-        if (send_msg(sfd, ereq, (uint32_t)strlen(ereq)) == 0) { char *er=NULL; uint32_t el=0; if (recv_msg(sfd, &er, &el) == 0) print_human("SS", er); free(er);} close(sfd); return 0;
+        if (send_msg(sfd, ereq, (uint32_t)strlen(ereq)) == 0) { char *er=NULL; uint32_t el=0; if (recv_msg(sfd, &er, &el) == 0) print_human("SS", er); free(er);} return 0;
     } else if (CMDEQ(cmd, "RENAME")) {
-        if (argc < 6) { fprintf(stderr, "rename requires <old> <new>\n"); close(fd); return 1; }
+        if (argc < 6) { fprintf(stderr, "rename requires <old> <new>\n"); return 1; }
         const char *of = argv[4]; const char *nf = argv[5];
         json_put_string_field(payload, sizeof(payload), "type", "RENAME", 1);
         json_put_string_field(payload, sizeof(payload), "file", of, 0);
@@ -918,67 +1207,31 @@ static int client_handle_oneshot(int argc, char **argv, const char *username) {
         json_put_string_field(payload, sizeof(payload), "user", username, 0);
         strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
     } else if (CMDEQ(cmd, "UNDO")) {
-        if (argc < 5) { fprintf(stderr, "undo requires <file>\n"); close(fd); return 1; }
+        if (argc < 5) { fprintf(stderr, "undo requires <file>\n"); return 1; }
         const char *file = argv[4];
-        // LOOKUP for UNDO
-        json_put_string_field(payload, sizeof(payload), "type", "LOOKUP", 1);
-        json_put_string_field(payload, sizeof(payload), "op", "UNDO", 0);
-        json_put_string_field(payload, sizeof(payload), "file", file, 0);
-        json_put_string_field(payload, sizeof(payload), "user", username, 0);
-        strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
-        if (send_msg(fd, payload, (uint32_t)strlen(payload)) < 0) { perror("send"); close(fd); return 1; }
-        char *resp = NULL; uint32_t rlen = 0;
-    if (recv_msg(fd, &resp, &rlen) < 0) { fprintf(stderr, "ERROR: failed to receive LOOKUP from NM\n"); close(fd); return 1; }
-        char st_lookup_undo[32]={0}; (void)json_get_string_field(resp, "status", st_lookup_undo, sizeof(st_lookup_undo));
-        if (st_lookup_undo[0] && strcmp(st_lookup_undo, "OK") != 0) { print_human("NM", resp); free(resp); close(fd); return 1; }
-        int dport = 0; char ssaddr[64] = {0}; char ticket[256] = {0};
-        int ok = (json_get_int_field(resp, "ssDataPort", &dport) == 0 && json_get_string_field(resp, "ssAddr", ssaddr, sizeof(ssaddr)) == 0 && json_get_string_field(resp, "ticket", ticket, sizeof(ticket)) == 0);
-        if (!ok || dport <= 0) { print_human("NM", resp); free(resp); close(fd); return 1; }
-        free(resp); close(fd);
-        int sfd = tcp_connect(ssaddr, (uint16_t)dport);
-        if (sfd < 0) { perror("connect SS"); return 1; }
         char req[256]; req[0] = '\0';
         json_put_string_field(req, sizeof(req), "type", "UNDO", 1);
         json_put_string_field(req, sizeof(req), "file", file, 0);
-        json_put_string_field(req, sizeof(req), "ticket", ticket, 0);
-        strncat(req, "}", sizeof(req) - strlen(req) - 1);
-        if (send_msg(sfd, req, (uint32_t)strlen(req)) < 0) { perror("send UNDO"); close(sfd); return 1; }
-        char *r2 = NULL; uint32_t r2l = 0;
-        if (recv_msg(sfd, &r2, &r2l) < 0) { perror("recv UNDO"); close(sfd); return 1; }
-    print_human("SS", r2);
-        free(r2); close(sfd);
+        char *r2 = NULL;
+        if (ss_route_call(nm_host, nm_port, username, file, "UNDO", 0, req, &r2) < 0) return 1;
+        print_human("SS", r2);
+        free(r2);
         return 0;
     } else if (CMDEQ(cmd, "REVERT")) {
-        if (argc < 6) { fprintf(stderr, "revert requires <file> <checkpoint_tag>\n"); close(fd); return 1; }
+        if (argc < 6) { fprintf(stderr, "revert requires <file> <checkpoint_tag>\n"); return 1; }
         const char *file = argv[4]; const char *ver_or_name = argv[5];
-        json_put_string_field(payload, sizeof(payload), "type", "LOOKUP", 1);
-        json_put_string_field(payload, sizeof(payload), "op", "REVERT", 0);
-        json_put_string_field(payload, sizeof(payload), "file", file, 0);
-        json_put_string_field(payload, sizeof(payload), "user", username, 0);
-        strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
-        if (send_msg(fd, payload, (uint32_t)strlen(payload)) < 0) { perror("send"); close(fd); return 1; }
-    char *resp = NULL; uint32_t rlen = 0; if (recv_msg(fd, &resp, &rlen) < 0) { fprintf(stderr, "ERROR: failed to receive LOOKUP from NM\n"); close(fd); return 1; }
-        char st_lookup_revert[32]={0}; (void)json_get_string_field(resp, "status", st_lookup_revert, sizeof(st_lookup_revert));
-        if (st_lookup_revert[0] && strcmp(st_lookup_revert, "OK") != 0) { print_human("NM", resp); free(resp); close(fd); return 1; }
-        int dport = 0; char ssaddr[64] = {0}; char ticket[256] = {0};
-        int ok = (json_get_int_field(resp, "ssDataPort", &dport) == 0 && json_get_string_field(resp, "ssAddr", ssaddr, sizeof(ssaddr)) == 0 && json_get_string_field(resp, "ticket", ticket, sizeof(ticket)) == 0);
-        if (!ok || dport <= 0) { print_human("NM", resp); free(resp); close(fd); return 1; }
-        free(resp); close(fd);
-        int sfd = tcp_connect(ssaddr, (uint16_t)dport); if (sfd < 0) { perror("connect SS"); return 1; }
         char req[256]; req[0] = '\0';
         json_put_string_field(req, sizeof(req), "type", "REVERT", 1);
         json_put_string_field(req, sizeof(req), "file", file, 0);
         // Always treat second argument as checkpoint tag
         json_put_string_field(req, sizeof(req), "name", ver_or_name, 0);
-        json_put_string_field(req, sizeof(req), "ticket", ticket, 0);
-        strncat(req, "}", sizeof(req) - strlen(req) - 1);
-        if (send_msg(sfd, req, (uint32_t)strlen(req)) < 0) { perror("send REVERT"); close(sfd); return 1; }
-        char *r2 = NULL; uint32_t r2l = 0; if (recv_msg(sfd, &r2, &r2l) < 0) { perror("recv REVERT"); close(sfd); return 1; }
-    print_human("SS", r2);
-        free(r2); close(sfd);
+        char *r2 = NULL;
+        if (ss_route_call(nm_host, nm_port, username, file, "REVERT", 0, req, &r2) < 0) return 1;
+        print_human("SS", r2);
+        free(r2);
         return 0;
     } else if (CMDEQ(cmd, "ADDACCESS")) {
-        if (argc < 7) { fprintf(stderr, "ADDACCESS requires -r|-w <file> <user>\n"); close(fd); return 1; }
+        if (argc < 7) { fprintf(stderr, "ADDACCESS requires -r|-w <file> <user>\n"); return 1; }
         const char *flag = argv[4]; const char *file = argv[5]; const char *user = argv[6]; 
         const char *mode = (strcmp(flag, "-w")==0 || strcmp(flag, "-rw")==0 || strcmp(flag, "-wr")==0)?"RW":"R";
         json_put_string_field(payload, sizeof(payload), "type", "ADDACCESS", 1);
@@ -987,26 +1240,26 @@ static int client_handle_oneshot(int argc, char **argv, const char *username) {
         json_put_string_field(payload, sizeof(payload), "mode", mode, 0);
         strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
     } else if (CMDEQ(cmd, "REMACCESS")) {
-        if (argc < 6) { fprintf(stderr, "remaccess requires <file> <user>\n"); close(fd); return 1; }
+        if (argc < 6) { fprintf(stderr, "remaccess requires <file> <user>\n"); return 1; }
         const char *file = argv[4]; const char *user = argv[5];
         json_put_string_field(payload, sizeof(payload), "type", "REMACCESS", 1);
         json_put_string_field(payload, sizeof(payload), "file", file, 0);
         json_put_string_field(payload, sizeof(payload), "user", user, 0);
         strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
     } else if (CMDEQ(cmd, "CREATEFOLDER")) {
-        if (argc < 5) { fprintf(stderr, "CREATEFOLDER requires <path>\n"); close(fd); return 1; }
+        if (argc < 5) { fprintf(stderr, "CREATEFOLDER requires <path>\n"); return 1; }
         const char *path = argv[4];
         json_put_string_field(payload, sizeof(payload), "type", "CREATEFOLDER", 1);
         json_put_string_field(payload, sizeof(payload), "path", path, 0);
         strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
     } else if (CMDEQ(cmd, "VIEWFOLDER")) {
-        if (argc < 5) { fprintf(stderr, "VIEWFOLDER requires <path>\n"); close(fd); return 1; }
+        if (argc < 5) { fprintf(stderr, "VIEWFOLDER requires <path>\n"); return 1; }
         const char *path = argv[4];
         json_put_string_field(payload, sizeof(payload), "type", "VIEWFOLDER", 1);
         json_put_string_field(payload, sizeof(payload), "path", path, 0);
         strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
     } else if (CMDEQ(cmd, "MOVE")) {
-        if (argc < 6) { fprintf(stderr, "MOVE requires <src> <dst>\n"); close(fd); return 1; }
+        if (argc < 6) { fprintf(stderr, "MOVE requires <src> <dst>\n"); return 1; }
         const char *src = argv[4]; const char *dst = argv[5];
         json_put_string_field(payload, sizeof(payload), "type", "MOVE", 1);
         json_put_string_field(payload, sizeof(payload), "src", src, 0);
@@ -1014,7 +1267,7 @@ static int client_handle_oneshot(int argc, char **argv, const char *username) {
         json_put_string_field(payload, sizeof(payload), "user", username, 0);
         strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
     } else if (CMDEQ(cmd, "REQUEST_ACCESS")) {
-        if (argc < 5) { fprintf(stderr, "REQUEST_ACCESS requires <file> [ -r | -w ]\n"); close(fd); return 1; }
+        if (argc < 5) { fprintf(stderr, "REQUEST_ACCESS requires <file> [ -r | -w ]\n"); return 1; }
         const char *file = argv[4]; const char *mode = "R";
         if (argc >= 6) {
             if (strcmp(argv[5], "-w") == 0 || strcmp(argv[5], "-rw") == 0 || strcmp(argv[5], "-wr") == 0) mode = "W";
@@ -1026,96 +1279,71 @@ static int client_handle_oneshot(int argc, char **argv, const char *username) {
         json_put_string_field(payload, sizeof(payload), "mode", mode, 0);
         strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
     } else if (CMDEQ(cmd, "VIEWREQUESTS")) {
-        if (argc < 5) { fprintf(stderr, "VIEWREQUESTS requires <file>\n"); close(fd); return 1; }
+        if (argc < 5) { fprintf(stderr, "VIEWREQUESTS requires <file>\n"); return 1; }
         const char *file = argv[4];
         json_put_string_field(payload, sizeof(payload), "type", "VIEWREQUESTS", 1);
         json_put_string_field(payload, sizeof(payload), "file", file, 0);
         json_put_string_field(payload, sizeof(payload), "user", username, 0);
         strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
     } else if (CMDEQ(cmd, "CHECKPOINT")) {
-        if (argc < 6) { fprintf(stderr, "CHECKPOINT requires <file> <name>\n"); close(fd); return 1; }
+        if (argc < 6) { fprintf(stderr, "CHECKPOINT requires <file> <name>\n"); return 1; }
         const char *file = argv[4]; const char *name = argv[5];
-        // LOOKUP for CHECKPOINT
-        json_put_string_field(payload, sizeof(payload), "type", "LOOKUP", 1);
-        json_put_string_field(payload, sizeof(payload), "op", "CHECKPOINT", 0);
-        json_put_string_field(payload, sizeof(payload), "file", file, 0);
-        json_put_string_field(payload, sizeof(payload), "user", username, 0);
-        strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
-        if (send_msg(fd, payload, (uint32_t)strlen(payload)) < 0) { perror("send"); close(fd); return 1; }
-        char *resp=NULL; uint32_t rlen=0; if (recv_msg(fd, &resp, &rlen) < 0) { perror("recv"); close(fd); return 1; }
-        char st_lookup_checkpoint[32]={0}; (void)json_get_string_field(resp, "status", st_lookup_checkpoint, sizeof(st_lookup_checkpoint));
-        if (st_lookup_checkpoint[0] && strcmp(st_lookup_checkpoint, "OK") != 0) { print_human("NM", resp); free(resp); close(fd); return 1; }
-        int dport=0; char ssaddr[64]={0}; char ticket[256]={0};
-        int ok = (json_get_int_field(resp, "ssDataPort", &dport) == 0 && json_get_string_field(resp, "ssAddr", ssaddr, sizeof(ssaddr)) == 0 && json_get_string_field(resp, "ticket", ticket, sizeof(ticket)) == 0);
-        if (!ok || dport<=0) { print_human("NM", resp); free(resp); close(fd); return 1; }
-        free(resp); close(fd);
-        int sfd = tcp_connect(ssaddr, (uint16_t)dport); if (sfd < 0) { perror("connect SS"); return 1; }
         char req[512]; req[0]='\0'; json_put_string_field(req, sizeof(req), "type", "CHECKPOINT", 1);
         json_put_string_field(req, sizeof(req), "file", file, 0);
-        json_put_string_field(req, sizeof(req), "ticket", ticket, 0);
         json_put_string_field(req, sizeof(req), "name", name, 0);
-        strncat(req, "}", sizeof(req) - strlen(req) - 1);
-        if (send_msg(sfd, req, (uint32_t)strlen(req)) < 0) { perror("send CHECKPOINT"); close(sfd); return 1; }
-        char *r=NULL; uint32_t rl=0; if (recv_msg(sfd, &r, &rl) < 0) { perror("recv CHECKPOINT"); close(sfd); return 1; }
-        print_human("SS", r); free(r); close(sfd); return 0;
+        char *r=NULL;
+        if (ss_route_call(nm_host, nm_port, username, file, "CHECKPOINT", 0, req, &r) < 0) return 1;
+        print_human("SS", r); free(r); return 0;
     } else if (CMDEQ(cmd, "LISTCHECKPOINTS")) {
-        if (argc < 5) { fprintf(stderr, "LISTCHECKPOINTS requires <file>\n"); close(fd); return 1; }
+        if (argc < 5) { fprintf(stderr, "LISTCHECKPOINTS requires <file>\n"); return 1; }
         const char *file = argv[4];
-        json_put_string_field(payload, sizeof(payload), "type", "LOOKUP", 1);
-        json_put_string_field(payload, sizeof(payload), "op", "LISTCHECKPOINTS", 0);
-        json_put_string_field(payload, sizeof(payload), "file", file, 0);
-        json_put_string_field(payload, sizeof(payload), "user", username, 0);
-        strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
-        if (send_msg(fd, payload, (uint32_t)strlen(payload)) < 0) { perror("send"); close(fd); return 1; }
-        char *resp=NULL; uint32_t rlen=0; if (recv_msg(fd, &resp, &rlen) < 0) { perror("recv"); close(fd); return 1; }
-        char st_lookup_listcp[32]={0}; (void)json_get_string_field(resp, "status", st_lookup_listcp, sizeof(st_lookup_listcp));
-        if (st_lookup_listcp[0] && strcmp(st_lookup_listcp, "OK") != 0) { print_human("NM", resp); free(resp); close(fd); return 1; }
-        int dport=0; char ssaddr[64]={0}; char ticket[256]={0};
-        int ok = (json_get_int_field(resp, "ssDataPort", &dport) == 0 && json_get_string_field(resp, "ssAddr", ssaddr, sizeof(ssaddr)) == 0 && json_get_string_field(resp, "ticket", ticket, sizeof(ticket)) == 0);
-        if (!ok || dport<=0) { print_human("NM", resp); free(resp); close(fd); return 1; }
-        free(resp); close(fd);
-        int sfd = tcp_connect(ssaddr, (uint16_t)dport); if (sfd < 0) { perror("connect SS"); return 1; }
         char req[256]; req[0]='\0'; json_put_string_field(req, sizeof(req), "type", "LISTCHECKPOINTS", 1);
         json_put_string_field(req, sizeof(req), "file", file, 0);
-        json_put_string_field(req, sizeof(req), "ticket", ticket, 0);
-        strncat(req, "}", sizeof(req) - strlen(req) - 1);
-        if (send_msg(sfd, req, (uint32_t)strlen(req)) < 0) { perror("send LISTCHECKPOINTS"); close(sfd); return 1; }
-        char *r=NULL; uint32_t rl=0; if (recv_msg(sfd, &r, &rl) < 0) { perror("recv LISTCHECKPOINTS"); close(sfd); return 1; }
-        print_human("SS", r); free(r); close(sfd); return 0;
+        char *r=NULL;
+        if (ss_route_call(nm_host, nm_port, username, file, "LISTCHECKPOINTS", 0, req, &r) < 0) return 1;
+        print_human("SS", r); free(r); return 0;
     } else if (CMDEQ(cmd, "VIEWCHECKPOINT")) {
-        if (argc < 6) { fprintf(stderr, "VIEWCHECKPOINT requires <file> <name>\n"); close(fd); return 1; }
+        if (argc < 6) { fprintf(stderr, "VIEWCHECKPOINT requires <file> <name>\n"); return 1; }
         const char *file = argv[4]; const char *name = argv[5];
-        json_put_string_field(payload, sizeof(payload), "type", "LOOKUP", 1);
-        json_put_string_field(payload, sizeof(payload), "op", "VIEWCHECKPOINT", 0);
-        json_put_string_field(payload, sizeof(payload), "file", file, 0);
-        json_put_string_field(payload, sizeof(payload), "user", username, 0);
-        strncat(payload, "}", sizeof(payload) - strlen(payload) - 1);
-        if (send_msg(fd, payload, (uint32_t)strlen(payload)) < 0) { perror("send"); close(fd); return 1; }
-        char *resp=NULL; uint32_t rlen=0; if (recv_msg(fd, &resp, &rlen) < 0) { perror("recv"); close(fd); return 1; }
-        int dport=0; char ssaddr[64]={0}; char ticket[256]={0};
-        int ok = (json_get_int_field(resp, "ssDataPort", &dport) == 0 && json_get_string_field(resp, "ssAddr", ssaddr, sizeof(ssaddr)) == 0 && json_get_string_field(resp, "ticket", ticket, sizeof(ticket)) == 0);
-    free(resp); close(fd); if (!ok || dport<=0) { fprintf(stderr, "ERROR: LOOKUP failed (no storage server available)\n"); return 1; }
-        int sfd = tcp_connect(ssaddr, (uint16_t)dport); if (sfd < 0) { perror("connect SS"); return 1; }
         char req[512]; req[0]='\0'; json_put_string_field(req, sizeof(req), "type", "VIEWCHECKPOINT", 1);
         json_put_string_field(req, sizeof(req), "file", file, 0);
-        json_put_string_field(req, sizeof(req), "ticket", ticket, 0);
         json_put_string_field(req, sizeof(req), "name", name, 0);
-        strncat(req, "}", sizeof(req) - strlen(req) - 1);
-        if (send_msg(sfd, req, (uint32_t)strlen(req)) < 0) { perror("send VIEWCHECKPOINT"); close(sfd); return 1; }
-        char *r=NULL; uint32_t rl=0; if (recv_msg(sfd, &r, &rl) < 0) { perror("recv VIEWCHECKPOINT"); close(sfd); return 1; }
-        print_human("SS", r); free(r); close(sfd); return 0;
+        char *r=NULL;
+        if (ss_route_call(nm_host, nm_port, username, file, "VIEWCHECKPOINT", 0, req, &r) < 0) return 1;
+        print_human("SS", r); free(r); return 0;
     } else {
         fprintf(stderr, "Unknown command: %s\n", cmd);
-        close(fd); return 1;
+        return 1;
     }
 
-    if (send_msg(fd, payload, (uint32_t)strlen(payload)) < 0) { perror("send"); close(fd); return 1; }
-
+    // Listings are paged: ask for CLI_PAGE_SIZE entries, print each page as it arrives and fetch the
+    // next one (same connection) only when the previous one has been shown
+    int paged = CMDEQ(cmd, "VIEW") || CMDEQ(cmd, "VIEWFOLDER") || CMDEQ(cmd, "LISTTRASH");
+    char req[1400]; snprintf(req, sizeof(req), "%s", payload);
+    size_t base = strlen(req);
+    if (paged && base > 0) {
+        req[--base] = '\0'; // reopen the object
+        json_put_int_field(req, sizeof(req), "limit", CLI_PAGE_SIZE, 0);
+        base = strlen(req);
+        strncat(req, "}", sizeof(req) - strlen(req) - 1);
+    }
     char *resp = NULL; uint32_t rlen = 0;
-    if (recv_msg(fd, &resp, &rlen) < 0) { perror("recv"); close(fd); return 1; }
-    print_human("NM", resp);
-    free(resp);
+    if (nm_call(nm_host, nm_port, req, &resp, &rlen) != 0) { perror("request"); return 1; }
+    g_page_first = 1;
+    for (;;) {
+        char next[600]; next[0] = '\0';
+        if (paged) (void)json_get_string_field(resp, "next", next, sizeof(next));
+        g_page_last = !next[0];
+        print_human("NM", resp);
+        free(resp); resp = NULL;
+        if (g_page_last || !more_prompt()) break;
+        g_page_first = 0;
+        req[base] = '\0';
+        json_put_string_field(req, sizeof(req), "cursor", next, 0);
+        strncat(req, "}", sizeof(req) - strlen(req) - 1);
+        if (nm_call(nm_host, nm_port, req, &resp, &rlen) != 0) { perror("next page"); break; }
+    }
+    g_page_first = g_page_last = 1;
 
-    close(fd);
     return 0;
 }
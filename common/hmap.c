@@ -0,0 +1,224 @@
+#define _POSIX_C_SOURCE 200809L
+#include "hmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define HMAP_MIN_CAP 16
+#define HMAP_MIGRATE_STEP 8 // old slots visited per mutation while resizing (at least)
+
+static uint32_t hmap_hash(const char *s) {
+    // FNV-1a; 0 marks an empty slot, so remap it
+    uint32_t h = 2166136261u;
+    for (; *s; ++s) { h ^= (unsigned char)(*s); h *= 16777619u; }
+    return h ? h : 1u;
+}
+
+static size_t probe_dist(size_t pos, uint32_t hash, size_t mask) {
+    return (pos - (hash & mask)) & mask;
+}
+
+static hmap_slot_t *slot_find(hmap_slot_t *slots, size_t cap, const char *key, uint32_t hash) {
+    if (!cap) return NULL;
+    size_t mask = cap - 1, pos = hash & mask;
+    for (size_t d = 0; ; ++d, pos = (pos + 1) & mask) {
+        hmap_slot_t *s = &slots[pos];
+        // Robin Hood invariant: once a slot is poorer than we would be, key is absent
+        if (!s->hash || probe_dist(pos, s->hash, mask) < d) return NULL;
+        if (s->hash == hash && strcmp(s->key, key) == 0) return s;
+    }
+}
+
+// Place an entry known to be absent; takes ownership of key
+static void slot_insert(hmap_slot_t *slots, size_t cap, char *key, uint32_t hash, size_t val) {
+    size_t mask = cap - 1, pos = hash & mask, d = 0;
+    for (;;) {
+        hmap_slot_t *s = &slots[pos];
+        if (!s->hash) { s->key = key; s->hash = hash; s->val = val; return; }
+        size_t sd = probe_dist(pos, s->hash, mask);
+        if (sd < d) {
+            // steal from the rich: the resident is closer to home, so it moves on instead
+            hmap_slot_t t = *s;
+            s->key = key; s->hash = hash; s->val = val;
+            key = t.key; hash = t.hash; val = t.val;
+            d = sd;
+        }
+        pos = (pos + 1) & mask; d++;
+    }
+}
+
+// Empty slot s and shift the rest of its cluster back, so no tombstones are needed
+static void slot_remove(hmap_slot_t *slots, size_t cap, hmap_slot_t *s) {
+    size_t mask = cap - 1, pos = (size_t)(s - slots);
+    free(s->key);
+    for (;;) {
+        size_t next = (pos + 1) & mask;
+        hmap_slot_t *n = &slots[next];
+        if (!n->hash || probe_dist(next, n->hash, mask) == 0) break;
+        slots[pos] = *n;
+        pos = next;
+    }
+    slots[pos].key = NULL; slots[pos].hash = 0; slots[pos].val = 0;
+}
+
+// Move old slots into the current array. Always stops at a cluster boundary: a half-moved cluster
+// would leave holes that cut the probe paths of entries still in the old array.
+static void migrate(hmap_t *m, int all) {
+    if (!m->old) return;
+    size_t mask = m->old_cap - 1, n = 0;
+    while (m->old_left && (all || n < HMAP_MIGRATE_STEP || m->old[m->old_pos].hash)) {
+        hmap_slot_t *s = &m->old[m->old_pos];
+        if (s->hash) {
+            slot_insert(m->slots, m->cap, s->key, s->hash, s->val);
+            m->count++; m->old_count--;
+            s->key = NULL; s->hash = 0;
+        }
+        m->old_pos = (m->old_pos + 1) & mask;
+        m->old_left--; n++;
+    }
+    if (!m->old_left) {
+        free(m->old);
+        m->old = NULL; m->old_cap = m->old_count = m->old_pos = 0;
+    }
+}
+
+static int grow(hmap_t *m) {
+    migrate(m, 1);
+    size_t ncap = m->cap ? m->cap * 2 : HMAP_MIN_CAP;
+    hmap_slot_t *ns = (hmap_slot_t *)calloc(ncap, sizeof(hmap_slot_t));
+    if (!ns) return -1;
+    if (!m->count) { free(m->slots); m->slots = ns; m->cap = ncap; return 0; }
+    m->old = m->slots; m->old_cap = m->cap; m->old_count = m->count;
+    m->slots = ns; m->cap = ncap; m->count = 0;
+    // Start draining at an empty slot so every step begins on a cluster boundary (load < 1 guarantees one)
+    m->old_pos = 0;
+    while (m->old[m->old_pos].hash) m->old_pos++;
+    m->old_left = m->old_cap;
+    return 0;
+}
+
+void hmap_init(hmap_t *m) {
+    memset(m, 0, sizeof(*m));
+}
+
+void hmap_free(hmap_t *m) {
+    for (size_t i = 0; i < m->cap; ++i) free(m->slots[i].key);
+    for (size_t i = 0; i < m->old_cap; ++i) free(m->old[i].key);
+    free(m->slots);
+    free(m->old);
+    hmap_init(m);
+}
+
+int hmap_get(const hmap_t *m, const char *key, size_t *out) {
+    if (!key) return -1;
+    uint32_t h = hmap_hash(key);
+    hmap_slot_t *s = slot_find(m->slots, m->cap, key, h);
+    if (!s && m->old) s = slot_find(m->old, m->old_cap, key, h);
+    if (!s) return -1;
+    if (out) *out = s->val;
+    return 0;
+}
+
+const char *hmap_key(const hmap_t *m, const char *key) {
+    if (!key) return NULL;
+    uint32_t h = hmap_hash(key);
+    hmap_slot_t *s = slot_find(m->slots, m->cap, key, h);
+    if (!s && m->old) s = slot_find(m->old, m->old_cap, key, h);
+    return s ? s->key : NULL;
+}
+
+int hmap_put(hmap_t *m, const char *key, size_t val) {
+    if (!key) return -1;
+    migrate(m, 0);
+    uint32_t h = hmap_hash(key);
+    hmap_slot_t *s = slot_find(m->slots, m->cap, key, h);
+    if (!s && m->old) s = slot_find(m->old, m->old_cap, key, h);
+    if (s) { s->val = val; return 0; }
+    if ((m->count + 1) * 8 > m->cap * 7 && grow(m) != 0) return -1;
+    char *k = strdup(key);
+    if (!k) return -1;
+    slot_insert(m->slots, m->cap, k, h, val);
+    m->count++;
+    return 1;
+}
+
+int hmap_del(hmap_t *m, const char *key) {
+    if (!key) return 0;
+    migrate(m, 0);
+    uint32_t h = hmap_hash(key);
+    hmap_slot_t *s = slot_find(m->slots, m->cap, key, h);
+    if (s) { slot_remove(m->slots, m->cap, s); m->count--; return 1; }
+    if (m->old && (s = slot_find(m->old, m->old_cap, key, h)) != NULL) {
+        slot_remove(m->old, m->old_cap, s); m->old_count--; return 1;
+    }
+    return 0;
+}
+
+int hmap_reserve(hmap_t *m, size_t n) {
+    migrate(m, 1);
+    size_t ncap = m->cap ? m->cap : HMAP_MIN_CAP;
+    while (n * 8 > ncap * 7) ncap *= 2;
+    if (ncap == m->cap) return 0;
+    hmap_slot_t *ns = (hmap_slot_t *)calloc(ncap, sizeof(hmap_slot_t));
+    if (!ns) return -1;
+    for (size_t i = 0; i < m->cap; ++i) {
+        if (m->slots[i].hash) slot_insert(ns, ncap, m->slots[i].key, m->slots[i].hash, m->slots[i].val);
+    }
+    free(m->slots);
+    m->slots = ns; m->cap = ncap;
+    return 0;
+}
+
+int hmap_put_many(hmap_t *m, const char *const *keys, const size_t *vals, size_t n) {
+    if (hmap_count(m) || n < 1024) {
+        for (size_t i = 0; i < n; ++i) if (hmap_put(m, keys[i], vals[i]) < 0) return -1;
+        return 0;
+    }
+    if (hmap_reserve(m, n) != 0) return -1;
+    // Insert in home-slot order: each insert then lands just past the previous one, so filling a table
+    // far larger than the cache streams through it instead of missing on every probe. Entries are
+    // copied and bucketed by the top bits of their home slot (counting sort) in one sequential pass
+    // over the input; order within a bucket does not matter.
+    size_t mask = m->cap - 1, shift = 0;
+    while ((mask >> shift) >= 4096) shift++;
+    size_t nb = (mask >> shift) + 1;
+    hmap_slot_t *tmp = (hmap_slot_t *)malloc(n * sizeof(hmap_slot_t));
+    hmap_slot_t *sorted = (hmap_slot_t *)malloc(n * sizeof(hmap_slot_t));
+    size_t *start = (size_t *)calloc(nb + 1, sizeof(size_t));
+    if (!tmp || !sorted || !start) { free(tmp); free(sorted); free(start); return -1; }
+    size_t i = 0;
+    for (; i < n; ++i) {
+        tmp[i].key = strdup(keys[i]);
+        if (!tmp[i].key) break;
+        tmp[i].hash = hmap_hash(keys[i]);
+        tmp[i].val = vals[i];
+        start[((tmp[i].hash & mask) >> shift) + 1]++;
+    }
+    if (i < n) {
+        while (i) free(tmp[--i].key);
+        free(tmp); free(sorted); free(start);
+        return -1;
+    }
+    for (size_t b = 0; b < nb; ++b) start[b + 1] += start[b];
+    for (i = 0; i < n; ++i) sorted[start[(tmp[i].hash & mask) >> shift]++] = tmp[i];
+    for (i = 0; i < n; ++i) slot_insert(m->slots, m->cap, sorted[i].key, sorted[i].hash, sorted[i].val);
+    m->count += n;
+    free(tmp); free(sorted); free(start);
+    return 0;
+}
+
+size_t hmap_count(const hmap_t *m) {
+    return m->count + m->old_count;
+}
+
+int hmap_next(const hmap_t *m, size_t *cursor, const char **key, size_t *val) {
+    while (*cursor < m->cap + m->old_cap) {
+        size_t i = (*cursor)++;
+        const hmap_slot_t *s = i < m->cap ? &m->slots[i] : &m->old[i - m->cap];
+        if (!s->hash) continue;
+        if (key) *key = s->key;
+        if (val) *val = s->val;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef HMAP_H
+#define HMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// String-keyed open-addressing hash table (Robin Hood probing)
+// - Slots are one flat array; each stores its key's 32-bit hash, so probes compare
+//   hashes before strings and resizing never rehashes keys.
+// - Grows by doubling at 7/8 load. The old array is drained a few clusters per
+//   mutation (incremental resize), so no single insert pays for a full rehash.
+// - Keys are copied on insert and owned by the table. Values are size_t
+//   (array indexes, ids, small flag sets).
+// - Not thread-safe. hmap_get/hmap_next never modify the table, so concurrent
+//   readers are fine under a reader lock; mutations need exclusive access.
+
+typedef struct hmap_slot {
+    char *key;
+    uint32_t hash; // 0 = empty slot
+    size_t val;
+} hmap_slot_t;
+
+typedef struct hmap {
+    hmap_slot_t *slots;
+    size_t cap;       // power of two (0 before first insert)
+    size_t count;
+    // Previous array while an incremental resize is in progress
+    hmap_slot_t *old;
+    size_t old_cap;
+    size_t old_count;
+    size_t old_pos;   // next old slot to move
+    size_t old_left;  // old slots not yet visited
+} hmap_t;
+
+#define HMAP_INIT {0}
+
+void hmap_init(hmap_t *m);
+void hmap_free(hmap_t *m);
+
+// Returns 0 and sets *out (if non-NULL) when key is present, -1 otherwise.
+int hmap_get(const hmap_t *m, const char *key, size_t *out);
+
+// Insert or overwrite. Returns 1 if inserted, 0 if an existing value was replaced, -1 on OOM.
+int hmap_put(hmap_t *m, const char *key, size_t val);
+
+// Remove key. Returns 1 if it was present, 0 otherwise.
+int hmap_del(hmap_t *m, const char *key);
+
+// Size the table for n entries up front (one rehash now instead of resizes during a bulk load).
+// Returns 0 on success, -1 on OOM.
+int hmap_reserve(hmap_t *m, size_t n);
+
+// Bulk insert of n distinct keys that are not in the table yet (vals[i] for keys[i]). Much faster
+// than n hmap_put calls when filling an empty table; falls back to them otherwise. Returns 0 or -1 on OOM.
+int hmap_put_many(hmap_t *m, const char *const *keys, const size_t *vals, size_t n);
+
+// The table's own copy of key, or NULL if absent. It stays valid (resizes move slots, not keys) until
+// key is deleted, so callers may point at it instead of keeping a duplicate.
+const char *hmap_key(const hmap_t *m, const char *key);
+
+size_t hmap_count(const hmap_t *m);
+
+// Iterate: start with *cursor = 0; returns 1 per entry, 0 when done. Order is unspecified and
+// the cursor is only valid while the table is not mutated.
+int hmap_next(const hmap_t *m, size_t *cursor, const char **key, size_t *val);
+
+#endif // HMAP_H
@@ -160,3 +160,33 @@ void json_put_string_field(char *dst, size_t dst_sz, const char *key, const char
 void json_put_int_field(char *dst, size_t dst_sz, const char *key, int val, int first) {
     snprintf(dst + strlen(dst), dst_sz - strlen(dst), "%s\"%s\":%d", first ? "{" : ",", key, val);
 }
+
+char *hex_encode(const char *s, size_t n) {
+    static const char digits[] = "0123456789abcdef";
+    char *out = (char *)malloc(n * 2 + 1);
+    if (!out) return NULL;
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char c = (unsigned char)s[i];
+        out[2*i] = digits[c >> 4]; out[2*i+1] = digits[c & 15];
+    }
+    out[n * 2] = '\0';
+    return out;
+}
+
+static int hex_val(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+int hex_decode(const char *hex, size_t n, char *out) {
+    if (!hex || !out || (n & 1)) return -1;
+    for (size_t i = 0; i < n; i += 2) {
+        int hi = hex_val(hex[i]), lo = hex_val(hex[i+1]);
+        if (hi < 0 || lo < 0) return -1;
+        out[i/2] = (char)((hi << 4) | lo);
+    }
+    out[n/2] = '\0';
+    return (int)(n / 2);
+}
@@ -43,4 +43,10 @@ int json_get_int_field(const char *json, const char *key, int *out);
 void json_put_string_field(char *dst, size_t dst_sz, const char *key, const char *val, int first);
 void json_put_int_field(char *dst, size_t dst_sz, const char *key, int val, int first);
 
+// Hex transport for payloads the minimal JSON helpers cannot carry (quotes, commas, control bytes)
+// hex_encode: returns a malloc'd NUL-terminated string (caller frees), NULL on OOM
+// hex_decode: decodes n hex digits into out (needs n/2+1 bytes); returns decoded length or -1
+char *hex_encode(const char *s, size_t n);
+int hex_decode(const char *hex, size_t n, char *out);
+
 #endif // NET_PROTO_H
@@ -1,55 +1,142 @@
 #include "tickets.h"
 
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
-static const char *kSalt = "DOCSPLUS-SALT-2025";
+static const char *kSalt = "DOCSPLUS-SALT-2025"; // default secret when DOCS_TICKET_KEY is not set
 
-static unsigned long checksum(const char *file, const char *op, int ssid, long exp) {
-    unsigned long sum = 5381u;
-    for (const char *p = file; p && *p; ++p) sum = ((sum << 5) + sum) + (unsigned char)*p;
-    for (const char *p = op; p && *p; ++p) sum = ((sum << 5) + sum) + (unsigned char)*p;
-    const char *s = kSalt; while (*s) { sum = ((sum << 5) + sum) + (unsigned char)*s++; }
-    sum = ((sum << 5) + sum) + (unsigned long)ssid;
-    sum = ((sum << 5) + sum) + (unsigned long)exp;
-    return sum;
+// SipHash-2-4. The keyed initial state is the key schedule: it is derived from the secret once per
+// process and every MAC starts from a copy of it.
+typedef struct { uint64_t v0, v1, v2, v3; } sip_key_t;
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND do { \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+    } while (0)
+
+static void sip_schedule(sip_key_t *k, uint64_t k0, uint64_t k1) {
+    k->v0 = k0 ^ 0x736f6d6570736575ULL; k->v1 = k1 ^ 0x646f72616e646f6dULL;
+    k->v2 = k0 ^ 0x6c7967656e657261ULL; k->v3 = k1 ^ 0x7465646279746573ULL;
+}
+
+static uint64_t sip_mac(const sip_key_t *k, const void *data, size_t n) {
+    const unsigned char *in = (const unsigned char *)data;
+    uint64_t v0 = k->v0, v1 = k->v1, v2 = k->v2, v3 = k->v3;
+    uint64_t b = (uint64_t)n << 56;
+    const unsigned char *end = in + (n - n % 8);
+    for (; in != end; in += 8) {
+        uint64_t m = 0;
+        for (int i = 0; i < 8; ++i) m |= (uint64_t)in[i] << (8 * i);
+        v3 ^= m; SIPROUND; SIPROUND; v0 ^= m;
+    }
+    for (size_t i = 0; i < n % 8; ++i) b |= (uint64_t)in[i] << (8 * i);
+    v3 ^= b; SIPROUND; SIPROUND; v0 ^= b;
+    v2 ^= 0xff; SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static sip_key_t g_key;
+static pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+
+// Stretch the secret (any length) into the 128-bit key, then schedule it
+static void key_init(void) {
+    const char *secret = getenv("DOCS_TICKET_KEY");
+    if (!secret || !*secret) secret = kSalt;
+    sip_key_t zero; sip_schedule(&zero, 0, 0);
+    size_t n = strlen(secret);
+    char *tmp = (char *)malloc(n + 1);
+    uint64_t k0 = 0, k1 = 0;
+    if (tmp) {
+        memcpy(tmp, secret, n);
+        tmp[n] = 0; k0 = sip_mac(&zero, tmp, n + 1);
+        tmp[n] = 1; k1 = sip_mac(&zero, tmp, n + 1);
+        free(tmp);
+    }
+    sip_schedule(&g_key, k0, k1);
+}
+
+static uint64_t token_mac(const char *body, size_t n) {
+    pthread_once(&g_key_once, key_init);
+    return sip_mac(&g_key, body, n);
+}
+
+static const struct { const char *op; int bit; } kOps[] = {
+    { "READ", TICKET_READ }, { "WRITE", TICKET_WRITE }, { "UNDO", TICKET_UNDO }, { "REVERT", TICKET_REVERT },
+    { "CHECKPOINT", TICKET_CHECKPOINT }, { "VIEWCHECKPOINT", TICKET_VIEWCHECKPOINT },
+    { "LISTCHECKPOINTS", TICKET_LISTCHECKPOINTS },
+};
+
+int ticket_op_bit(const char *op) {
+    if (!op) return 0;
+    for (size_t i = 0; i < sizeof(kOps) / sizeof(kOps[0]); ++i) if (strcmp(kOps[i].op, op) == 0) return kOps[i].bit;
+    return 0;
+}
+
+// Append "|<mac>" over the body already in out
+static int seal(char *out, size_t out_sz, int n) {
+    if (n <= 0 || (size_t)n >= out_sz) return -1;
+    unsigned long long mac = (unsigned long long)token_mac(out, (size_t)n);
+    int m = snprintf(out + n, out_sz - (size_t)n, "|%016llx", mac);
+    return (m > 0 && (size_t)(n + m) < out_sz) ? 0 : -1;
 }
 
 int ticket_build(const char *file, const char *op, int ssid, int ttl_seconds,
                  char *out, size_t out_sz) {
     if (!file || !op || !out || out_sz < 16) return -1;
-    time_t now = time(NULL);
-    long exp = (long)now + ttl_seconds;
-    unsigned long sig = checksum(file, op, ssid, exp);
-    int n = snprintf(out, out_sz, "%s|%s|%d|%ld|%lu", file, op, ssid, exp, sig);
-    return (n > 0 && (size_t)n < out_sz) ? 0 : -1;
+    long exp = (long)time(NULL) + ttl_seconds;
+    return seal(out, out_sz, snprintf(out, out_sz, "%s|%s|%d|%ld", file, op, ssid, exp));
 }
 
-int ticket_validate(const char *ticket, const char *required_file,
-                    const char *required_op, int expected_ssid) {
-    if (!ticket || !required_file || !required_op) return -1;
+int ticket_build_cap(int kind, const char *scope, int perms, int ssid, int ttl_seconds,
+                     char *out, size_t out_sz) {
+    if ((kind != TICKET_SCOPE_FILE && kind != TICKET_SCOPE_PREFIX) || !scope || !*scope || !perms || !out || out_sz < 16) return -1;
+    long exp = (long)time(NULL) + ttl_seconds;
+    return seal(out, out_sz, snprintf(out, out_sz, "C|%c|%s|%d|%d|%ld", kind, scope, perms, ssid, exp));
+}
+
+int ticket_check(const char *ticket, const char *required_file, int ops, int expected_ssid) {
+    if (!ticket || !required_file || !ops) return -1;
+    const char *bar = strrchr(ticket, '|');
+    if (!bar || strlen(bar + 1) != 16) return -1;
+    size_t body = (size_t)(bar - ticket);
     char buf[512];
-    size_t n = strlen(ticket);
-    if (n >= sizeof(buf)) return -1;
-    memcpy(buf, ticket, n + 1);
-    char *file = strtok(buf, "|");
-    char *op = strtok(NULL, "|");
-    char *ssid_s = strtok(NULL, "|");
-    char *exp_s = strtok(NULL, "|");
-    char *sig_s = strtok(NULL, "|");
-    if (!file || !op || !ssid_s || !exp_s || !sig_s) return -1;
-    int ssid = atoi(ssid_s);
-    long exp = atol(exp_s);
-    unsigned long sig = strtoul(sig_s, NULL, 10);
+    if (body >= sizeof(buf)) return -1;
+    memcpy(buf, ticket, body); buf[body] = '\0';
+    // Split in place (no strtok: the SS validates from many threads)
+    char *f[7]; int nf = 0;
+    for (char *p = buf; nf < 7; ) {
+        f[nf++] = p;
+        char *q = strchr(p, '|');
+        if (!q) break;
+        *q = '\0'; p = q + 1;
+    }
+    const char *scope; int perms, ssid, prefix = 0; long exp;
+    if (nf == 4) { scope = f[0]; perms = ticket_op_bit(f[1]); ssid = atoi(f[2]); exp = atol(f[3]); }
+    else if (nf == 6 && strcmp(f[0], "C") == 0 && (strcmp(f[1], "F") == 0 || strcmp(f[1], "P") == 0)) {
+        prefix = (f[1][0] == TICKET_SCOPE_PREFIX);
+        scope = f[2]; perms = atoi(f[3]); ssid = atoi(f[4]); exp = atol(f[5]);
+    }
+    else return -1;
     // Basic checks
-    if (strcmp(file, required_file) != 0) return -1;
-    if (strcmp(op, required_op) != 0) return -1;
+    if (!(perms & ops)) return -1;
     if (ssid != expected_ssid) return -1;
-    time_t now = time(NULL);
-    if ((long)now > exp) return -1;
-    unsigned long expect = checksum(file, op, ssid, exp);
-    if (expect != sig) return -1;
-    return 0;
+    if ((long)time(NULL) > exp) return -1;
+    if (prefix) { size_t sl = strlen(scope); if (!sl || strncmp(required_file, scope, sl) != 0) return -1; }
+    else if (strcmp(scope, required_file) != 0) return -1;
+    char expect[20]; snprintf(expect, sizeof(expect), "%016llx", (unsigned long long)token_mac(ticket, body));
+    unsigned diff = 0;
+    for (int i = 0; i < 16; ++i) diff |= (unsigned)(expect[i] ^ bar[1 + i]);
+    return diff ? -1 : 0;
+}
+
+int ticket_validate(const char *ticket, const char *required_file,
+                    const char *required_op, int expected_ssid) {
+    return ticket_check(ticket, required_file, ticket_op_bit(required_op), expected_ssid);
 }
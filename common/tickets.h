@@ -4,14 +4,45 @@
 #include <stddef.h>
 
 // Minimal ticketing for Docs++
-// Ticket format (ASCII): file|op|ssid|exp|sig
-// where sig is a simple salted checksum over file,op,ssid,exp.
+// Two token formats, both signed with a keyed MAC (SipHash-2-4, 16 hex digits):
+//   ticket:     file|op|ssid|exp|mac            one operation on one file
+//   capability: C|kind|scope|perms|ssid|exp|mac every operation in the perms bitmask on scope, where kind
+//                                               F makes scope one file name (matched exactly) and P makes
+//                                               it a name prefix ("docs/")
+// The scope kind is part of the signed body, so no file name (even one containing '*') widens a grant.
+// The key comes from DOCS_TICKET_KEY (or a built-in default) and is scheduled once per process; NM and
+// SS must agree on it.
+
+// Permission bits, one per ticketed operation
+#define TICKET_READ            0x01
+#define TICKET_WRITE           0x02
+#define TICKET_UNDO            0x04
+#define TICKET_REVERT          0x08
+#define TICKET_CHECKPOINT      0x10
+#define TICKET_VIEWCHECKPOINT  0x20
+#define TICKET_LISTCHECKPOINTS 0x40
+#define TICKET_READ_OPS  (TICKET_READ | TICKET_VIEWCHECKPOINT | TICKET_LISTCHECKPOINTS)
+#define TICKET_WRITE_OPS (TICKET_WRITE | TICKET_UNDO | TICKET_REVERT | TICKET_CHECKPOINT)
+
+// Bit for an operation name ("READ", "WRITE", ...); 0 if it is not a ticketed operation
+int ticket_op_bit(const char *op);
 
 int ticket_build(const char *file, const char *op, int ssid, int ttl_seconds,
                  char *out, size_t out_sz);
 
-// Validate a ticket for the given op/file and expected ssid. Returns 0 if OK.
+// Capability scope kinds
+#define TICKET_SCOPE_FILE   'F'
+#define TICKET_SCOPE_PREFIX 'P'
+
+// Capability for every operation in perms on scope (a TICKET_SCOPE_* kind). Returns 0 on success
+int ticket_build_cap(int kind, const char *scope, int perms, int ssid, int ttl_seconds,
+                     char *out, size_t out_sz);
+
+// Validate a ticket or capability for the given op/file and expected ssid. Returns 0 if OK.
 int ticket_validate(const char *ticket, const char *required_file,
                     const char *required_op, int expected_ssid);
 
+// Same, accepting a token that grants any one of the operations in ops (TICKET_* bits)
+int ticket_check(const char *ticket, const char *required_file, int ops, int expected_ssid);
+
 #endif // TICKETS_H
@@ -1,16 +1,15 @@
 #define _POSIX_C_SOURCE 200809L
 #include "nm_dir.h"
 #include "nm_persist.h"
+#include "nm_watch.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
-// Simple hash map for filename->ssId using chaining
-typedef struct node { char *k; int v; struct node *next; } node_t;
-
-#define NBKT 257
-static node_t *g_buckets[NBKT];
+// filename -> ssId comes straight from the persisted directory index (nm_state_find_dir), which is a hash
+// table loaded with the state; this module adds the LRU and keeps the two in step.
 
 // Simple LRU cache for last 64 lookups
 typedef struct lru_node { char *k; int v; struct lru_node *prev, *next; } lru_node_t;
@@ -18,29 +17,14 @@ static lru_node_t *g_lru_head = NULL, *g_lru_tail = NULL; // MRU at head
 static size_t g_lru_size = 0;
 static const size_t LRU_MAX = 64;
 
-static unsigned hash_str(const char *s) {
-    unsigned h = 2166136261u;
-    for (; *s; ++s) { h ^= (unsigned char)(*s); h *= 16777619u; }
-    return h;
-}
-
-static void map_put(const char *k, int v) {
-    unsigned h = hash_str(k) % NBKT;
-    node_t *n = g_buckets[h];
-    for (; n; n = n->next) {
-        if (strcmp(n->k, k) == 0) { n->v = v; return; }
-    }
-    n = (node_t *)malloc(sizeof(node_t));
-    n->k = strdup(k); n->v = v; n->next = g_buckets[h]; g_buckets[h] = n;
-}
+// Lookups share g_map_rw, mutations take it exclusively, so a lookup never caches a mapping that a
+// concurrent set/del/rename has already replaced. The LRU is reordered on every hit, so it has its
+// own short mutex. Order: g_map_rw before g_lru_mu.
+static pthread_rwlock_t g_map_rw = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t g_lru_mu = PTHREAD_MUTEX_INITIALIZER;
 
 static int map_get(const char *k, int *out_v) {
-    unsigned h = hash_str(k) % NBKT;
-    node_t *n = g_buckets[h];
-    for (; n; n = n->next) {
-        if (strcmp(n->k, k) == 0) { if (out_v) *out_v = n->v; return 0; }
-    }
-    return -1;
+    return nm_state_find_dir(k, out_v);
 }
 
 static void lru_promote(lru_node_t *n) {
@@ -72,63 +56,74 @@ static void lru_insert(const char *k, int v) {
 }
 
 void nm_dir_init(void) {
-    // Seed from persisted state
-    char files[256][128]; int ss[256];
-    size_t n = nm_state_get_dir(files, ss, 256);
-    for (size_t i = 0; i < n; ++i) map_put(files[i], ss[i]);
+    // Nothing to seed: mappings are read from the loaded state on demand and the LRU fills as files are used
 }
 
 int nm_dir_lookup(const char *file, int *out_ss_id) {
+    pthread_rwlock_rdlock(&g_map_rw);
     // LRU first
+    pthread_mutex_lock(&g_lru_mu);
     lru_node_t *n = lru_find(file);
-    if (n) { if (out_ss_id) *out_ss_id = n->v; lru_promote(n); return 0; }
+    if (n) { if (out_ss_id) *out_ss_id = n->v; lru_promote(n); pthread_mutex_unlock(&g_lru_mu); pthread_rwlock_unlock(&g_map_rw); return 0; }
+    pthread_mutex_unlock(&g_lru_mu);
     // Map
-    int v=0; if (map_get(file, &v) == 0) { lru_insert(file, v); if (out_ss_id) *out_ss_id = v; return 0; }
-    return -1;
+    int v=0, rc = -1;
+    if (map_get(file, &v) == 0) {
+        pthread_mutex_lock(&g_lru_mu);
+        if (!lru_find(file)) lru_insert(file, v); // another reader may have cached it meanwhile
+        pthread_mutex_unlock(&g_lru_mu);
+        if (out_ss_id) *out_ss_id = v;
+        rc = 0;
+    }
+    pthread_rwlock_unlock(&g_map_rw);
+    return rc;
 }
 
 int nm_dir_set(const char *file, int ss_id) {
+    pthread_rwlock_wrlock(&g_map_rw);
     int old=0; int existed = (map_get(file, &old) == 0);
-    if (!existed || old != ss_id) {
-        map_put(file, ss_id);
+    int changed = (!existed || old != ss_id);
+    if (changed) {
         nm_state_set_dir(file, ss_id);
         // update LRU
+        pthread_mutex_lock(&g_lru_mu);
         lru_node_t *n = lru_find(file);
         if (n) { n->v = ss_id; lru_promote(n); }
         else lru_insert(file, ss_id);
-        return 1;
+        pthread_mutex_unlock(&g_lru_mu);
     }
+    pthread_rwlock_unlock(&g_map_rw);
+    if (changed && existed) nm_watch_route_changed(file, NM_ROUTE_ALL);
+    return changed;
+}
+
+typedef struct { char *dst; size_t sz, w; int include_ss, n; } view_json_t;
+
+static int view_json_add(const char *file, int ss_id, void *arg) {
+    view_json_t *v = (view_json_t *)arg;
+    size_t w = v->w;
+    if (v->n) w += snprintf(v->dst + w, w < v->sz ? v->sz - w : 0, ",");
+    if (v->include_ss) w += snprintf(v->dst + w, w < v->sz ? v->sz - w : 0, "{\"name\":\"%s\",\"ssId\":%d}", file, ss_id);
+    else w += snprintf(v->dst + w, w < v->sz ? v->sz - w : 0, "\"%s\"", file);
+    // Keep room for the closing "]}"; entries that do not fit are dropped whole
+    if (w + 3 > v->sz) { v->dst[v->w] = '\0'; return 1; }
+    v->w = w; v->n++;
     return 0;
 }
 
 size_t nm_dir_build_view_json(char *dst, size_t dst_sz, int include_ss) {
-    size_t written = 0;
-    written += snprintf(dst + written, dst_sz - written, "{\"status\":\"OK\",\"files\":[");
-    // Iterate through persistence snapshot to have stable listing
-    char files[512][128]; int ss[512]; size_t n = nm_state_get_dir(files, ss, 512);
-    for (size_t i = 0; i < n; ++i) {
-        if (i) written += snprintf(dst + written, dst_sz - written, ",");
-        if (include_ss) written += snprintf(dst + written, dst_sz - written, "{\"name\":\"%s\",\"ssId\":%d}", files[i], ss[i]);
-        else written += snprintf(dst + written, dst_sz - written, "\"%s\"", files[i]);
-        if (written >= dst_sz) break;
-    }
-    if (written < dst_sz) written += snprintf(dst + written, dst_sz - written, "]}");
-    return written;
+    view_json_t v = { dst, dst_sz, 0, include_ss, 0 };
+    v.w = snprintf(dst, dst_sz, "{\"status\":\"OK\",\"files\":[");
+    if (v.w + 3 > dst_sz) return v.w;
+    nm_state_foreach_dir(NULL, 0, view_json_add, &v);
+    v.w += snprintf(dst + v.w, dst_sz - v.w, "]}");
+    return v.w;
 }
 
 int nm_dir_del(const char *file) {
-    // remove from map buckets
-    unsigned h = hash_str(file) % NBKT;
-    node_t *prev = NULL, *n = g_buckets[h];
-    while (n) {
-        if (strcmp(n->k, file) == 0) {
-            if (prev) prev->next = n->next; else g_buckets[h] = n->next;
-            free(n->k); free(n);
-            break;
-        }
-        prev = n; n = n->next;
-    }
+    pthread_rwlock_wrlock(&g_map_rw);
     // remove from LRU
+    pthread_mutex_lock(&g_lru_mu);
     lru_node_t *ln = g_lru_head;
     while (ln) {
         if (strcmp(ln->k, file) == 0) {
@@ -138,32 +133,26 @@ int nm_dir_del(const char *file) {
         }
         ln = ln->next;
     }
+    pthread_mutex_unlock(&g_lru_mu);
     // persistence
-    return nm_state_del_dir(file);
+    int r = nm_state_del_dir(file);
+    pthread_rwlock_unlock(&g_map_rw);
+    if (r) nm_watch_route_changed(file, NM_ROUTE_ALL);
+    return r;
 }
 
 int nm_dir_rename(const char *old_file, const char *new_file) {
     if (!old_file || !new_file || !*old_file || !*new_file) return 0;
+    pthread_rwlock_wrlock(&g_map_rw);
     // Check existing mapping value
-    int ssid = 0; if (map_get(old_file, &ssid) != 0) return 0;
+    int ssid = 0; if (map_get(old_file, &ssid) != 0) { pthread_rwlock_unlock(&g_map_rw); return 0; }
     // Ensure destination not present
-    int dummy = 0; if (map_get(new_file, &dummy) == 0) return 0;
+    int dummy = 0; if (map_get(new_file, &dummy) == 0) { pthread_rwlock_unlock(&g_map_rw); return 0; }
     // Update persistence first
-    if (!nm_state_rename_dir(old_file, new_file)) return 0;
-    
-    // Remove old from map (without touching persistence)
-    unsigned h = hash_str(old_file) % NBKT;
-    node_t *prev = NULL, *n = g_buckets[h];
-    while (n) {
-        if (strcmp(n->k, old_file) == 0) {
-            if (prev) prev->next = n->next; else g_buckets[h] = n->next;
-            free(n->k); free(n);
-            break;
-        }
-        prev = n; n = n->next;
-    }
+    if (!nm_state_rename_dir(old_file, new_file)) { pthread_rwlock_unlock(&g_map_rw); return 0; }
     
     // Remove old from LRU (without touching persistence)
+    pthread_mutex_lock(&g_lru_mu);
     lru_node_t *ln = g_lru_head;
     while (ln) {
         if (strcmp(ln->k, old_file) == 0) {
@@ -174,8 +163,10 @@ int nm_dir_rename(const char *old_file, const char *new_file) {
         ln = ln->next;
     }
     
-    // Add new mapping to map and LRU
-    map_put(new_file, ssid);
+    // Cache the new name
     lru_insert(new_file, ssid);
+    pthread_mutex_unlock(&g_lru_mu);
+    pthread_rwlock_unlock(&g_map_rw);
+    nm_watch_route_changed(old_file, NM_ROUTE_ALL);
     return 1;
 }
@@ -3,7 +3,7 @@
 
 #include <stddef.h>
 
-// Initialize directory and LRU from persisted state
+// Initialize directory and LRU; lookups are served from the state loaded by nm_state_load
 void nm_dir_init(void);
 
 // Lookup a file; returns 0 and sets *out_ss_id on success, -1 if not found
@@ -12,7 +12,8 @@ int nm_dir_lookup(const char *file, int *out_ss_id);
 // Upsert mapping and update persistence; returns 1 if added/changed
 int nm_dir_set(const char *file, int ss_id);
 
-// Build a JSON array of files (with ss_id) into dst; returns bytes written
+// Build a JSON array of files (with ss_id) into dst; returns bytes written. Entries that do not fit are
+// left out, so dst always holds valid JSON
 size_t nm_dir_build_view_json(char *dst, size_t dst_sz, int include_ss);
 
 // Delete mapping; returns 1 if removed
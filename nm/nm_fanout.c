@@ -0,0 +1,142 @@
+#define _POSIX_C_SOURCE 200809L
+#include "nm_fanout.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common/net_proto.h"
+
+#define FANOUT_WINDOW 8 // unanswered requests per SS connection
+
+// Calls are grouped by SS (order[grp[g]..grp[g+1]) are the call indices for group g, in caller order);
+// workers take whole groups, so one SS never sees two connections from the same fan-out
+typedef struct {
+    nm_fanout_call_t *calls;
+    size_t *order, *grp, ngroups;
+    nm_fanout_resolve_fn resolve;
+    struct timespec due;
+    pthread_mutex_t mu;
+    size_t next, answered;
+} fanout_t;
+
+static long ms_left(const struct timespec *due) {
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long)(due->tv_sec - now.tv_sec) * 1000 + (due->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+static void set_timeouts(int fd, long ms) {
+    struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+    (void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    (void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Connect without outliving the deadline (a down host would otherwise hold the worker for the kernel's
+// SYN timeout). Names that are not dotted quads fall back to a plain blocking connect.
+static int connect_by(const char *addr, int port, const struct timespec *due) {
+    struct sockaddr_in sa; memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET; sa.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, addr, &sa.sin_addr) != 1) return tcp_connect(addr, (uint16_t)port);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int fl = fcntl(fd, F_GETFL, 0);
+    if (fl < 0 || fcntl(fd, F_SETFL, fl | O_NONBLOCK) != 0) { close(fd); return -1; }
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        long left = ms_left(due);
+        struct pollfd p = { .fd = fd, .events = POLLOUT, .revents = 0 };
+        int err = 0; socklen_t el = sizeof(err);
+        if (errno != EINPROGRESS || left <= 0 || poll(&p, 1, (int)left) != 1 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &el) != 0 || err != 0) { close(fd); return -1; }
+    }
+    (void)fcntl(fd, F_SETFL, fl);
+    return fd;
+}
+
+// Run one SS's calls over a single pipelined connection; returns how many were answered
+static size_t run_group(fanout_t *f, size_t g) {
+    const size_t *idx = f->order + f->grp[g]; size_t n = f->grp[g + 1] - f->grp[g];
+    int port = 0; char addr[64];
+    if (f->resolve(f->calls[idx[0]].ssid, &port, addr, sizeof(addr)) != 0 || port == 0) return 0;
+    int fd = connect_by(addr, port, &f->due);
+    if (fd < 0) return 0;
+    size_t sent = 0, got = 0;
+    while (got < n) {
+        long left = ms_left(&f->due);
+        if (left <= 0) break;
+        set_timeouts(fd, left);
+        while (sent < n && sent - got < FANOUT_WINDOW) {
+            const char *req = f->calls[idx[sent]].req;
+            if (send_msg(fd, req, (uint32_t)strlen(req)) != 0) break;
+            f->calls[idx[sent++]].sent = 1;
+        }
+        if (sent == got) break;
+        char *r = NULL; uint32_t rl = 0;
+        if (recv_msg(fd, &r, &rl) != 0 || !r) { free(r); break; }
+        f->calls[idx[got++]].reply = r;
+    }
+    close(fd);
+    return got;
+}
+
+static void *worker(void *arg) {
+    fanout_t *f = (fanout_t *)arg;
+    for (;;) {
+        pthread_mutex_lock(&f->mu);
+        size_t g = f->next < f->ngroups ? f->next++ : f->ngroups;
+        pthread_mutex_unlock(&f->mu);
+        if (g == f->ngroups) break;
+        size_t a = run_group(f, g);
+        pthread_mutex_lock(&f->mu); f->answered += a; pthread_mutex_unlock(&f->mu);
+    }
+    return NULL;
+}
+
+size_t nm_fanout(nm_fanout_call_t *calls, size_t n, nm_fanout_resolve_fn resolve, int max_parallel, int deadline_ms) {
+    for (size_t i = 0; i < n; i++) { calls[i].reply = NULL; calls[i].sent = 0; }
+    if (n == 0) return 0;
+    fanout_t f; memset(&f, 0, sizeof(f));
+    f.calls = calls; f.resolve = resolve;
+    f.order = (size_t *)malloc(sizeof(size_t) * n); f.grp = (size_t *)malloc(sizeof(size_t) * (n + 1));
+    int *ssids = (int *)malloc(sizeof(int) * n);
+    if (!f.order || !f.grp || !ssids) { free(f.order); free(f.grp); free(ssids); return 0; }
+    // Distinct SSs in first-seen order, then each one's calls in caller order (O(n * SSs); SSs are few)
+    size_t w = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!calls[i].req) continue;
+        size_t g = 0; while (g < f.ngroups && ssids[g] != calls[i].ssid) g++;
+        if (g == f.ngroups) ssids[f.ngroups++] = calls[i].ssid;
+    }
+    for (size_t g = 0; g < f.ngroups; g++) {
+        f.grp[g] = w;
+        for (size_t i = 0; i < n; i++) if (calls[i].req && calls[i].ssid == ssids[g]) f.order[w++] = i;
+    }
+    f.grp[f.ngroups] = w;
+    free(ssids);
+    if (f.ngroups == 0) { free(f.order); free(f.grp); return 0; }
+    clock_gettime(CLOCK_MONOTONIC, &f.due);
+    f.due.tv_sec += deadline_ms / 1000; f.due.tv_nsec += (long)(deadline_ms % 1000) * 1000000;
+    if (f.due.tv_nsec >= 1000000000L) { f.due.tv_sec++; f.due.tv_nsec -= 1000000000L; }
+    pthread_mutex_init(&f.mu, NULL);
+    // The calling thread works too, so a single-SS fan-out starts no thread at all
+    size_t extra = (size_t)(max_parallel > 1 ? max_parallel - 1 : 0);
+    if (extra > f.ngroups - 1) extra = f.ngroups - 1;
+    pthread_t *tids = extra ? (pthread_t *)malloc(sizeof(pthread_t) * extra) : NULL;
+    size_t started = 0;
+    for (size_t t = 0; tids && t < extra; t++) if (pthread_create(&tids[started], NULL, worker, &f) == 0) started++;
+    worker(&f);
+    for (size_t t = 0; t < started; t++) pthread_join(tids[t], NULL);
+    free(tids);
+    pthread_mutex_destroy(&f.mu);
+    free(f.order); free(f.grp);
+    return f.answered;
+}
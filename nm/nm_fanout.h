@@ -0,0 +1,27 @@
+#ifndef NM_FANOUT_H
+#define NM_FANOUT_H
+
+#include <stddef.h>
+
+// Scatter-gather RPCs from the NM to storage servers. A multi-file operation hands over every request
+// at once; calls to the same SS are pipelined in order over one connection, and different SSs are
+// served concurrently, so the operation costs about the slowest SS instead of the sum over files.
+
+#define NM_FANOUT_PARALLEL 8     // SSs contacted at once by default
+#define NM_FANOUT_DEADLINE_MS 5000 // default time allowed for a whole fan-out
+
+typedef struct {
+    int ssid;        // SS to ask
+    const char *req; // request JSON (owned by the caller); NULL skips the call
+    char *reply;     // malloc'd reply (caller frees); NULL if the SS was down, failed or missed the deadline
+    int sent;        // the whole request went out: with no reply, the SS may or may not have acted on it
+} nm_fanout_call_t;
+
+// Address of an SS data port; returns 0 on success (same contract as the NM's get_ss_info)
+typedef int (*nm_fanout_resolve_fn)(int ssid, int *port, char *addr, size_t addr_sz);
+
+// Issue calls[0..n) with at most max_parallel SSs in flight, all due within deadline_ms of the call.
+// Calls to one SS keep their order. Returns the number of calls that got a reply.
+size_t nm_fanout(nm_fanout_call_t *calls, size_t n, nm_fanout_resolve_fn resolve, int max_parallel, int deadline_ms);
+
+#endif // NM_FANOUT_H
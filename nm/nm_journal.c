@@ -0,0 +1,233 @@
+#define _POSIX_C_SOURCE 200809L
+#include "nm_journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// File layout: 8-byte magic, then frames of
+//   u32 payload length | u64 seq | u32 checksum (FNV-1a over seq and payload) | payload
+// in host byte order (the journal never leaves this machine). Replay stops at the first short or
+// corrupt frame, which is where a crash tore the tail.
+static const char kMagic[8] = {'N','M','J','R','N','L','1','\n'};
+#define FRAME_HDR 16
+#define MAX_RECORD (1u << 20)
+
+static pthread_mutex_t g_jmu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_work = PTHREAD_COND_INITIALIZER;  // records queued
+static pthread_cond_t g_done = PTHREAD_COND_INITIALIZER;  // a batch reached the disk
+static int g_fd = -1;
+static char g_path[512];
+static unsigned char *g_pend = NULL; // queued frames not yet handed to the writer
+static size_t g_pend_len = 0, g_pend_cap = 0;
+static int g_writing = 0;
+static int g_err = 0;
+static size_t g_file_bytes = 0;
+static unsigned long long g_next_seq = 1, g_last_seq = 0, g_durable_seq = 0;
+
+static uint32_t frame_sum(unsigned long long seq, const unsigned char *p, size_t len) {
+    uint32_t h = 2166136261u;
+    const unsigned char *s = (const unsigned char *)&seq;
+    for (size_t i = 0; i < sizeof(seq); ++i) { h ^= s[i]; h *= 16777619u; }
+    for (size_t i = 0; i < len; ++i) { h ^= p[i]; h *= 16777619u; }
+    return h;
+}
+
+static int write_all(int fd, const unsigned char *p, size_t n) {
+    while (n) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) { if (errno == EINTR) continue; return -1; }
+        p += w; n -= (size_t)w;
+    }
+    return 0;
+}
+
+// Group commit: whatever queued while the previous fsync ran goes out as one write + one fsync
+static void *journal_writer(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_jmu);
+    for (;;) {
+        while (!g_pend_len) pthread_cond_wait(&g_work, &g_jmu);
+        unsigned char *batch = g_pend; size_t n = g_pend_len; unsigned long long upto = g_last_seq;
+        int fd = g_fd;
+        g_pend = NULL; g_pend_len = g_pend_cap = 0;
+        g_writing = 1;
+        pthread_mutex_unlock(&g_jmu);
+        int rc = write_all(fd, batch, n);
+        if (rc == 0) rc = fdatasync(fd);
+        free(batch);
+        pthread_mutex_lock(&g_jmu);
+        if (rc != 0 && !g_err) fprintf(stderr, "[NM] journal write failed: %s\n", strerror(errno));
+        if (rc != 0) g_err = 1;
+        g_writing = 0;
+        g_durable_seq = upto;
+        pthread_cond_broadcast(&g_done);
+    }
+    return NULL;
+}
+
+// Walk the frames of a journal image; returns the byte length of the intact prefix
+static size_t scan(const unsigned char *buf, size_t n, unsigned long long after_seq, nm_journal_apply_fn fn, unsigned long long *max_seq) {
+    if (n < sizeof(kMagic) || memcmp(buf, kMagic, sizeof(kMagic)) != 0) return 0;
+    size_t off = sizeof(kMagic);
+    while (n - off >= FRAME_HDR) {
+        uint32_t len, sum; unsigned long long seq;
+        memcpy(&len, buf + off, 4); memcpy(&seq, buf + off + 4, 8); memcpy(&sum, buf + off + 12, 4);
+        if (len > MAX_RECORD || n - off - FRAME_HDR < len) break;
+        const unsigned char *rec = buf + off + FRAME_HDR;
+        if (frame_sum(seq, rec, len) != sum) break;
+        if (seq > after_seq && fn) fn(rec, len);
+        if (max_seq && seq > *max_seq) *max_seq = seq;
+        off += FRAME_HDR + len;
+    }
+    return off;
+}
+
+static unsigned char *read_file(const char *path, size_t *n_out) {
+    *n_out = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) { close(fd); return NULL; }
+    unsigned char *buf = (unsigned char *)malloc((size_t)st.st_size);
+    size_t got = 0;
+    while (buf && got < (size_t)st.st_size) {
+        ssize_t r = read(fd, buf + got, (size_t)st.st_size - got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        got += (size_t)r;
+    }
+    close(fd);
+    *n_out = got;
+    return buf;
+}
+
+static int open_fresh(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    if (write_all(fd, (const unsigned char *)kMagic, sizeof(kMagic)) != 0 || fsync(fd) != 0) { close(fd); return -1; }
+    return fd;
+}
+
+int nm_journal_open(const char *path, unsigned long long next_seq) {
+    size_t n = 0;
+    unsigned char *buf = read_file(path, &n);
+    size_t good = buf ? scan(buf, n, 0, NULL, NULL) : 0;
+    free(buf);
+    int fd;
+    if (good == 0) {
+        fd = open_fresh(path);
+        good = sizeof(kMagic);
+    } else {
+        fd = open(path, O_WRONLY);
+        if (fd >= 0 && good < n) {
+            fprintf(stderr, "[NM] journal %s: dropping %zu byte(s) of torn tail\n", path, n - good);
+            if (ftruncate(fd, (off_t)good) != 0) { close(fd); fd = -1; }
+        }
+        if (fd >= 0 && lseek(fd, 0, SEEK_END) < 0) { close(fd); fd = -1; }
+    }
+    if (fd < 0) { fprintf(stderr, "[NM] journal %s: %s\n", path, strerror(errno)); return -1; }
+    pthread_mutex_lock(&g_jmu);
+    g_fd = fd;
+    snprintf(g_path, sizeof(g_path), "%s", path);
+    g_file_bytes = good;
+    g_next_seq = next_seq ? next_seq : 1;
+    g_last_seq = g_durable_seq = g_next_seq - 1;
+    pthread_mutex_unlock(&g_jmu);
+    pthread_t th; pthread_create(&th, NULL, journal_writer, NULL); pthread_detach(th);
+    return 0;
+}
+
+unsigned long long nm_journal_append(const void *rec, size_t len) {
+    if (len > MAX_RECORD) return 0;
+    pthread_mutex_lock(&g_jmu);
+    if (g_fd < 0) { pthread_mutex_unlock(&g_jmu); return 0; }
+    size_t need = g_pend_len + FRAME_HDR + len;
+    if (need > g_pend_cap) {
+        size_t nc = g_pend_cap ? g_pend_cap * 2 : 4096;
+        while (nc < need) nc *= 2;
+        unsigned char *p = (unsigned char *)realloc(g_pend, nc);
+        if (!p) { pthread_mutex_unlock(&g_jmu); return 0; }
+        g_pend = p; g_pend_cap = nc;
+    }
+    unsigned long long seq = g_next_seq++;
+    uint32_t len32 = (uint32_t)len, sum = frame_sum(seq, (const unsigned char *)rec, len);
+    unsigned char *f = g_pend + g_pend_len;
+    memcpy(f, &len32, 4); memcpy(f + 4, &seq, 8); memcpy(f + 12, &sum, 4);
+    memcpy(f + FRAME_HDR, rec, len);
+    g_pend_len += FRAME_HDR + len;
+    g_file_bytes += FRAME_HDR + len;
+    g_last_seq = seq;
+    pthread_cond_signal(&g_work);
+    pthread_mutex_unlock(&g_jmu);
+    return seq;
+}
+
+int nm_journal_sync(void) {
+    pthread_mutex_lock(&g_jmu);
+    unsigned long long target = g_last_seq;
+    while (g_fd >= 0 && g_durable_seq < target) pthread_cond_wait(&g_done, &g_jmu);
+    int r = g_err ? -1 : 0;
+    pthread_mutex_unlock(&g_jmu);
+    return r;
+}
+
+unsigned long long nm_journal_last_seq(void) {
+    pthread_mutex_lock(&g_jmu);
+    unsigned long long s = g_last_seq;
+    pthread_mutex_unlock(&g_jmu);
+    return s;
+}
+
+size_t nm_journal_bytes(void) {
+    pthread_mutex_lock(&g_jmu);
+    size_t b = g_file_bytes;
+    pthread_mutex_unlock(&g_jmu);
+    return b;
+}
+
+int nm_journal_rotate(void) {
+    pthread_mutex_lock(&g_jmu);
+    if (g_fd < 0) { pthread_mutex_unlock(&g_jmu); return -1; }
+    while (g_pend_len || g_writing) pthread_cond_wait(&g_done, &g_jmu);
+    char old[600]; snprintf(old, sizeof(old), "%s.old", g_path);
+    if (access(old, F_OK) == 0) { pthread_mutex_unlock(&g_jmu); return 1; }
+    int fd = -1;
+    if (rename(g_path, old) == 0) fd = open_fresh(g_path);
+    if (fd < 0) {
+        // Could not start a fresh file; keep appending to whichever file is live
+        fprintf(stderr, "[NM] journal rotate failed: %s\n", strerror(errno));
+        if (access(g_path, F_OK) != 0) rename(old, g_path);
+        pthread_mutex_unlock(&g_jmu);
+        return 1;
+    }
+    close(g_fd);
+    g_fd = fd;
+    g_file_bytes = sizeof(kMagic);
+    pthread_mutex_unlock(&g_jmu);
+    return 0;
+}
+
+void nm_journal_drop_old(void) {
+    pthread_mutex_lock(&g_jmu);
+    if (g_fd < 0) { pthread_mutex_unlock(&g_jmu); return; }
+    char old[600]; snprintf(old, sizeof(old), "%s.old", g_path);
+    unlink(old);
+    pthread_mutex_unlock(&g_jmu);
+}
+
+unsigned long long nm_journal_replay(const char *path, unsigned long long after_seq, nm_journal_apply_fn fn) {
+    size_t n = 0;
+    unsigned char *buf = read_file(path, &n);
+    if (!buf) return 0;
+    unsigned long long max_seq = 0;
+    scan(buf, n, after_seq, fn, &max_seq);
+    free(buf);
+    return max_seq;
+}
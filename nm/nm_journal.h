@@ -0,0 +1,42 @@
+#ifndef NM_JOURNAL_H
+#define NM_JOURNAL_H
+
+#include <stddef.h>
+
+// Append-only NM metadata journal: framing, group-committed fsync and rotation.
+// Record payloads are opaque here; nm_persist encodes one record per state mutation.
+// Every record gets a sequence number; a snapshot remembers the last one it covers, so
+// recovery is "load snapshot, replay records with a higher seq".
+
+// Open (or create) the journal at path for appending; next record gets seq next_seq.
+// A torn tail left by a crash is truncated away. Starts the group-commit writer. Returns 0 on success.
+int nm_journal_open(const char *path, unsigned long long next_seq);
+
+// Queue a record; returns its seq, or 0 when no journal is open (e.g. while replaying at startup).
+// Does not wait for the disk: the writer thread flushes batches as they accumulate.
+unsigned long long nm_journal_append(const void *rec, size_t len);
+
+// Wait until every record appended so far is on disk. Concurrent callers share one fsync.
+// Returns 0 on success, -1 if a write failed.
+int nm_journal_sync(void);
+
+// Seq of the newest appended record (0 if none)
+unsigned long long nm_journal_last_seq(void);
+
+// Bytes in the live journal file, including queued records
+size_t nm_journal_bytes(void);
+
+// Flush, then move the live file to <path>.old and continue in a fresh one. The caller must keep
+// appends out while this runs. Returns 0 if rotated, 1 if an earlier <path>.old still exists (its
+// snapshot never completed) and the live file was kept, -1 if no journal is open.
+int nm_journal_rotate(void);
+
+// Delete <path>.old once a snapshot covering it is safely on disk
+void nm_journal_drop_old(void);
+
+// Apply every intact record of the journal at path with seq > after_seq, in order.
+// Returns the highest seq seen (0 if none). A missing file is not an error.
+typedef void (*nm_journal_apply_fn)(const unsigned char *rec, size_t len);
+unsigned long long nm_journal_replay(const char *path, unsigned long long after_seq, nm_journal_apply_fn fn);
+
+#endif // NM_JOURNAL_H
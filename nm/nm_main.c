@@ -1,4 +1,6 @@
+#define _POSIX_C_SOURCE 200809L
 #include <arpa/inet.h>
+#include <stdarg.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
@@ -8,24 +10,62 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <time.h>
+#include <math.h>
 
 #include "../common/net_proto.h"
 #include "nm_persist.h"
 #include "nm_dir.h"
+#include "nm_watch.h"
+#include "nm_fanout.h"
 #include "../common/tickets.h"
+#include "../common/hmap.h"
 #include <errno.h>
 
 #define BACKLOG 64
+#define NM_STATE_FILE "nm_state.snap"  // binary snapshot; mutations since it go to NM_STATE_FILE ".journal"
+#define NM_STATE_JSON "nm_state.json"  // JSON snapshot of older NMs, imported once when there is no binary one
 
 static volatile int g_running = 1;
 
+// Failure detection: phi-accrual over heartbeat inter-arrival times. phi = -log10(P(a gap this long)),
+// with the gap distribution estimated from the last HB_WINDOW arrivals. Thresholds are tunable via
+// NM_PHI_SUSPECT / NM_PHI_DOWN; NM_HB_TIMEOUT stays as a hard ceiling and as the rule until
+// HB_MIN_SAMPLES gaps have been seen.
+#define HB_WINDOW 64
+#define HB_MIN_SAMPLES 5
+#define HB_MIN_STDDEV 0.25      // seconds; keeps a perfectly regular SS from tripping on small jitter
+#define HB_TICK_MS 200
+static double g_phi_suspect = 3.0;
+static double g_phi_down = 8.0;
+static double g_hb_timeout = 6.0;
+
+// Placement of new files: live per-SS load reported on heartbeats, each term normalised to the busiest
+// up SS and weighted (NM_PLACE_W_BYTES / _QPS / _SESSIONS / _DISK). Two random candidates are scored and
+// the lighter one wins, so a burst of CREATEs does not herd onto one "best" SS between heartbeats.
+static double g_w_bytes = 1.0, g_w_qps = 1.0, g_w_sessions = 1.0, g_w_disk = 1.0;
+static int g_place_min_free_mb = 64; // NM_PLACE_MIN_FREE_MB: SSs below this are never chosen
+
+static double now_mono(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
 typedef struct ss_entry {
     int ss_id;
     int ss_ctrl_port;
     int ss_data_port;
     char ss_addr[64];
-    time_t last_heartbeat;
+    double last_hb;     // monotonic seconds of the last heartbeat
     int is_up;
+    int suspect;        // phi crossed the suspect threshold: still primary, but reads go elsewhere
+    double hb_gaps[HB_WINDOW]; // recent heartbeat inter-arrival times (ring buffer)
+    int hb_n, hb_pos;
+    int load;           // requests in flight + served since the previous heartbeat (SS-reported)
+    int reads_assigned; // READ lookups routed here since the last heartbeat
+    int stored_kb;      // bytes under files/, in KiB (SS-reported)
+    int sessions;       // open write sessions (SS-reported)
+    int free_mb;        // free disk at the store root; -1 until reported
+    int placed;         // new files placed here since the last heartbeat
     struct ss_entry *next;
 } ss_entry_t;
 
@@ -37,7 +77,9 @@ static void add_ss(int id, int ctrl, int data, const char *addr) {
     ss_entry_t *e = (ss_entry_t *)malloc(sizeof(ss_entry_t));
     e->ss_id = id; e->ss_ctrl_port = ctrl; e->ss_data_port = data;
     snprintf(e->ss_addr, sizeof(e->ss_addr), "%s", addr);
-    e->last_heartbeat = time(NULL); e->is_up = 1; e->next = g_ss_list; g_ss_list = e;
+    e->last_hb = now_mono(); e->is_up = 1; e->suspect = 0; e->hb_n = 0; e->hb_pos = 0;
+    e->load = 0; e->reads_assigned = 0; e->stored_kb = 0; e->sessions = 0; e->free_mb = -1; e->placed = 0;
+    e->next = g_ss_list; g_ss_list = e;
     pthread_mutex_unlock(&g_mu);
 }
 
@@ -46,6 +88,33 @@ static ss_entry_t *find_ss_nolock(int id) {
     return NULL;
 }
 
+// Suspicion level for e at time now (caller holds g_mu); -1 while there are too few samples
+static double ss_phi_nolock(const ss_entry_t *e, double now) {
+    if (e->hb_n < HB_MIN_SAMPLES) return -1.0;
+    double mean = 0, var = 0;
+    for (int i = 0; i < e->hb_n; i++) mean += e->hb_gaps[i];
+    mean /= e->hb_n;
+    for (int i = 0; i < e->hb_n; i++) var += (e->hb_gaps[i] - mean) * (e->hb_gaps[i] - mean);
+    double sd = sqrt(var / e->hb_n); if (sd < HB_MIN_STDDEV) sd = HB_MIN_STDDEV;
+    // Logistic approximation of the normal tail
+    double y = (now - e->last_hb - mean) / sd;
+    double ex = exp(-y * (1.5976 + 0.070566 * y * y));
+    double p = (y > 0) ? ex / (1.0 + ex) : 1.0 - 1.0 / (1.0 + ex);
+    if (p < 1e-300) p = 1e-300;
+    return -log10(p);
+}
+
+// Record a heartbeat arrival (caller holds g_mu)
+static void ss_hb_arrival_nolock(ss_entry_t *e, double now) {
+    double gap = now - e->last_hb;
+    // Gaps spanning an outage say nothing about normal cadence
+    if (e->is_up && gap > 0 && gap < g_hb_timeout) {
+        e->hb_gaps[e->hb_pos] = gap; e->hb_pos = (e->hb_pos + 1) % HB_WINDOW;
+        if (e->hb_n < HB_WINDOW) e->hb_n++;
+    }
+    e->last_hb = now;
+}
+
 static int get_ss_info(int ssid, int *out_port, char *out_addr, size_t addr_sz) {
     pthread_mutex_lock(&g_mu);
     ss_entry_t *e = find_ss_nolock(ssid);
@@ -66,6 +135,219 @@ static int g_replication_queue = 0; // pending/in-flight tasks
 static void repq_inc(int delta) { pthread_mutex_lock(&g_rep_mu); g_replication_queue += delta; if (g_replication_queue < 0) g_replication_queue = 0; pthread_mutex_unlock(&g_rep_mu); }
 static int repq_get(void) { pthread_mutex_lock(&g_rep_mu); int v = g_replication_queue; pthread_mutex_unlock(&g_rep_mu); return v; }
 
+// Replica freshness: every commit bumps a per-file head version; a replica is up to date once a
+// replication task started at (or after) that head has completed against it. The same node carries
+// the file's access heat for the rebalancer. In-memory only: file -> node in g_repv.
+#define REPV_MAX 16
+typedef struct repv_node {
+    long head;
+    int n;
+    int ssids[REPV_MAX];
+    long acked[REPV_MAX];
+    long hits;          // LOOKUPs since the last rebalancer pass, halved every pass
+    time_t moved_at;    // last rebalancer migration (cooldown)
+} repv_node_t;
+static hmap_t g_repv = HMAP_INIT;
+static pthread_mutex_t g_repv_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static repv_node_t *repv_find_nolock(const char *file, int create) {
+    size_t v = 0;
+    if (hmap_get(&g_repv, file, &v) == 0) return (repv_node_t *)(uintptr_t)v;
+    if (!create) return NULL;
+    repv_node_t *n = (repv_node_t *)calloc(1, sizeof(*n)); if (!n) return NULL;
+    if (hmap_put(&g_repv, file, (size_t)(uintptr_t)n) < 0) { free(n); return NULL; }
+    return n;
+}
+
+static long *repv_slot_nolock(repv_node_t *n, int ssid) {
+    for (int i = 0; i < n->n; i++) if (n->ssids[i] == ssid) return &n->acked[i];
+    if (n->n >= REPV_MAX) return NULL;
+    n->ssids[n->n] = ssid; n->acked[n->n] = n->head; // unseen replicas start level with head
+    return &n->acked[n->n++];
+}
+
+// New commit on the primary; returns the new head version
+static long repv_bump(const char *file) {
+    pthread_mutex_lock(&g_repv_mu);
+    repv_node_t *n = repv_find_nolock(file, 1); long v = n ? ++n->head : 0;
+    pthread_mutex_unlock(&g_repv_mu);
+    return v;
+}
+
+static long repv_head(const char *file) {
+    pthread_mutex_lock(&g_repv_mu);
+    repv_node_t *n = repv_find_nolock(file, 0); long v = n ? n->head : 0;
+    pthread_mutex_unlock(&g_repv_mu);
+    return v;
+}
+
+// Mark a replica as behind head (e.g. it rejoined with unknown contents)
+static void repv_invalidate(const char *file, int ssid) {
+    pthread_mutex_lock(&g_repv_mu);
+    repv_node_t *n = repv_find_nolock(file, 1);
+    if (n) { long *a = repv_slot_nolock(n, ssid); if (a) *a = n->head - 1; }
+    pthread_mutex_unlock(&g_repv_mu);
+}
+
+// Replica has applied everything up to ver
+static void repv_ack(const char *file, int ssid, long ver) {
+    pthread_mutex_lock(&g_repv_mu);
+    repv_node_t *n = repv_find_nolock(file, 1);
+    if (n) { long *a = repv_slot_nolock(n, ssid); if (a && *a < ver) *a = ver; }
+    pthread_mutex_unlock(&g_repv_mu);
+}
+
+// Whether ssid is known to hold head: only an ack (or a promotion) recorded since this NM started counts.
+// A node that merely carries heat, or a replica without a slot, may have missed commits made before a
+// restart, so it is behind.
+static int repv_is_current(const char *file, int ssid) {
+    pthread_mutex_lock(&g_repv_mu);
+    int cur = 0; repv_node_t *n = repv_find_nolock(file, 0);
+    if (n) for (int i = 0; i < n->n; i++) if (n->ssids[i] == ssid) { cur = (n->acked[i] >= n->head); break; }
+    pthread_mutex_unlock(&g_repv_mu);
+    return cur;
+}
+
+static void repv_forget(const char *file) {
+    pthread_mutex_lock(&g_repv_mu);
+    repv_node_t *n = repv_find_nolock(file, 0);
+    if (n) { hmap_del(&g_repv, file); free(n); }
+    pthread_mutex_unlock(&g_repv_mu);
+}
+
+static void repv_rename(const char *old_file, const char *new_file) {
+    repv_forget(new_file);
+    pthread_mutex_lock(&g_repv_mu);
+    repv_node_t *n = repv_find_nolock(old_file, 0);
+    if (n) {
+        hmap_del(&g_repv, old_file);
+        if (hmap_put(&g_repv, new_file, (size_t)(uintptr_t)n) < 0) free(n); // OOM: the file just loses its history
+    }
+    pthread_mutex_unlock(&g_repv_mu);
+}
+
+static void repv_heat_note(const char *file) {
+    pthread_mutex_lock(&g_repv_mu);
+    repv_node_t *n = repv_find_nolock(file, 1); if (n) n->hits++;
+    pthread_mutex_unlock(&g_repv_mu);
+}
+
+// Heat of file, or -1 if it was migrated less than cooldown seconds ago
+static long repv_heat(const char *file, time_t now, int cooldown) {
+    pthread_mutex_lock(&g_repv_mu);
+    repv_node_t *n = repv_find_nolock(file, 0); long v = 0;
+    if (n) v = (n->moved_at && now - n->moved_at < cooldown) ? -1 : n->hits;
+    pthread_mutex_unlock(&g_repv_mu);
+    return v;
+}
+
+static void repv_mark_moved(const char *file, time_t now) {
+    pthread_mutex_lock(&g_repv_mu);
+    repv_node_t *n = repv_find_nolock(file, 1); if (n) n->moved_at = now;
+    pthread_mutex_unlock(&g_repv_mu);
+}
+
+static void repv_heat_decay(void) {
+    pthread_mutex_lock(&g_repv_mu);
+    size_t cur = 0; const char *key; size_t v;
+    while (hmap_next(&g_repv, &cur, &key, &v)) ((repv_node_t *)(uintptr_t)v)->hits /= 2;
+    pthread_mutex_unlock(&g_repv_mu);
+}
+
+// Last version ssid is known to hold: 0 for untracked files, -1 if it never acked since a commit
+static long repv_acked(const char *file, int ssid) {
+    pthread_mutex_lock(&g_repv_mu);
+    long v = 0; repv_node_t *n = repv_find_nolock(file, 0);
+    if (n) {
+        v = n->head > 0 ? -1 : 0;
+        for (int i = 0; i < n->n; i++) if (n->ssids[i] == ssid) { v = n->acked[i]; break; }
+    }
+    pthread_mutex_unlock(&g_repv_mu);
+    return v;
+}
+
+// Failover moved the primary to new_primary: it now defines head, replicas that were level with it stay
+// current, and the old primary is behind until its copy has been reconciled and resynced
+static void repv_promote(const char *file, int new_primary, int old_primary) {
+    pthread_mutex_lock(&g_repv_mu);
+    repv_node_t *n = repv_find_nolock(file, 0);
+    if (n) {
+        long *np = repv_slot_nolock(n, new_primary); long base = np ? *np : n->head;
+        for (int i = 0; i < n->n; i++) {
+            if (n->ssids[i] == new_primary || (n->ssids[i] != old_primary && n->acked[i] >= base)) n->acked[i] = n->head;
+            else if (n->acked[i] >= n->head) n->acked[i] = n->head - 1;
+        }
+        long *op = repv_slot_nolock(n, old_primary); if (op && *op >= n->head) *op = n->head - 1;
+    }
+    pthread_mutex_unlock(&g_repv_mu);
+}
+
+// Unreplicated tails: when failover has to promote a replica that is behind, the commits only the old
+// primary holds are parked here with the promoted copy's content at promotion time (the merge base).
+// When the old primary returns, its copy (theirs) is captured before anything overwrites it and merged
+// onto the current primary with MERGE_TAIL. In-memory only, like the version tracker.
+#define TAIL_MAX_TRIES 20
+#define TAIL_RETRY_TICKS 25 // heartbeat-monitor ticks between retries
+typedef struct tail_rec {
+    char file[128];
+    int old_primary;
+    long lost;      // commits the promoted copy was missing
+    char *base;     // promoted copy at promotion time
+    char *theirs;   // old primary's copy once captured, NULL until then
+    int tries;      // failed reconcile attempts
+    int busy, dead; // being reconciled / forgotten meanwhile (freed by the reconciler)
+    struct tail_rec *next;
+} tail_rec_t;
+static tail_rec_t *g_tails = NULL;
+static pthread_mutex_t g_tail_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static void tail_free(tail_rec_t *t) { if (!t) return; free(t->base); free(t->theirs); free(t); }
+
+// Takes ownership of base
+static void tail_park(const char *file, int old_primary, long lost, char *base) {
+    tail_rec_t *t = (tail_rec_t *)calloc(1, sizeof(*t)); if (!t) { free(base); return; }
+    snprintf(t->file, sizeof(t->file), "%s", file); t->old_primary = old_primary; t->lost = lost; t->base = base;
+    pthread_mutex_lock(&g_tail_mu);
+    // A second failover before reconciliation keeps the older base: it predates both tails
+    for (tail_rec_t *o = g_tails; o; o = o->next) if (strcmp(o->file, file) == 0 && o->old_primary == old_primary) { pthread_mutex_unlock(&g_tail_mu); tail_free(t); return; }
+    t->next = g_tails; g_tails = t;
+    pthread_mutex_unlock(&g_tail_mu);
+}
+
+// Does ssid still hold an uncaptured tail for file? Its copy must not be overwritten until then.
+static int tail_holds(const char *file, int ssid) {
+    pthread_mutex_lock(&g_tail_mu);
+    int held = 0;
+    for (tail_rec_t *t = g_tails; t && !held; t = t->next) held = (t->old_primary == ssid && !t->theirs && strcmp(t->file, file) == 0);
+    pthread_mutex_unlock(&g_tail_mu);
+    return held;
+}
+
+static size_t tail_pending(void) {
+    pthread_mutex_lock(&g_tail_mu);
+    size_t n = 0; for (tail_rec_t *t = g_tails; t; t = t->next) n++;
+    pthread_mutex_unlock(&g_tail_mu);
+    return n;
+}
+
+static void tail_forget(const char *file) {
+    pthread_mutex_lock(&g_tail_mu);
+    for (tail_rec_t **pp = &g_tails; *pp; ) {
+        if (strcmp((*pp)->file, file) == 0) {
+            tail_rec_t *t = *pp;
+            if (t->busy) t->dead = 1; else { *pp = t->next; tail_free(t); continue; }
+        }
+        pp = &(*pp)->next;
+    }
+    pthread_mutex_unlock(&g_tail_mu);
+}
+
+static void tail_rename(const char *old_file, const char *new_file) {
+    pthread_mutex_lock(&g_tail_mu);
+    for (tail_rec_t *t = g_tails; t; t = t->next) if (strcmp(t->file, old_file) == 0) snprintf(t->file, sizeof(t->file), "%s", new_file);
+    pthread_mutex_unlock(&g_tail_mu);
+}
+
 // Minimal JSON string unescape for EXEC script bodies
 static void json_unescape_inplace(char *str) {
     if (!str) return;
@@ -124,7 +406,7 @@ static int fetch_checkpoint_from_ss(const char *file, const char *cpname, int ss
 }
 
 // Fire-and-forget PUT replicate to a target ssid (fetches from primary)
-typedef struct { char file[128]; int primary_ssid; int target_ssid; } repl_put_args_t;
+typedef struct { char file[128]; int primary_ssid; int target_ssid; long ver; } repl_put_args_t;
 static void *repl_put_thread(void *arg) {
     repl_put_args_t *a = (repl_put_args_t *)arg;
     char body[8192]; body[0]='\0';
@@ -134,7 +416,9 @@ static void *repl_put_thread(void *arg) {
             int dfd = tcp_connect(dest_addr, (uint16_t)dport);
             if (dfd >= 0) {
                 char req[9216]; req[0]='\0'; json_put_string_field(req, sizeof(req), "type", "PUT", 1); json_put_string_field(req, sizeof(req), "file", a->file, 0); json_put_string_field(req, sizeof(req), "body", body, 0); strncat(req, "}", sizeof(req)-strlen(req)-1);
-                (void)send_msg(dfd, req, (uint32_t)strlen(req)); char *rr=NULL; uint32_t rrl=0; (void)recv_msg(dfd, &rr, &rrl); if (rr) free(rr); close(dfd);
+                (void)send_msg(dfd, req, (uint32_t)strlen(req)); char *rr=NULL; uint32_t rrl=0; (void)recv_msg(dfd, &rr, &rrl);
+                if (rr && strstr(rr, "\"status\":\"OK\"")) repv_ack(a->file, a->target_ssid, a->ver);
+                free(rr); close(dfd);
                 fprintf(stderr, "[NM] Replicated PUT %s -> ss%d\n", a->file, a->target_ssid);
             }
         }
@@ -145,8 +429,9 @@ static void *repl_put_thread(void *arg) {
 }
 
 static void schedule_put_repl(const char *file, int primary_ssid, int target_ssid) {
+    if (tail_holds(file, target_ssid)) return; // old primary's tail not captured yet; resync covers it afterwards
     repl_put_args_t *a = (repl_put_args_t *)malloc(sizeof(*a)); if (!a) return;
-    snprintf(a->file, sizeof(a->file), "%s", file); a->primary_ssid = primary_ssid; a->target_ssid = target_ssid;
+    snprintf(a->file, sizeof(a->file), "%s", file); a->primary_ssid = primary_ssid; a->target_ssid = target_ssid; a->ver = repv_head(file);
     pthread_t th; repq_inc(1); pthread_create(&th, NULL, repl_put_thread, a); pthread_detach(th);
 }
 
@@ -182,69 +467,8 @@ static void schedule_checkpoint_repl(const char *file, const char *name, int pri
     pthread_t th; repq_inc(1); pthread_create(&th, NULL, repl_checkpoint_thread, a); pthread_detach(th);
 }
 
-// Fire-and-forget undo replicate to a target ssid (fetches from primary)
-typedef struct { char file[128]; int primary_ssid; int target_ssid; } repl_undo_args_t;
-static void *repl_undo_thread(void *arg) {
-    repl_undo_args_t *a = (repl_undo_args_t *)arg;
-    // Fetch undo from primary using READ ticket (undo is just a file)
-    int pport = 0; char paddr[64];
-    if (get_ss_info(a->primary_ssid, &pport, paddr, sizeof(paddr)) == 0 && pport) {
-        char ticket[256]; 
-        if (ticket_build(a->file, "READ", a->primary_ssid, 600, ticket, sizeof(ticket)) == 0) {
-            int sfd = tcp_connect(paddr, (uint16_t)pport);
-            if (sfd >= 0) {
-                // Build request to read undo file directly
-                char undo_file[256]; snprintf(undo_file, sizeof(undo_file), "../undo/%s.undo", a->file);
-                char req[512]; req[0]='\0';
-                json_put_string_field(req, sizeof(req), "type", "READ", 1);
-                json_put_string_field(req, sizeof(req), "file", undo_file, 0);
-                json_put_string_field(req, sizeof(req), "ticket", ticket, 0);
-                strncat(req, "}", sizeof(req)-strlen(req)-1);
-                if (send_msg(sfd, req, (uint32_t)strlen(req)) == 0) {
-                    char *resp = NULL; uint32_t rl = 0;
-                    if (recv_msg(sfd, &resp, &rl) == 0 && resp) {
-                        if (strstr(resp, "\"status\":\"OK\"")) {
-                            char body[8192]; body[0] = '\0';
-                            if (json_get_string_field(resp, "body", body, sizeof(body)) == 0) {
-                                // Now send to target SS
-                                int dport = 0; char dest_addr[64];
-                                if (get_ss_info(a->target_ssid, &dport, dest_addr, sizeof(dest_addr)) == 0 && dport) {
-                                    int dfd = tcp_connect(dest_addr, (uint16_t)dport);
-                                    if (dfd >= 0) {
-                                        char put_req[9216]; put_req[0]='\0';
-                                        json_put_string_field(put_req, sizeof(put_req), "type", "PUT_UNDO", 1);
-                                        json_put_string_field(put_req, sizeof(put_req), "file", a->file, 0);
-                                        json_put_string_field(put_req, sizeof(put_req), "body", body, 0);
-                                        strncat(put_req, "}", sizeof(put_req)-strlen(put_req)-1);
-                                        (void)send_msg(dfd, put_req, (uint32_t)strlen(put_req));
-                                        char *rr=NULL; uint32_t rrl=0; (void)recv_msg(dfd, &rr, &rrl);
-                                        if (rr) free(rr);
-                                        close(dfd);
-                                        fprintf(stderr, "[NM] Replicated UNDO %s -> ss%d\n", a->file, a->target_ssid);
-                                    }
-                                }
-                            }
-                        }
-                        free(resp);
-                    }
-                }
-                close(sfd);
-            }
-        }
-    }
-    repq_inc(-1);
-    free(a);
-    return NULL;
-}
-
-static void schedule_undo_repl(const char *file, int primary_ssid, int target_ssid) {
-    repl_undo_args_t *a = (repl_undo_args_t *)malloc(sizeof(*a)); if (!a) return;
-    snprintf(a->file, sizeof(a->file), "%s", file); a->primary_ssid = primary_ssid; a->target_ssid = target_ssid;
-    pthread_t th; repq_inc(1); pthread_create(&th, NULL, repl_undo_thread, a); pthread_detach(th);
-}
-
 // Fire-and-forget simple command replicate (CREATE/DELETE/RENAME)
-typedef struct { char type[16]; char file[128]; char newfile[128]; int target_ssid; } repl_cmd_args_t;
+typedef struct { char type[16]; char file[128]; char newfile[128]; int target_ssid; long ver; } repl_cmd_args_t;
 static void *repl_cmd_thread(void *arg) {
     repl_cmd_args_t *a = (repl_cmd_args_t*)arg;
     int dport = 0; char dest_addr[64];
@@ -252,7 +476,10 @@ static void *repl_cmd_thread(void *arg) {
         int dfd = tcp_connect(dest_addr, (uint16_t)dport);
         if (dfd >= 0) {
             char req[512]; req[0]='\0'; json_put_string_field(req, sizeof(req), "type", a->type, 1); json_put_string_field(req, sizeof(req), "file", a->file, 0); if (strcmp(a->type, "RENAME")==0) json_put_string_field(req, sizeof(req), "newFile", a->newfile, 0); strncat(req, "}", sizeof(req)-strlen(req)-1);
-            (void)send_msg(dfd, req, (uint32_t)strlen(req)); char *r=NULL; uint32_t rl=0; (void)recv_msg(dfd, &r, &rl); if (r) free(r); close(dfd);
+            (void)send_msg(dfd, req, (uint32_t)strlen(req)); char *r=NULL; uint32_t rl=0; (void)recv_msg(dfd, &r, &rl);
+            // A fresh CREATE leaves the replica level with an empty primary
+            if (r && strstr(r, "\"status\":\"OK\"") && strcmp(a->type, "CREATE") == 0) repv_ack(a->file, a->target_ssid, a->ver);
+            free(r); close(dfd);
             fprintf(stderr, "[NM] Replicated %s %s -> ss%d\n", a->type, a->file, a->target_ssid);
         }
     }
@@ -263,86 +490,1114 @@ static void *repl_cmd_thread(void *arg) {
 
 static void schedule_cmd_repl(const char *type, const char *file, const char *newfile, int target_ssid) {
     repl_cmd_args_t *a = (repl_cmd_args_t*)malloc(sizeof(*a)); if (!a) return;
-    snprintf(a->type, sizeof(a->type), "%s", type); snprintf(a->file, sizeof(a->file), "%s", file); a->newfile[0]='\0'; if (newfile) snprintf(a->newfile, sizeof(a->newfile), "%s", newfile); a->target_ssid = target_ssid;
+    snprintf(a->type, sizeof(a->type), "%s", type); snprintf(a->file, sizeof(a->file), "%s", file); a->newfile[0]='\0'; if (newfile) snprintf(a->newfile, sizeof(a->newfile), "%s", newfile); a->target_ssid = target_ssid; a->ver = repv_head(file);
     pthread_t th; repq_inc(1); pthread_create(&th, NULL, repl_cmd_thread, a); pthread_detach(th);
 }
 
-// Background thread: mark SS down if heartbeat stale and promote replicas
+// --- Anti-entropy scrubber ---
+// Push-on-commit replication above can miss updates (a dropped PUT, a replica that was down, on-disk
+// corruption). The scrubber walks the directory comparing each replica's Merkle root (ss_merkle on the SS)
+// with the primary's; on mismatch it diffs per-sentence leaves and ships only the divergent sentences.
+#define SCRUB_INTERVAL_SEC 30
+#define SCRUB_FILES_PER_PASS 64   // bounds SS traffic per pass; a cursor resumes where the last pass stopped
+#define SCRUB_MAX_PATCH 256       // SS_MAX_PATCH on the SS; wider diffs fall back to a whole-file PUT
+
+static int ss_is_up(int ssid) {
+    pthread_mutex_lock(&g_mu); ss_entry_t *e = find_ss_nolock(ssid); int up = (e && e->is_up); pthread_mutex_unlock(&g_mu);
+    return up;
+}
+
+// Connect to an SS data port; returns the fd or -1
+static int ss_open(int ssid) {
+    int port = 0; char addr[64];
+    if (get_ss_info(ssid, &port, addr, sizeof(addr)) != 0 || port == 0) return -1;
+    return tcp_connect(addr, (uint16_t)port);
+}
+
+// One request/reply round trip to an SS data port; returns the malloc'd reply or NULL
+static char *ss_rpc(int ssid, const char *req) {
+    int fd = ss_open(ssid); if (fd < 0) return NULL;
+    char *r = NULL; uint32_t rl = 0;
+    if (send_msg(fd, req, (uint32_t)strlen(req)) != 0 || recv_msg(fd, &r, &rl) != 0) { free(r); r = NULL; }
+    close(fd);
+    return r;
+}
+
+// Fence (ttl > 0) or unfence (0) client commits on file at ssid; returns 0 once the SS has applied it
+static int ss_fence(int ssid, const char *file, int ttl) {
+    char req[256]; req[0]='\0';
+    json_put_string_field(req, sizeof(req), "type", "FENCE", 1); json_put_string_field(req, sizeof(req), "file", file, 0);
+    json_put_int_field(req, sizeof(req), "ttl", ttl, 0); strncat(req, "}", sizeof(req)-strlen(req)-1);
+    char *r = ss_rpc(ssid, req); int rc = (r && strstr(r, "\"status\":\"OK\"")) ? 0 : -1;
+    free(r);
+    return rc;
+}
+
+typedef struct { char root[17]; int count; char *leaves; } scrub_digest_t; // leaves: count*16 hex digits, or NULL
+
+// Fetch a HASH digest. Returns 0 on success, 1 if the SS lacks the file, -1 if unreachable or malformed.
+static int scrub_digest(int ssid, const char *file, int root_only, scrub_digest_t *d) {
+    memset(d, 0, sizeof(*d));
+    char req[256]; req[0]='\0';
+    json_put_string_field(req, sizeof(req), "type", "HASH", 1); json_put_string_field(req, sizeof(req), "file", file, 0); json_put_int_field(req, sizeof(req), "rootOnly", root_only, 0); strncat(req, "}", sizeof(req)-strlen(req)-1);
+    char *r = ss_rpc(ssid, req); if (!r) return -1;
+    int rc = -1;
+    if (strstr(r, "\"status\":\"ERR_NOTFOUND\"")) rc = 1;
+    else if (strstr(r, "\"status\":\"OK\"") && json_get_string_field(r, "rootHash", d->root, sizeof(d->root)) == 0 && json_get_int_field(r, "sentCount", &d->count) == 0 && d->count >= 0) {
+        rc = 0;
+        if (!root_only) {
+            size_t lsz = (size_t)d->count * 16 + 1;
+            d->leaves = (char *)malloc(lsz);
+            if (!d->leaves || json_get_string_field(r, "leafHashes", d->leaves, lsz) != 0 || strlen(d->leaves) != lsz - 1) { free(d->leaves); d->leaves = NULL; rc = -1; }
+        }
+    }
+    free(r);
+    return rc;
+}
+
+// A RENAME request (to new_file) went out to ssid but its reply was lost. Send it again: OK, or the old
+// name gone while new_file answers HASH, means ssid holds new_file (1); any other answer means it kept
+// the old name (0); -1 if ssid cannot be reached to tell.
+static int ss_settle_rename(int ssid, const char *new_file, const char *req) {
+    char *r = ss_rpc(ssid, req); if (!r) return -1;
+    int rc = 0;
+    if (strstr(r, "\"status\":\"OK\"")) rc = 1;
+    else if (strstr(r, "\"status\":\"ERR_NOTFOUND\"")) {
+        scrub_digest_t d; int h = scrub_digest(ssid, new_file, 1, &d);
+        rc = h == 0 ? 1 : (h < 0 ? -1 : 0);
+    }
+    free(r);
+    return rc;
+}
+
+// Copy sentences idx[0..nd) from primary onto target and resize target to count sentences
+static int scrub_patch(const char *file, int primary, int target, const int *idx, int nd, int count) {
+    size_t isz = (size_t)nd * 12 + 1; char *ilist = (char *)malloc(isz); if (!ilist) return -1;
+    ilist[0] = '\0';
+    for (int k = 0; k < nd; ++k) snprintf(ilist + strlen(ilist), isz - strlen(ilist), "%s%d", k ? "," : "", idx[k]);
+    int rc = -1;
+    char *req = (char *)malloc(isz + 256); char *r = NULL, *hex = NULL, *preq = NULL;
+    if (!req) goto done;
+    req[0]='\0';
+    json_put_string_field(req, isz + 256, "type", "SENTENCES", 1); json_put_string_field(req, isz + 256, "file", file, 0); json_put_string_field(req, isz + 256, "sentIdx", ilist, 0); strncat(req, "}", isz + 256 - strlen(req) - 1);
+    r = ss_rpc(primary, req);
+    int pcount = -1;
+    if (!r || !strstr(r, "\"status\":\"OK\"") || json_get_int_field(r, "sentCount", &pcount) != 0 || pcount != count) goto done; // primary moved on; next pass retries
+    hex = (char *)malloc(strlen(r) + 1);
+    if (!hex || json_get_string_field(r, "sentHex", hex, strlen(r) + 1) != 0) goto done;
+    size_t psz = strlen(hex) + isz + 512;
+    preq = (char *)malloc(psz); if (!preq) goto done;
+    preq[0]='\0';
+    json_put_string_field(preq, psz, "type", "PATCH_SENTENCES", 1); json_put_string_field(preq, psz, "file", file, 0); json_put_int_field(preq, psz, "sentCount", count, 0);
+    json_put_string_field(preq, psz, "sentIdx", ilist, 0); json_put_string_field(preq, psz, "sentHex", hex, 0); strncat(preq, "}", psz - strlen(preq) - 1);
+    free(r); r = ss_rpc(target, preq);
+    if (r && strstr(r, "\"status\":\"OK\"")) rc = 0;
+done:
+    free(ilist); free(req); free(r); free(hex); free(preq);
+    return rc;
+}
+
+// Bring target's copy of file level with the primary's.
+// Returns 0 if already in sync, 1 if repaired (or a full PUT was scheduled), -1 on failure.
+static int scrub_file(const char *file, int primary, int target) {
+    long ver = repv_head(file);
+    if (tail_holds(file, target)) return -1;
+    scrub_digest_t pd, td;
+    if (scrub_digest(primary, file, 1, &pd) != 0) return -1;
+    int trc = scrub_digest(target, file, 1, &td);
+    if (trc < 0) return -1;
+    if (trc == 0 && strcmp(pd.root, td.root) == 0) { repv_ack(file, target, ver); return 0; }
+    if (trc == 1) {
+        fprintf(stderr, "[NM] Scrub %s: missing on ss%d, full copy\n", file, target);
+        schedule_put_repl(file, primary, target); return 1;
+    }
+    if (scrub_digest(primary, file, 0, &pd) != 0) return -1;
+    if (scrub_digest(target, file, 0, &td) != 0) { free(pd.leaves); return -1; }
+    int idx[SCRUB_MAX_PATCH]; int nd = 0, overflow = 0;
+    for (int i = 0; i < pd.count; ++i) {
+        if (i < td.count && memcmp(pd.leaves + (size_t)i * 16, td.leaves + (size_t)i * 16, 16) == 0) continue;
+        if (nd == SCRUB_MAX_PATCH) { overflow = 1; break; }
+        idx[nd++] = i;
+    }
+    free(pd.leaves); free(td.leaves);
+    // A diff touching most of the file is cheaper as one PUT
+    if (overflow || nd * 2 > pd.count) {
+        fprintf(stderr, "[NM] Scrub %s: ss%d diverged (%d/%d sentences), full copy\n", file, target, nd, pd.count);
+        schedule_put_repl(file, primary, target); return 1;
+    }
+    if (scrub_patch(file, primary, target, idx, nd, pd.count) != 0) return -1;
+    repv_ack(file, target, ver);
+    fprintf(stderr, "[NM] Scrub %s: patched %d/%d sentence(s) on ss%d\n", file, nd, pd.count, target);
+    return 1;
+}
+
+// Merge one parked tail onto the file's current primary. Returns 0 when the record can be dropped.
+static int tail_merge(const char *file, const char *base, const char *theirs) {
+    int primary = 0;
+    if (nm_dir_lookup(file, &primary) != 0) return 0; // file is gone
+    char *bh = hex_encode(base, strlen(base)), *th = hex_encode(theirs, strlen(theirs));
+    size_t rsz = (bh ? strlen(bh) : 0) + (th ? strlen(th) : 0) + 512;
+    char *req = (bh && th) ? (char *)malloc(rsz) : NULL;
+    int rc = -1;
+    if (req) {
+        req[0]='\0';
+        json_put_string_field(req, rsz, "type", "MERGE_TAIL", 1); json_put_string_field(req, rsz, "file", file, 0);
+        json_put_string_field(req, rsz, "baseHex", bh, 0); json_put_string_field(req, rsz, "theirsHex", th, 0); strncat(req, "}", rsz - strlen(req) - 1);
+        char *r = ss_rpc(primary, req);
+        int merged = 0, conflicts = 0;
+        if (r && strstr(r, "\"status\":\"OK\"")) {
+            json_get_int_field(r, "mergedCount", &merged); json_get_int_field(r, "conflictCount", &conflicts);
+            fprintf(stderr, "[NM] Tail %s: %d sentence(s) recovered onto ss%d, %d conflict(s) kept the newer primary's text\n", file, merged, primary, conflicts);
+            rc = 0;
+        } else if (r && strstr(r, "\"status\":\"ERR_NOTFOUND\"")) rc = 0;
+        free(r);
+    }
+    free(bh); free(th); free(req);
+    return rc;
+}
+
+// Reconcile parked tails whose old primary is ssid (or every up one for ssid < 0). Captures the old
+// primary's copy first so a resync may then overwrite it; merges that fail (primary busy or down) stay parked.
+static void tail_reconcile(int ssid) {
+    tail_rec_t *work[64]; size_t nw = 0;
+    pthread_mutex_lock(&g_tail_mu);
+    for (tail_rec_t *t = g_tails; t && nw < 64; t = t->next) {
+        if (t->busy || t->dead || (ssid >= 0 && t->old_primary != ssid)) continue;
+        t->busy = 1; work[nw++] = t;
+    }
+    pthread_mutex_unlock(&g_tail_mu);
+    for (size_t k = 0; k < nw; ++k) {
+        tail_rec_t *t = work[k];
+        char file[128]; snprintf(file, sizeof(file), "%s", t->file); // t->file may be renamed under us
+        int done = 0;
+        if (!t->theirs) {
+            if (!ss_is_up(t->old_primary)) goto next;
+            char *body = (char *)malloc(8192);
+            if (body && fetch_file_from_ss(file, t->old_primary, body, 8192) == 0) {
+                pthread_mutex_lock(&g_tail_mu); t->theirs = body; pthread_mutex_unlock(&g_tail_mu);
+            } else free(body);
+        }
+        if (t->theirs) done = (tail_merge(file, t->base, t->theirs) == 0);
+        if (!done && ++t->tries >= TAIL_MAX_TRIES) {
+            fprintf(stderr, "[NM] Tail %s: giving up after %d attempts; %ld commit(s) from ss%d not recovered\n", file, t->tries, t->lost, t->old_primary);
+            done = 1;
+        }
+    next:
+        pthread_mutex_lock(&g_tail_mu);
+        t->busy = 0;
+        if (done || t->dead) {
+            for (tail_rec_t **pp = &g_tails; *pp; pp = &(*pp)->next) if (*pp == t) { *pp = t->next; break; }
+            tail_free(t);
+        }
+        pthread_mutex_unlock(&g_tail_mu);
+    }
+}
+
+typedef struct { char files[SCRUB_FILES_PER_PASS][128]; int ps[SCRUB_FILES_PER_PASS]; size_t n; } scrub_batch_t;
+
+static int scrub_collect(const char *file, int ss_id, void *arg) {
+    scrub_batch_t *b = (scrub_batch_t *)arg;
+    snprintf(b->files[b->n], sizeof(b->files[b->n]), "%s", file);
+    b->ps[b->n++] = ss_id;
+    return 0;
+}
+
+// Background thread: periodic anti-entropy pass over up to SCRUB_FILES_PER_PASS files
+static void *scrub_thread(void *arg) {
+    (void)arg;
+    size_t cursor = 0;
+    scrub_batch_t *b = (scrub_batch_t *)malloc(sizeof(*b));
+    if (!b) return NULL;
+    while (g_running) {
+        sleep(SCRUB_INTERVAL_SEC);
+        // Take the next slice of the directory; wrap to the start for the rest of the budget
+        size_t start = cursor;
+        b->n = 0;
+        nm_state_foreach_dir(&cursor, SCRUB_FILES_PER_PASS, scrub_collect, b);
+        if (cursor == 0 && b->n < SCRUB_FILES_PER_PASS && start > 0) {
+            size_t more = SCRUB_FILES_PER_PASS - b->n;
+            nm_state_foreach_dir(&cursor, more < start ? more : start, scrub_collect, b);
+        }
+        if (b->n == 0) continue;
+        int checked = 0, repaired = 0;
+        for (size_t i = 0; i < b->n; ++i) {
+            if (!ss_is_up(b->ps[i])) continue;
+            int repls[16]; size_t nr = nm_state_get_replicas(b->files[i], repls, 16); if (nr > 16) nr = 16;
+            for (size_t j = 0; j < nr; ++j) {
+                if (repls[j] == b->ps[i] || !ss_is_up(repls[j])) continue;
+                checked++;
+                if (scrub_file(b->files[i], b->ps[i], repls[j]) > 0) repaired++;
+            }
+        }
+        if (repaired) fprintf(stderr, "[NM] Scrub pass: %d replica copies checked, %d repaired\n", checked, repaired);
+    }
+    free(b);
+    return NULL;
+}
+
+// --- Bulk resync on SS rejoin ---
+// A rejoining SS gets one session thread instead of a thread per object. Files it replicates are walked
+// in batches sharing a primary; both sides answer a MANIFEST (content root, undo digest, checkpoint digests)
+// and only objects that are missing or differ are copied, pipelined over one connection per side.
+#define RESYNC_BATCH 64
+#define RESYNC_WINDOW 8                         // unanswered requests per pipelined connection
+#define RESYNC_DEADLINE_MS 30000                // both MANIFEST replies of a batch
+#define RESYNC_BYTES_PER_SEC (4 * 1024 * 1024)  // copy budget so a rejoin does not starve foreground traffic
+
+typedef struct resync_sess { int ssid; int again; size_t total; size_t done; struct resync_sess *next; } resync_sess_t;
+static resync_sess_t *g_resync = NULL;
+static pthread_mutex_t g_resync_mu = PTHREAD_MUTEX_INITIALIZER;
+
+// Files not yet checked across all running sessions (reported by STATS)
+static size_t resync_pending(void) {
+    size_t n = 0;
+    pthread_mutex_lock(&g_resync_mu);
+    for (resync_sess_t *r = g_resync; r; r = r->next) n += r->total - r->done;
+    pthread_mutex_unlock(&g_resync_mu);
+    return n;
+}
+
+// Send reqs[0..n) over fd with at most RESYNC_WINDOW unanswered; replies[i] receives each malloc'd reply.
+// The SS answers in order on a connection, so replies line up with requests. Returns -1 if the link drops.
+static int ss_pipeline(int fd, char **reqs, int n, char **replies) {
+    int sent = 0, got = 0;
+    while (got < n) {
+        while (sent < n && sent - got < RESYNC_WINDOW) {
+            if (send_msg(fd, reqs[sent], (uint32_t)strlen(reqs[sent])) != 0) return -1;
+            sent++;
+        }
+        char *r = NULL; uint32_t rl = 0;
+        if (recv_msg(fd, &r, &rl) != 0) { free(r); return -1; }
+        replies[got++] = r;
+    }
+    return 0;
+}
+
+typedef struct { char *root; char *undo; char *cps; } resync_mf_t; // fields point into the MANIFEST reply
+
+// MANIFEST request for files[sel[0..n)] (malloc'd; caller frees)
+static char *resync_manifest_req(char files[][128], const int *sel, int n) {
+    size_t rsz = (size_t)n * 257 + 64; char *req = (char *)malloc(rsz); if (!req) return NULL;
+    size_t w = (size_t)snprintf(req, rsz, "{\"type\":\"MANIFEST\",\"files\":\"");
+    for (int i = 0; i < n; ++i) {
+        char *h = hex_encode(files[sel[i]], strlen(files[sel[i]])); if (!h) { free(req); return NULL; }
+        w += (size_t)snprintf(req + w, rsz - w, "%s%s", i ? "," : "", h); free(h);
+    }
+    snprintf(req + w, rsz - w, "\"}");
+    return req;
+}
+
+// Split a MANIFEST reply for n files into mf; returns r, which backs mf (caller frees), or NULL (r freed)
+static char *resync_manifest_parse(char *r, int n, resync_mf_t *mf) {
+    char *m = (r && strstr(r, "\"status\":\"OK\"")) ? strstr(r, "\"manifest\":\"") : NULL;
+    if (!m) { free(r); return NULL; }
+    m += strlen("\"manifest\":\"");
+    char *end = strchr(m, '"'); if (end) *end = '\0';
+    for (int i = 0; i < n; ++i) {
+        char *next = strchr(m, ','); if (next) *next = '\0';
+        char *c1 = strchr(m, ':'); char *c2 = c1 ? strchr(c1 + 1, ':') : NULL;
+        if (!c2 || (!next && i + 1 < n)) { free(r); return NULL; }
+        *c1 = '\0'; *c2 = '\0';
+        mf[i].root = m; mf[i].undo = c1 + 1; mf[i].cps = c2 + 1;
+        m = next ? next + 1 : m + strlen(m);
+    }
+    return r;
+}
+
+// Is "<hexname>=<digest>" present in a '+'-separated checkpoint list?
+static int resync_cp_listed(const char *cps, const char *item, size_t ilen) {
+    for (const char *p = cps; *p; ) {
+        const char *e = strchr(p, '+'); size_t l = e ? (size_t)(e - p) : strlen(p);
+        if (l == ilen && strncmp(p, item, l) == 0) return 1;
+        if (!e) break;
+        p = e + 1;
+    }
+    return 0;
+}
+
+typedef struct { int kind; int fi; char name[256]; } resync_obj_t; // kind: 0 content, 1 undo, 2 checkpoint
+
+// Bring target level with primary for files[sel[0..n)]. Returns bytes pushed, -1 if the target is unreachable.
+static long resync_batch(int target, int primary, char files[][128], const int *sel, int n) {
+    long vers[RESYNC_BATCH]; for (int i = 0; i < n; ++i) vers[i] = repv_head(files[sel[i]]);
+    resync_mf_t tm[RESYNC_BATCH], pm[RESYNC_BATCH];
+    // Both manifests at once: the batch waits for the slower SS, not for the two in turn
+    char *req = resync_manifest_req(files, sel, n); if (!req) return -1;
+    nm_fanout_call_t mc[2] = { { target, req, NULL, 0 }, { primary, req, NULL, 0 } };
+    (void)nm_fanout(mc, 2, get_ss_info, 2, RESYNC_DEADLINE_MS);
+    free(req);
+    char *tbuf = resync_manifest_parse(mc[0].reply, n, tm);
+    char *pbuf = resync_manifest_parse(mc[1].reply, n, pm);
+    if (!tbuf) { free(pbuf); return -1; }
+    if (!pbuf) { free(tbuf); return 0; } // primary away; failover resyncs later
+    int cap = n * 4, nobj = 0; resync_obj_t *objs = (resync_obj_t *)malloc(sizeof(resync_obj_t) * (size_t)cap);
+    for (int i = 0; objs && i < n; ++i) {
+        const char *f = files[sel[i]];
+        if (nobj + 2 > cap) { resync_obj_t *no = (resync_obj_t *)realloc(objs, sizeof(resync_obj_t) * (size_t)(cap *= 2)); if (!no) break; objs = no; }
+        if (strcmp(pm[i].root, "-") != 0 && strcmp(pm[i].root, tm[i].root) != 0) { objs[nobj].kind = 0; objs[nobj].fi = i; nobj++; }
+        else if (strcmp(pm[i].root, tm[i].root) == 0) repv_ack(f, target, vers[i]);
+        if (strcmp(pm[i].undo, "-") != 0 && strcmp(pm[i].undo, tm[i].undo) != 0) { objs[nobj].kind = 1; objs[nobj].fi = i; nobj++; }
+        for (const char *p = pm[i].cps; *p; ) {
+            const char *e = strchr(p, '+'); size_t l = e ? (size_t)(e - p) : strlen(p);
+            const char *eq = memchr(p, '=', l);
+            if (eq && !resync_cp_listed(tm[i].cps, p, l) && (size_t)(eq - p) / 2 < sizeof(objs[0].name)) {
+                if (nobj == cap) { resync_obj_t *no = (resync_obj_t *)realloc(objs, sizeof(resync_obj_t) * (size_t)(cap *= 2)); if (!no) break; objs = no; }
+                if (hex_decode(p, (size_t)(eq - p), objs[nobj].name) > 0) { objs[nobj].kind = 2; objs[nobj].fi = i; nobj++; }
+            }
+            if (!e) break;
+            p = e + 1;
+        }
+    }
+    long pushed = 0;
+    if (objs && nobj > 0) {
+        char **reqs = (char **)calloc((size_t)nobj, sizeof(char *)); char **reps = (char **)calloc((size_t)nobj, sizeof(char *));
+        char **puts = (char **)calloc((size_t)nobj, sizeof(char *)); char **acks = (char **)calloc((size_t)nobj, sizeof(char *));
+        int pfd = ss_open(primary);
+        for (int k = 0; reqs && reps && puts && acks && pfd >= 0 && k < nobj; ++k) {
+            const char *f = files[sel[objs[k].fi]];
+            char rfile[160]; const char *op = "READ";
+            if (objs[k].kind == 1) snprintf(rfile, sizeof(rfile), "../undo/%s.undo", f); else snprintf(rfile, sizeof(rfile), "%s", f);
+            if (objs[k].kind == 2) op = "VIEWCHECKPOINT";
+            char ticket[256]; if (ticket_build(rfile, op, primary, 600, ticket, sizeof(ticket)) != 0) ticket[0] = '\0';
+            reqs[k] = (char *)malloc(768); if (!reqs[k]) continue;
+            reqs[k][0] = '\0';
+            json_put_string_field(reqs[k], 768, "type", op, 1); json_put_string_field(reqs[k], 768, "file", rfile, 0); json_put_string_field(reqs[k], 768, "ticket", ticket, 0);
+            if (objs[k].kind == 2) json_put_string_field(reqs[k], 768, "name", objs[k].name, 0);
+            strncat(reqs[k], "}", 768 - strlen(reqs[k]) - 1);
+        }
+        int nfetch = 0; while (nfetch < nobj && reqs && reqs[nfetch]) nfetch++;
+        if (pfd >= 0 && nfetch == nobj) (void)ss_pipeline(pfd, reqs, nobj, reps);
+        if (pfd >= 0) close(pfd);
+        // Turn every fetched body into the matching PUT / PUT_UNDO / PUT_CHECKPOINT
+        int nput = 0;
+        int *which = (int *)malloc(sizeof(int) * (size_t)nobj);
+        for (int k = 0; which && reps && k < nobj; ++k) {
+            if (!reps[k] || !strstr(reps[k], "\"status\":\"OK\"")) continue;
+            size_t bsz = strlen(reps[k]) + 1; char *body = (char *)malloc(bsz);
+            if (!body || json_get_string_field(reps[k], "body", body, bsz) != 0) { free(body); continue; }
+            const char *f = files[sel[objs[k].fi]];
+            size_t psz = bsz + 512; char *pr = (char *)malloc(psz);
+            if (pr) {
+                pr[0] = '\0';
+                json_put_string_field(pr, psz, "type", objs[k].kind == 0 ? "PUT" : objs[k].kind == 1 ? "PUT_UNDO" : "PUT_CHECKPOINT", 1);
+                json_put_string_field(pr, psz, "file", f, 0);
+                if (objs[k].kind == 2) json_put_string_field(pr, psz, "name", objs[k].name, 0);
+                json_put_string_field(pr, psz, "body", body, 0); strncat(pr, "}", psz - strlen(pr) - 1);
+                puts[nput] = pr; which[nput] = k; nput++; pushed += (long)strlen(pr);
+            }
+            free(body);
+        }
+        int tfd = nput > 0 ? ss_open(target) : -1;
+        if (tfd < 0 && nput > 0) pushed = -1;
+        else if (nput > 0 && ss_pipeline(tfd, puts, nput, acks) != 0) pushed = -1;
+        if (tfd >= 0) close(tfd);
+        for (int q = 0; which && q < nput; ++q) {
+            const resync_obj_t *o = &objs[which[q]];
+            if (o->kind == 0 && acks[q] && strstr(acks[q], "\"status\":\"OK\"")) repv_ack(files[sel[o->fi]], target, vers[o->fi]);
+        }
+        fprintf(stderr, "[NM] Resync ss%d <- ss%d: %d/%d stale object(s) copied\n", target, primary, nput, nobj);
+        for (int k = 0; k < nobj; ++k) { if (reqs) free(reqs[k]); if (reps) free(reps[k]); if (puts) free(puts[k]); if (acks) free(acks[k]); }
+        free(reqs); free(reps); free(puts); free(acks); free(which);
+    }
+    free(objs); free(tbuf); free(pbuf);
+    return pushed;
+}
+
+
+// Session body: every file the SS replicates, grouped by primary, RESYNC_BATCH at a time
+static void resync_run(resync_sess_t *sess) {
+    int target = sess->ssid;
+    tail_reconcile(target); // a returning old primary's unreplicated edits are merged before its copy is replaced
+    size_t nrep = 0; char **names = nm_state_get_ss_files(target, NM_ROLE_REPLICA, &nrep);
+    size_t alloc = nrep > 0 ? nrep : 1;
+    char (*files)[128] = malloc(sizeof(char[128]) * alloc); int *ps = (int *)malloc(sizeof(int) * alloc); int *sel = (int *)malloc(sizeof(int) * alloc);
+    if (!files || !ps || !sel) { free(files); free(ps); free(sel); nm_state_free_list(names, nrep); return; }
+    size_t m = 0;
+    for (size_t i = 0; i < nrep; ++i) {
+        int primary = 0;
+        if (nm_dir_lookup(names[i], &primary) != 0 || primary == target || tail_holds(names[i], target)) continue;
+        snprintf(files[m], 128, "%s", names[i]); ps[m] = primary; sel[m] = (int)m;
+        repv_invalidate(files[m], target);
+        m++;
+    }
+    nm_state_free_list(names, nrep);
+    pthread_mutex_lock(&g_resync_mu); sess->total = m; sess->done = 0; pthread_mutex_unlock(&g_resync_mu);
+    fprintf(stderr, "[NM] Resync ss%d: %zu replicated file(s) to check\n", target, m);
+    time_t t0 = time(NULL); long bytes = 0; size_t next = 0;
+    int *batch = (int *)malloc(sizeof(int) * RESYNC_BATCH); char *taken = (char *)calloc(m > 0 ? m : 1, 1);
+    while (batch && taken && next < m && g_running) {
+        // Next batch: the first unprocessed file's primary, plus following files on the same primary
+        while (next < m && taken[next]) next++;
+        if (next >= m) break;
+        int primary = ps[sel[next]]; int nb = 0;
+        for (size_t k = next; k < m && nb < RESYNC_BATCH; ++k) if (!taken[k] && ps[sel[k]] == primary) { taken[k] = 1; batch[nb++] = sel[k]; }
+        long pushed = resync_batch(target, primary, files, batch, nb);
+        if (pushed < 0) { fprintf(stderr, "[NM] Resync ss%d: target unreachable, abandoning\n", target); break; }
+        bytes += pushed;
+        pthread_mutex_lock(&g_resync_mu); sess->done += (size_t)nb; size_t done = sess->done; pthread_mutex_unlock(&g_resync_mu);
+        fprintf(stderr, "[NM] Resync ss%d: %zu/%zu files checked, %ld bytes sent\n", target, done, m, bytes);
+        // Throttle: stay under RESYNC_BYTES_PER_SEC averaged over the session
+        long ahead = bytes / RESYNC_BYTES_PER_SEC - (long)(time(NULL) - t0);
+        if (ahead > 0) sleep((unsigned)ahead);
+    }
+    free(batch); free(taken); free(files); free(ps); free(sel);
+}
+
+static void *resync_thread(void *arg) {
+    resync_sess_t *sess = (resync_sess_t *)arg;
+    for (;;) {
+        resync_run(sess);
+        // Another rejoin while we ran means the directory may have moved on; go again, else retire
+        pthread_mutex_lock(&g_resync_mu);
+        if (sess->again) { sess->again = 0; pthread_mutex_unlock(&g_resync_mu); continue; }
+        for (resync_sess_t **pp = &g_resync; *pp; pp = &(*pp)->next) if (*pp == sess) { *pp = sess->next; break; }
+        pthread_mutex_unlock(&g_resync_mu);
+        break;
+    }
+    fprintf(stderr, "[NM] Resync ss%d: done\n", sess->ssid);
+    free(sess);
+    repq_inc(-1);
+    return NULL;
+}
+
+// Start (or re-arm) the bulk resync session for an SS that registered or came back UP
+static void resync_request(int ssid) {
+    pthread_mutex_lock(&g_resync_mu);
+    for (resync_sess_t *r = g_resync; r; r = r->next) if (r->ssid == ssid) { r->again = 1; pthread_mutex_unlock(&g_resync_mu); return; }
+    resync_sess_t *sess = (resync_sess_t *)calloc(1, sizeof(*sess));
+    if (!sess) { pthread_mutex_unlock(&g_resync_mu); return; }
+    sess->ssid = ssid; sess->next = g_resync; g_resync = sess;
+    pthread_mutex_unlock(&g_resync_mu);
+    pthread_t th; repq_inc(1); pthread_create(&th, NULL, resync_thread, sess); pthread_detach(th);
+}
+
+// Promote a replica for every file whose primary is ssid. The candidate is the up replica holding the
+// highest replicated version; if even that one is behind, its current copy is parked as the merge base
+// for the old primary's tail. Returns how many files still lack an up replica.
+static size_t failover_ss(int ssid) {
+    size_t n = 0, stuck = 0; int promoted = 0, behind = 0;
+    char **files = nm_state_get_ss_files(ssid, NM_ROLE_PRIMARY, &n);
+    for (size_t i = 0; i < n; i++) {
+        int repls[16]; size_t nr = nm_state_get_replicas(files[i], repls, 16);
+        if (nr > 16) nr = 16;
+        int up[16]; size_t nup = 0;
+        pthread_mutex_lock(&g_mu);
+        for (size_t j = 0; j < nr; j++) { ss_entry_t *ce = find_ss_nolock(repls[j]); if (repls[j] != ssid && ce && ce->is_up) up[nup++] = repls[j]; }
+        pthread_mutex_unlock(&g_mu);
+        int cand = -1; long best = 0;
+        for (size_t j = 0; j < nup; j++) { long v = repv_acked(files[i], up[j]); if (cand < 0 || v > best) { cand = up[j]; best = v; } }
+        if (cand < 0) { stuck++; continue; }
+        long head = repv_head(files[i]);
+        if (best < head) {
+            // Nobody has the last head - best commits; keep what cand has now so they can be merged back later
+            char *base = (char *)malloc(8192);
+            if (!base || fetch_file_from_ss(files[i], cand, base, 8192) != 0) { free(base); stuck++; continue; }
+            long lost = best < 0 ? head : head - best;
+            tail_park(files[i], ssid, lost, base);
+            behind++;
+            fprintf(stderr, "[NM] %s: best replica ss%d is %ld commit(s) behind; tail parked until ss%d returns\n", files[i], cand, lost, ssid);
+        }
+        // Promote candidate and ensure old primary becomes a replica
+        nm_dir_set(files[i], cand);
+        int new_reps[16]; size_t nnr = 0;
+        new_reps[nnr++] = ssid;
+        // Keep other replicas except the new primary and duplicates
+        for (size_t k = 0; k < nr && nnr < 16; k++) {
+            if (repls[k] == cand || repls[k] == ssid) continue;
+            new_reps[nnr++] = repls[k];
+        }
+        nm_state_set_replicas(files[i], new_reps, nnr);
+        repv_promote(files[i], cand, ssid);
+        (void)ss_fence(cand, files[i], 0); // cand may still be fenced from a migration away from it
+        promoted++;
+        fprintf(stderr, "[NM] Promoted %s primary -> ss%d; old primary %d set as replica\n", files[i], cand, ssid);
+    }
+    nm_state_free_list(files, n);
+    if (promoted) {
+        fprintf(stderr, "[NM] Failover ss%d: %d file(s) promoted (%d with a parked tail), %zu waiting for a replica\n", ssid, promoted, behind, stuck);
+        (void)nm_state_save(NM_STATE_FILE);
+    }
+    return stuck;
+}
+
+// Background thread: mark SS suspect/down from its phi (or the hard timeout) and promote replicas.
+// Work per tick is O(registered SSs); promotion walks only the downed SS's files via the per-SS index.
+// SSs whose files could not all be promoted (no replica up yet) stay in `pending` and are retried.
+typedef struct { int *v; size_t n, cap; } id_set_t;
+
+// Add id unless already present; the set is small (one entry per SS)
+static void id_set_add(id_set_t *s, int id) {
+    for (size_t i = 0; i < s->n; ++i) if (s->v[i] == id) return;
+    if (s->n == s->cap) {
+        size_t nc = s->cap ? s->cap * 2 : 16;
+        int *p = (int *)realloc(s->v, nc * sizeof(int));
+        if (!p) return;
+        s->v = p; s->cap = nc;
+    }
+    s->v[s->n++] = id;
+}
+
+static int id_set_visit(int ss_id, void *arg) { id_set_add((id_set_t *)arg, ss_id); return 0; }
+
 static void *hb_monitor_thread(void *arg) {
     (void)arg;
+    id_set_t pending = { NULL, 0, 0 };
+    time_t started = time(NULL); int seeded = 0; unsigned ticks = 0;
     while (g_running) {
-        time_t now = time(NULL);
+        time_t now = time(NULL); double mnow = now_mono();
         pthread_mutex_lock(&g_mu);
         for (ss_entry_t *e = g_ss_list; e; e = e->next) {
-            int was_up = e->is_up;
-            if (now - e->last_heartbeat > 6) e->is_up = 0; else e->is_up = 1;
-            if (was_up && !e->is_up) {
-                fprintf(stderr, "[NM] SS %d marked DOWN\n", e->ss_id);
+            if (!e->is_up) continue; // only a heartbeat brings an SS back
+            double silent = mnow - e->last_hb;
+            double phi = ss_phi_nolock(e, mnow);
+            if (silent > g_hb_timeout || phi >= g_phi_down) {
+                e->is_up = 0; e->suspect = 0;
+                fprintf(stderr, "[NM] SS %d marked DOWN (silent %.1fs, phi=%.1f)\n", e->ss_id, silent, phi);
+                id_set_add(&pending, e->ss_id);
+            } else if (!e->suspect && phi >= g_phi_suspect) {
+                e->suspect = 1;
+                fprintf(stderr, "[NM] SS %d SUSPECT (silent %.1fs, phi=%.1f); routing reads away\n", e->ss_id, silent, phi);
             }
         }
         pthread_mutex_unlock(&g_mu);
-        // Promote primaries whose SS is down
-        char files[512][128]; int ssids[512]; size_t n = nm_state_get_dir(files, ssids, 512);
-        for (size_t i=0;i<n;i++) {
-            int primary = ssids[i];
-            int up = 0; pthread_mutex_lock(&g_mu); ss_entry_t *e = find_ss_nolock(primary); if (e && e->is_up) up = 1; pthread_mutex_unlock(&g_mu);
-            if (!up) {
-                int repls[16]; size_t nr = nm_state_get_replicas(files[i], repls, 16);
-                int promoted = 0;
-                for (size_t j=0;j<nr;j++) {
-                    int cand = repls[j]; int cand_up=0; pthread_mutex_lock(&g_mu); ss_entry_t *ce = find_ss_nolock(cand); if (ce && ce->is_up) cand_up=1; pthread_mutex_unlock(&g_mu);
-                    if (cand_up) {
-                        // Promote candidate and ensure old primary becomes a replica
-                        nm_dir_set(files[i], cand);
-                        int new_reps[16]; size_t nnr = 0;
-                        // Include old primary as replica
-                        new_reps[nnr++] = primary;
-                        // Keep other replicas except the new primary and duplicates
-                        for (size_t k=0;k<nr && nnr<16;k++) {
-                            if (repls[k] == cand || repls[k] == primary) continue;
-                            new_reps[nnr++] = repls[k];
-                        }
-                        nm_state_set_replicas(files[i], new_reps, nnr);
-                        promoted = 1; fprintf(stderr, "[NM] Promoted %s primary -> ss%d; old primary %d set as replica\n", files[i], cand, primary);
-                        break;
-                    }
-                }
-                if (promoted) (void)nm_state_save("nm_state.json");
-            }
+        // After one heartbeat window, SSs that own files but never came up count as down too
+        if (!seeded && now - started > 6) {
+            id_set_t ids = { NULL, 0, 0 };
+            nm_state_foreach_indexed_ss(id_set_visit, &ids);
+            for (size_t k = 0; k < ids.n; k++) if (!ss_is_up(ids.v[k])) id_set_add(&pending, ids.v[k]);
+            free(ids.v);
+            seeded = 1;
         }
-        sleep(1);
+        // Promote primaries whose SS is down; drop entries that recovered or have nothing left to move
+        for (size_t p = 0; p < pending.n; ) {
+            if (ss_is_up(pending.v[p]) || failover_ss(pending.v[p]) == 0) { pending.v[p] = pending.v[--pending.n]; continue; }
+            p++;
+        }
+        // Parked tails whose merge failed earlier (primary busy or down) get another try every few seconds
+        if (++ticks % TAIL_RETRY_TICKS == 0 && tail_pending() > 0) tail_reconcile(-1);
+        struct timespec tick = { 0, HB_TICK_MS * 1000000L }; nanosleep(&tick, NULL);
     }
+    free(pending.v);
     return NULL;
 }
 
+typedef struct { double stored, qps, sessions, free; } place_max_t;
+
+static double place_score_nolock(const ss_entry_t *e, const place_max_t *mx) {
+    double sc = 0;
+    if (mx->stored > 0) sc += g_w_bytes * e->stored_kb / mx->stored;
+    if (mx->qps > 0) sc += g_w_qps * (e->load + e->reads_assigned + e->placed) / mx->qps;
+    if (mx->sessions > 0) sc += g_w_sessions * e->sessions / mx->sessions;
+    if (mx->free > 0 && e->free_mb >= 0) sc += g_w_disk * (1.0 - e->free_mb / mx->free);
+    return sc;
+}
+
+// Pick the SS for a new file (see the placement note at the top). O(registered SSs); no directory scan.
 static int pick_least_loaded_ss(int *out_ssid, int *out_data_port, char *out_addr, size_t addr_sz) {
-    // Count mappings per SS
-    int counts[1024]; int ssids[1024]; int nss=0;
+    static unsigned seed = 0;
+    ss_entry_t *elig[2] = { NULL, NULL }; int n = 0;
+    place_max_t mx = { 0, 0, 0, 0 };
     pthread_mutex_lock(&g_mu);
-    for (ss_entry_t *e = g_ss_list; e; e = e->next) { ssids[nss]=e->ss_id; counts[nss]=0; nss++; if (nss>=1024) break; }
-    pthread_mutex_unlock(&g_mu);
-    // Tally from directory
-    char files[512][128]; int ssmap[512]; size_t n = nm_state_get_dir(files, ssmap, 512);
-    for (size_t i=0; i<n; ++i) {
-        for (int j=0; j<nss; ++j) if (ssmap[i] == ssids[j]) { counts[j]++; break; }
+    if (seed == 0) seed = (unsigned)time(NULL) ^ (unsigned)getpid();
+    // One pass finds the maxima and two distinct random eligible SSs (reservoir sampling)
+    for (ss_entry_t *e = g_ss_list; e; e = e->next) {
+        if (!e->is_up || e->ss_data_port == 0) continue;
+        if (e->free_mb >= 0 && e->free_mb < g_place_min_free_mb) continue; // disk nearly full
+        n++;
+        if (n <= 2) elig[n - 1] = e;
+        else if ((int)(rand_r(&seed) % (unsigned)n) < 2) elig[rand_r(&seed) % 2u] = e;
+        if (e->stored_kb > mx.stored) mx.stored = e->stored_kb;
+        double q = e->load + e->reads_assigned + e->placed; if (q > mx.qps) mx.qps = q;
+        if (e->sessions > mx.sessions) mx.sessions = e->sessions;
+        if (e->free_mb > mx.free) mx.free = e->free_mb;
     }
-    // Choose min count (tie: first)
-    if (nss == 0) return -1;
-    int best = 0; for (int j=1; j<nss; ++j) if (counts[j] < counts[best]) best = j;
-    int chosen_ssid = ssids[best];
-    int data_port = 0; char ss_addr[64] = "127.0.0.1";
-    pthread_mutex_lock(&g_mu);
-    for (ss_entry_t *e = g_ss_list; e; e=e->next) {
-        if (e->ss_id==chosen_ssid) { data_port = e->ss_data_port; snprintf(ss_addr, sizeof(ss_addr), "%s", e->ss_addr); break; }
+    if (n == 0) { pthread_mutex_unlock(&g_mu); return -1; }
+    ss_entry_t *best = elig[0];
+    if (n > 1) {
+        // Suspect SSs lose to healthy ones regardless of score
+        double si = place_score_nolock(elig[0], &mx) + (elig[0]->suspect ? 1e6 : 0);
+        double sj = place_score_nolock(elig[1], &mx) + (elig[1]->suspect ? 1e6 : 0);
+        best = sj < si ? elig[1] : elig[0];
     }
+    best->placed++;
+    int chosen_ssid = best->ss_id, data_port = best->ss_data_port;
+    char ss_addr[64]; snprintf(ss_addr, sizeof(ss_addr), "%s", best->ss_addr);
     pthread_mutex_unlock(&g_mu);
-    if (data_port==0) return -1;
     if (out_ssid) *out_ssid = chosen_ssid;
     if (out_data_port) *out_data_port = data_port;
     if (out_addr && addr_sz > 0) snprintf(out_addr, addr_sz, "%s", ss_addr);
     return 0;
 }
 
+// --- Online migration and background rebalancing ---
+// A file moves in two copies: a bulk copy (content, undo, checkpoints via the resync MANIFEST diff) while
+// writes continue, then a cutover. For the cutover the NM stops issuing mutating tickets for the file,
+// waits for the source's sentence locks on it to drain, copies the remaining delta and switches the
+// directory. If the file is still locked after REBAL_DRAIN_MS the move is abandoned and retried later.
+#define REBAL_INTERVAL_SEC 20
+#define REBAL_MOVES_PER_PASS 4
+#define REBAL_BYTES_PER_SEC (1024 * 1024)
+#define REBAL_MIN_SKEW 0.75      // placement-score gap between the busiest and idlest SS that triggers moves
+#define REBAL_MIN_KB 64          // ...and the busiest SS must hold at least this much, or carry REBAL_MIN_LOAD
+#define REBAL_MIN_LOAD 5
+#define REBAL_COOLDOWN_SEC 600   // a migrated file stays put this long (no ping-pong)
+#define REBAL_DRAIN_MS 3000
+#define MIG_FENCE_SEC 600        // fence lapses on its own if the NM dies before lifting it
+static int g_rebalance = 1;      // NM_REBALANCE=0 turns the background rebalancer off
+
+enum { MIG_OK = 0, MIG_UNAVAILABLE = -1, MIG_LOCKED = -2, MIG_NOTFOUND = -3 };
+
+#define MIGR_MAX 16
+static char g_migrating[MIGR_MAX][128];
+static pthread_mutex_t g_migr_mu = PTHREAD_MUTEX_INITIALIZER;
+
+// Files in cutover refuse mutating LOOKUPs
+static int migr_frozen(const char *file) {
+    pthread_mutex_lock(&g_migr_mu);
+    int hit = 0; for (int i = 0; i < MIGR_MAX && !hit; i++) hit = (g_migrating[i][0] && strcmp(g_migrating[i], file) == 0);
+    pthread_mutex_unlock(&g_migr_mu);
+    return hit;
+}
+
+static int migr_freeze(const char *file) {
+    pthread_mutex_lock(&g_migr_mu);
+    int slot = -1;
+    for (int i = 0; i < MIGR_MAX; i++) {
+        if (g_migrating[i][0] && strcmp(g_migrating[i], file) == 0) { slot = -1; break; }
+        if (!g_migrating[i][0] && slot < 0) slot = i;
+    }
+    if (slot >= 0) snprintf(g_migrating[slot], sizeof(g_migrating[slot]), "%s", file);
+    pthread_mutex_unlock(&g_migr_mu);
+    return slot >= 0 ? 0 : -1;
+}
+
+static void migr_thaw(const char *file) {
+    pthread_mutex_lock(&g_migr_mu);
+    for (int i = 0; i < MIGR_MAX; i++) if (g_migrating[i][0] && strcmp(g_migrating[i], file) == 0) g_migrating[i][0] = '\0';
+    pthread_mutex_unlock(&g_migr_mu);
+}
+
+// Sentence locks ssid holds on file; -1 if unreachable
+static int ss_lock_count(int ssid, const char *file) {
+    char req[256]; req[0]='\0';
+    json_put_string_field(req, sizeof(req), "type", "LOCKS", 1); json_put_string_field(req, sizeof(req), "file", file, 0); strncat(req, "}", sizeof(req)-strlen(req)-1);
+    char *r = ss_rpc(ssid, req); int n = -1;
+    if (r && strstr(r, "\"status\":\"OK\"") && json_get_int_field(r, "lockCount", &n) != 0) n = -1;
+    free(r);
+    return n;
+}
+
+// Move file's primary from src to dst. If dst already replicated the file the two swap roles;
+// otherwise src's copy is deleted once the directory points at dst. *bytes_out gets the bytes copied.
+// Freezing LOOKUPs stops new tickets. Tickets already out are stopped by fencing src once its sessions
+// have drained, so nothing lands there after the last copy. The fence is lifted again once the directory
+// points at dst (or the move is abandoned); it only has to cover the final copy.
+static int migrate_file(const char *file, int src, int dst, long *bytes_out) {
+    if (bytes_out) *bytes_out = 0;
+    if (!ss_is_up(src) || !ss_is_up(dst)) return MIG_UNAVAILABLE;
+    char files[1][128]; int sel[1] = { 0 };
+    snprintf(files[0], sizeof(files[0]), "%s", file);
+    long copied = resync_batch(dst, src, files, sel, 1);
+    if (copied < 0) return MIG_UNAVAILABLE;
+    if (migr_freeze(file) != 0) return MIG_LOCKED;
+    nm_watch_route_changed(file, NM_ROUTE_ALL); // cached write tickets must come back to a frozen LOOKUP
+    // dst may still carry a fence from an earlier move away from it
+    if (ss_fence(dst, file, 0) != 0) { migr_thaw(file); return MIG_UNAVAILABLE; }
+    int rc = MIG_LOCKED;
+    for (int waited = 0; waited <= REBAL_DRAIN_MS; waited += 100) {
+        int held = ss_lock_count(src, file);
+        if (held < 0) { rc = MIG_UNAVAILABLE; break; }
+        if (held == 0) {
+            // Fence, then count again: a session opened since the first count would be refused at commit,
+            // so lift the fence and keep draining instead
+            if (ss_fence(src, file, MIG_FENCE_SEC) != 0) { rc = MIG_UNAVAILABLE; break; }
+            held = ss_lock_count(src, file);
+            if (held == 0) { rc = MIG_OK; break; }
+            (void)ss_fence(src, file, 0);
+            if (held < 0) { rc = MIG_UNAVAILABLE; break; }
+        }
+        struct timespec ts = { 0, 100 * 1000000L }; nanosleep(&ts, NULL);
+    }
+    int cur = 0;
+    if (rc == MIG_OK && (nm_dir_lookup(file, &cur) != 0 || cur != src)) rc = MIG_NOTFOUND; // deleted or moved meanwhile
+    if (rc == MIG_OK) {
+        long delta = resync_batch(dst, src, files, sel, 1);
+        if (delta < 0) rc = MIG_UNAVAILABLE; else copied += delta;
+    }
+    int was_replica = 0;
+    if (rc == MIG_OK) {
+        int repls[16]; size_t nr = nm_state_get_replicas(file, repls, 16); if (nr > 16) nr = 16;
+        int new_reps[16]; size_t nnr = 0;
+        for (size_t k = 0; k < nr; k++) { if (repls[k] == dst) { was_replica = 1; continue; } if (repls[k] != src) new_reps[nnr++] = repls[k]; }
+        if (was_replica && nnr < 16) new_reps[nnr++] = src;
+        nm_dir_set(file, dst);
+        nm_state_set_replicas(file, new_reps, nnr);
+        repv_promote(file, dst, src);
+        (void)nm_state_save(NM_STATE_FILE);
+    }
+    (void)ss_fence(src, file, 0);
+    migr_thaw(file);
+    if (rc != MIG_OK) return rc;
+    if (!was_replica) {
+        char dreq[256]; dreq[0]='\0';
+        json_put_string_field(dreq, sizeof(dreq), "type", "DELETE", 1); json_put_string_field(dreq, sizeof(dreq), "file", file, 0); strncat(dreq, "}", sizeof(dreq)-strlen(dreq)-1);
+        free(ss_rpc(src, dreq)); // best-effort; the scrubber never looks at SSs outside the replica set
+    }
+    fprintf(stderr, "[NM] Migrated %s ss%d -> ss%d (%ld bytes, %s)\n", file, src, dst, copied, was_replica ? "roles swapped" : "source dropped");
+    if (bytes_out) *bytes_out = copied;
+    return MIG_OK;
+}
+
+// Background rebalancer: every REBAL_INTERVAL_SEC compare the placement scores of the up SSs and, when the
+// busiest is clearly ahead of the idlest, move its hottest primaries there, a few per pass and under a byte
+// budget. A newly added SS scores lowest, so it fills up without operator action.
+static void *rebalance_thread(void *arg) {
+    (void)arg;
+    while (g_running) {
+        sleep(REBAL_INTERVAL_SEC);
+        if (!g_rebalance) continue;
+        int hot = -1, cold = -1; double hs = 0, cs = 0; int hot_kb = 0, hot_load = 0;
+        place_max_t mx = { 0, 0, 0, 0 };
+        pthread_mutex_lock(&g_mu);
+        for (ss_entry_t *e = g_ss_list; e; e = e->next) {
+            if (!e->is_up || e->ss_data_port == 0) continue;
+            if (e->stored_kb > mx.stored) mx.stored = e->stored_kb;
+            double q = e->load + e->reads_assigned + e->placed; if (q > mx.qps) mx.qps = q;
+            if (e->sessions > mx.sessions) mx.sessions = e->sessions;
+            if (e->free_mb > mx.free) mx.free = e->free_mb;
+        }
+        for (ss_entry_t *e = g_ss_list; e; e = e->next) {
+            if (!e->is_up || e->ss_data_port == 0 || e->suspect) continue;
+            double sc = place_score_nolock(e, &mx);
+            if (hot < 0 || sc > hs) { hot = e->ss_id; hs = sc; hot_kb = e->stored_kb; hot_load = e->load; }
+            if ((cold < 0 || sc < cs) && (e->free_mb < 0 || e->free_mb >= g_place_min_free_mb)) { cold = e->ss_id; cs = sc; }
+        }
+        pthread_mutex_unlock(&g_mu);
+        if (hot < 0 || cold < 0 || hot == cold || hs - cs < REBAL_MIN_SKEW || (hot_kb < REBAL_MIN_KB && hot_load < REBAL_MIN_LOAD)) { repv_heat_decay(); continue; }
+        size_t n = 0; char **files = nm_state_get_ss_files(hot, NM_ROLE_PRIMARY, &n);
+        // Hottest first; files inside their cooldown are skipped. Leave the SS at least one primary.
+        time_t now = time(NULL);
+        long heat[REBAL_MOVES_PER_PASS]; size_t pick[REBAL_MOVES_PER_PASS]; int np = 0;
+        for (size_t i = 0; n > 1 && i < n; i++) {
+            long h = repv_heat(files[i], now, REBAL_COOLDOWN_SEC);
+            if (h < 0) continue;
+            int at = np;
+            while (at > 0 && heat[at - 1] < h) at--;
+            if (at >= REBAL_MOVES_PER_PASS) continue;
+            if (np < REBAL_MOVES_PER_PASS) np++;
+            for (int k = np - 1; k > at; k--) { heat[k] = heat[k - 1]; pick[k] = pick[k - 1]; }
+            heat[at] = h; pick[at] = i;
+        }
+        if (np > 0) fprintf(stderr, "[NM] Rebalance: ss%d (score %.2f) -> ss%d (score %.2f), %d candidate(s)\n", hot, hs, cold, cs, np);
+        time_t t0 = time(NULL); long bytes = 0;
+        for (int k = 0; k < np && g_running; k++) {
+            long b = 0;
+            int rc = migrate_file(files[pick[k]], hot, cold, &b);
+            if (rc == MIG_OK) repv_mark_moved(files[pick[k]], time(NULL));
+            else if (rc == MIG_LOCKED) fprintf(stderr, "[NM] Rebalance: %s busy, left on ss%d\n", files[pick[k]], hot);
+            else if (rc == MIG_UNAVAILABLE) break;
+            bytes += b;
+            long ahead = bytes / REBAL_BYTES_PER_SEC - (long)(time(NULL) - t0);
+            if (ahead > 0) sleep((unsigned)ahead);
+        }
+        nm_state_free_list(files, n);
+        repv_heat_decay();
+    }
+    return NULL;
+}
+
+// Choose the SS that serves a READ: the primary or any up, caught-up replica, whichever reports
+// the least load, avoiding SSs the failure detector currently suspects. Returns the chosen ssid (falls back to the primary), filling port/addr when known.
+static int pick_read_ss(const char *file, int primary, int *out_port, char *out_addr, size_t addr_sz) {
+    int cands[17]; int nc = 0; cands[nc++] = primary;
+    int repls[16]; size_t nr = nm_state_get_replicas(file, repls, 16);
+    if (nr > 16) nr = 16;
+    for (size_t i = 0; i < nr; i++) if (repls[i] != primary && repv_is_current(file, repls[i])) cands[nc++] = repls[i];
+    static unsigned rr = 0; // rotates ties so equal replicas share traffic
+    pthread_mutex_lock(&g_mu);
+    ss_entry_t *best = NULL; int best_score = 0; unsigned start = rr++;
+    // Suspect SSs serve only when every candidate is suspect
+    for (int pass = 0; pass < 2 && !best; pass++) {
+        for (int k = 0; k < nc; k++) {
+            ss_entry_t *e = find_ss_nolock(cands[(start + (unsigned)k) % (unsigned)nc]);
+            if (!e || !e->is_up || e->ss_data_port == 0 || (pass == 0 && e->suspect)) continue;
+            int score = e->load + e->reads_assigned;
+            if (!best || score < best_score) { best = e; best_score = score; }
+        }
+    }
+    int chosen = primary;
+    if (best) {
+        best->reads_assigned++; chosen = best->ss_id;
+        if (out_port) *out_port = best->ss_data_port;
+        if (out_addr && addr_sz > 0) snprintf(out_addr, addr_sz, "%s", best->ss_addr);
+    }
+    pthread_mutex_unlock(&g_mu);
+    if (!best && get_ss_info(primary, out_port, out_addr, addr_sz) != 0 && out_port) *out_port = 0;
+    return chosen;
+}
+
+// --- Routing ---
+// Route and ticket for op on an existing file (ssid is its primary), shared by LOOKUP and LOOKUP_BATCH.
+// session asks for a capability covering every operation the user may run on the file (on its primary),
+// so a read-edit-checkpoint sequence needs a single LOOKUP; primary pins a READ to the primary
+// (read-your-writes). Returns the reply status; "OK" fills o.
+#define NM_LOOKUP_BATCH_MAX 256
+typedef struct { char addr[64]; int port; char ticket[256]; int perms; } route_out_t;
+
+static const char *lookup_route(const char *file, const char *op, const char *user, int ssid, int session, int primary, route_out_t *o) {
+    int mutating = (strcmp(op, "WRITE") == 0 || strcmp(op, "UNDO") == 0 || strcmp(op, "REVERT") == 0 || strcmp(op, "CHECKPOINT") == 0);
+    if ((strcmp(op, "READ") == 0 && nm_acl_check(file, user, "READ") != 0) || (strcmp(op, "WRITE") == 0 && nm_acl_check(file, user, "WRITE") != 0)) return "ERR_NOAUTH";
+    // Migration cutover in progress; the client retries like any lock conflict
+    if (mutating && migr_frozen(file)) return "ERR_LOCKED";
+    repv_heat_note(file);
+    // Update metadata: track access time for READ, modification time for WRITE
+    int now = (int)time(NULL);
+    if (strcmp(op, "READ") == 0) {
+        nm_state_set_file_accessed(file, user, now);
+    } else if (strcmp(op, "WRITE") == 0) {
+        nm_state_set_file_modified(file, user, now);
+    }
+    // The stamps ride the next group commit; a LOOKUP does not wait on fsync for them
+
+    // READs may be served by a caught-up replica unless the caller asks for the primary
+    o->port = 0; o->addr[0] = '\0'; int target = ssid;
+    if (strcmp(op, "READ") == 0 && !primary && !session) target = pick_read_ss(file, ssid, &o->port, o->addr, sizeof(o->addr));
+    else (void)get_ss_info(ssid, &o->port, o->addr, sizeof(o->addr));
+    if (target != ssid) fprintf(stderr, "[NM] LOOKUP READ %s routed to replica ss%d (primary ss%d)\n", file, target, ssid);
+    // The requested op is granted exactly as for a single ticket; the others follow the ACL,
+    // and a file in migration cutover gets no mutating ones
+    o->perms = ticket_op_bit(op);
+    if (session) {
+        if (nm_acl_check(file, user, "READ") == 0) o->perms |= TICKET_READ_OPS;
+        if (nm_acl_check(file, user, "WRITE") == 0 && !migr_frozen(file)) o->perms |= TICKET_WRITE_OPS;
+    }
+    int trc = session ? ticket_build_cap(TICKET_SCOPE_FILE, file, o->perms, target, 600, o->ticket, sizeof(o->ticket)) : ticket_build(file, op, target, 600, o->ticket, sizeof(o->ticket));
+    if (trc != 0) return "ERR_INTERNAL";
+    return o->port ? "OK" : "ERR_UNAVAILABLE";
+}
+
+// --- File stats ---
+// Size, word and char counts and mtime come with each SS_COMMIT and are kept beside the directory entry.
+// atime is the NM's last-accessed stamp when stats are served from there (the SS's is filesystem atime).
+static int file_stats_cached(const char *file, nm_file_stats_t *st, int *atime) {
+    if (nm_state_get_file_stats(file, st) != 0) return -1;
+    int acc = 0; (void)nm_state_get_file_metadata(file, NULL, 0, NULL, NULL, 0, &acc);
+    *atime = acc ? acc : st->mtime;
+    return 0;
+}
+
+// Take stats from an OK SS INFO reply and cache them unless a commit reported newer ones meanwhile
+static void file_stats_parse(const char *file, const char *r, nm_file_stats_t *st, int *atime) {
+    (void)json_get_int_field(r, "size", &st->size); (void)json_get_int_field(r, "words", &st->words); (void)json_get_int_field(r, "chars", &st->chars); (void)json_get_int_field(r, "mtime", &st->mtime); (void)json_get_int_field(r, "atime", atime);
+    (void)nm_state_set_file_stats(file, st, 1);
+}
+
+// Stats for file, asking its primary ssid with SS INFO when not cached. Returns 0 on success, -1 if the
+// SS is unreachable, 1 if it answered with an error (*err_reply holds it; caller frees)
+static int file_stats(const char *file, int ssid, nm_file_stats_t *st, int *atime, char **err_reply) {
+    memset(st, 0, sizeof(*st)); *atime = 0; *err_reply = NULL;
+    if (file_stats_cached(file, st, atime) == 0) return 0;
+    char ticket[256]; if (ticket_build(file, "READ", ssid, 600, ticket, sizeof(ticket)) != 0) return -1;
+    char req[512]; req[0]='\0'; json_put_string_field(req, sizeof(req), "type", "INFO", 1); json_put_string_field(req, sizeof(req), "file", file, 0); json_put_string_field(req, sizeof(req), "ticket", ticket, 0); strncat(req, "}", sizeof(req)-strlen(req)-1);
+    char *r = ss_rpc(ssid, req);
+    if (!r) return -1;
+    if (!strstr(r, "\"status\":\"OK\"")) { *err_reply = r; return 1; }
+    file_stats_parse(file, r, st, atime);
+    free(r);
+    return 0;
+}
+
+// VIEW -l details for files[0..n): ssids[i] is the file's primary (-1 if it is gone) and infos[i] its
+// SS INFO reply (NULL when the stats are cached, the user may not open the file or the SS did not
+// answer). The INFOs go out as one fan-out across the SSs involved.
+static void view_fetch_info(char (*files)[256], size_t n, const char *user, int *ssids, char **infos) {
+    nm_fanout_call_t *calls = (nm_fanout_call_t *)malloc(sizeof(*calls) * (n ? n : 1)); size_t *idx = (size_t *)malloc(sizeof(size_t) * (n ? n : 1));
+    if (!calls || !idx) { free(calls); free(idx); for (size_t i = 0; i < n; i++) ssids[i] = -1; return; }
+    size_t nc = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (nm_state_find_dir(files[i], &ssids[i]) != 0) { ssids[i] = -1; continue; }
+        if (nm_state_get_file_stats(files[i], NULL) == 0) continue;
+        int can_r = (nm_acl_check(files[i], user, "READ") == 0);
+        int can_w = (nm_acl_check(files[i], user, "WRITE") == 0);
+        // Build READ ticket if allowed, else WRITE ticket
+        char ticket[256];
+        if (!(can_r || can_w) || ticket_build(files[i], can_r ? "READ" : "WRITE", ssids[i], 600, ticket, sizeof(ticket)) != 0) continue;
+        char req[512]; req[0]='\0'; json_put_string_field(req, sizeof(req), "type", "INFO", 1);
+        json_put_string_field(req, sizeof(req), "file", files[i], 0);
+        json_put_string_field(req, sizeof(req), "ticket", ticket, 0);
+        strncat(req, "}", sizeof(req)-strlen(req)-1);
+        char *dup = strdup(req);
+        if (!dup) continue;
+        calls[nc].ssid = ssids[i]; calls[nc].req = dup; idx[nc++] = i;
+    }
+    (void)nm_fanout(calls, nc, get_ss_info, NM_FANOUT_PARALLEL, NM_FANOUT_DEADLINE_MS);
+    for (size_t k = 0; k < nc; k++) { infos[idx[k]] = calls[k].reply; free((char *)calls[k].req); }
+    free(calls); free(idx);
+}
+
+// --- Listings ---
+// VIEW, VIEWFOLDER and LISTTRASH are paged: a request carries `limit` (default NM_PAGE_DEFAULT, at most
+// NM_PAGE_MAX) and the opaque `cursor` from the previous reply, and the reply carries `next` while more
+// remain. Pages are in name order and the cursor is the last name served, so a page is stable under
+// concurrent creates/deletes: nothing before the cursor is repeated and nothing after it is skipped.
+// Each page is one O(n log limit) walk that keeps the smallest names past the cursor.
+#define NM_PAGE_DEFAULT 100
+#define NM_PAGE_MAX 500
+#define NM_PAGE_ITEM_MAX 800 // bytes reserved per item in a reply (longest is a VIEW -l / LISTTRASH record)
+
+// Replies are built by nm_state_foreach_* callbacks into a fixed buffer. An item that does not fit is
+// dropped whole and stops the walk, so the reply stays valid JSON.
+typedef struct { char *buf; size_t cap, w; int first; } reply_t;
+
+static void reply_init(reply_t *r, char *buf, size_t cap, const char *head) {
+    r->buf = buf; r->cap = cap; r->first = 1;
+    r->w = (size_t)snprintf(buf, cap, "%s", head);
+}
+
+// Append one array item (comma-separated); returns 1 once the buffer is full
+static int reply_item(reply_t *r, const char *fmt, ...) {
+    // Always keep room for a closing "]}" (or "],\"files\":[" in VIEWFOLDER)
+    const size_t tail = 16;
+    if (r->w + tail >= r->cap) return 1;
+    size_t room = r->cap - r->w - tail, n = 0;
+    if (!r->first) { if (room < 2) return 1; r->buf[r->w] = ','; n = 1; }
+    va_list ap; va_start(ap, fmt);
+    int k = vsnprintf(r->buf + r->w + n, room - n, fmt, ap);
+    va_end(ap);
+    if (k < 0 || (size_t)k >= room - n) { r->buf[r->w] = '\0'; return 1; }
+    r->w += n + (size_t)k; r->first = 0;
+    return 0;
+}
+
+static void reply_raw(reply_t *r, const char *s) {
+    if (r->w < r->cap) r->w += (size_t)snprintf(r->buf + r->w, r->cap - r->w, "%s", s);
+    if (r->w >= r->cap) r->w = r->cap - 1;
+}
+
+// Entries collected under a state lock and acted on (SS I/O) after the walk
+typedef struct { char file[128]; char aux[128]; int ssid; } ent_t;
+typedef struct { ent_t *v; size_t n, cap; } ent_list_t;
+
+static int ent_list_add(ent_list_t *l, const char *file, const char *aux, int ssid) {
+    if (l->n == l->cap) {
+        size_t nc = l->cap ? l->cap * 2 : 64;
+        ent_t *p = (ent_t *)realloc(l->v, nc * sizeof(ent_t));
+        if (!p) return 1;
+        l->v = p; l->cap = nc;
+    }
+    ent_t *e = &l->v[l->n++];
+    snprintf(e->file, sizeof(e->file), "%s", file);
+    snprintf(e->aux, sizeof(e->aux), "%s", aux ? aux : "");
+    e->ssid = ssid;
+    return 0;
+}
+
+// Page selection: the `cap` smallest distinct names greater than `after`, kept sorted
+typedef struct { char (*v)[256]; size_t n, cap; const char *after; } page_sel_t;
+
+static int page_sel_init(page_sel_t *p, size_t cap, const char *after) {
+    p->v = (char (*)[256])malloc(cap * sizeof(*p->v));
+    p->n = 0; p->cap = cap; p->after = after;
+    return p->v ? 0 : -1;
+}
+
+// Could name still make the page? Lets callers skip costly checks (ACLs) for most entries
+static int page_sel_wants(const page_sel_t *p, const char *name) {
+    if (p->after && strcmp(name, p->after) <= 0) return 0;
+    return p->n < p->cap || strcmp(name, p->v[p->n - 1]) < 0;
+}
+
+static void page_sel_add(page_sel_t *p, const char *name, size_t len) {
+    if (len >= sizeof(p->v[0])) len = sizeof(p->v[0]) - 1;
+    char key[256]; memcpy(key, name, len); key[len] = '\0';
+    if (!page_sel_wants(p, key)) return;
+    size_t lo = 0, hi = p->n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2; int c = strcmp(p->v[mid], key);
+        if (c == 0) return; // already selected (folder segments repeat)
+        if (c < 0) lo = mid + 1; else hi = mid;
+    }
+    if (p->n == p->cap) p->n--; // the largest falls off
+    memmove(p->v + lo + 1, p->v + lo, (p->n - lo) * sizeof(p->v[0]));
+    memcpy(p->v[lo], key, len + 1);
+    p->n++;
+}
+
+// Page size and decoded cursor of a listing request. The cursor is a phase letter plus the hex-encoded
+// last name; returns the phase ('\0' for a first page) and fills after
+static char page_request(const char *req, size_t *limit, char *after, size_t after_sz) {
+    int lim = 0;
+    *limit = (json_get_int_field(req, "limit", &lim) == 0 && lim > 0) ? (size_t)lim : NM_PAGE_DEFAULT;
+    if (*limit > NM_PAGE_MAX) *limit = NM_PAGE_MAX;
+    after[0] = '\0';
+    char cur[600];
+    if (json_get_string_field(req, "cursor", cur, sizeof(cur)) != 0 || !cur[0]) return '\0';
+    size_t hl = strlen(cur + 1);
+    if (hl % 2 || hl / 2 + 1 > after_sz || hex_decode(cur + 1, hl, after) < 0) { after[0] = '\0'; return '\0'; }
+    return cur[0];
+}
+
+// Append ",\"next\":\"<phase><hex name>\"" to a reply
+static void reply_next(reply_t *r, char phase, const char *name) {
+    char *h = hex_encode(name, strlen(name));
+    if (!h) return;
+    char tail[600]; snprintf(tail, sizeof(tail), ",\"next\":\"%c%s\"", phase, h);
+    free(h);
+    // Drop the closing brace, add the field, close again
+    if (r->w > 0 && r->buf[r->w - 1] == '}') { r->buf[--r->w] = '\0'; reply_raw(r, tail); reply_raw(r, "}"); }
+}
+
+static char *page_buf(size_t limit, size_t *cap) {
+    *cap = 2048 + limit * NM_PAGE_ITEM_MAX;
+    return (char *)malloc(*cap);
+}
+
+static int page_name(const char *name, void *arg) {
+    page_sel_add((page_sel_t *)arg, name, strlen(name));
+    return 0;
+}
+
+static int page_view_file(const char *f, int ss_id, void *arg) {
+    (void)ss_id;
+    return page_name(f, arg);
+}
+
+// Keep the names that still have a directory entry (an ACL can briefly outlive its file mid-DELETE);
+// returns the new count
+static size_t view_keep_listed(char (*v)[256], size_t n) {
+    size_t w = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (nm_state_find_dir(v[i], NULL) != 0) continue;
+        if (w != i) memcpy(v[w], v[i], sizeof(v[0]));
+        w++;
+    }
+    return w;
+}
+
+static int page_trash(const char *file, const char *trashed, int ssid, const char *owner, int when, void *arg) {
+    (void)trashed; (void)ssid; (void)owner; (void)when;
+    page_sel_add((page_sel_t *)arg, file, strlen(file));
+    return 0;
+}
+
+typedef struct { reply_t *r; int active; } users_walk_t;
+
+static int list_user(const char *user, int active, void *arg) {
+    users_walk_t *c = (users_walk_t *)arg;
+    if (active != c->active) return 0;
+    return reply_item(c->r, "\"%s\"", user);
+}
+
+typedef struct { ent_list_t *out; const char *file; const char *user; } purge_walk_t;
+
+static int pick_purge(const char *file, const char *trashed, int ssid, const char *owner, int when, void *arg) {
+    (void)when;
+    purge_walk_t *c = (purge_walk_t *)arg;
+    if (c->file) { if (strcmp(file, c->file) != 0) return 0; }
+    else if (owner[0] && strcmp(owner, c->user) != 0) return 0;
+    return ent_list_add(c->out, file, trashed, ssid);
+}
+
 static void *client_thread(void *arg) {
     int fd = (int)(intptr_t)arg;
     while (g_running) {
@@ -372,50 +1627,10 @@ static void *client_thread(void *arg) {
             add_ss(ssId, ctrl, data, ss_ip);
             printf("[NM] Registered SS id=%d ctrl=%d data=%d addr=%s\n", ssId, ctrl, data, ss_ip);
             
-            // Immediately resync files where this SS is a replica (from saved state)
+            // Bring files where this SS is a replica (from saved state) up to date in one bulk session
             fprintf(stderr, "[NM] SS %d registered, checking for replicas to resync\n", ssId);
-            char files[512][128]; int ps[512]; size_t n = nm_state_get_dir(files, ps, 512);
-            for (size_t i=0;i<n;i++) {
-                int repls[16]; size_t nr = nm_state_get_replicas(files[i], repls, 16);
-                for (size_t j=0;j<nr;j++) if (repls[j]==ssId) {
-                    fprintf(stderr, "[NM] Resyncing file %s to newly registered ss%d\n", files[i], ssId);
-                    // Resync file content
-                    schedule_put_repl(files[i], ps[i], ssId);
-                    
-                    // Resync undo snapshot (if exists on primary)
-                    schedule_undo_repl(files[i], ps[i], ssId);
-                    
-                    // Best-effort: also resync checkpoints list and push each
-                    int pport=0; char paddr[64];
-                    if (get_ss_info(ps[i], &pport, paddr, sizeof(paddr)) == 0 && pport) {
-                        char ticket[256]; if (ticket_build(files[i], "LISTCHECKPOINTS", ps[i], 600, ticket, sizeof(ticket)) == 0) {
-                            int sfd = tcp_connect(paddr, (uint16_t)pport);
-                            if (sfd >= 0) {
-                                char req[512]; req[0]='\0'; json_put_string_field(req, sizeof(req), "type", "LISTCHECKPOINTS", 1); json_put_string_field(req, sizeof(req), "file", files[i], 0); json_put_string_field(req, sizeof(req), "ticket", ticket, 0); strncat(req, "}", sizeof(req)-strlen(req)-1);
-                                if (send_msg(sfd, req, (uint32_t)strlen(req)) == 0) {
-                                    char *r=NULL; uint32_t rl=0; if (recv_msg(sfd, &r, &rl) == 0 && r && strstr(r, "\"status\":\"OK\"")) {
-                                        const char *p = strchr(r, '['); if (p) {
-                                            p++;
-                                            while (*p && *p!=']') {
-                                                while (*p==' '||*p=='\n'||*p=='\t'||*p==',') p++;
-                                                if (*p=='"') {
-                                                    p++; const char *s=p; while(*p && *p!='"') p++; size_t nlen=(size_t)(p-s);
-                                                    char name[256]; if (nlen>=sizeof(name)) nlen=sizeof(name)-1; memcpy(name, s, nlen); name[nlen]='\0';
-                                                    if (*p=='"') p++;
-                                                    schedule_checkpoint_repl(files[i], name, ps[i], ssId);
-                                                } else break;
-                                            }
-                                        }
-                                    }
-                                    if (r) free(r);
-                                }
-                                close(sfd);
-                            }
-                        }
-                    }
-                }
-            }
-            
+            resync_request(ssId);
+
             const char *resp = "{\"status\":\"OK\"}";
             send_msg(fd, resp, (uint32_t)strlen(resp));
         } else if (strcmp(type, "SS_HEARTBEAT") == 0) {
@@ -426,58 +1641,25 @@ static void *client_thread(void *arg) {
                 // Unknown server; add with unknown ports (will not be considered UP until it REGISTERs with ports)
                 struct sockaddr_in peer_addr; socklen_t peer_len = sizeof(peer_addr); char ss_ip[64] = "127.0.0.1";
                 if (getpeername(fd, (struct sockaddr*)&peer_addr, &peer_len) == 0) { inet_ntop(AF_INET, &peer_addr.sin_addr, ss_ip, sizeof(ss_ip)); }
-                e = (ss_entry_t *)malloc(sizeof(ss_entry_t)); memset(e,0,sizeof(*e)); e->ss_id=ssId; e->ss_ctrl_port=0; e->ss_data_port=0; snprintf(e->ss_addr, sizeof(e->ss_addr), "%s", ss_ip); e->next=g_ss_list; g_ss_list=e;
+                e = (ss_entry_t *)malloc(sizeof(ss_entry_t)); memset(e,0,sizeof(*e)); e->free_mb = -1; e->ss_id=ssId; e->ss_ctrl_port=0; e->ss_data_port=0; snprintf(e->ss_addr, sizeof(e->ss_addr), "%s", ss_ip); e->next=g_ss_list; g_ss_list=e;
             }
             int was_up = e->is_up;
-            e->last_heartbeat = time(NULL);
+            ss_hb_arrival_nolock(e, now_mono());
+            if (e->suspect) { e->suspect = 0; fprintf(stderr, "[NM] SS %d heartbeat resumed; no longer suspect\n", ssId); }
+            int load = 0; if (json_get_int_field(buf, "load", &load) == 0 && load >= 0) e->load = load;
+            e->reads_assigned = 0; // the SS-reported load now covers earlier assignments
+            int v = 0;
+            if (json_get_int_field(buf, "storedKB", &v) == 0 && v >= 0) e->stored_kb = v;
+            if (json_get_int_field(buf, "sessions", &v) == 0 && v >= 0) e->sessions = v;
+            if (json_get_int_field(buf, "freeMB", &v) == 0) e->free_mb = v;
+            e->placed = 0;
             // Only mark as UP if we know its data port (i.e., it REGISTERed before/after heartbeat)
             e->is_up = (e->ss_data_port != 0);
             pthread_mutex_unlock(&g_mu);
             if (!was_up && e->is_up) {
                 fprintf(stderr, "[NM] SS %d transitioned UP\n", ssId);
                 // Resync files where this SS is a replica
-                char files[512][128]; int ps[512]; size_t n = nm_state_get_dir(files, ps, 512);
-                for (size_t i=0;i<n;i++) {
-                    int repls[16]; size_t nr = nm_state_get_replicas(files[i], repls, 16);
-                    for (size_t j=0;j<nr;j++) if (repls[j]==ssId) {
-                        // Resync file content
-                        schedule_put_repl(files[i], ps[i], ssId);
-                        
-                        // Resync undo snapshot (if exists on primary)
-                        schedule_undo_repl(files[i], ps[i], ssId);
-                        
-                        // Best-effort: also resync checkpoints list and push each
-                        // Fetch checkpoint names from primary
-                        int pport=0; char paddr[64];
-                        if (get_ss_info(ps[i], &pport, paddr, sizeof(paddr)) == 0 && pport) {
-                            char ticket[256]; if (ticket_build(files[i], "LISTCHECKPOINTS", ps[i], 600, ticket, sizeof(ticket)) == 0) {
-                                int sfd = tcp_connect(paddr, (uint16_t)pport);
-                                if (sfd >= 0) {
-                                    char req[512]; req[0]='\0'; json_put_string_field(req, sizeof(req), "type", "LISTCHECKPOINTS", 1); json_put_string_field(req, sizeof(req), "file", files[i], 0); json_put_string_field(req, sizeof(req), "ticket", ticket, 0); strncat(req, "}", sizeof(req)-strlen(req)-1);
-                                    if (send_msg(sfd, req, (uint32_t)strlen(req)) == 0) {
-                                        char *r=NULL; uint32_t rl=0; if (recv_msg(sfd, &r, &rl) == 0 && r && strstr(r, "\"status\":\"OK\"")) {
-                                            // Parse simple list of checkpoint names
-                                            const char *p = strchr(r, '['); if (p) {
-                                                p++;
-                                                while (*p && *p!=']') {
-                                                    while (*p==' '||*p=='\n'||*p=='\t'||*p==',') p++;
-                                                    if (*p=='"') {
-                                                        p++; const char *s=p; while(*p && *p!='"') p++; size_t nlen=(size_t)(p-s);
-                                                        char name[256]; if (nlen>=sizeof(name)) nlen=sizeof(name)-1; memcpy(name, s, nlen); name[nlen]='\0';
-                                                        if (*p=='"') p++;
-                                                        schedule_checkpoint_repl(files[i], name, ps[i], ssId);
-                                                    } else break;
-                                                }
-                                            }
-                                        }
-                                        if (r) free(r);
-                                    }
-                                    close(sfd);
-                                }
-                            }
-                        }
-                    }
-                }
+                resync_request(ssId);
             }
             const char *resp = "{\"status\":\"OK\"}"; send_msg(fd, resp, (uint32_t)strlen(resp));
         } else if (strcmp(type, "SS_COMMIT") == 0) {
@@ -485,8 +1667,15 @@ static void *client_thread(void *arg) {
             if (!okf || ssId==0) { const char *er="{\"status\":\"ERR_BADREQ\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
             else {
                 int primary=0; if (nm_state_find_dir(file, &primary)==0 && primary==ssId) {
+                    // Stats of the committed content (absent from older SSs; the cache then refills via SS INFO)
+                    nm_file_stats_t st;
+                    if (json_get_int_field(buf, "words", &st.words) == 0 && json_get_int_field(buf, "size", &st.size) == 0 &&
+                        json_get_int_field(buf, "chars", &st.chars) == 0 && json_get_int_field(buf, "mtime", &st.mtime) == 0)
+                        (void)nm_state_set_file_stats(file, &st, 0);
                     int repls[16]; size_t nr = nm_state_get_replicas(file, repls, 16);
+                    (void)repv_bump(file); // replicas stay off the read path until this PUT lands
                     for (size_t i=0;i<nr;i++) schedule_put_repl(file, primary, repls[i]);
+                    if (nr > 0) nm_watch_route_changed(file, NM_ROUTE_READS);
                 }
                 const char *ok="{\"status\":\"OK\"}"; send_msg(fd, ok, (uint32_t)strlen(ok));
             }
@@ -551,11 +1740,12 @@ static void *client_thread(void *arg) {
                                         if (nr > 0) {
                                             nm_state_set_replicas(file, replicas, nr);
                                             for (size_t i = 0; i < nr; i++) {
+                                                repv_invalidate(file, replicas[i]);
                                                 schedule_cmd_repl("CREATE", file, NULL, replicas[i]);
                                             }
                                         }
                                         
-                                        (void)nm_state_save("nm_state.json");
+                                        (void)nm_state_save(NM_STATE_FILE);
                                     }
                                     if (r) free(r);
                                 }
@@ -577,26 +1767,57 @@ static void *client_thread(void *arg) {
                     }
                 } else {
                     // File exists: build ticket
-                    if ((strcmp(op, "READ") == 0 && nm_acl_check(file, user, "READ") != 0) || (strcmp(op, "WRITE") == 0 && nm_acl_check(file, user, "WRITE") != 0)) {
-                        const char *er = "{\"status\":\"ERR_NOAUTH\"}"; send_msg(fd, er, (uint32_t)strlen(er));
-                    } else {
-                        // Update metadata: track access time for READ, modification time for WRITE
-                        int now = (int)time(NULL);
-                        if (strcmp(op, "READ") == 0) {
-                            nm_state_set_file_accessed(file, user, now);
-                        } else if (strcmp(op, "WRITE") == 0) {
-                            nm_state_set_file_modified(file, user, now);
-                        }
-                        (void)nm_state_save("nm_state.json");
-                        
-                        char ticket2[256]; if (ticket_build(file, op, ssid, 600, ticket2, sizeof(ticket2)) != 0) { const char *er = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
-                        else { int dport2=0; char ss_addr2[64];
-                            if (get_ss_info(ssid, &dport2, ss_addr2, sizeof(ss_addr2)) == 0 && dport2) {
-                                char resp2[512]; snprintf(resp2,sizeof(resp2),"{\"status\":\"OK\",\"ssAddr\":\"%s\",\"ssDataPort\":%d,\"ticket\":\"%s\"}", ss_addr2, dport2, ticket2); send_msg(fd, resp2, (uint32_t)strlen(resp2));
-                            } else { const char *er="{\"status\":\"ERR_UNAVAILABLE\"}"; send_msg(fd, er, (uint32_t)strlen(er)); } }
-                    }
+                    int session = 0; (void)json_get_int_field(buf, "session", &session);
+                    char consistency[16]; consistency[0]='\0'; (void)json_get_string_field(buf, "consistency", consistency, sizeof(consistency));
+                    route_out_t ro;
+                    const char *st = lookup_route(file, op, user, ssid, session, strcmp(consistency, "primary") == 0, &ro);
+                    char resp2[512];
+                    if (strcmp(st, "OK") == 0) snprintf(resp2, sizeof(resp2), "{\"status\":\"OK\",\"ssAddr\":\"%s\",\"ssDataPort\":%d,\"ticket\":\"%s\",\"perms\":%d}", ro.addr, ro.port, ro.ticket, ro.perms);
+                    else snprintf(resp2, sizeof(resp2), "{\"status\":\"%s\"}", st);
+                    send_msg(fd, resp2, (uint32_t)strlen(resp2));
                 }
             }
+        } else if (strcmp(type, "LOOKUP_BATCH") == 0) {
+            // Routes for many files in one round trip: "items" is "<hex file>:<op>,..." (at most
+            // NM_LOOKUP_BATCH_MAX), "session"/"consistency" apply to every item, and "routes" answers
+            // in request order, each item shaped like a LOOKUP reply. Missing files are not provisioned.
+            char user[128]; user[0]='\0';
+            (void)json_get_string_field(buf, "user", user, sizeof(user));
+            if (!user[0]) snprintf(user, sizeof(user), "%s", "anonymous");
+            int session = 0; (void)json_get_int_field(buf, "session", &session);
+            char consistency[16]; consistency[0]='\0'; (void)json_get_string_field(buf, "consistency", consistency, sizeof(consistency));
+            char *items = (char *)malloc(len + 1);
+            int n = 0;
+            if (items && json_get_string_field(buf, "items", items, len + 1) == 0 && items[0]) {
+                n = 1; for (const char *c = items; *c; ++c) if (*c == ',') n++;
+            }
+            size_t cap = (size_t)n * 480 + 64; char *resp = n > 0 && n <= NM_LOOKUP_BATCH_MAX ? (char *)malloc(cap) : NULL;
+            if (!resp) {
+                const char *er = n > NM_LOOKUP_BATCH_MAX || (items && n == 0) ? "{\"status\":\"ERR_BADREQ\"}" : "{\"status\":\"ERR_INTERNAL\"}";
+                send_msg(fd, er, (uint32_t)strlen(er));
+            } else {
+                reply_t r; reply_init(&r, resp, cap, "{\"status\":\"OK\",\"routes\":[");
+                int nok = 0;
+                for (char *it = items; it; ) {
+                    char *next = strchr(it, ','); if (next) *next++ = '\0';
+                    char *colon = strchr(it, ':'); char file[128]; const char *op = colon ? colon + 1 : "";
+                    int fl = colon && (size_t)(colon - it) < 2 * sizeof(file) ? hex_decode(it, (size_t)(colon - it), file) : -1;
+                    const char *st; route_out_t ro; int ssid = 0;
+                    if (fl <= 0 || !ticket_op_bit(op)) st = "ERR_BADREQ";
+                    else if (nm_state_find_dir(file, &ssid) != 0) st = "ERR_NOTFOUND";
+                    else st = lookup_route(file, op, user, ssid, session, strcmp(consistency, "primary") == 0, &ro);
+                    if (strcmp(st, "OK") == 0) {
+                        nok++;
+                        reply_item(&r, "{\"status\":\"OK\",\"ssAddr\":\"%s\",\"ssDataPort\":%d,\"ticket\":\"%s\",\"perms\":%d}", ro.addr, ro.port, ro.ticket, ro.perms);
+                    } else reply_item(&r, "{\"status\":\"%s\"}", st);
+                    it = next;
+                }
+                reply_raw(&r, "]}");
+                fprintf(stderr, "[NM] LOOKUP_BATCH user=%s items=%d routed=%d\n", user, n, nok);
+                send_msg(fd, resp, (uint32_t)strlen(resp));
+                free(resp);
+            }
+            free(items);
         } else if (strcmp(type, "CREATE") == 0) {
             // Explicit CREATE: create empty file mapping and optional public ACL flags
             char file[128]; char user[128]; user[0]='\0'; int pubR=0, pubW=0;
@@ -641,11 +1862,12 @@ static void *client_thread(void *arg) {
                                         nm_state_set_replicas(file, replicas, nr);
                                         // Asynchronously replicate initial empty file to replicas
                                         for (size_t i = 0; i < nr; i++) {
+                                            repv_invalidate(file, replicas[i]);
                                             schedule_cmd_repl("CREATE", file, NULL, replicas[i]);
                                         }
                                     }
                                     
-                                    (void)nm_state_save("nm_state.json"); const char *ok="{\"status\":\"OK\"}"; send_msg(fd, ok, (uint32_t)strlen(ok));
+                                    (void)nm_state_save(NM_STATE_FILE); const char *ok="{\"status\":\"OK\"}"; send_msg(fd, ok, (uint32_t)strlen(ok));
                                 } else { const char *er="{\"status\":\"ERR_INTERNAL\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
                                 if (r) free(r);
                             }
@@ -686,9 +1908,9 @@ static void *client_thread(void *arg) {
                                         int repls[16]; size_t nr = nm_state_get_replicas(file, repls, 16);
                                         for (size_t i=0;i<nr;i++) schedule_cmd_repl("RENAME", file, tpath, repls[i]);
                                         // Remove mapping and ACLs, add to trash state
-                                        nm_dir_del(file); nm_acl_delete(file); nm_state_clear_requests_for(file);
+                                        nm_dir_del(file); nm_acl_delete(file); nm_state_clear_requests_for(file); repv_forget(file); tail_forget(file);
                                         nm_state_trash_add(file, tpath, ssid, owner, (int)now);
-                                        (void)nm_state_save("nm_state.json");
+                                        (void)nm_state_save(NM_STATE_FILE);
                                         const char *ok="{\"status\":\"OK\"}"; send_msg(fd, ok, (uint32_t)strlen(ok));
                                     }
                                 }
@@ -713,89 +1935,10 @@ static void *client_thread(void *arg) {
                     if (nm_acl_check(file, user, "WRITE") != 0) {
                         const char *resp = "{\"status\":\"ERR_NOAUTH\"}"; send_msg(fd, resp, (uint32_t)strlen(resp));
                     } else {
-                        // resolve data ports and addresses
-                        int src_port=0, dst_port=0; char src_addr[64], dst_addr[64];
-                        if (get_ss_info(src_ssid, &src_port, src_addr, sizeof(src_addr)) != 0 || get_ss_info(target, &dst_port, dst_addr, sizeof(dst_addr)) != 0 || src_port==0 || dst_port==0) {
-                            fprintf(stderr, "[NM] MIGRATE resolve failed: src_port=%d dst_port=%d\n", src_port, dst_port);
-                            const char *resp = "{\"status\":\"ERR_UNAVAILABLE\"}"; send_msg(fd, resp, (uint32_t)strlen(resp));
-                        } else {
-                            // READ from source with ticket
-                            char ticket[256];
-                            if (ticket_build(file, "READ", src_ssid, 600, ticket, sizeof(ticket)) != 0) {
-                                const char *er = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(fd, er, (uint32_t)strlen(er));
-                            } else {
-                                int sfd = tcp_connect(src_addr, (uint16_t)src_port);
-                                if (sfd < 0) {
-                                    fprintf(stderr, "[NM] MIGRATE connect to src failed: port=%d\n", src_port);
-                                    const char *resp = "{\"status\":\"ERR_UNAVAILABLE\"}"; send_msg(fd, resp, (uint32_t)strlen(resp));
-                                } else {
-                                    char req[512]; req[0]='\0';
-                                    json_put_string_field(req, sizeof(req), "type", "READ", 1);
-                                    json_put_string_field(req, sizeof(req), "file", file, 0);
-                                    json_put_string_field(req, sizeof(req), "ticket", ticket, 0);
-                                    strncat(req, "}", sizeof(req)-strlen(req)-1);
-                                    if (send_msg(sfd, req, (uint32_t)strlen(req)) != 0) {
-                                        close(sfd);
-                                        const char *er = "{\"status\":\"ERR_UNAVAILABLE\"}"; send_msg(fd, er, (uint32_t)strlen(er));
-                                    } else {
-                                        char *r=NULL; uint32_t rl=0;
-                                        if (recv_msg(sfd, &r, &rl) != 0 || !r || !strstr(r, "\"status\":\"OK\"")) {
-                                            fprintf(stderr, "[NM] MIGRATE READ failed from src\n");
-                                            free(r); close(sfd);
-                                            const char *er = "{\"status\":\"ERR_UNAVAILABLE\"}"; send_msg(fd, er, (uint32_t)strlen(er));
-                                        } else {
-                                            // Extract body
-                                            char body[8192];
-                                            if (json_get_string_field(r, "body", body, sizeof(body)) != 0) {
-                                                free(r); close(sfd);
-                                                const char *er = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(fd, er, (uint32_t)strlen(er));
-                                            } else {
-                                                free(r); close(sfd);
-                                                // PUT to destination
-                                                int dfd = tcp_connect(dst_addr, (uint16_t)dst_port);
-                                                if (dfd < 0) {
-                                                    fprintf(stderr, "[NM] MIGRATE connect to dst failed: port=%d\n", dst_port);
-                                                    const char *er = "{\"status\":\"ERR_UNAVAILABLE\"}"; send_msg(fd, er, (uint32_t)strlen(er));
-                                                } else {
-                                                    char preq[9216]; preq[0]='\0';
-                                                    json_put_string_field(preq, sizeof(preq), "type", "PUT", 1);
-                                                    json_put_string_field(preq, sizeof(preq), "file", file, 0);
-                                                    json_put_string_field(preq, sizeof(preq), "body", body, 0);
-                                                    strncat(preq, "}", sizeof(preq)-strlen(preq)-1);
-                                                    if (send_msg(dfd, preq, (uint32_t)strlen(preq)) != 0) {
-                                                        close(dfd);
-                                                        const char *er = "{\"status\":\"ERR_UNAVAILABLE\"}"; send_msg(fd, er, (uint32_t)strlen(er));
-                                                    } else {
-                                                        char *r2=NULL; uint32_t r2l=0;
-                                                        if (recv_msg(dfd, &r2, &r2l) != 0 || !r2 || !strstr(r2, "\"status\":\"OK\"")) {
-                                                            fprintf(stderr, "[NM] MIGRATE PUT failed at dst\n");
-                                                            free(r2); close(dfd);
-                                                            const char *er = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(fd, er, (uint32_t)strlen(er));
-                                                        } else {
-                                                            free(r2); close(dfd);
-                                                            // Delete from source (best-effort)
-                                                            int sfd2 = tcp_connect(src_addr, (uint16_t)src_port);
-                                                            if (sfd2 >= 0) {
-                                                                char dreq[256]; dreq[0]='\0';
-                                                                json_put_string_field(dreq, sizeof(dreq), "type", "DELETE", 1);
-                                                                json_put_string_field(dreq, sizeof(dreq), "file", file, 0);
-                                                                strncat(dreq, "}", sizeof(dreq)-strlen(dreq)-1);
-                                                                (void)send_msg(sfd2, dreq, (uint32_t)strlen(dreq));
-                                                                char *dr=NULL; uint32_t drl=0; (void)recv_msg(sfd2, &dr, &drl); free(dr); close(sfd2);
-                                                            }
-                                                            // Update mapping
-                                                            nm_dir_set(file, target);
-                                                            (void)nm_state_save("nm_state.json");
-                                                            const char *ok = "{\"status\":\"OK\"}"; send_msg(fd, ok, (uint32_t)strlen(ok));
-                                                        }
-                                                    }
-                                                }
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-                        }
+                        int rc = migrate_file(file, src_ssid, target, NULL);
+                        const char *resp = rc == MIG_OK ? "{\"status\":\"OK\"}" : rc == MIG_LOCKED ? "{\"status\":\"ERR_LOCKED\"}" : rc == MIG_NOTFOUND ? "{\"status\":\"ERR_NOTFOUND\"}" : "{\"status\":\"ERR_UNAVAILABLE\"}";
+                        if (rc == MIG_OK) repv_mark_moved(file, time(NULL));
+                        send_msg(fd, resp, (uint32_t)strlen(resp));
                     }
                 }
             }
@@ -830,10 +1973,11 @@ static void *client_thread(void *arg) {
                                             if (strstr(r, "\"status\":\"OK\"")) {
                                                 nm_dir_rename(file, nfile);
                                                 nm_acl_rename(file, nfile);
+                                                repv_rename(file, nfile); tail_rename(file, nfile);
                                                 // replicate rename to replicas (lookup after rename using new key)
                                                 int repls[16]; size_t nr = nm_state_get_replicas(nfile, repls, 16);
                                                 for (size_t i=0;i<nr;i++) schedule_cmd_repl("RENAME", file, nfile, repls[i]);
-                                                (void)nm_state_save("nm_state.json");
+                                                (void)nm_state_save(NM_STATE_FILE);
                                                 const char *ok = "{\"status\":\"OK\"}"; send_msg(fd, ok, (uint32_t)strlen(ok));
                                             } else if (strstr(r, "ERR_CONFLICT")) { const char *er = "{\"status\":\"ERR_CONFLICT\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
                                             else if (strstr(r, "ERR_NOTFOUND")) { const char *er = "{\"status\":\"ERR_NOTFOUND\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
@@ -855,7 +1999,7 @@ static void *client_thread(void *arg) {
             } else {
                 // Persist logical folder in state
                 nm_state_add_folder(path);
-                (void)nm_state_save("nm_state.json");
+                (void)nm_state_save(NM_STATE_FILE);
                 // Also create the folder physically on the primary SS (prefer ss1 if present)
                 int data_port = 0;
                 pthread_mutex_lock(&g_mu);
@@ -899,54 +2043,38 @@ static void *client_thread(void *arg) {
                 snprintf(path, sizeof(path), "%s", in_path);
                 label = in_path;
             }
-            // Build listing: immediate child folders and files under path
-            char resp[8192]; size_t w=0; w += snprintf(resp+w, sizeof(resp)-w, "{\"status\":\"OK\",\"path\":\"%s\",\"folders\":[", label);
-            // Folders
-            char folders[512][256]; size_t nf = nm_state_get_folders(folders, 512); int first=1;
-            size_t plen = strlen(path);
-            for (size_t i=0;i<nf;i++){
-                const char *f = folders[i];
-                if (plen==0 || (strncmp(f, path, plen)==0 && (f[plen]=='/' || plen==0))) {
-                    // extract immediate child (the next segment)
-                    const char *rest = f + plen; if (*rest=='/') rest++;
-                    if (!*rest) continue;
-                    const char *slash = strchr(rest, '/');
-                    size_t seglen = slash? (size_t)(slash-rest) : strlen(rest);
-                    char seg[256]; if (seglen >= sizeof(seg)) seglen = sizeof(seg)-1; memcpy(seg, rest, seglen); seg[seglen]='\0';
-                    // emit unique children only (simple O(n^2) dedup given small sizes)
-                    int seen = 0;
-                    for (size_t j=0;j<i;j++){
-                        const char *fj = folders[j];
-                        if (plen==0 || (strncmp(fj, path, plen)==0 && (fj[plen]=='/' || plen==0))) {
-                            const char *rj = fj + plen; if (*rj=='/') rj++;
-                            if (!*rj) continue;
-                            const char *sj = strchr(rj, '/'); size_t slen = sj? (size_t)(sj-rj) : strlen(rj);
-                            if (slen == seglen && strncmp(rj, seg, seglen)==0) { seen = 1; break; }
-                        }
-                    }
-                    if (!seen) {
-                        if (!first) w += snprintf(resp+w, sizeof(resp)-w, ",");
-                        first = 0; w += snprintf(resp+w, sizeof(resp)-w, "\"%s\"", seg);
-                    }
+            // One page of immediate child folders, then files, under path ("F"/"D" cursors)
+            size_t limit; char after[300];
+            char phase = page_request(buf, &limit, after, sizeof(after));
+            size_t cap; char *resp = page_buf(limit, &cap);
+            page_sel_t folders, files;
+            if (!resp || page_sel_init(&folders, limit + 1, phase == 'F' ? after : NULL) != 0) { free(resp); resp = NULL; }
+            else if (page_sel_init(&files, limit + 1, phase == 'D' ? after : NULL) != 0) { free(folders.v); free(resp); resp = NULL; }
+            if (!resp) { const char *er = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
+            else {
+                char head[320]; snprintf(head, sizeof(head), "{\"status\":\"OK\",\"path\":\"%s\",\"folders\":[", label);
+                reply_t r; reply_init(&r, resp, cap, head);
+                if (phase != 'D') nm_state_foreach_child_folder(path, page_name, &folders);
+                size_t nf = folders.n < limit ? folders.n : limit;
+                for (size_t i = 0; i < nf; i++) reply_item(&r, "\"%s\"", folders.v[i]);
+                reply_raw(&r, "],\"files\":["); r.first = 1;
+                // Files only once the folders are exhausted; the rest of the page (plus one to see if more remain)
+                size_t nfile = 0;
+                if (folders.n <= limit) {
+                    files.cap = limit - nf + 1;
+                    nm_state_foreach_child_file(path, page_name, &files);
+                    nfile = files.n < limit - nf ? files.n : limit - nf;
+                    for (size_t i = 0; i < nfile; i++) reply_item(&r, "\"%s\"", files.v[i]);
                 }
-            }
-            if (w < sizeof(resp)) w += snprintf(resp+w, sizeof(resp)-w, "],\"files\":[");
-            // Files (from directory mapping)
-            char files[512][128]; int ss[512]; size_t n = nm_state_get_dir(files, ss, 512); first=1;
-            for (size_t i=0;i<n;i++){
-                const char *f = files[i];
-                if (plen==0 || (strncmp(f, path, plen)==0 && (f[plen]=='/' || plen==0))) {
-                    const char *rest = f + plen; if (*rest=='/') rest++;
-                    if (!*rest) continue; // the folder itself
-                    // only immediate children that are files (i.e., no further slash in rest)
-                    if (!strchr(rest, '/')) {
-                        if (!first) w += snprintf(resp+w, sizeof(resp)-w, ",");
-                        first=0; w += snprintf(resp+w, sizeof(resp)-w, "\"%s\"", rest);
-                    }
+                reply_raw(&r, "]}");
+                if (folders.n > limit) reply_next(&r, 'F', folders.v[nf - 1]);
+                else if (files.n > nfile) {
+                    if (nfile) reply_next(&r, 'D', files.v[nfile - 1]);
+                    else reply_next(&r, 'F', nf ? folders.v[nf - 1] : after);
                 }
+                send_msg(fd, resp, (uint32_t)strlen(resp));
+                free(folders.v); free(files.v); free(resp);
             }
-            if (w < sizeof(resp)) w += snprintf(resp+w, sizeof(resp)-w, "]}");
-            send_msg(fd, resp, (uint32_t)strlen(resp));
         } else if (strcmp(type, "MOVE") == 0) {
             // MOVE can move a file or a folder prefix; also support moving a file into a known folder
             char src[256], dst_in[256]; src[0]=dst_in[0]='\0';
@@ -957,11 +2085,7 @@ static void *client_thread(void *arg) {
                 char dst[256]; snprintf(dst, sizeof(dst), "%s", dst_in);
                 // strip trailing slashes (except if root "")
                 size_t dl = strlen(dst); while (dl>0 && dst[dl-1]=='/') dst[--dl] = '\0';
-                int is_folder = 0;
-                {
-                    char folders[256][256]; size_t nf = nm_state_get_folders(folders, 256);
-                    for (size_t i=0;i<nf;i++){ if (strcmp(folders[i], dst) == 0) { is_folder = 1; break; } }
-                }
+                int is_folder = nm_state_folder_exists(dst);
                 char final_dst[256];
                 if (is_folder) {
                     // final path = dst + "/" + basename(src)
@@ -993,10 +2117,10 @@ static void *client_thread(void *arg) {
                                     char *r=NULL; uint32_t rl=0; if (recv_msg(sfd, &r, &rl)==0 && r && strstr(r, "\"status\":\"OK\"")) {
                                         // Capture replicas of source before state changes
                                         int repls[16]; size_t nr = nm_state_get_replicas(src, repls, 16);
-                                        nm_dir_rename(src, final_dst); nm_acl_rename(src, final_dst);
+                                        nm_dir_rename(src, final_dst); nm_acl_rename(src, final_dst); repv_rename(src, final_dst); tail_rename(src, final_dst);
                                         // Replicate rename to replicas
                                         for (size_t i=0;i<nr;i++) schedule_cmd_repl("RENAME", src, final_dst, repls[i]);
-                                        (void)nm_state_save("nm_state.json");
+                                        (void)nm_state_save(NM_STATE_FILE);
                                         const char *ok = "{\"status\":\"OK\"}"; send_msg(fd, ok, (uint32_t)strlen(ok));
                                     } else { const char *er = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
                                     free(r);
@@ -1006,34 +2130,51 @@ static void *client_thread(void *arg) {
                         }
                     } else {
                         // Treat as folder move (prefix): compute impacted files and rename on respective SS
-                        char files[1024][128]; char new_files[1024][128]; int ssids[1024];
-                        int n = nm_state_move_folder_prefix(src, final_dst, files, new_files, ssids, 1024);
-                        if (n <= 0) { const char *resp = "{\"status\":\"ERR_NOTFOUND\"}"; send_msg(fd, resp, (uint32_t)strlen(resp)); }
+                        nm_moved_file_t *mv = NULL;
+                        int n = nm_state_move_folder_prefix(src, final_dst, &mv);
+                        if (n < 0) { const char *resp = "{\"status\":\"ERR_CONFLICT\"}"; send_msg(fd, resp, (uint32_t)strlen(resp)); }
+                        else if (n == 0) { const char *resp = "{\"status\":\"ERR_NOTFOUND\"}"; send_msg(fd, resp, (uint32_t)strlen(resp)); }
                         else {
+                            // Every file's RENAME goes out in one fan-out. Files an SS did not rename go back to
+                            // their old names, so the directory keeps matching where the bytes are. A RENAME that
+                            // went out but got no answer may have landed: the SS is asked again before deciding.
                             int failures = 0;
-                            for (int i=0; i<n; ++i) {
-                                int data_port = 0; char ss_addr[64];
-                                if (get_ss_info(ssids[i], &data_port, ss_addr, sizeof(ss_addr)) != 0 || data_port == 0) { failures++; continue; }
-                                int sfd = tcp_connect(ss_addr, (uint16_t)data_port);
-                                if (sfd < 0) { failures++; continue; }
+                            nm_fanout_call_t *calls = (nm_fanout_call_t *)calloc((size_t)n, sizeof(*calls));
+                            for (int i=0; calls && i<n; ++i) {
                                 char req[512]; req[0]='\0';
                                 json_put_string_field(req, sizeof(req), "type", "RENAME", 1);
-                                json_put_string_field(req, sizeof(req), "file", files[i], 0);
-                                json_put_string_field(req, sizeof(req), "newFile", new_files[i], 0);
+                                json_put_string_field(req, sizeof(req), "file", mv[i].file, 0);
+                                json_put_string_field(req, sizeof(req), "newFile", mv[i].new_file, 0);
                                 strncat(req, "}", sizeof(req)-strlen(req)-1);
-                                if (send_msg(sfd, req, (uint32_t)strlen(req)) != 0) { close(sfd); failures++; continue; }
-                                char *r=NULL; uint32_t rl=0; if (recv_msg(sfd, &r, &rl) != 0 || !r || !strstr(r, "\"status\":\"OK\"")) { failures++; }
-                                else {
-                                    // Replicate this file rename to its replicas
-                                    int repls[16]; size_t nr = nm_state_get_replicas(files[i], repls, 16);
-                                    nm_acl_rename(files[i], new_files[i]);
-                                    for (size_t j=0;j<nr;j++) schedule_cmd_repl("RENAME", files[i], new_files[i], repls[j]);
+                                calls[i].ssid = mv[i].ss_id; calls[i].req = strdup(req);
+                            }
+                            if (calls) (void)nm_fanout(calls, (size_t)n, get_ss_info, NM_FANOUT_PARALLEL, NM_FANOUT_DEADLINE_MS);
+                            for (int i=0; i<n; ++i) {
+                                const char *r = calls ? calls[i].reply : NULL;
+                                int done = r ? (strstr(r, "\"status\":\"OK\"") != NULL) : 0;
+                                if (!r && calls && calls[i].sent) {
+                                    int st = ss_settle_rename(mv[i].ss_id, mv[i].new_file, calls[i].req);
+                                    if (st < 0) fprintf(stderr, "[NM] MOVE: ss%d unreachable, cannot tell whether %s was renamed; keeping the old name\n", mv[i].ss_id, mv[i].file);
+                                    done = (st == 1);
                                 }
-                                free(r); close(sfd);
+                                if (!done) {
+                                    failures++;
+                                    if (!nm_dir_rename(mv[i].new_file, mv[i].file)) fprintf(stderr, "[NM] MOVE: could not restore %s\n", mv[i].file);
+                                    continue;
+                                }
+                                // Replicate this file rename to the replicas it had before the move
+                                nm_acl_rename(mv[i].file, mv[i].new_file); repv_rename(mv[i].file, mv[i].new_file); tail_rename(mv[i].file, mv[i].new_file);
+                                for (size_t j=0;j<mv[i].n_repls;j++) schedule_cmd_repl("RENAME", mv[i].file, mv[i].new_file, mv[i].repls[j]);
                             }
+                            for (int i=0; calls && i<n; ++i) { free((char *)calls[i].req); free(calls[i].reply); }
+                            free(calls);
+                            // Routes change once the SSs hold the new names; large moves flush client caches wholesale
+                            if (n - failures > 64) nm_watch_route_changed(NULL, NM_ROUTE_ALL);
+                            else for (int i = 0; i < n; ++i) if (nm_state_find_dir(mv[i].file, NULL) != 0) nm_watch_route_changed(mv[i].file, NM_ROUTE_ALL);
                             if (failures) { const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(fd, resp, (uint32_t)strlen(resp)); }
-                            else { (void)nm_state_save("nm_state.json"); const char *resp = "{\"status\":\"OK\"}"; send_msg(fd, resp, (uint32_t)strlen(resp)); }
+                            else { (void)nm_state_save(NM_STATE_FILE); const char *resp = "{\"status\":\"OK\"}"; send_msg(fd, resp, (uint32_t)strlen(resp)); }
                         }
+                        nm_state_free_moves(mv, n);
                     }
                 }
             }
@@ -1044,7 +2185,8 @@ static void *client_thread(void *arg) {
             } else {
                 int perm = (strcmp(mode, "RW")==0)? (ACL_R|ACL_W) : (strcmp(mode, "W")==0? ACL_W : ACL_R);
                 nm_acl_grant(file, target, perm); nm_state_remove_request(file, target);
-                (void)nm_state_save("nm_state.json");
+                nm_watch_route_changed(file, NM_ROUTE_ALL); // a grant may also narrow RW to R
+                (void)nm_state_save(NM_STATE_FILE);
                 const char *ok = "{\"status\":\"OK\"}"; send_msg(fd, ok, (uint32_t)strlen(ok));
             }
         } else if (strcmp(type, "REMACCESS") == 0) {
@@ -1053,7 +2195,8 @@ static void *client_thread(void *arg) {
                 const char *resp = "{\"status\":\"ERR_BADREQ\"}"; send_msg(fd, resp, (uint32_t)strlen(resp));
             } else {
                 nm_acl_revoke(file, target);
-                (void)nm_state_save("nm_state.json");
+                nm_watch_route_changed(file, NM_ROUTE_ALL);
+                (void)nm_state_save(NM_STATE_FILE);
                 const char *ok = "{\"status\":\"OK\"}"; send_msg(fd, ok, (uint32_t)strlen(ok));
             }
         } else if (strcmp(type, "VIEWREQUESTS") == 0) {
@@ -1078,10 +2221,13 @@ static void *client_thread(void *arg) {
                 if (nm_state_find_dir(file, NULL) != 0) { const char *er="{\"status\":\"ERR_NOTFOUND\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
                 else {
                     int added = nm_state_add_request(file, user, m);
-                    if (added) { (void)nm_state_save("nm_state.json"); const char *ok="{\"status\":\"OK\"}"; send_msg(fd, ok, (uint32_t)strlen(ok)); }
+                    if (added) { (void)nm_state_save(NM_STATE_FILE); const char *ok="{\"status\":\"OK\"}"; send_msg(fd, ok, (uint32_t)strlen(ok)); }
                     else { const char *er="{\"status\":\"ERR_CONFLICT\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
                 }
             }
+        } else if (strcmp(type, "WATCH") == 0) {
+            // Route-change watch (client route cache): after the ack this connection only carries pushes
+            if (nm_watch_add(fd) != 0) { const char *er = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
         } else if (strcmp(type, "CLIENT_HELLO") == 0) {
             char user[128];
             if (json_get_string_field(buf, "user", user, sizeof(user)) == 0) {
@@ -1092,7 +2238,7 @@ static void *client_thread(void *arg) {
                     free(buf); close(fd); return NULL;
                 }
                 nm_state_set_user_active(user, 1);
-                (void)nm_state_save("nm_state.json");
+                (void)nm_state_save(NM_STATE_FILE);
             } else {
                 printf("[NM] Client hello (user unknown)\n");
             }
@@ -1109,7 +2255,7 @@ static void *client_thread(void *arg) {
             if (!user[0]) { const char *er = "{\"status\":\"ERR_BADREQ\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
             else {
                 nm_state_set_user_active(user, active ? 1 : 0);
-                (void)nm_state_save("nm_state.json");
+                (void)nm_state_save(NM_STATE_FILE);
                 const char *ok = "{\"status\":\"OK\"}"; send_msg(fd, ok, (uint32_t)strlen(ok));
             }
         } else if (strcmp(type, "LIST_SS") == 0) {
@@ -1129,35 +2275,13 @@ static void *client_thread(void *arg) {
             send_msg(fd, resp, (uint32_t)strlen(resp));
     } else if (strcmp(type, "LIST_USERS") == 0) {
             // Return all users with their active status
-            char all_users[256][128]; size_t n_all = nm_state_get_users(all_users, 256);
-            char active_users[256][128]; size_t n_active = nm_state_get_active_users(active_users, 256);
-            
-            char resp[8192]; size_t w = 0; 
-            w += snprintf(resp + w, sizeof(resp) - w, "{\"status\":\"OK\",\"active\":[");
-            for (size_t i = 0; i < n_active; ++i) {
-                if (i) w += snprintf(resp + w, sizeof(resp) - w, ",");
-                w += snprintf(resp + w, sizeof(resp) - w, "\"%s\"", active_users[i]);
-            }
-            w += snprintf(resp + w, sizeof(resp) - w, "],\"inactive\":[");
-            
-            int first_inactive = 1;
-            for (size_t i = 0; i < n_all; ++i) {
-                // Check if this user is active
-                int is_active = 0;
-                for (size_t j = 0; j < n_active; ++j) {
-                    if (strcmp(all_users[i], active_users[j]) == 0) {
-                        is_active = 1;
-                        break;
-                    }
-                }
-                if (!is_active) {
-                    if (!first_inactive) w += snprintf(resp + w, sizeof(resp) - w, ",");
-                    w += snprintf(resp + w, sizeof(resp) - w, "\"%s\"", all_users[i]);
-                    first_inactive = 0;
-                }
-            }
-            
-            if (w < sizeof(resp)) w += snprintf(resp + w, sizeof(resp) - w, "]}");
+            char resp[8192]; reply_t r; reply_init(&r, resp, sizeof(resp), "{\"status\":\"OK\",\"active\":[");
+            users_walk_t walk = { &r, 1 };
+            nm_state_foreach_user(list_user, &walk);
+            reply_raw(&r, "],\"inactive\":["); r.first = 1;
+            walk.active = 0;
+            nm_state_foreach_user(list_user, &walk);
+            reply_raw(&r, "]}");
             send_msg(fd, resp, (uint32_t)strlen(resp));
         } else if (strcmp(type, "APPROVE_ACCESS") == 0) {
             char file[128]; char owner[128]; char target[128]; char mode[8]; owner[0]=mode[0]=0;
@@ -1167,31 +2291,39 @@ static void *client_thread(void *arg) {
                 else {
                     (void)json_get_string_field(buf, "mode", mode, sizeof(mode)); int perm = (strcmp(mode, "W")==0? (ACL_R|ACL_W) : (strcmp(mode, "RW")==0? (ACL_R|ACL_W) : ACL_R));
                     nm_acl_grant(file, target, perm); nm_state_remove_request(file, target);
-                    (void)nm_state_save("nm_state.json");
+                    nm_watch_route_changed(file, NM_ROUTE_ALL); // as ADDACCESS: the grant may narrow RW to R
+                    (void)nm_state_save(NM_STATE_FILE);
                     const char *ok="{\"status\":\"OK\"}"; send_msg(fd, ok, (uint32_t)strlen(ok));
                 }
             }
         } else if (strcmp(type, "DENY_ACCESS") == 0) {
             char file[128]; char owner[128]; char target[128]; if (json_get_string_field(buf, "file", file, sizeof(file))!=0 || json_get_string_field(buf, "user", owner, sizeof(owner))!=0 || json_get_string_field(buf, "target", target, sizeof(target))!=0) { const char *er="{\"status\":\"ERR_BADREQ\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
-            else { char ow[128]; if (nm_acl_get_owner(file, ow, sizeof(ow))!=0 || strcmp(ow, owner)!=0) { const char *er="{\"status\":\"ERR_NOAUTH\"}"; send_msg(fd, er, (uint32_t)strlen(er)); } else { nm_state_remove_request(file, target); (void)nm_state_save("nm_state.json"); const char *ok="{\"status\":\"OK\"}"; send_msg(fd, ok, (uint32_t)strlen(ok)); } }
+            else { char ow[128]; if (nm_acl_get_owner(file, ow, sizeof(ow))!=0 || strcmp(ow, owner)!=0) { const char *er="{\"status\":\"ERR_NOAUTH\"}"; send_msg(fd, er, (uint32_t)strlen(er)); } else { nm_state_remove_request(file, target); (void)nm_state_save(NM_STATE_FILE); const char *ok="{\"status\":\"OK\"}"; send_msg(fd, ok, (uint32_t)strlen(ok)); } }
         } else if (strcmp(type, "STATS") == 0) {
-            // Count mapped files accurately by requesting a large snapshot
-            char f2[1024][128]; int s2[1024]; size_t nf = nm_state_get_dir(f2, s2, 1024);
+            size_t nf = nm_state_dir_count();
             int q = repq_get(); int locks = -1;
-            char resp[256]; snprintf(resp, sizeof(resp), "{\"status\":\"OK\",\"files\":%zu,\"activeLocks\":%d,\"replicationQueue\":%d}", nf, locks, q);
+            char resp[256]; snprintf(resp, sizeof(resp), "{\"status\":\"OK\",\"files\":%zu,\"activeLocks\":%d,\"replicationQueue\":%d,\"resyncPending\":%zu,\"tailsPending\":%zu}", nf, locks, q, resync_pending(), tail_pending());
             send_msg(fd, resp, (uint32_t)strlen(resp));
         } else if (strcmp(type, "LISTTRASH") == 0) {
-            // List trashed items
-            char files[256][128]; char trashed[256][128]; int ssids[256]; char owners[256][128]; int whens[256];
-            size_t n = nm_state_get_trash(files, trashed, ssids, owners, whens, 256);
-            char resp[16384]; size_t w=0; w += snprintf(resp+w, sizeof(resp)-w, "{\"status\":\"OK\",\"trash\":[");
-            for (size_t i=0;i<n;i++) {
-                if (i) w += snprintf(resp+w, sizeof(resp)-w, ",");
-                w += snprintf(resp+w, sizeof(resp)-w, "{\"file\":\"%s\",\"trashed\":\"%s\",\"owner\":\"%s\",\"ssid\":%d,\"when\":%d}", files[i], trashed[i], owners[i], ssids[i], whens[i]);
-                if (w >= sizeof(resp)) break;
+            // One page of trashed items in name order
+            size_t limit; char after[300];
+            (void)page_request(buf, &limit, after, sizeof(after));
+            size_t cap; char *resp = page_buf(limit, &cap); page_sel_t sel;
+            if (!resp || page_sel_init(&sel, limit + 1, after) != 0) { free(resp); const char *er = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
+            else {
+                nm_state_foreach_trash(page_trash, &sel);
+                reply_t r; reply_init(&r, resp, cap, "{\"status\":\"OK\",\"trash\":[");
+                size_t n = sel.n < limit ? sel.n : limit;
+                for (size_t i = 0; i < n; i++) {
+                    char tpath[128], owner[128]; int ssid = 0, when = 0; tpath[0] = owner[0] = '\0';
+                    if (nm_state_trash_find(sel.v[i], tpath, sizeof(tpath), &ssid, owner, sizeof(owner), &when) != 0) continue; // purged meanwhile
+                    reply_item(&r, "{\"file\":\"%s\",\"trashed\":\"%s\",\"owner\":\"%s\",\"ssid\":%d,\"when\":%d}", sel.v[i], tpath, owner, ssid, when);
+                }
+                reply_raw(&r, "]}");
+                if (sel.n > limit) reply_next(&r, 'T', sel.v[n - 1]);
+                send_msg(fd, resp, (uint32_t)strlen(resp));
+                free(sel.v); free(resp);
             }
-            if (w < sizeof(resp)) w += snprintf(resp+w, sizeof(resp)-w, "]}");
-            send_msg(fd, resp, (uint32_t)strlen(resp));
         } else if (strcmp(type, "RESTORE") == 0) {
             // Restore a trashed file back to original path; owner-only
             char file[128]; char user[128]; user[0]='\0';
@@ -1226,7 +2358,7 @@ static void *client_thread(void *arg) {
                                     int repls[16]; size_t nr = nm_state_get_replicas(file, repls, 16);
                                     for (size_t i=0;i<nr;i++) schedule_cmd_repl("RENAME", tpath, file, repls[i]);
                                     
-                                    (void)nm_state_save("nm_state.json");
+                                    (void)nm_state_save(NM_STATE_FILE);
                                     const char *ok = "{\"status\":\"OK\"}"; send_msg(fd, ok, (uint32_t)strlen(ok));
                                 }
                             }
@@ -1238,28 +2370,32 @@ static void *client_thread(void *arg) {
             // Permanently delete trashed files; if 'file' provided, purge only that entry; otherwise purge all owned by 'user'
             char user[128]; user[0]='\0'; (void)json_get_string_field(buf, "user", user, sizeof(user)); if(!user[0]) snprintf(user,sizeof(user),"%s","anonymous");
             char target[128]; int has_file = (json_get_string_field(buf, "file", target, sizeof(target)) == 0);
-            // Iterate over trash entries safely by snapshot
-            char files[256][128]; char trashed[256][128]; int ssids[256]; char owners[256][128]; int whens[256];
-            size_t n = nm_state_get_trash(files, trashed, ssids, owners, whens, 256);
+            // Pick the entries under the trash lock, then purge them on their SSs
+            ent_list_t picked = { NULL, 0, 0 };
+            purge_walk_t walk = { &picked, has_file ? target : NULL, user };
+            nm_state_foreach_trash(pick_purge, &walk);
+            // Purge on the SSs in one fan-out; an entry whose SS did not answer stays in the trash
             int purged = 0;
-            for (size_t i=0;i<n;i++) {
-                if (has_file) { if (strcmp(files[i], target) != 0) continue; }
-                else { if (owners[i][0] && strcmp(owners[i], user) != 0) continue; }
-                // Delete on SS
-                int data_port=0; char ss_addr[64];
-                if (get_ss_info(ssids[i], &data_port, ss_addr, sizeof(ss_addr)) != 0 || data_port==0) continue;
-                int sfd = tcp_connect(ss_addr, (uint16_t)data_port); if (sfd < 0) continue;
-                char req[256]; req[0]='\0'; json_put_string_field(req, sizeof(req), "type", "DELETE", 1); json_put_string_field(req, sizeof(req), "file", trashed[i], 0); strncat(req, "}", sizeof(req)-strlen(req)-1);
-                if (send_msg(sfd, req, (uint32_t)strlen(req)) == 0) { char *r=NULL; uint32_t rl=0; (void)recv_msg(sfd, &r, &rl); if (r) free(r); }
-                close(sfd);
-                
+            nm_fanout_call_t *calls = (nm_fanout_call_t *)calloc(picked.n ? picked.n : 1, sizeof(*calls));
+            for (size_t i=0; calls && i<picked.n; i++) {
+                char req[256]; req[0]='\0'; json_put_string_field(req, sizeof(req), "type", "DELETE", 1); json_put_string_field(req, sizeof(req), "file", picked.v[i].aux, 0); strncat(req, "}", sizeof(req)-strlen(req)-1);
+                calls[i].ssid = picked.v[i].ssid; calls[i].req = strdup(req);
+            }
+            if (calls) (void)nm_fanout(calls, picked.n, get_ss_info, NM_FANOUT_PARALLEL, NM_FANOUT_DEADLINE_MS);
+            for (size_t i=0;i<picked.n;i++) {
+                const ent_t *t = &picked.v[i];
+                if (!calls || !calls[i].reply) continue;
+
                 // Schedule DELETE replication to replicas
-                int repls[16]; size_t nr = nm_state_get_replicas(files[i], repls, 16);
-                for (size_t j=0;j<nr;j++) schedule_cmd_repl("DELETE", trashed[i], NULL, repls[j]);
-                
-                nm_state_trash_remove(files[i]); purged++;
+                int repls[16]; size_t nr = nm_state_get_replicas(t->file, repls, 16);
+                for (size_t j=0;j<nr;j++) schedule_cmd_repl("DELETE", t->aux, NULL, repls[j]);
+
+                nm_state_trash_remove(t->file); purged++;
             }
-            (void)nm_state_save("nm_state.json");
+            for (size_t i=0; calls && i<picked.n; i++) { free((char *)calls[i].req); free(calls[i].reply); }
+            free(calls);
+            free(picked.v);
+            (void)nm_state_save(NM_STATE_FILE);
             const char *ok = "{\"status\":\"OK\"}"; send_msg(fd, ok, (uint32_t)strlen(ok));
         } else if (strcmp(type, "VIEW") == 0) {
             // flags: -a (all), -l (details). Default: only files user can READ.
@@ -1269,74 +2405,49 @@ static void *client_thread(void *arg) {
             // Support -a, -l, and combined forms like -al or -la
             int all = (strchr(flags, 'a') != NULL);
             int det = (strchr(flags, 'l') != NULL);
-            // Enumerate files
-            char files[512][128]; int ssids[512]; size_t n = nm_state_get_dir(files, ssids, 512);
-            char resp[16384]; size_t w=0;
-            if (!det) {
-                w += snprintf(resp+w, sizeof(resp)-w, "{\"status\":\"OK\",\"files\":[");
-                int first=1;
-                for (size_t i=0;i<n;i++) {
-                    if (!all) {
-                        int can_r = (nm_acl_check(files[i], user, "READ") == 0);
-                        int can_w = (nm_acl_check(files[i], user, "WRITE") == 0);
-                        if (!(can_r || can_w)) continue;
-                    }
-                    if (!first) w += snprintf(resp+w, sizeof(resp)-w, ",");
-                    first=0;
-                    w += snprintf(resp+w, sizeof(resp)-w, "\"%s\"", files[i]);
-                    if (w >= sizeof(resp)) break;
-                }
-                if (w < sizeof(resp)) w += snprintf(resp+w, sizeof(resp)-w, "]}");
-                send_msg(fd, resp, (uint32_t)strlen(resp));
-            } else {
-                // Detailed: fetch INFO from SS for each matching file and include owner
-                w += snprintf(resp+w, sizeof(resp)-w, "{\"status\":\"OK\",\"details\":[");
-                int first=1;
-                for (size_t i=0;i<n;i++) {
-                    const char *f = files[i]; int ssid = ssids[i];
-                    int can_r = (nm_acl_check(f, user, "READ") == 0);
-                    int can_w = (nm_acl_check(f, user, "WRITE") == 0);
-                    if (!all && !(can_r || can_w)) continue;
-                    int size=0, words=0, chars=0, mtime=0, atime=0;
-            if (can_r || can_w) {
-                        // resolve ss data port and address
-                        int data_port=0; char ss_addr[64];
-                        if (get_ss_info(ssid, &data_port, ss_addr, sizeof(ss_addr)) == 0 && data_port!=0) {
-                // Build READ ticket if allowed, else WRITE ticket
-                char ticket[256]; const char *op = can_r ? "READ" : "WRITE";
-                if (ticket_build(f, op, ssid, 600, ticket, sizeof(ticket)) == 0) {
-                                // Query SS INFO
-                                int sfd = tcp_connect(ss_addr, (uint16_t)data_port);
-                                if (sfd >= 0) {
-                                    char req[512]; req[0]='\0'; json_put_string_field(req, sizeof(req), "type", "INFO", 1);
-                                    json_put_string_field(req, sizeof(req), "file", f, 0);
-                                    json_put_string_field(req, sizeof(req), "ticket", ticket, 0);
-                                    strncat(req, "}", sizeof(req)-strlen(req)-1);
-                                    if (send_msg(sfd, req, (uint32_t)strlen(req)) == 0) {
-                                        char *r=NULL; uint32_t rl=0; if (recv_msg(sfd, &r, &rl) == 0 && r && strstr(r, "\"status\":\"OK\"")) {
-                                            (void)json_get_int_field(r, "size", &size); (void)json_get_int_field(r, "words", &words); (void)json_get_int_field(r, "chars", &chars); (void)json_get_int_field(r, "mtime", &mtime); (void)json_get_int_field(r, "atime", &atime);
-                                        }
-                                        if (r) free(r);
-                                    }
-                                    close(sfd);
-                                }
-                            }
-                        }
-                    }
+            // One page of visible files in name order; -l details are fetched for that page only
+            size_t limit; char after[300];
+            (void)page_request(buf, &limit, after, sizeof(after));
+            size_t cap; char *resp = page_buf(limit, &cap); page_sel_t sel;
+            if (!resp || page_sel_init(&sel, limit + 1, after) != 0) { free(resp); const char *er = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
+            else {
+                // Without -a only the user's own and public files are walked, via the per-user ACL index
+                if (all) nm_state_foreach_dir(NULL, 0, page_view_file, &sel);
+                else nm_acl_foreach_visible(user, page_name, &sel);
+                size_t n = sel.n < limit ? sel.n : limit;
+                char last[256]; last[0] = '\0';
+                if (n) memcpy(last, sel.v[n - 1], sizeof(last));
+                if (!all) n = view_keep_listed(sel.v, n);
+                reply_t r;
+                reply_init(&r, resp, cap, det ? "{\"status\":\"OK\",\"details\":[" : "{\"status\":\"OK\",\"files\":[");
+                // -l: stats from the SS_COMMIT cache; files it does not cover are asked for with SS INFO,
+                // fanned out across the SSs involved
+                int *ssids = det ? (int *)calloc(n ? n : 1, sizeof(int)) : NULL;
+                char **infos = det ? (char **)calloc(n ? n : 1, sizeof(char *)) : NULL;
+                if (ssids && infos) view_fetch_info(sel.v, n, user, ssids, infos);
+                for (size_t i = 0; i < n; i++) {
+                    const char *f = sel.v[i];
+                    if (!det) { reply_item(&r, "\"%s\"", f); continue; }
+                    if (!ssids || !infos || ssids[i] < 0) continue; // deleted meanwhile
+                    nm_file_stats_t st = {0, 0, 0, 0}; int atime = 0;
+                    if (infos[i] == NULL) (void)file_stats_cached(f, &st, &atime);
+                    else if (strstr(infos[i], "\"status\":\"OK\"")) file_stats_parse(f, infos[i], &st, &atime);
+                    int size = st.size, words = st.words, chars = st.chars, mtime = st.mtime;
                     char owner[128]; owner[0]='\0'; (void)nm_acl_get_owner(f, owner, sizeof(owner));
-                    if (!first) { w += snprintf(resp+w, sizeof(resp)-w, ","); }
-                    first = 0;
-                    w += snprintf(resp+w, sizeof(resp)-w, "{\"name\":\"%s\",\"words\":%d,\"chars\":%d,\"size\":%d,\"mtime\":%d,\"atime\":%d,\"owner\":\"%s\"}", f, words, chars, size, mtime, atime, owner);
-                    if (w >= sizeof(resp)) break;
+                    reply_item(&r, "{\"name\":\"%s\",\"words\":%d,\"chars\":%d,\"size\":%d,\"mtime\":%d,\"atime\":%d,\"owner\":\"%s\"}", f, words, chars, size, mtime, atime, owner);
                 }
-                if (w < sizeof(resp)) w += snprintf(resp+w, sizeof(resp)-w, "]}");
+                for (size_t i = 0; infos && i < n; i++) free(infos[i]);
+                free(infos); free(ssids);
+                reply_raw(&r, "]}");
+                if (sel.n > limit) reply_next(&r, 'V', last);
                 send_msg(fd, resp, (uint32_t)strlen(resp));
+                free(sel.v); free(resp);
             }
         } else if (strcmp(type, "DIR_SET") == 0) { // debug: set mapping
             char file[128]; int ssid = 0;
             if (json_get_string_field(buf, "file", file, sizeof(file)) == 0 && json_get_int_field(buf, "ssId", &ssid) == 0) {
                 nm_dir_set(file, ssid);
-                (void)nm_state_save("nm_state.json");
+                (void)nm_state_save(NM_STATE_FILE);
                 const char *resp = "{\"status\":\"OK\"}";
                 send_msg(fd, resp, (uint32_t)strlen(resp));
             } else {
@@ -1344,7 +2455,7 @@ static void *client_thread(void *arg) {
                 send_msg(fd, resp, (uint32_t)strlen(resp));
             }
         } else if (strcmp(type, "INFO") == 0) {
-            // INFO collected by NM by querying SS INFO and combining with ACL owner
+            // INFO: content stats from the SS_COMMIT cache (SS INFO only when unknown) combined with ACL owner
             char file[128]; char user[128]; user[0]='\0';
             (void)json_get_string_field(buf, "user", user, sizeof(user)); if(!user[0]) snprintf(user,sizeof(user),"%s","anonymous");
             if (json_get_string_field(buf, "file", file, sizeof(file)) != 0) { const char *er = "{\"status\":\"ERR_BADREQ\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
@@ -1352,36 +2463,23 @@ static void *client_thread(void *arg) {
                 int ssid=0; if (nm_state_find_dir(file, &ssid) != 0) { const char *er = "{\"status\":\"ERR_NOTFOUND\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
                 else if (nm_acl_check(file, user, "READ") != 0) { const char *er = "{\"status\":\"ERR_NOAUTH\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
                 else {
-                    int data_port=0; char ss_addr[64];
-                    if (get_ss_info(ssid, &data_port, ss_addr, sizeof(ss_addr)) != 0 || data_port==0) { const char *er = "{\"status\":\"ERR_UNAVAILABLE\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
+                    nm_file_stats_t st; int atime = 0; char *r = NULL;
+                    int rc = file_stats(file, ssid, &st, &atime, &r);
+                    if (rc < 0) { const char *er = "{\"status\":\"ERR_UNAVAILABLE\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
+                    else if (rc > 0) send_msg(fd, r, (uint32_t)strlen(r)); // the SS's own error
                     else {
-                        char ticket[256]; if (ticket_build(file, "READ", ssid, 600, ticket, sizeof(ticket)) != 0) { const char *er = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
-                        else {
-                            int sfd = tcp_connect(ss_addr, (uint16_t)data_port); if (sfd < 0) { const char *er = "{\"status\":\"ERR_UNAVAILABLE\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
-                            else {
-                                char req[512]; req[0]='\0'; json_put_string_field(req, sizeof(req), "type", "INFO", 1); json_put_string_field(req, sizeof(req), "file", file, 0); json_put_string_field(req, sizeof(req), "ticket", ticket, 0); strncat(req, "}", sizeof(req)-strlen(req)-1);
-                                if (send_msg(sfd, req, (uint32_t)strlen(req)) != 0) { close(sfd); const char *er = "{\"status\":\"ERR_UNAVAILABLE\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
-                                else {
-                                    char *r=NULL; uint32_t rl=0; if (recv_msg(sfd, &r, &rl) != 0 || !r) { close(sfd); const char *er = "{\"status\":\"ERR_UNAVAILABLE\"}"; send_msg(fd, er, (uint32_t)strlen(er)); }
-                                    else if (!strstr(r, "\"status\":\"OK\"")) { send_msg(fd, r, rl); free(r); close(sfd); }
-                                    else {
-                                        int size=0, words=0, chars=0, mtime=0, atime=0; (void)json_get_int_field(r, "size", &size); (void)json_get_int_field(r, "words", &words); (void)json_get_int_field(r, "chars", &chars); (void)json_get_int_field(r, "mtime", &mtime); (void)json_get_int_field(r, "atime", &atime);
-                                        free(r); close(sfd);
-                                        char owner[128]; owner[0]='\0'; (void)nm_acl_get_owner(file, owner, sizeof(owner));
-                                        char access[1024]; access[0]='\0'; (void)nm_acl_format_access(file, access, sizeof(access));
-                                        
-                                        // Get metadata tracking info
-                                        char mod_user[128] = {0}, acc_user[128] = {0};
-                                        int mod_time = 0, acc_time = 0;
-                                        (void)nm_state_get_file_metadata(file, mod_user, sizeof(mod_user), &mod_time, acc_user, sizeof(acc_user), &acc_time);
-                                        
-                                        char resp[2048]; snprintf(resp, sizeof(resp), "{\"status\":\"OK\",\"file\":\"%s\",\"owner\":\"%s\",\"size\":%d,\"words\":%d,\"chars\":%d,\"mtime\":%d,\"atime\":%d,\"access\":\"%s\",\"last_modified_user\":\"%s\",\"last_modified_time\":%d,\"last_accessed_user\":\"%s\",\"last_accessed_time\":%d}", file, owner, size, words, chars, mtime, atime, access, mod_user[0] ? mod_user : "", mod_time, acc_user[0] ? acc_user : "", acc_time);
-                                        send_msg(fd, resp, (uint32_t)strlen(resp));
-                                    }
-                                }
-                            }
-                        }
+                        char owner[128]; owner[0]='\0'; (void)nm_acl_get_owner(file, owner, sizeof(owner));
+                        char access[1024]; access[0]='\0'; (void)nm_acl_format_access(file, access, sizeof(access));
+
+                        // Get metadata tracking info
+                        char mod_user[128] = {0}, acc_user[128] = {0};
+                        int mod_time = 0, acc_time = 0;
+                        (void)nm_state_get_file_metadata(file, mod_user, sizeof(mod_user), &mod_time, acc_user, sizeof(acc_user), &acc_time);
+
+                        char resp[2048]; snprintf(resp, sizeof(resp), "{\"status\":\"OK\",\"file\":\"%s\",\"owner\":\"%s\",\"size\":%d,\"words\":%d,\"chars\":%d,\"mtime\":%d,\"atime\":%d,\"access\":\"%s\",\"last_modified_user\":\"%s\",\"last_modified_time\":%d,\"last_accessed_user\":\"%s\",\"last_accessed_time\":%d}", file, owner, st.size, st.words, st.chars, st.mtime, atime, access, mod_user[0] ? mod_user : "", mod_time, acc_user[0] ? acc_user : "", acc_time);
+                        send_msg(fd, resp, (uint32_t)strlen(resp));
                     }
+                    free(r);
                 }
             }
         } else if (strcmp(type, "EXEC") == 0) {
@@ -1503,6 +2601,7 @@ static void *client_thread(void *arg) {
         }
         free(buf);
     }
+    nm_watch_remove(fd);
     close(fd);
     return NULL;
 }
@@ -1512,16 +2611,43 @@ static void on_sigint(int sig) {
 }
 
 int main(int argc, char **argv) {
+    if (argc >= 3 && strcmp(argv[1], "--export-json") == 0) {
+        // Offline export of the current state (snapshot + journal) as JSON; safe next to a running NM
+        nm_state_init();
+        if (nm_state_load_readonly(NM_STATE_FILE, NM_STATE_JSON) != 0 || nm_state_export_json(argv[2]) != 0) {
+            fprintf(stderr, "[NM] export to %s failed\n", argv[2]);
+            return 1;
+        }
+        printf("[NM] Exported state to %s\n", argv[2]);
+        return 0;
+    }
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <nm_ctrl_port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <nm_ctrl_port>\n       %s --export-json <out.json>\n", argv[0], argv[0]);
         return 1;
     }
     uint16_t port = (uint16_t)atoi(argv[1]);
     signal(SIGINT, on_sigint);
+    signal(SIGPIPE, SIG_IGN); // sends to departed clients and SSs return errors
+    // Failure-detector tuning
+    const char *ev;
+    if ((ev = getenv("NM_PHI_SUSPECT")) && atof(ev) > 0) g_phi_suspect = atof(ev);
+    if ((ev = getenv("NM_PHI_DOWN")) && atof(ev) > 0) g_phi_down = atof(ev);
+    if ((ev = getenv("NM_HB_TIMEOUT")) && atof(ev) > 0) g_hb_timeout = atof(ev);
+    if (g_phi_down < g_phi_suspect) g_phi_down = g_phi_suspect;
+    // Placement weights
+    if ((ev = getenv("NM_PLACE_W_BYTES")) && atof(ev) >= 0) g_w_bytes = atof(ev);
+    if ((ev = getenv("NM_PLACE_W_QPS")) && atof(ev) >= 0) g_w_qps = atof(ev);
+    if ((ev = getenv("NM_PLACE_W_SESSIONS")) && atof(ev) >= 0) g_w_sessions = atof(ev);
+    if ((ev = getenv("NM_PLACE_W_DISK")) && atof(ev) >= 0) g_w_disk = atof(ev);
+    if ((ev = getenv("NM_PLACE_MIN_FREE_MB")) && atoi(ev) >= 0) g_place_min_free_mb = atoi(ev);
+    if ((ev = getenv("NM_REBALANCE"))) g_rebalance = atoi(ev) != 0;
 
     nm_state_init();
+    if (nm_state_load(NM_STATE_FILE, NM_STATE_JSON) != 0) {
+        fprintf(stderr, "[NM] Refusing to start: %s is unreadable (move it aside to start empty)\n", NM_STATE_FILE);
+        return 1;
+    }
     nm_dir_init();
-    nm_state_load("nm_state.json");
 
     int lfd = tcp_listen(port, BACKLOG);
     if (lfd < 0) { perror("listen"); return 1; }
@@ -1529,6 +2655,9 @@ int main(int argc, char **argv) {
 
     // Start heartbeat monitor
     pthread_t th_hb; pthread_create(&th_hb, NULL, hb_monitor_thread, NULL); pthread_detach(th_hb);
+    // Start anti-entropy scrubber
+    pthread_t th_sc; pthread_create(&th_sc, NULL, scrub_thread, NULL); pthread_detach(th_sc);
+    pthread_t th_rb; pthread_create(&th_rb, NULL, rebalance_thread, NULL); pthread_detach(th_rb);
 
     while (g_running) {
         struct sockaddr_in cli; socklen_t clilen = sizeof(cli);
@@ -1539,10 +2668,9 @@ int main(int argc, char **argv) {
     }
 
     close(lfd);
-    // Save state on shutdown
-    if (nm_state_save("nm_state.json") == 0) {
-        char users[64][128];
-        size_t n = nm_state_get_users(users, 64);
+    // Compact the journal into a snapshot on shutdown
+    if (nm_state_snapshot(NM_STATE_FILE) == 0) {
+        size_t n = nm_state_foreach_user(NULL, NULL);
         printf("[NM] Saved state with %zu user(s).\n", n);
     }
     printf("[NM] Shutting down.\n");
@@ -1,75 +1,88 @@
 #define _POSIX_C_SOURCE 200809L
 #include "nm_persist.h"
+#include "hmap.h"
+#include "nm_journal.h"
 
 #include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-// Hash table implementation for O(1) lookups
-#define HASH_BUCKETS 256
-
-static unsigned hash_djb2(const char *str) {
-    unsigned long hash = 5381;
-    int c;
-    while ((c = *str++))
-        hash = ((hash << 5) + hash) + c;
-    return hash % HASH_BUCKETS;
-}
-
-struct acl_user { char *user; int perm; };
-
-// Hash map structures for O(1) lookups
-typedef struct user_hash_node {
-    char *user;
-    int is_active;
-    struct user_hash_node *next;
-} user_hash_node_t;
-
-typedef struct acl_hash_node {
-    char *file;
-    size_t acl_index; // index into g_state.acls array
-    struct acl_hash_node *next;
-} acl_hash_node_t;
-
-typedef struct folder_hash_node {
-    char *path;
-    size_t folder_index; // index into g_state.folders array
-    struct folder_hash_node *next;
-} folder_hash_node_t;
-
-typedef struct req_hash_node {
-    char *file;
-    size_t req_index; // index into g_state.requests array
-    struct req_hash_node *next;
-} req_hash_node_t;
-
-typedef struct trash_hash_node {
-    char *file;
-    size_t trash_index; // index into g_state.trash array
-    struct trash_hash_node *next;
-} trash_hash_node_t;
+struct acl_user { uint32_t uid; int perm; };
+
+// Per-SS file index: file -> role bits saying whether ss serves it as primary and/or replica
+typedef struct ss_index {
+    int ss_id;
+    size_t n_primary;
+    size_t n_replica;
+    hmap_t files;
+    struct ss_index *next;
+} ss_index_t;
+
+// Path tree: folders and directory entries split at '/', so listing or moving a folder touches only its
+// subtree. A node stays while it holds files, children or a declared folder; n_decl counts the declared
+// folders at or below it, which is what makes a child show up in VIEWFOLDER.
+typedef struct path_node {
+    char *name;               // segment ("" for the root)
+    struct path_node *parent;
+    hmap_t kids;              // segment -> struct path_node *
+    hmap_t files;             // leaf names of the files directly here
+    int is_folder;            // declared with CREATEFOLDER
+    size_t n_decl;
+} path_node_t;
+
+// Replica list of one directory entry. A borrowed list (from the snapshot) has cap 0 but a non-NULL v.
+typedef struct { int *v; uint32_t n, cap; } repl_list_t;
+
+// The directory as columns (structure of arrays): entry i is element i of every column. A scan that needs
+// one field streams through that column alone, and an entry has no allocation of its own: file points at
+// dir_map's key copy, or into the snapshot mapping for entries loaded from it.
+typedef struct {
+    const char **file;
+    int *ss_id;                // primary
+    repl_list_t *repl;
+    uint32_t *mod_uid, *acc_uid;
+    int *mod_time, *acc_time;
+    nm_file_stats_t *stats;    // meaningful where has_stats[i]
+    unsigned char *has_stats;
+    size_t n, cap;
+} dir_cols_t;
 
 typedef struct {
-    char **users;
+    const char **users; // interned names
     size_t n_users;
     size_t cap_users;
-    // Hash maps for O(1) lookups
-    user_hash_node_t *user_map[HASH_BUCKETS];
-    acl_hash_node_t *acl_map[HASH_BUCKETS];
-    folder_hash_node_t *folder_map[HASH_BUCKETS];
-    req_hash_node_t *req_map[HASH_BUCKETS];
-    trash_hash_node_t *trash_map[HASH_BUCKETS];
+    // Hash maps for O(1) lookups; the *_map tables map a key to its index in the matching array
+    hmap_t user_map;   // user -> is_active
+    hmap_t acl_map;
+    hmap_t folder_map;
+    hmap_t req_map;
+    hmap_t trash_map;
+    hmap_t dir_map;
+    // Files by serving SS (primary/replica), so failover touches only the affected files
+    ss_index_t *ss_index;
+    // Folders and files by path segment
+    path_node_t *tree;
+    // Interned user names: uid -> name, name -> uid
+    char **uid_names;
+    size_t n_uids, cap_uids;
+    hmap_t uid_map;
+    // Per-user ACL index: uid -> hmap_t * of the files that user owns or holds a grant on (ACL_IDX_* bits)
+    hmap_t **acl_idx;
+    size_t cap_acl_idx;
     // Active users (logged-in)
-    char **active_users;
+    const char **active_users; // interned names
     size_t n_active;
     size_t cap_active;
-    struct dir_entry { char *file; int ss_id; int *replicas; size_t n_repl; size_t cap_repl; char *last_modified_user; int last_modified_time; char *last_accessed_user; int last_accessed_time; } *dir;
-    size_t n_dir;
-    size_t cap_dir;
-    struct acl_entry { char *file; char *owner; struct acl_user *grants; size_t n_grants; size_t cap_grants; } *acls;
+    dir_cols_t dir;
+    struct acl_entry { char *file; uint32_t owner; struct acl_user *grants; size_t n_grants; size_t cap_grants; } *acls;
     size_t n_acls;
     size_t cap_acls;
     // Folders list (logical prefixes)
@@ -77,31 +90,179 @@ typedef struct {
     size_t n_folders;
     size_t cap_folders;
     // Access requests per file (with mode per user: 'R' or 'W')
-    struct req_entry { char *file; char **users; char *modes; size_t n_users; size_t cap_users; } *requests;
+    struct req_entry { char *file; uint32_t *uids; char *modes; size_t n_users; size_t cap_users; } *requests;
     size_t n_requests;
     size_t cap_requests;
     // Trash entries (soft-deleted files tracked at NM)
-    struct trash_entry { char *file; char *trashed; int ssid; char *owner; int when; } *trash;
+    struct trash_entry { char *file; char *trashed; int ssid; uint32_t owner; int when; } *trash;
     size_t n_trash;
     size_t cap_trash;
 } nm_state_t;
 
 static nm_state_t g_state;
 
-static void safe_copy(char *dst, size_t dstsz, const char *src) {
-    if (!dst || dstsz == 0) return;
-    if (!src) { dst[0] = '\0'; return; }
-    size_t n = strlen(src);
-    if (n >= dstsz) n = dstsz - 1;
-    memcpy(dst, src, n);
-    dst[n] = '\0';
+// Binary snapshot mapped at startup. Strings loaded from it point into the mapping instead of being copied,
+// and per-entry arrays (replicas, grants, request users) start out borrowed from it or from one load-time
+// pool: a borrowed array has cap 0 but a non-NULL pointer. Neither is ever freed, so the mapping stays for
+// the life of the process even after newer snapshots replace the file.
+static const unsigned char *g_snap_map = NULL;
+static size_t g_snap_map_len = 0;
+
+// free() for state strings, which may live in the snapshot mapping
+static void sfree(char *s) {
+    if (s && !((const unsigned char *)s >= g_snap_map && (const unsigned char *)s < g_snap_map + g_snap_map_len)) free(s);
+}
+
+// realloc() for per-entry arrays, copying a borrowed one out instead
+static void *grow_array(void *p, size_t used, size_t cap, size_t newcap, size_t elem) {
+    if (cap == 0 && p) {
+        void *q = malloc(newcap * elem);
+        if (q) memcpy(q, p, used * elem);
+        return q;
+    }
+    return realloc(p, newcap * elem);
+}
+
+// Locking: one reader-writer lock per independent part of g_state, so LOOKUP-path readers (directory,
+// ACL checks) run in parallel and only mutations of the same part exclude each other. Public functions
+// take the lock and call a *_nolock body; *_nolock bodies never call public functions of their own part.
+// Order when several are held (only nm_state_save does): users, dir, acl, req, trash.
+// The last-accessed/modified fields are written under the dir read lock plus g_meta_mu, so READ LOOKUPs
+// recording access time do not serialize against each other on the directory.
+static pthread_rwlock_t g_users_rw = PTHREAD_RWLOCK_INITIALIZER; // users, active users
+static pthread_rwlock_t g_dir_rw = PTHREAD_RWLOCK_INITIALIZER;   // dir, replicas, per-SS index, folders
+static pthread_rwlock_t g_acl_rw = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t g_req_rw = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t g_trash_rw = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t g_meta_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_save_mu = PTHREAD_MUTEX_INITIALIZER;   // one writer of the state file at a time
+
+// ---- User ids ----
+// Every user name is stored once. ACL owners and grants, access stamps, pending requests and trash owners
+// hold its dense uid, so per-file records carry 4 bytes per user and ACL checks compare integers. Ids are
+// never reused; UID_NONE (0) is "no user" and UID_ANON is always 1. g_uid_rw is a leaf lock (nothing is
+// taken while holding it), so any part may intern under its own lock.
+#define UID_NONE 0u
+#define UID_ANON 1u
+static pthread_rwlock_t g_uid_rw = PTHREAD_RWLOCK_INITIALIZER;
+
+// uid of name, or UID_NONE if it was never interned
+static uint32_t uid_find(const char *name) {
+    if (!name || !*name) return UID_NONE;
+    size_t v = 0;
+    pthread_rwlock_rdlock(&g_uid_rw);
+    int hit = hmap_get(&g_state.uid_map, name, &v) == 0;
+    pthread_rwlock_unlock(&g_uid_rw);
+    return hit ? (uint32_t)v : UID_NONE;
+}
+
+// uid of name, assigning the next one on first sight (UID_NONE for a NULL or empty name)
+static uint32_t uid_intern(const char *name) {
+    uint32_t id = uid_find(name);
+    if (id != UID_NONE || !name || !*name) return id;
+    size_t v = 0;
+    pthread_rwlock_wrlock(&g_uid_rw);
+    if (hmap_get(&g_state.uid_map, name, &v) == 0) id = (uint32_t)v; // interned meanwhile
+    else {
+        if (g_state.n_uids == g_state.cap_uids) {
+            size_t nc = g_state.cap_uids * 2;
+            char **p = (char **)realloc(g_state.uid_names, nc * sizeof(char *));
+            if (!p) { fprintf(stderr, "[NM] out of memory\n"); exit(1); }
+            g_state.uid_names = p; g_state.cap_uids = nc;
+        }
+        id = (uint32_t)g_state.n_uids;
+        if (!(g_state.uid_names[id] = strdup(name)) || hmap_put(&g_state.uid_map, name, id) < 0) { fprintf(stderr, "[NM] out of memory\n"); exit(1); }
+        g_state.n_uids++;
+    }
+    pthread_rwlock_unlock(&g_uid_rw);
+    return id;
+}
+
+// Name of uid ("" for UID_NONE); names are never freed, so the pointer stays valid
+static const char *uid_str(uint32_t id) {
+    if (id == UID_NONE) return "";
+    pthread_rwlock_rdlock(&g_uid_rw);
+    const char *s = id < g_state.n_uids ? g_state.uid_names[id] : "";
+    pthread_rwlock_unlock(&g_uid_rw);
+    return s;
+}
+
+// ---- Journal records ----
+// Each successful mutation appends one record while its part's lock is still held, so a snapshot taken
+// under all the read locks covers exactly the records up to nm_journal_last_seq(). Encoding: op byte,
+// then fields in order; strings as u16 length + bytes, ints as 4 host-order bytes.
+enum {
+    J_ADD_USER = 1, J_USER_ACTIVE, J_SET_DIR, J_DEL_DIR, J_RENAME_DIR, J_SET_REPLICAS, J_MODIFIED, J_ACCESSED,
+    J_ACL_OWNER, J_ACL_GRANT, J_ACL_REVOKE, J_ACL_DELETE, J_ACL_RENAME, J_ADD_FOLDER, J_REMOVE_FOLDER, J_MOVE_FOLDER,
+    J_ADD_REQUEST, J_REMOVE_REQUEST, J_CLEAR_REQUESTS, J_TRASH_ADD, J_TRASH_REMOVE
+};
+#define JREC_MAX 4096
+#define JSTR_MAX 1024
+
+typedef struct { unsigned char b[JREC_MAX]; size_t n; int bad; } jrec_t;
+
+static void jr_str(jrec_t *r, const char *s) {
+    size_t l = s ? strlen(s) : 0;
+    if (l >= JSTR_MAX || r->n + 2 + l > sizeof(r->b)) { r->bad = 1; return; }
+    uint16_t l16 = (uint16_t)l;
+    memcpy(r->b + r->n, &l16, 2); memcpy(r->b + r->n + 2, s, l);
+    r->n += 2 + l;
+}
+
+static void jr_int(jrec_t *r, int v) {
+    if (r->n + 4 > sizeof(r->b)) { r->bad = 1; return; }
+    memcpy(r->b + r->n, &v, 4);
+    r->n += 4;
+}
+
+// fmt: one letter per field, 's' = string, 'i' = int
+static void journal_log(int op, const char *fmt, ...) {
+    jrec_t r; r.n = 0; r.bad = 0;
+    r.b[r.n++] = (unsigned char)op;
+    va_list ap; va_start(ap, fmt);
+    for (; *fmt; ++fmt) {
+        if (*fmt == 's') jr_str(&r, va_arg(ap, const char *));
+        else jr_int(&r, va_arg(ap, int));
+    }
+    va_end(ap);
+    if (r.bad) { fprintf(stderr, "[NM] journal: record op %d too large, dropped\n", op); return; }
+    nm_journal_append(r.b, r.n);
+}
+
+static void journal_replicas(const char *file, const int *replicas, size_t n) {
+    jrec_t r; r.n = 0; r.bad = 0;
+    r.b[r.n++] = J_SET_REPLICAS;
+    jr_str(&r, file);
+    jr_int(&r, (int)n);
+    for (size_t i = 0; i < n; ++i) jr_int(&r, replicas[i]);
+    if (!r.bad) nm_journal_append(r.b, r.n);
+}
+
+typedef struct { const unsigned char *p; size_t n, off; int bad; } jdec_t;
+
+static void jd_str(jdec_t *d, char *out) {
+    uint16_t l = 0;
+    if (d->off + 2 > d->n) { d->bad = 1; out[0] = '\0'; return; }
+    memcpy(&l, d->p + d->off, 2);
+    if (l >= JSTR_MAX || d->off + 2 + l > d->n) { d->bad = 1; out[0] = '\0'; return; }
+    memcpy(out, d->p + d->off + 2, l); out[l] = '\0';
+    d->off += 2 + (size_t)l;
+}
+
+static int jd_int(jdec_t *d) {
+    int v = 0;
+    if (d->off + 4 > d->n) { d->bad = 1; return 0; }
+    memcpy(&v, d->p + d->off, 4);
+    d->off += 4;
+    return v;
 }
 
+
 static void ensure_user_cap(size_t need) {
     if (g_state.cap_users >= need) return;
     size_t newcap = g_state.cap_users ? g_state.cap_users * 2 : 8;
     while (newcap < need) newcap *= 2;
-    char **p = (char **)realloc(g_state.users, newcap * sizeof(char *));
+    const char **p = (const char **)realloc(g_state.users, newcap * sizeof(char *));
     if (!p) return; // OOM; silently ignore growth
     g_state.users = p;
     g_state.cap_users = newcap;
@@ -111,7 +272,7 @@ static void ensure_active_cap(size_t need) {
     if (g_state.cap_active >= need) return;
     size_t newcap = g_state.cap_active ? g_state.cap_active * 2 : 8;
     while (newcap < need) newcap *= 2;
-    char **p = (char **)realloc(g_state.active_users, newcap * sizeof(char *));
+    const char **p = (const char **)realloc(g_state.active_users, newcap * sizeof(char *));
     if (!p) return; // OOM ignore
     g_state.active_users = p;
     g_state.cap_active = newcap;
@@ -119,306 +280,352 @@ static void ensure_active_cap(size_t need) {
 
 void nm_state_init(void) {
     memset(&g_state, 0, sizeof(g_state));
-    // Initialize hash maps
-    for (int i = 0; i < HASH_BUCKETS; i++) {
-        g_state.user_map[i] = NULL;
-        g_state.acl_map[i] = NULL;
-        g_state.folder_map[i] = NULL;
-        g_state.req_map[i] = NULL;
-        g_state.trash_map[i] = NULL;
-    }
+    hmap_init(&g_state.user_map);
+    hmap_init(&g_state.acl_map);
+    hmap_init(&g_state.uid_map);
+    g_state.uid_names = (char **)calloc(64, sizeof(char *));
+    g_state.cap_uids = 64; g_state.n_uids = 1; // uid 0 is UID_NONE
+    if (!g_state.uid_names || uid_intern("anonymous") != UID_ANON) { fprintf(stderr, "[NM] out of memory\n"); exit(1); }
+    hmap_init(&g_state.folder_map);
+    hmap_init(&g_state.req_map);
+    hmap_init(&g_state.trash_map);
+    hmap_init(&g_state.dir_map);
+    g_state.tree = (path_node_t *)calloc(1, sizeof(path_node_t));
+    if (g_state.tree) g_state.tree->name = strdup("");
+    if (!g_state.tree || !g_state.tree->name) { fprintf(stderr, "[NM] out of memory\n"); exit(1); }
+}
+
+// Index map helpers: key -> position in the matching g_state array
+static size_t index_map_find(const hmap_t *m, const char *key, int *found) {
+    size_t v = 0;
+    *found = hmap_get(m, key, &v) == 0;
+    return *found ? v : 0;
+}
+
+// Position of file in the directory columns; returns 1 if found
+static int dir_find(const char *file, size_t *i) {
+    int found = 0;
+    *i = index_map_find(&g_state.dir_map, file, &found);
+    return found;
 }
 
-// User hash map helpers
-static void user_map_insert(const char *user, int is_active) {
-    unsigned h = hash_djb2(user);
-    user_hash_node_t *node = (user_hash_node_t *)malloc(sizeof(user_hash_node_t));
-    node->user = strdup(user);
-    node->is_active = is_active;
-    node->next = g_state.user_map[h];
-    g_state.user_map[h] = node;
+// Grow every directory column to hold need entries; returns -1 on OOM (columns keep their old cap)
+static int dir_reserve(size_t need) {
+    dir_cols_t *d = &g_state.dir;
+    if (d->cap >= need) return 0;
+    size_t nc = d->cap ? d->cap * 2 : 8;
+    while (nc < need) nc *= 2;
+#define GROW(col) do { void *p_ = realloc(d->col, nc * sizeof(*d->col)); if (!p_) return -1; d->col = p_; } while (0)
+    GROW(file); GROW(ss_id); GROW(repl); GROW(mod_uid); GROW(acc_uid); GROW(mod_time); GROW(acc_time);
+    GROW(stats); GROW(has_stats);
+#undef GROW
+    d->cap = nc;
+    return 0;
 }
 
-static user_hash_node_t *user_map_find(const char *user) {
-    unsigned h = hash_djb2(user);
-    user_hash_node_t *node = g_state.user_map[h];
-    while (node) {
-        if (strcmp(node->user, user) == 0) return node;
-        node = node->next;
+// Copy entry src over entry dst (swap-remove)
+static void dir_move(size_t dst, size_t src) {
+    dir_cols_t *d = &g_state.dir;
+    d->file[dst] = d->file[src]; d->ss_id[dst] = d->ss_id[src]; d->repl[dst] = d->repl[src];
+    d->mod_uid[dst] = d->mod_uid[src]; d->acc_uid[dst] = d->acc_uid[src];
+    d->mod_time[dst] = d->mod_time[src]; d->acc_time[dst] = d->acc_time[src];
+    d->stats[dst] = d->stats[src]; d->has_stats[dst] = d->has_stats[src];
+}
+
+
+// Per-SS index helpers
+static ss_index_t *ss_index_find(int ss_id, int create) {
+    for (ss_index_t *x = g_state.ss_index; x; x = x->next) if (x->ss_id == ss_id) return x;
+    if (!create) return NULL;
+    ss_index_t *x = (ss_index_t *)calloc(1, sizeof(ss_index_t));
+    if (!x) return NULL;
+    x->ss_id = ss_id;
+    x->next = g_state.ss_index;
+    g_state.ss_index = x;
+    return x;
+}
+
+static void ss_index_add(int ss_id, const char *file, int role) {
+    ss_index_t *x = ss_index_find(ss_id, 1);
+    if (!x) return;
+    size_t roles = 0;
+    hmap_get(&x->files, file, &roles);
+    if (roles & (size_t)role) return;
+    if (hmap_put(&x->files, file, roles | (size_t)role) < 0) return;
+    if (role == NM_ROLE_PRIMARY) x->n_primary++; else x->n_replica++;
+}
+
+static void ss_index_remove(int ss_id, const char *file, int role) {
+    ss_index_t *x = ss_index_find(ss_id, 0);
+    if (!x) return;
+    size_t roles = 0;
+    if (hmap_get(&x->files, file, &roles) != 0 || !(roles & (size_t)role)) return;
+    roles &= ~(size_t)role;
+    if (role == NM_ROLE_PRIMARY) x->n_primary--; else x->n_replica--;
+    if (roles == 0) hmap_del(&x->files, file);
+    else hmap_put(&x->files, file, roles);
+}
+
+// Index every role of dir entry i under a (possibly new) file name, or drop it (add=0)
+static void ss_index_entry(size_t i, const char *file, int add) {
+    const repl_list_t *r = &g_state.dir.repl[i];
+    if (add) ss_index_add(g_state.dir.ss_id[i], file, NM_ROLE_PRIMARY); else ss_index_remove(g_state.dir.ss_id[i], file, NM_ROLE_PRIMARY);
+    for (size_t j = 0; j < r->n; ++j) {
+        if (add) ss_index_add(r->v[j], file, NM_ROLE_REPLICA); else ss_index_remove(r->v[j], file, NM_ROLE_REPLICA);
+    }
+}
+
+// Roles ss_id has for dir entry i (0 if none)
+static size_t entry_roles(size_t i, int ss_id) {
+    const repl_list_t *r = &g_state.dir.repl[i];
+    size_t roles = g_state.dir.ss_id[i] == ss_id ? NM_ROLE_PRIMARY : 0;
+    for (size_t j = 0; j < r->n; ++j) if (r->v[j] == ss_id) roles |= NM_ROLE_REPLICA;
+    return roles;
+}
+
+// Path tree helpers. Empty segments ("a//b", a trailing '/') are skipped.
+static path_node_t *tree_kid(path_node_t *n, const char *seg) {
+    size_t v = 0;
+    return hmap_get(&n->kids, seg, &v) == 0 ? (path_node_t *)(uintptr_t)v : NULL;
+}
+
+// Node for the first len bytes of path ("" is the root); missing nodes are created when create is set
+static path_node_t *tree_walk(const char *path, size_t len, int create) {
+    path_node_t *n = g_state.tree;
+    char seg[256];
+    for (size_t i = 0; n && i < len; ) {
+        size_t j = i;
+        while (j < len && path[j] != '/') j++;
+        size_t sl = j - i < sizeof(seg) ? j - i : sizeof(seg) - 1;
+        memcpy(seg, path + i, sl); seg[sl] = '\0';
+        i = j + 1;
+        if (!sl) continue;
+        path_node_t *k = tree_kid(n, seg);
+        if (!k && create) {
+            k = (path_node_t *)calloc(1, sizeof(*k));
+            if (!k || !(k->name = strdup(seg))) { fprintf(stderr, "[NM] out of memory\n"); exit(1); }
+            k->parent = n;
+            hmap_put(&n->kids, seg, (size_t)(uintptr_t)k);
+        }
+        n = k;
     }
-    return NULL;
+    return n;
 }
 
-// ACL hash map helpers
-static void acl_map_insert(const char *file, size_t index) {
-    unsigned h = hash_djb2(file);
-    acl_hash_node_t *node = (acl_hash_node_t *)malloc(sizeof(acl_hash_node_t));
-    node->file = strdup(file);
-    node->acl_index = index;
-    node->next = g_state.acl_map[h];
-    g_state.acl_map[h] = node;
+static void tree_count_decl(path_node_t *n, long delta) {
+    for (; n; n = n->parent) n->n_decl = (size_t)((long)n->n_decl + delta);
 }
 
-static size_t acl_map_find(const char *file, int *found) {
-    unsigned h = hash_djb2(file);
-    acl_hash_node_t *node = g_state.acl_map[h];
-    while (node) {
-        if (strcmp(node->file, file) == 0) {
-            *found = 1;
-            return node->acl_index;
-        }
-        node = node->next;
+// Free n and its now-empty ancestors (never the root)
+static void tree_prune(path_node_t *n) {
+    while (n && n->parent && !n->is_folder && !hmap_count(&n->kids) && !hmap_count(&n->files)) {
+        path_node_t *up = n->parent;
+        hmap_del(&up->kids, n->name);
+        hmap_free(&n->kids); hmap_free(&n->files); free(n->name); free(n);
+        n = up;
     }
-    *found = 0;
-    return 0;
 }
 
-static void acl_map_remove(const char *file) {
-    unsigned h = hash_djb2(file);
-    acl_hash_node_t *prev = NULL, *node = g_state.acl_map[h];
-    while (node) {
-        if (strcmp(node->file, file) == 0) {
-            if (prev) prev->next = node->next;
-            else g_state.acl_map[h] = node->next;
-            free(node->file);
-            free(node);
-            return;
-        }
-        prev = node;
-        node = node->next;
-    }
+// Split file into its folder node and leaf name
+static path_node_t *tree_file_node(const char *file, int create, const char **leaf) {
+    const char *slash = strrchr(file, '/');
+    *leaf = slash ? slash + 1 : file;
+    return **leaf ? tree_walk(file, slash ? (size_t)(slash - file) : 0, create) : NULL;
 }
 
-static void acl_map_update_index(const char *file, size_t new_index) {
-    unsigned h = hash_djb2(file);
-    acl_hash_node_t *node = g_state.acl_map[h];
-    while (node) {
-        if (strcmp(node->file, file) == 0) {
-            node->acl_index = new_index;
-            return;
-        }
-        node = node->next;
-    }
+static void tree_add_file(const char *file) {
+    const char *leaf;
+    path_node_t *n = tree_file_node(file, 1, &leaf);
+    if (n) hmap_put(&n->files, leaf, 0);
 }
 
-// Folder hash map helpers
-static void folder_map_insert(const char *path, size_t index) {
-    unsigned h = hash_djb2(path);
-    folder_hash_node_t *node = (folder_hash_node_t *)malloc(sizeof(folder_hash_node_t));
-    node->path = strdup(path);
-    node->folder_index = index;
-    node->next = g_state.folder_map[h];
-    g_state.folder_map[h] = node;
+static void tree_del_file(const char *file) {
+    const char *leaf;
+    path_node_t *n = tree_file_node(file, 0, &leaf);
+    if (!n) return;
+    hmap_del(&n->files, leaf);
+    tree_prune(n);
 }
 
-static int folder_map_exists(const char *path) {
-    unsigned h = hash_djb2(path);
-    folder_hash_node_t *node = g_state.folder_map[h];
-    while (node) {
-        if (strcmp(node->path, path) == 0) return 1;
-        node = node->next;
-    }
-    return 0;
+static void tree_add_folder(const char *path) {
+    path_node_t *n = tree_walk(path, strlen(path), 1);
+    if (n && n != g_state.tree && !n->is_folder) { n->is_folder = 1; tree_count_decl(n, 1); }
 }
 
-static void folder_map_remove(const char *path) {
-    unsigned h = hash_djb2(path);
-    folder_hash_node_t *prev = NULL, *node = g_state.folder_map[h];
-    while (node) {
-        if (strcmp(node->path, path) == 0) {
-            if (prev) prev->next = node->next;
-            else g_state.folder_map[h] = node->next;
-            free(node->path);
-            free(node);
-            return;
-        }
-        prev = node;
-        node = node->next;
-    }
+static void tree_del_folder(const char *path) {
+    path_node_t *n = tree_walk(path, strlen(path), 0);
+    if (!n || !n->is_folder) return;
+    n->is_folder = 0;
+    tree_count_decl(n, -1);
+    tree_prune(n);
 }
 
-static void folder_map_update_index(const char *path, size_t new_index) {
-    unsigned h = hash_djb2(path);
-    folder_hash_node_t *node = g_state.folder_map[h];
-    while (node) {
-        if (strcmp(node->path, path) == 0) {
-            node->folder_index = new_index;
-            return;
-        }
-        node = node->next;
+// Move src's children, files and declaration into dst and free src (a folder moved onto an existing one)
+static void tree_merge(path_node_t *dst, path_node_t *src) {
+    size_t cur = 0; const char *key; size_t val;
+    while (hmap_next(&src->files, &cur, &key, &val)) hmap_put(&dst->files, key, 0);
+    cur = 0;
+    while (hmap_next(&src->kids, &cur, &key, &val)) {
+        path_node_t *k = (path_node_t *)(uintptr_t)val, *d = tree_kid(dst, k->name);
+        if (d) tree_merge(d, k);
+        else { k->parent = dst; hmap_put(&dst->kids, k->name, val); }
     }
+    dst->is_folder |= src->is_folder;
+    hmap_free(&src->kids); hmap_free(&src->files); free(src->name); free(src);
 }
 
-// Request hash map helpers
-static void req_map_insert(const char *file, size_t index) {
-    unsigned h = hash_djb2(file);
-    req_hash_node_t *node = (req_hash_node_t *)malloc(sizeof(req_hash_node_t));
-    node->file = strdup(file);
-    node->req_index = index;
-    node->next = g_state.req_map[h];
-    g_state.req_map[h] = node;
-}
-
-static size_t req_map_find(const char *file, int *found) {
-    unsigned h = hash_djb2(file);
-    req_hash_node_t *node = g_state.req_map[h];
-    while (node) {
-        if (strcmp(node->file, file) == 0) {
-            *found = 1;
-            return node->req_index;
-        }
-        node = node->next;
+// Whether merging src into dst would fold two files into one leaf
+static int tree_conflicts(path_node_t *dst, const path_node_t *src) {
+    size_t cur = 0; const char *key; size_t val;
+    while (hmap_next(&src->files, &cur, &key, &val)) if (hmap_get(&dst->files, key, NULL) == 0) return 1;
+    cur = 0;
+    while (hmap_next(&src->kids, &cur, &key, &val)) {
+        path_node_t *d = tree_kid(dst, key);
+        if (d && tree_conflicts(d, (const path_node_t *)(uintptr_t)val)) return 1;
     }
-    *found = 0;
     return 0;
 }
 
-static void req_map_remove(const char *file) {
-    unsigned h = hash_djb2(file);
-    req_hash_node_t *prev = NULL, *node = g_state.req_map[h];
-    while (node) {
-        if (strcmp(node->file, file) == 0) {
-            if (prev) prev->next = node->next;
-            else g_state.req_map[h] = node->next;
-            free(node->file);
-            free(node);
-            return;
-        }
-        prev = node;
-        node = node->next;
-    }
+static size_t tree_recount(path_node_t *n) {
+    size_t c = n->is_folder ? 1 : 0, cur = 0; const char *key; size_t val;
+    while (hmap_next(&n->kids, &cur, &key, &val)) c += tree_recount((path_node_t *)(uintptr_t)val);
+    return n->n_decl = c;
 }
 
-static void req_map_update_index(const char *file, size_t new_index) {
-    unsigned h = hash_djb2(file);
-    req_hash_node_t *node = g_state.req_map[h];
-    while (node) {
-        if (strcmp(node->file, file) == 0) {
-            node->req_index = new_index;
-            return;
-        }
-        node = node->next;
-    }
+// Index the loaded directory and folder list (binary snapshot load)
+static void tree_build(void) {
+    for (size_t i = 0; i < g_state.dir.n; ++i) tree_add_file(g_state.dir.file[i]);
+    for (size_t i = 0; i < g_state.n_folders; ++i) tree_add_folder(g_state.folders[i]);
 }
 
-// Trash hash map helpers
-static void trash_map_insert(const char *file, size_t index) {
-    unsigned h = hash_djb2(file);
-    trash_hash_node_t *node = (trash_hash_node_t *)malloc(sizeof(trash_hash_node_t));
-    node->file = strdup(file);
-    node->trash_index = index;
-    node->next = g_state.trash_map[h];
-    g_state.trash_map[h] = node;
-}
+// Index fills after a binary load. Each job fills its own table, so they run on parallel threads.
+typedef struct { hmap_t *m; const char **keys; size_t *vals; size_t n; pthread_t th; int started; } bulk_fill_t;
 
-static size_t trash_map_find(const char *file, int *found) {
-    unsigned h = hash_djb2(file);
-    trash_hash_node_t *node = g_state.trash_map[h];
-    while (node) {
-        if (strcmp(node->file, file) == 0) {
-            *found = 1;
-            return node->trash_index;
-        }
-        node = node->next;
-    }
-    *found = 0;
-    return 0;
+static void *bulk_fill_run(void *arg) {
+    bulk_fill_t *b = (bulk_fill_t *)arg;
+    hmap_put_many(b->m, b->keys, b->vals, b->n);
+    return NULL;
 }
 
-static void trash_map_remove(const char *file) {
-    unsigned h = hash_djb2(file);
-    trash_hash_node_t *prev = NULL, *node = g_state.trash_map[h];
-    while (node) {
-        if (strcmp(node->file, file) == 0) {
-            if (prev) prev->next = node->next;
-            else g_state.trash_map[h] = node->next;
-            free(node->file);
-            free(node);
-            return;
+// Build the directory, ACL and per-SS indexes over freshly loaded arrays. Returns -1 on OOM.
+static int build_indexes(void) {
+    size_t nj = 2;
+    for (size_t i = 0; i < g_state.dir.n; ++i) {
+        ss_index_find(g_state.dir.ss_id[i], 1);
+        for (size_t j = 0; j < g_state.dir.repl[i].n; ++j) ss_index_find(g_state.dir.repl[i].v[j], 1);
+    }
+    for (ss_index_t *x = g_state.ss_index; x; x = x->next) nj++;
+    bulk_fill_t *jobs = (bulk_fill_t *)calloc(nj, sizeof(*jobs));
+    if (!jobs) return -1;
+    int rc = 0;
+    for (size_t j = 0; j < nj; ++j) {
+        size_t cap = j == 1 ? g_state.n_acls : g_state.dir.n;
+        jobs[j].keys = (const char **)malloc((cap + 1) * sizeof(char *));
+        jobs[j].vals = (size_t *)malloc((cap + 1) * sizeof(size_t));
+        if (!jobs[j].keys || !jobs[j].vals) { rc = -1; goto done; }
+    }
+    jobs[0].m = &g_state.dir_map;
+    for (size_t i = 0; i < g_state.dir.n; ++i) { jobs[0].keys[i] = g_state.dir.file[i]; jobs[0].vals[i] = i; }
+    jobs[0].n = g_state.dir.n;
+    jobs[1].m = &g_state.acl_map;
+    for (size_t i = 0; i < g_state.n_acls; ++i) { jobs[1].keys[i] = g_state.acls[i].file; jobs[1].vals[i] = i; }
+    jobs[1].n = g_state.n_acls;
+    size_t j = 2;
+    for (ss_index_t *x = g_state.ss_index; x; x = x->next, ++j) {
+        bulk_fill_t *b = &jobs[j];
+        b->m = &x->files;
+        for (size_t i = 0; i < g_state.dir.n; ++i) {
+            size_t roles = entry_roles(i, x->ss_id);
+            if (!roles) continue;
+            b->keys[b->n] = g_state.dir.file[i]; b->vals[b->n++] = roles;
+            if (roles & NM_ROLE_PRIMARY) x->n_primary++;
+            if (roles & NM_ROLE_REPLICA) x->n_replica++;
         }
-        prev = node;
-        node = node->next;
     }
-}
-
-static void trash_map_update_index(const char *file, size_t new_index) {
-    unsigned h = hash_djb2(file);
-    trash_hash_node_t *node = g_state.trash_map[h];
-    while (node) {
-        if (strcmp(node->file, file) == 0) {
-            node->trash_index = new_index;
-            return;
-        }
-        node = node->next;
+    for (j = 0; j < nj; ++j) {
+        jobs[j].started = pthread_create(&jobs[j].th, NULL, bulk_fill_run, &jobs[j]) == 0;
+        if (!jobs[j].started) bulk_fill_run(&jobs[j]);
     }
+    for (j = 0; j < nj; ++j) if (jobs[j].started) pthread_join(jobs[j].th, NULL);
+done:
+    for (j = 0; j < nj; ++j) { free(jobs[j].keys); free(jobs[j].vals); }
+    free(jobs);
+    return rc;
 }
 
-
-int nm_state_add_user(const char *user) {
+static int nm_state_add_user_nolock(const char *user) {
     if (!user || !*user) return 0;
     // Check hash map first (O(1))
-    if (user_map_find(user)) return 0;
+    if (hmap_get(&g_state.user_map, user, NULL) == 0) return 0;
     
     // Add to array
     ensure_user_cap(g_state.n_users + 1);
     if (g_state.cap_users < g_state.n_users + 1) return 0; // failed to grow
-    g_state.users[g_state.n_users] = strdup(user);
-    if (!g_state.users[g_state.n_users]) return 0;
+    g_state.users[g_state.n_users] = uid_str(uid_intern(user)); // shares the interned name
     g_state.n_users++;
     
     // Add to hash map
-    user_map_insert(user, 0);
+    hmap_put(&g_state.user_map, user, 0);
     return 1;
 }
 
-size_t nm_state_get_users(char users[][128], size_t max_users) {
-    size_t c = 0;
-    for (size_t i = 0; i < g_state.n_users && c < max_users; ++i) {
-        snprintf(users[c], 128, "%s", g_state.users[i]);
-        c++;
-    }
-    return c;
+int nm_state_add_user(const char *user) {
+    pthread_rwlock_wrlock(&g_users_rw);
+    int r = nm_state_add_user_nolock(user);
+    if (r > 0) journal_log(J_ADD_USER, "s", user);
+    pthread_rwlock_unlock(&g_users_rw);
+    return r;
 }
 
-size_t nm_state_get_active_users(char users[][128], size_t max_users) {
+static size_t nm_state_foreach_user_nolock(nm_user_visit_fn fn, void *arg) {
     size_t c = 0;
-    for (size_t i = 0; i < g_state.n_active && c < max_users; ++i) {
-        snprintf(users[c], 128, "%s", g_state.active_users[i]);
+    for (size_t i = 0; i < g_state.n_users; ++i) {
         c++;
+        size_t active = 0;
+        hmap_get(&g_state.user_map, g_state.users[i], &active);
+        if (fn && fn(g_state.users[i], (int)active, arg)) break;
     }
     return c;
 }
 
-int nm_state_user_is_active(const char *user) {
+size_t nm_state_foreach_user(nm_user_visit_fn fn, void *arg) {
+    pthread_rwlock_rdlock(&g_users_rw);
+    size_t r = nm_state_foreach_user_nolock(fn, arg);
+    pthread_rwlock_unlock(&g_users_rw);
+    return r;
+}
+
+static int nm_state_user_is_active_nolock(const char *user) {
     if (!user || !*user) return 0;
     // O(1) hash map lookup
-    user_hash_node_t *node = user_map_find(user);
-    return node ? node->is_active : 0;
+    size_t is_active = 0;
+    hmap_get(&g_state.user_map, user, &is_active);
+    return (int)is_active;
 }
 
-int nm_state_set_user_active(const char *user, int active) {
+int nm_state_user_is_active(const char *user) {
+    pthread_rwlock_rdlock(&g_users_rw);
+    int r = nm_state_user_is_active_nolock(user);
+    pthread_rwlock_unlock(&g_users_rw);
+    return r;
+}
+
+static int nm_state_set_user_active_nolock(const char *user, int active) {
     if (!user || !*user) return 0;
     // Ensure it's a known user when activating
-    if (active) nm_state_add_user(user);
+    if (active) nm_state_add_user_nolock(user);
     
     // Update hash map (O(1))
-    user_hash_node_t *node = user_map_find(user);
-    if (!node) {
-        if (!active) return 0; // trying to deactivate non-existent user
-        // Add new user node
-        user_map_insert(user, 1);
-        node = user_map_find(user);
-    }
-    
-    if (node->is_active == active) return 0; // no change
-    node->is_active = active;
+    size_t is_active = 0;
+    if (hmap_get(&g_state.user_map, user, &is_active) != 0 && !active) return 0; // trying to deactivate non-existent user
+    if ((int)is_active == active) return 0; // no change
+    hmap_put(&g_state.user_map, user, (size_t)active);
     
     // Look for existing in active list
     for (size_t i = 0; i < g_state.n_active; ++i) {
         if (strcmp(g_state.active_users[i], user) == 0) {
             if (active) return 0; // already active (shouldn't happen with hash map check)
-            // deactivate: remove by swap-with-last
-            free(g_state.active_users[i]);
+            // deactivate: remove by swap-with-last (names are interned, nothing to free)
             if (i + 1 < g_state.n_active) g_state.active_users[i] = g_state.active_users[g_state.n_active - 1];
             g_state.n_active--;
             return 1;
@@ -428,12 +635,19 @@ int nm_state_set_user_active(const char *user, int active) {
     // add to active
     ensure_active_cap(g_state.n_active + 1);
     if (g_state.cap_active < g_state.n_active + 1) return 0;
-    g_state.active_users[g_state.n_active] = strdup(user);
-    if (!g_state.active_users[g_state.n_active]) return 0;
+    g_state.active_users[g_state.n_active] = uid_str(uid_intern(user));
     g_state.n_active++;
     return 1;
 }
 
+int nm_state_set_user_active(const char *user, int active) {
+    pthread_rwlock_wrlock(&g_users_rw);
+    int r = nm_state_set_user_active_nolock(user, active);
+    if (r > 0) journal_log(J_USER_ACTIVE, "si", user, active);
+    pthread_rwlock_unlock(&g_users_rw);
+    return r;
+}
+
 static int write_atomic(const char *path, const char *data, size_t len) {
     char tmppath[512];
     snprintf(tmppath, sizeof(tmppath), "%s.tmp.%d", path, (int)getpid());
@@ -449,171 +663,302 @@ static int write_atomic(const char *path, const char *data, size_t len) {
     return 0;
 }
 
-int nm_state_save(const char *path) {
-    // Compose JSON: users, directory, acls, replicas, requests, folders, trash
-    size_t bufcap = 16384 + (g_state.n_users + g_state.n_active) * 64 + g_state.n_dir * 160 + g_state.n_acls * 320 + g_state.n_folders * 64 + g_state.n_trash * 256;
-    char *buf = (char *)malloc(bufcap);
-    if (!buf) return -1;
-    buf[0] = '\0';
-    strcat(buf, "{\n  \"users\":[");
-    for (size_t i = 0; i < g_state.n_users; ++i) {
-        if (i) strcat(buf, ",");
-        strcat(buf, "\"");
-        // escape quotes/backslashes minimally (usernames are simple in spec)
-        const char *s = g_state.users[i];
-        for (; *s; ++s) {
-            if (*s == '"' || *s == '\\') {
-                strncat(buf, "\\", bufcap - strlen(buf) - 1);
-            }
-            char ch[2] = {*s, 0};
-            strncat(buf, ch, bufcap - strlen(buf) - 1);
-        }
-        strcat(buf, "\"");
-    }
-    strcat(buf, "],\n  \"active\":[");
-    for (size_t i = 0; i < g_state.n_active; ++i) {
-        if (i) strcat(buf, ",");
-        strcat(buf, "\"");
-        const char *s = g_state.active_users[i];
-        for (; *s; ++s) { if (*s == '"' || *s == '\\') strncat(buf, "\\", bufcap - strlen(buf) - 1); char ch[2] = {*s,0}; strncat(buf, ch, bufcap - strlen(buf) - 1); }
-        strcat(buf, "\"");
-    }
-    strcat(buf, "],\n  \"directory\":{");
-    for (size_t i = 0; i < g_state.n_dir; ++i) {
-        if (i) strcat(buf, ",");
-        strcat(buf, "\"");
-        const char *s = g_state.dir[i].file;
-        for (; *s; ++s) {
-            if (*s == '"' || *s == '\\') strncat(buf, "\\", bufcap - strlen(buf) - 1);
-            char ch[2] = {*s, 0};
-            strncat(buf, ch, bufcap - strlen(buf) - 1);
-        }
-        strcat(buf, "\":{\"ss_id\":");
-        char num[32]; snprintf(num, sizeof(num), "%d", g_state.dir[i].ss_id);
-        strncat(buf, num, bufcap - strlen(buf) - 1);
-        // Add metadata fields
-        strcat(buf, ",\"last_modified_user\":");
-        if (g_state.dir[i].last_modified_user && *g_state.dir[i].last_modified_user) {
-            strcat(buf, "\"");
-            s = g_state.dir[i].last_modified_user;
-            for (; *s; ++s) {
-                if (*s == '"' || *s == '\\') strncat(buf, "\\", bufcap - strlen(buf) - 1);
-                char ch[2] = {*s, 0};
-                strncat(buf, ch, bufcap - strlen(buf) - 1);
-            }
-            strcat(buf, "\"");
-        } else {
-            strcat(buf, "null");
+// ---- Snapshot writers ----
+// Growable output buffer; oom is sticky, so builders check it once at the end
+typedef struct { char *b; size_t n, cap; int oom; } sbuf_t;
+
+static void sb_put(sbuf_t *sb, const void *p, size_t len) {
+    if (sb->oom) return;
+    if (sb->n + len + 1 > sb->cap) {
+        size_t nc = sb->cap ? sb->cap * 2 : 65536;
+        while (nc < sb->n + len + 1) nc *= 2;
+        char *q = (char *)realloc(sb->b, nc);
+        if (!q) { sb->oom = 1; return; }
+        sb->b = q; sb->cap = nc;
+    }
+    memcpy(sb->b + sb->n, p, len);
+    sb->n += len;
+    sb->b[sb->n] = '\0';
+}
+
+static void sb_puts(sbuf_t *sb, const char *s) { sb_put(sb, s, strlen(s)); }
+
+static void sb_int(sbuf_t *sb, long long v) {
+    char num[32];
+    int l = snprintf(num, sizeof(num), "%lld", v);
+    sb_put(sb, num, (size_t)l);
+}
+
+// Quoted JSON string; escapes quotes and backslashes only (names are simple in spec)
+static void sb_jstr(sbuf_t *sb, const char *s) {
+    sb_put(sb, "\"", 1);
+    const char *run = s;
+    for (; s && *s; ++s) {
+        if (*s == '"' || *s == '\\') { sb_put(sb, run, (size_t)(s - run)); sb_put(sb, "\\", 1); run = s; }
+    }
+    if (run) sb_put(sb, run, (size_t)(s - run));
+    sb_put(sb, "\"", 1);
+}
+
+// JSON export: journal position, users, directory, acls, replicas, requests, folders, trash.
+// Same layout the loader has always read, so an export can seed a fresh NM.
+static void build_json(sbuf_t *sb, unsigned long long journal_seq) {
+    sb_puts(sb, "{\n  \"journalSeq\":"); sb_int(sb, (long long)journal_seq);
+    sb_puts(sb, ",\n  \"users\":[");
+    for (size_t i = 0; i < g_state.n_users; ++i) { if (i) sb_puts(sb, ","); sb_jstr(sb, g_state.users[i]); }
+    sb_puts(sb, "],\n  \"active\":[");
+    for (size_t i = 0; i < g_state.n_active; ++i) { if (i) sb_puts(sb, ","); sb_jstr(sb, g_state.active_users[i]); }
+    sb_puts(sb, "],\n  \"directory\":{");
+    for (size_t i = 0; i < g_state.dir.n; ++i) {
+        const dir_cols_t *d = &g_state.dir;
+        if (i) sb_puts(sb, ",");
+        sb_jstr(sb, d->file[i]);
+        sb_puts(sb, ":{\"ss_id\":"); sb_int(sb, d->ss_id[i]);
+        sb_puts(sb, ",\"last_modified_user\":");
+        if (d->mod_uid[i]) sb_jstr(sb, uid_str(d->mod_uid[i])); else sb_puts(sb, "null");
+        sb_puts(sb, ",\"last_modified_time\":"); sb_int(sb, d->mod_time[i]);
+        sb_puts(sb, ",\"last_accessed_user\":");
+        if (d->acc_uid[i]) sb_jstr(sb, uid_str(d->acc_uid[i])); else sb_puts(sb, "null");
+        sb_puts(sb, ",\"last_accessed_time\":"); sb_int(sb, d->acc_time[i]);
+        sb_puts(sb, "}");
+    }
+    sb_puts(sb, "},\n  \"acls\":{");
+    for (size_t i = 0; i < g_state.n_acls; ++i) {
+        const struct acl_entry *e = &g_state.acls[i];
+        if (i) sb_puts(sb, ",");
+        sb_jstr(sb, e->file);
+        sb_puts(sb, ":{\"owner\":"); sb_jstr(sb, uid_str(e->owner));
+        sb_puts(sb, ",\"grants\":{");
+        for (size_t j = 0; j < e->n_grants; ++j) {
+            int p = e->grants[j].perm;
+            if (j) sb_puts(sb, ",");
+            sb_jstr(sb, uid_str(e->grants[j].uid));
+            sb_puts(sb, ":"); sb_jstr(sb, p == 3 ? "RW" : (p == 2 ? "W" : "R"));
         }
-        strcat(buf, ",\"last_modified_time\":");
-        snprintf(num, sizeof(num), "%d", g_state.dir[i].last_modified_time);
-        strncat(buf, num, bufcap - strlen(buf) - 1);
-        strcat(buf, ",\"last_accessed_user\":");
-        if (g_state.dir[i].last_accessed_user && *g_state.dir[i].last_accessed_user) {
-            strcat(buf, "\"");
-            s = g_state.dir[i].last_accessed_user;
-            for (; *s; ++s) {
-                if (*s == '"' || *s == '\\') strncat(buf, "\\", bufcap - strlen(buf) - 1);
-                char ch[2] = {*s, 0};
-                strncat(buf, ch, bufcap - strlen(buf) - 1);
-            }
-            strcat(buf, "\"");
-        } else {
-            strcat(buf, "null");
+        sb_puts(sb, "}}");
+    }
+    sb_puts(sb, "},\n  \"replicas\":{");
+    for (size_t i = 0; i < g_state.dir.n; ++i) {
+        if (i) sb_puts(sb, ",");
+        sb_jstr(sb, g_state.dir.file[i]);
+        sb_puts(sb, ":[");
+        for (size_t j = 0; j < g_state.dir.repl[i].n; ++j) { if (j) sb_puts(sb, ","); sb_int(sb, g_state.dir.repl[i].v[j]); }
+        sb_puts(sb, "]");
+    }
+    sb_puts(sb, "},\n  \"requests\":{");
+    for (size_t i = 0; i < g_state.n_requests; ++i) {
+        const struct req_entry *e = &g_state.requests[i];
+        if (i) sb_puts(sb, ",");
+        sb_jstr(sb, e->file);
+        sb_puts(sb, ":[");
+        for (size_t j = 0; j < e->n_users; ++j) {
+            char md[2] = { e->modes ? e->modes[j] : 'R', 0 };
+            if (j) sb_puts(sb, ",");
+            sb_puts(sb, "{\"user\":"); sb_jstr(sb, uid_str(e->uids[j]));
+            sb_puts(sb, ",\"mode\":"); sb_jstr(sb, md);
+            sb_puts(sb, "}");
         }
-        strcat(buf, ",\"last_accessed_time\":");
-        snprintf(num, sizeof(num), "%d", g_state.dir[i].last_accessed_time);
-        strncat(buf, num, bufcap - strlen(buf) - 1);
-        strcat(buf, "}");
-    }
-    strcat(buf, "},\n  \"acls\":{");
+        sb_puts(sb, "]");
+    }
+    sb_puts(sb, "},\n  \"folders\":[");
+    for (size_t i = 0; i < g_state.n_folders; ++i) { if (i) sb_puts(sb, ","); sb_jstr(sb, g_state.folders[i]); }
+    sb_puts(sb, "],\n  \"trash\":[");
+    for (size_t i = 0; i < g_state.n_trash; ++i) {
+        const struct trash_entry *e = &g_state.trash[i];
+        if (i) sb_puts(sb, ",");
+        sb_puts(sb, "{\"file\":"); sb_jstr(sb, e->file);
+        sb_puts(sb, ",\"trashed\":"); sb_jstr(sb, e->trashed);
+        sb_puts(sb, ",\"owner\":"); sb_jstr(sb, uid_str(e->owner));
+        sb_puts(sb, ",\"ssid\":"); sb_int(sb, e->ssid);
+        sb_puts(sb, ",\"when\":"); sb_int(sb, e->when);
+        sb_puts(sb, "}");
+    }
+    sb_puts(sb, "]\n}\n");
+}
+
+// Binary snapshot layout (host byte order; the file never leaves this machine):
+//   header | strings | users | active | dir | replicas | acls | grants | folders | requests | request users | trash
+// Each section starts 8-byte aligned and is an array of fixed-width records. Strings are u32 offsets into
+// the string section (NUL-terminated, deduplicated; offset 0 is the empty string and means "none"), and
+// records name their sub-lists as an index range into a shared section, so nothing in the file is a
+// pointer and the loader can use it in place.
+#define SNAP_MAGIC "NMSNAP\0\0"
+#define SNAP_VERSION 1
+enum { SEC_STR, SEC_USERS, SEC_ACTIVE, SEC_DIR, SEC_REPL, SEC_ACL, SEC_GRANT, SEC_FOLDER, SEC_REQ, SEC_REQ_USER, SEC_TRASH, SEC_COUNT };
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_sections;
+    uint64_t journal_seq; // last journal record the snapshot covers
+    uint64_t file_size;
+    struct { uint64_t off, count; } sec[SEC_COUNT];
+} snap_hdr_t;
+
+typedef struct { uint32_t file; int32_t ss_id; uint32_t repl, n_repl, mod_user; int32_t mod_time; uint32_t acc_user; int32_t acc_time; } snap_dir_t;
+typedef struct { uint32_t file, owner, grant, n_grants; } snap_acl_t;
+typedef struct { uint32_t user; int32_t perm; } snap_grant_t;
+typedef struct { uint32_t file, user, n_users, pad; } snap_req_t;
+typedef struct { uint32_t user; int32_t mode; } snap_req_user_t;
+typedef struct { uint32_t file, trashed, owner; int32_t ssid, when; uint32_t pad; } snap_trash_t;
+
+static const size_t k_snap_rec[SEC_COUNT] = {
+    1, sizeof(uint32_t), sizeof(uint32_t), sizeof(snap_dir_t), sizeof(int32_t), sizeof(snap_acl_t),
+    sizeof(snap_grant_t), sizeof(uint32_t), sizeof(snap_req_t), sizeof(snap_req_user_t), sizeof(snap_trash_t)
+};
+
+typedef struct { sbuf_t tab; hmap_t seen; } strtab_t;
+
+static uint32_t st_ref(strtab_t *st, const char *s) {
+    if (!s || !*s) return 0;
+    size_t off = 0, len = strlen(s);
+    if (hmap_get(&st->seen, s, &off) == 0) return (uint32_t)off;
+    off = st->tab.n;
+    if (off + len + 1 > UINT32_MAX) { st->tab.oom = 1; return 0; } // offsets are u32: 4 GiB of names
+    sb_put(&st->tab, s, len + 1);
+    hmap_put(&st->seen, s, off);
+    return (uint32_t)off;
+}
+
+static int build_snapshot_bin(sbuf_t *out, unsigned long long journal_seq) {
+    size_t n_repl = 0, n_grant = 0, n_ruser = 0;
+    for (size_t i = 0; i < g_state.dir.n; ++i) n_repl += g_state.dir.repl[i].n;
+    for (size_t i = 0; i < g_state.n_acls; ++i) n_grant += g_state.acls[i].n_grants;
+    for (size_t i = 0; i < g_state.n_requests; ++i) n_ruser += g_state.requests[i].n_users;
+    size_t count[SEC_COUNT] = { 0, g_state.n_users, g_state.n_active, g_state.dir.n, n_repl, g_state.n_acls, n_grant,
+                                g_state.n_folders, g_state.n_requests, n_ruser, g_state.n_trash };
+    void *sec[SEC_COUNT] = { 0 };
+    strtab_t st;
+    memset(&st, 0, sizeof(st));
+    sb_put(&st.tab, "", 1);
+    int rc = -1;
+    for (int s = 1; s < SEC_COUNT; ++s) {
+        if (count[s] && !(sec[s] = calloc(count[s], k_snap_rec[s]))) goto done;
+    }
+
+    uint32_t *users = (uint32_t *)sec[SEC_USERS], *active = (uint32_t *)sec[SEC_ACTIVE], *folders = (uint32_t *)sec[SEC_FOLDER];
+    for (size_t i = 0; i < g_state.n_users; ++i) users[i] = st_ref(&st, g_state.users[i]);
+    for (size_t i = 0; i < g_state.n_active; ++i) active[i] = st_ref(&st, g_state.active_users[i]);
+    for (size_t i = 0; i < g_state.n_folders; ++i) folders[i] = st_ref(&st, g_state.folders[i]);
+    int32_t *repl = (int32_t *)sec[SEC_REPL];
+    size_t r = 0;
+    for (size_t i = 0; i < g_state.dir.n; ++i) {
+        const dir_cols_t *e = &g_state.dir;
+        snap_dir_t *d = (snap_dir_t *)sec[SEC_DIR] + i;
+        d->file = st_ref(&st, e->file[i]);
+        d->ss_id = e->ss_id[i];
+        d->repl = (uint32_t)r; d->n_repl = e->repl[i].n;
+        for (size_t j = 0; j < e->repl[i].n; ++j) repl[r++] = e->repl[i].v[j];
+        d->mod_user = st_ref(&st, uid_str(e->mod_uid[i])); d->mod_time = e->mod_time[i];
+        d->acc_user = st_ref(&st, uid_str(e->acc_uid[i])); d->acc_time = e->acc_time[i];
+    }
+    r = 0;
     for (size_t i = 0; i < g_state.n_acls; ++i) {
-        if (i) strcat(buf, ",");
-        // key = filename
-        strcat(buf, "\"");
-        const char *s = g_state.acls[i].file;
-        for (; s && *s; ++s) { if (*s == '"' || *s == '\\') strncat(buf, "\\", bufcap - strlen(buf) - 1); char ch[2] = {*s,0}; strncat(buf, ch, bufcap - strlen(buf) - 1);}        
-        strcat(buf, "\":{");
-        // owner
-        strcat(buf, "\"owner\":\"");
-        s = g_state.acls[i].owner ? g_state.acls[i].owner : "";
-        for (; s && *s; ++s) { if (*s == '"' || *s == '\\') strncat(buf, "\\", bufcap - strlen(buf) - 1); char ch[2] = {*s,0}; strncat(buf, ch, bufcap - strlen(buf) - 1);}        
-        strcat(buf, "\",\"grants\":{");
-        for (size_t j = 0; j < g_state.acls[i].n_grants; ++j) {
-            if (j) strcat(buf, ",");
-            strcat(buf, "\"");
-            const char *u = g_state.acls[i].grants[j].user;
-            for (; u && *u; ++u) { if (*u == '"' || *u == '\\') strncat(buf, "\\", bufcap - strlen(buf) - 1); char ch[2] = {*u,0}; strncat(buf, ch, bufcap - strlen(buf) - 1);}            
-            strcat(buf, "\":\"");
-            int p = g_state.acls[i].grants[j].perm; const char *pv = (p==3?"RW":(p==2?"W":"R"));
-            strncat(buf, pv, bufcap - strlen(buf) - 1);
-            strcat(buf, "\"");
-        }
-        strcat(buf, "}}");
-    }
-    strcat(buf, "},\n  \"replicas\":{");
-    for (size_t i = 0; i < g_state.n_dir; ++i) {
-        if (i) strcat(buf, ",");
-        strcat(buf, "\"");
-        const char *s = g_state.dir[i].file;
-        for (; s && *s; ++s) { if (*s == '"' || *s == '\\') strncat(buf, "\\", bufcap - strlen(buf) - 1); char ch[2] = {*s,0}; strncat(buf, ch, bufcap - strlen(buf) - 1);}        
-        strcat(buf, "\":[");
-        for (size_t j=0;j<g_state.dir[i].n_repl;j++) {
-            if (j) strcat(buf, ",");
-            char num[32]; snprintf(num, sizeof(num), "%d", g_state.dir[i].replicas[j]);
-            strncat(buf, num, bufcap - strlen(buf) - 1);
+        const struct acl_entry *e = &g_state.acls[i];
+        snap_acl_t *a = (snap_acl_t *)sec[SEC_ACL] + i;
+        a->file = st_ref(&st, e->file); a->owner = st_ref(&st, uid_str(e->owner));
+        a->grant = (uint32_t)r; a->n_grants = (uint32_t)e->n_grants;
+        for (size_t j = 0; j < e->n_grants; ++j, ++r) {
+            snap_grant_t *g = (snap_grant_t *)sec[SEC_GRANT] + r;
+            g->user = st_ref(&st, uid_str(e->grants[j].uid)); g->perm = e->grants[j].perm;
         }
-        strcat(buf, "]");
-    }
-    strcat(buf, "},\n  \"requests\":{");
-    for (size_t i=0;i<g_state.n_requests;i++) {
-        if (i) strcat(buf, ",");
-        strcat(buf, "\"");
-        const char *s = g_state.requests[i].file;
-        for (; s && *s; ++s) { if (*s == '"' || *s == '\\') strncat(buf, "\\", bufcap - strlen(buf) - 1); char ch[2] = {*s,0}; strncat(buf, ch, bufcap - strlen(buf) - 1);}        
-        strcat(buf, "\":[");
-        for (size_t j=0;j<g_state.requests[i].n_users;j++) {
-            if (j) strcat(buf, ",");
-            // New format: object with user and mode
-            strcat(buf, "{\"user\":\"");
-            const char *u = g_state.requests[i].users[j];
-            for (; u && *u; ++u) { if (*u == '"' || *u == '\\') strncat(buf, "\\", bufcap - strlen(buf) - 1); char ch[2] = {*u,0}; strncat(buf, ch, bufcap - strlen(buf) - 1);}            
-            strcat(buf, "\",\"mode\":\"");
-            char md[2] = { g_state.requests[i].modes ? g_state.requests[i].modes[j] : 'R', 0 };
-            strncat(buf, md, bufcap - strlen(buf) - 1);
-            strcat(buf, "\"}");
+    }
+    r = 0;
+    for (size_t i = 0; i < g_state.n_requests; ++i) {
+        const struct req_entry *e = &g_state.requests[i];
+        snap_req_t *q = (snap_req_t *)sec[SEC_REQ] + i;
+        q->file = st_ref(&st, e->file);
+        q->user = (uint32_t)r; q->n_users = (uint32_t)e->n_users;
+        for (size_t j = 0; j < e->n_users; ++j, ++r) {
+            snap_req_user_t *u = (snap_req_user_t *)sec[SEC_REQ_USER] + r;
+            u->user = st_ref(&st, uid_str(e->uids[j])); u->mode = e->modes ? e->modes[j] : 'R';
         }
-        strcat(buf, "]");
     }
-    strcat(buf, "},\n  \"folders\":[");
-    for (size_t i = 0; i < g_state.n_folders; ++i) {
-        if (i) strcat(buf, ",");
-        strcat(buf, "\"");
-        const char *s = g_state.folders[i];
-        for (; s && *s; ++s) { if (*s == '"' || *s == '\\') strncat(buf, "\\", bufcap - strlen(buf) - 1); char ch[2] = {*s,0}; strncat(buf, ch, bufcap - strlen(buf) - 1);}        
-        strcat(buf, "\"");
-    }
-    strcat(buf, "],\n  \"trash\":[");
-    for (size_t i=0;i<g_state.n_trash;i++) {
-        if (i) strcat(buf, ",");
-        strcat(buf, "{\"file\":\"");
-        const char *s = g_state.trash[i].file; for (; s && *s; ++s) { if (*s=='"' || *s=='\\') strncat(buf, "\\", bufcap - strlen(buf) - 1); char ch[2] = {*s,0}; strncat(buf, ch, bufcap - strlen(buf) - 1);}        
-        strcat(buf, "\",\"trashed\":\"");
-        s = g_state.trash[i].trashed; for (; s && *s; ++s) { if (*s=='"' || *s=='\\') strncat(buf, "\\", bufcap - strlen(buf) - 1); char ch[2] = {*s,0}; strncat(buf, ch, bufcap - strlen(buf) - 1);}        
-        strcat(buf, "\",\"owner\":\"");
-        s = g_state.trash[i].owner; for (; s && *s; ++s) { if (*s=='"' || *s=='\\') strncat(buf, "\\", bufcap - strlen(buf) - 1); char ch[2] = {*s,0}; strncat(buf, ch, bufcap - strlen(buf) - 1);}        
-        strcat(buf, "\",\"ssid\":");
-        char num[64]; snprintf(num, sizeof(num), "%d", g_state.trash[i].ssid); strncat(buf, num, bufcap - strlen(buf) - 1);
-        strcat(buf, ",\"when\":"); snprintf(num, sizeof(num), "%d", g_state.trash[i].when); strncat(buf, num, bufcap - strlen(buf) - 1);
-        strcat(buf, "}");
-    }
-    strcat(buf, "]\n}\n");
-
-    int rc = write_atomic(path, buf, strlen(buf));
-    free(buf);
+    for (size_t i = 0; i < g_state.n_trash; ++i) {
+        const struct trash_entry *e = &g_state.trash[i];
+        snap_trash_t *t = (snap_trash_t *)sec[SEC_TRASH] + i;
+        t->file = st_ref(&st, e->file); t->trashed = st_ref(&st, e->trashed); t->owner = st_ref(&st, uid_str(e->owner));
+        t->ssid = e->ssid; t->when = e->when;
+    }
+    if (st.tab.oom) goto done;
+    sec[SEC_STR] = st.tab.b; count[SEC_STR] = st.tab.n;
+
+    snap_hdr_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAP_MAGIC, sizeof(h.magic));
+    h.version = SNAP_VERSION; h.n_sections = SEC_COUNT; h.journal_seq = journal_seq;
+    static const char zeros[8] = { 0 };
+    size_t off = (sizeof(h) + 7) & ~(size_t)7;
+    for (int s = 0; s < SEC_COUNT; ++s) {
+        h.sec[s].off = off; h.sec[s].count = count[s];
+        off += (count[s] * k_snap_rec[s] + 7) & ~(size_t)7;
+    }
+    h.file_size = off;
+    sb_put(out, &h, sizeof(h));
+    for (int s = 0; s < SEC_COUNT; ++s) {
+        sb_put(out, zeros, (size_t)h.sec[s].off - out->n);
+        if (count[s]) sb_put(out, sec[s], count[s] * k_snap_rec[s]);
+    }
+    sb_put(out, zeros, off - out->n);
+    rc = out->oom ? -1 : 0;
+done:
+    for (int s = 1; s < SEC_COUNT; ++s) free(sec[s]);
+    free(st.tab.b);
+    hmap_free(&st.seen);
     return rc;
 }
 
+// Snapshot path once the journal is open; empty before nm_state_load finishes
+static char g_snap_path[512];
+// Last journal record reflected in g_state when it was loaded (what an export reports without a journal)
+static unsigned long long g_loaded_seq = 0;
+
+// All read locks in the documented order: nothing can mutate (or append to the journal) while held
+static void lock_all_read(void) {
+    pthread_rwlock_rdlock(&g_users_rw); pthread_rwlock_rdlock(&g_dir_rw); pthread_mutex_lock(&g_meta_mu);
+    pthread_rwlock_rdlock(&g_acl_rw); pthread_rwlock_rdlock(&g_req_rw); pthread_rwlock_rdlock(&g_trash_rw);
+}
+
+static void unlock_all_read(void) {
+    pthread_rwlock_unlock(&g_trash_rw); pthread_rwlock_unlock(&g_req_rw); pthread_rwlock_unlock(&g_acl_rw);
+    pthread_mutex_unlock(&g_meta_mu); pthread_rwlock_unlock(&g_dir_rw); pthread_rwlock_unlock(&g_users_rw);
+}
+
+int nm_state_snapshot(const char *path) {
+    pthread_mutex_lock(&g_save_mu);
+    lock_all_read();
+    // No mutation can append while we hold every part, so the snapshot covers exactly the records up to seq
+    unsigned long long seq = nm_journal_last_seq();
+    nm_journal_rotate();
+    sbuf_t sb = { 0 };
+    int r = build_snapshot_bin(&sb, seq);
+    unlock_all_read();
+    // Only serializing needs the locks; mutations resume while the image goes to disk
+    if (r == 0) r = write_atomic(path, sb.b, sb.n);
+    free(sb.b);
+    if (r == 0) nm_journal_drop_old();
+    pthread_mutex_unlock(&g_save_mu);
+    return r;
+}
+
+int nm_state_export_json(const char *path) {
+    lock_all_read();
+    unsigned long long seq = nm_journal_last_seq();
+    if (seq < g_loaded_seq) seq = g_loaded_seq;
+    sbuf_t sb = { 0 };
+    build_json(&sb, seq);
+    unlock_all_read();
+    int r = sb.oom ? -1 : write_atomic(path, sb.b, sb.n);
+    free(sb.b);
+    return r;
+}
+
+int nm_state_save(const char *path) {
+    // Mutations were journaled as they happened; saving only waits for the group commit that carries them
+    if (!g_snap_path[0]) return nm_state_snapshot(path);
+    return nm_journal_sync();
+}
+
 static void parse_users_array(const char *json) {
     const char *p = strstr(json, "\"users\"");
     if (!p) return;
@@ -785,20 +1130,21 @@ static void parse_folders_array(const char *json);
 static void parse_replicas_object(const char *json);
 static void parse_requests_object(const char *json);
 
-int nm_state_load(const char *path) {
+// Parse a JSON snapshot into g_state; *journal_seq is the last journal record it covers (0 for
+// files written before the journal existed). Returns -1 if there is no readable snapshot.
+static int load_snapshot_json(const char *path, unsigned long long *journal_seq) {
+    *journal_seq = 0;
     FILE *f = fopen(path, "rb");
-    if (!f) {
-        // First run: create a skeleton file
-        (void)nm_state_save(path);
-        return 0;
-    }
+    if (!f) return -1;
     fseek(f, 0, SEEK_END); long sz = ftell(f); fseek(f, 0, SEEK_SET);
-    if (sz < 0 || sz > 10 * 1024 * 1024) { fclose(f); return -1; }
+    if (sz < 0) { fclose(f); return -1; }
     char *buf = (char *)malloc((size_t)sz + 1);
     if (!buf) { fclose(f); return -1; }
     size_t n = fread(buf, 1, (size_t)sz, f);
     fclose(f);
     buf[n] = '\0';
+    const char *js = strstr(buf, "\"journalSeq\"");
+    if (js && (js = strchr(js, ':')) != NULL) *journal_seq = strtoull(js + 1, NULL, 10);
     parse_users_array(buf);
     parse_active_array(buf);
     parse_directory_object(buf);
@@ -824,7 +1170,8 @@ int nm_state_load(const char *path) {
                 char owner[128] = {0};
                 // find owner
                 const char *ow = strstr(obj, "\"owner\"");
-                if (ow) { const char *q=strchr(ow, '"'); if(q){ q++; const char *qe=strchr(q,'"'); if(qe){ size_t ol=(size_t)(qe-q); if(ol>=sizeof(owner)) ol=sizeof(owner)-1; size_t k=0; const char *t=q; while(k<ol && *t){ if(*t=='\\'&&t[1]){t++; owner[k++]=*t++;} else owner[k++]=*t++; } owner[k]='\0'; }} }
+                if (ow) { const char *q=strchr(ow + 7, '"'); if(q){ q++; const char *qe=strchr(q,'"'); if(qe){ size_t ol=(size_t)(qe-q); if(ol>=sizeof(owner)) ol=sizeof(owner)-1; size_t k=0; const char *t=q; while(k<ol && *t){ if(*t=='\\'&&t[1]){t++; owner[k++]=*t++;} else owner[k++]=*t++; } owner[k]='\0'; }} }
+                nm_acl_set_owner(file, owner[0]?owner:NULL);
                 // find grants object
                 const char *gr = strstr(obj, "\"grants\"");
                 if (gr) {
@@ -844,17 +1191,15 @@ int nm_state_load(const char *path) {
                                 go++;
                                 const char *pe= strchr(go,'"'); if(pe){ char pv[4]={0}; size_t pl=(size_t)(pe-go); if(pl>3) pl=3; memcpy(pv,go,pl);
                                 int perm = (pv[0]=='R' && pv[1]=='W')?3:(pv[0]=='W'?2:1);
-                                nm_acl_set_owner(file, owner[0]?owner:NULL);
                                 if (u[0]) nm_acl_grant(file, u, perm);
                                 go = pe+1;
                             }}
                             while(*go && *go!=',' && *go!='}') go++;
                             if (*go==',') go++;
                         }
+                        // step past the grants object so the scan below finds this entry's own '}'
+                        if (*go=='}') obj = go + 1;
                     }
-                } else {
-                    // No grants; still set owner
-                    nm_acl_set_owner(file, owner[0]?owner:NULL);
                 }
                 // move obj to end of this acl entry
                 while (*obj && *obj!='}') obj++;
@@ -924,6 +1269,253 @@ int nm_state_load(const char *path) {
     return 0;
 }
 
+// Re-apply one journal record through the public API (the journal is not open yet, so nothing is re-logged)
+static void journal_apply(const unsigned char *rec, size_t len) {
+    jdec_t d = { rec, len, 1, 0 };
+    if (len < 1) return;
+    int op = rec[0];
+    char a[JSTR_MAX], b[JSTR_MAX], c[JSTR_MAX];
+    int x = 0, y = 0;
+    switch (op) {
+    case J_ADD_USER: jd_str(&d, a); if (!d.bad) nm_state_add_user(a); break;
+    case J_USER_ACTIVE: jd_str(&d, a); x = jd_int(&d); if (!d.bad) nm_state_set_user_active(a, x); break;
+    case J_SET_DIR: jd_str(&d, a); x = jd_int(&d); if (!d.bad) nm_state_set_dir(a, x); break;
+    case J_DEL_DIR: jd_str(&d, a); if (!d.bad) nm_state_del_dir(a); break;
+    case J_RENAME_DIR: jd_str(&d, a); jd_str(&d, b); if (!d.bad) nm_state_rename_dir(a, b); break;
+    case J_SET_REPLICAS: {
+        int reps[64]; size_t n = 0;
+        jd_str(&d, a); x = jd_int(&d);
+        for (int i = 0; i < x && !d.bad; ++i) { int v = jd_int(&d); if (n < 64) reps[n++] = v; }
+        if (!d.bad) nm_state_set_replicas(a, reps, n);
+        break;
+    }
+    case J_MODIFIED: jd_str(&d, a); jd_str(&d, b); x = jd_int(&d); if (!d.bad) nm_state_set_file_modified(a, b, x); break;
+    case J_ACCESSED: jd_str(&d, a); jd_str(&d, b); x = jd_int(&d); if (!d.bad) nm_state_set_file_accessed(a, b, x); break;
+    case J_ACL_OWNER: jd_str(&d, a); jd_str(&d, b); if (!d.bad) nm_acl_set_owner(a, b[0] ? b : NULL); break;
+    case J_ACL_GRANT: jd_str(&d, a); jd_str(&d, b); x = jd_int(&d); if (!d.bad) nm_acl_grant(a, b, x); break;
+    case J_ACL_REVOKE: jd_str(&d, a); jd_str(&d, b); if (!d.bad) nm_acl_revoke(a, b); break;
+    case J_ACL_DELETE: jd_str(&d, a); if (!d.bad) nm_acl_delete(a); break;
+    case J_ACL_RENAME: jd_str(&d, a); jd_str(&d, b); if (!d.bad) nm_acl_rename(a, b); break;
+    case J_ADD_FOLDER: jd_str(&d, a); if (!d.bad) nm_state_add_folder(a); break;
+    case J_REMOVE_FOLDER: jd_str(&d, a); if (!d.bad) nm_state_remove_folder(a); break;
+    case J_MOVE_FOLDER: jd_str(&d, a); jd_str(&d, b); if (!d.bad) nm_state_move_folder_prefix(a, b, NULL); break;
+    case J_ADD_REQUEST: jd_str(&d, a); jd_str(&d, b); x = jd_int(&d); if (!d.bad) nm_state_add_request(a, b, (char)x); break;
+    case J_REMOVE_REQUEST: jd_str(&d, a); jd_str(&d, b); if (!d.bad) nm_state_remove_request(a, b); break;
+    case J_CLEAR_REQUESTS: jd_str(&d, a); if (!d.bad) nm_state_clear_requests_for(a); break;
+    case J_TRASH_ADD:
+        jd_str(&d, a); jd_str(&d, b); x = jd_int(&d); jd_str(&d, c); y = jd_int(&d);
+        if (!d.bad) nm_state_trash_add(a, b, x, c[0] ? c : NULL, y);
+        break;
+    case J_TRASH_REMOVE: jd_str(&d, a); if (!d.bad) nm_state_trash_remove(a); break;
+    default: d.bad = 1; break;
+    }
+    if (d.bad) fprintf(stderr, "[NM] journal: skipped malformed record (op %d)\n", op);
+}
+
+// Background compaction: snapshot when the journal grows past NM_JOURNAL_MAX_MB or every NM_SNAPSHOT_SEC
+static void *snapshot_thread(void *arg) {
+    (void)arg;
+    int interval = 300; size_t max_bytes = (size_t)64 << 20;
+    const char *ev;
+    if ((ev = getenv("NM_SNAPSHOT_SEC")) && atoi(ev) > 0) interval = atoi(ev);
+    if ((ev = getenv("NM_JOURNAL_MAX_MB")) && atoi(ev) > 0) max_bytes = (size_t)atoi(ev) << 20;
+    int elapsed = 0;
+    for (;;) {
+        sleep(1);
+        elapsed++;
+        size_t jb = nm_journal_bytes();
+        if (jb > 64 && (elapsed >= interval || jb >= max_bytes)) {
+            if (nm_state_snapshot(g_snap_path) != 0) fprintf(stderr, "[NM] snapshot to %s failed\n", g_snap_path);
+            elapsed = 0;
+        }
+    }
+    return NULL;
+}
+
+// Map the binary snapshot at path and build g_state on it: record arrays are allocated once at their final
+// size, strings and replica lists stay in the mapping. Returns 1 if loaded, 0 if there is no snapshot,
+// -1 if the file is unusable (g_state is untouched then).
+static void acl_idx_build(void); // with the ACL helpers below
+
+static int load_snapshot_bin(const char *path, unsigned long long *journal_seq) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(snap_hdr_t)) { close(fd); return -1; }
+    size_t len = (size_t)st.st_size;
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    const unsigned char *base = (const unsigned char *)map;
+    snap_hdr_t h;
+    memcpy(&h, base, sizeof(h));
+    if (memcmp(h.magic, SNAP_MAGIC, sizeof(h.magic)) != 0 || h.version != SNAP_VERSION || h.n_sections != SEC_COUNT || h.file_size != len) goto bad;
+    for (int s = 0; s < SEC_COUNT; ++s) {
+        if (h.sec[s].off % 8 || h.sec[s].off > len || h.sec[s].count > (len - h.sec[s].off) / k_snap_rec[s]) goto bad;
+    }
+    const char *strs = (const char *)base + h.sec[SEC_STR].off;
+    size_t n_str = h.sec[SEC_STR].count;
+    if (n_str == 0 || strs[n_str - 1] != '\0') goto bad;
+    size_t n[SEC_COUNT];
+    for (int s = 0; s < SEC_COUNT; ++s) n[s] = h.sec[s].count;
+    const uint32_t *users = (const uint32_t *)(base + h.sec[SEC_USERS].off);
+    const uint32_t *active = (const uint32_t *)(base + h.sec[SEC_ACTIVE].off);
+    const uint32_t *folders = (const uint32_t *)(base + h.sec[SEC_FOLDER].off);
+    const snap_dir_t *dir = (const snap_dir_t *)(base + h.sec[SEC_DIR].off);
+    const int32_t *repl = (const int32_t *)(base + h.sec[SEC_REPL].off);
+    const snap_acl_t *acls = (const snap_acl_t *)(base + h.sec[SEC_ACL].off);
+    const snap_grant_t *grants = (const snap_grant_t *)(base + h.sec[SEC_GRANT].off);
+    const snap_req_t *reqs = (const snap_req_t *)(base + h.sec[SEC_REQ].off);
+    const snap_req_user_t *rusers = (const snap_req_user_t *)(base + h.sec[SEC_REQ_USER].off);
+    const snap_trash_t *trash = (const snap_trash_t *)(base + h.sec[SEC_TRASH].off);
+
+    // Validate every reference before touching g_state, so a bad file never leaves half a state behind
+#define SREF(r) ((size_t)(r) < n_str)
+#define NAME(r) ((r) != 0 && SREF(r))
+    for (size_t i = 0; i < n[SEC_USERS]; ++i) if (!NAME(users[i])) goto bad;
+    for (size_t i = 0; i < n[SEC_ACTIVE]; ++i) if (!NAME(active[i])) goto bad;
+    for (size_t i = 0; i < n[SEC_FOLDER]; ++i) if (!NAME(folders[i])) goto bad;
+    for (size_t i = 0; i < n[SEC_DIR]; ++i) {
+        const snap_dir_t *d = &dir[i];
+        if (!NAME(d->file) || !SREF(d->mod_user) || !SREF(d->acc_user) || (uint64_t)d->repl + d->n_repl > n[SEC_REPL]) goto bad;
+    }
+    for (size_t i = 0; i < n[SEC_ACL]; ++i) if (!NAME(acls[i].file) || !SREF(acls[i].owner) || (uint64_t)acls[i].grant + acls[i].n_grants > n[SEC_GRANT]) goto bad;
+    for (size_t i = 0; i < n[SEC_GRANT]; ++i) if (!NAME(grants[i].user)) goto bad;
+    for (size_t i = 0; i < n[SEC_REQ]; ++i) if (!NAME(reqs[i].file) || (uint64_t)reqs[i].user + reqs[i].n_users > n[SEC_REQ_USER]) goto bad;
+    for (size_t i = 0; i < n[SEC_REQ_USER]; ++i) if (!NAME(rusers[i].user)) goto bad;
+    for (size_t i = 0; i < n[SEC_TRASH]; ++i) if (!NAME(trash[i].file) || !NAME(trash[i].trashed) || !SREF(trash[i].owner)) goto bad;
+#undef NAME
+#undef SREF
+
+    g_snap_map = base; g_snap_map_len = len;
+#define STR(r) ((r) ? (char *)(strs + (r)) : NULL)
+#define UID(r) ((r) ? uid_intern(strs + (r)) : UID_NONE)
+#define ALLOC(ptr, cnt) do { if ((cnt) && !((ptr) = malloc((cnt) * sizeof(*(ptr))))) goto oom; } while (0)
+    struct acl_user *grant_pool = NULL; uint32_t *ruser_pool = NULL; char *rmode_pool = NULL;
+    ALLOC(g_state.users, n[SEC_USERS]); ALLOC(g_state.active_users, n[SEC_ACTIVE]); ALLOC(g_state.folders, n[SEC_FOLDER]);
+    if (dir_reserve(n[SEC_DIR]) != 0) goto oom;
+    ALLOC(g_state.acls, n[SEC_ACL]); ALLOC(g_state.requests, n[SEC_REQ]); ALLOC(g_state.trash, n[SEC_TRASH]);
+    ALLOC(grant_pool, n[SEC_GRANT]); ALLOC(ruser_pool, n[SEC_REQ_USER]); ALLOC(rmode_pool, n[SEC_REQ_USER]);
+    hmap_reserve(&g_state.user_map, n[SEC_USERS]);
+
+    for (size_t i = 0; i < n[SEC_USERS]; ++i) {
+        g_state.users[i] = uid_str(UID(users[i]));
+        hmap_put(&g_state.user_map, g_state.users[i], 0);
+    }
+    g_state.n_users = g_state.cap_users = n[SEC_USERS];
+    for (size_t i = 0; i < n[SEC_ACTIVE]; ++i) {
+        g_state.active_users[i] = uid_str(UID(active[i]));
+        hmap_put(&g_state.user_map, g_state.active_users[i], 1);
+    }
+    g_state.n_active = g_state.cap_active = n[SEC_ACTIVE];
+    for (size_t i = 0; i < n[SEC_FOLDER]; ++i) {
+        g_state.folders[i] = STR(folders[i]);
+        hmap_put(&g_state.folder_map, g_state.folders[i], i);
+    }
+    g_state.n_folders = g_state.cap_folders = n[SEC_FOLDER];
+    for (size_t i = 0; i < n[SEC_DIR]; ++i) {
+        dir_cols_t *e = &g_state.dir;
+        e->file[i] = STR(dir[i].file);
+        e->ss_id[i] = dir[i].ss_id;
+        e->repl[i].v = dir[i].n_repl ? (int *)(repl + dir[i].repl) : NULL;
+        e->repl[i].n = dir[i].n_repl; e->repl[i].cap = 0;
+        e->mod_uid[i] = UID(dir[i].mod_user); e->mod_time[i] = dir[i].mod_time;
+        e->acc_uid[i] = UID(dir[i].acc_user); e->acc_time[i] = dir[i].acc_time;
+        e->has_stats[i] = 0;
+    }
+    g_state.dir.n = n[SEC_DIR];
+    for (size_t i = 0; i < n[SEC_GRANT]; ++i) { grant_pool[i].uid = UID(grants[i].user); grant_pool[i].perm = grants[i].perm; }
+    for (size_t i = 0; i < n[SEC_ACL]; ++i) {
+        struct acl_entry *e = &g_state.acls[i];
+        e->file = STR(acls[i].file); e->owner = UID(acls[i].owner);
+        e->grants = acls[i].n_grants ? grant_pool + acls[i].grant : NULL;
+        e->n_grants = acls[i].n_grants; e->cap_grants = 0;
+    }
+    g_state.n_acls = g_state.cap_acls = n[SEC_ACL];
+    for (size_t i = 0; i < n[SEC_REQ_USER]; ++i) { ruser_pool[i] = UID(rusers[i].user); rmode_pool[i] = rusers[i].mode == 'W' ? 'W' : 'R'; }
+    for (size_t i = 0; i < n[SEC_REQ]; ++i) {
+        struct req_entry *e = &g_state.requests[i];
+        e->file = STR(reqs[i].file);
+        e->uids = reqs[i].n_users ? ruser_pool + reqs[i].user : NULL;
+        e->modes = reqs[i].n_users ? rmode_pool + reqs[i].user : NULL;
+        e->n_users = reqs[i].n_users; e->cap_users = 0;
+        hmap_put(&g_state.req_map, e->file, i);
+    }
+    g_state.n_requests = g_state.cap_requests = n[SEC_REQ];
+    for (size_t i = 0; i < n[SEC_TRASH]; ++i) {
+        struct trash_entry *e = &g_state.trash[i];
+        e->file = STR(trash[i].file); e->trashed = STR(trash[i].trashed); e->owner = UID(trash[i].owner);
+        e->ssid = trash[i].ssid; e->when = trash[i].when;
+        hmap_put(&g_state.trash_map, e->file, i);
+    }
+    g_state.n_trash = g_state.cap_trash = n[SEC_TRASH];
+    if (build_indexes() != 0) goto oom;
+    tree_build();
+    acl_idx_build();
+#undef ALLOC
+#undef UID
+#undef STR
+    *journal_seq = h.journal_seq;
+    return 1;
+oom:
+    fprintf(stderr, "[NM] out of memory loading %s\n", path);
+    exit(1);
+bad:
+    fprintf(stderr, "[NM] %s: not a valid v%d state snapshot\n", path, SNAP_VERSION);
+    munmap(map, len);
+    return -1;
+}
+
+// Load the newest state: binary snapshot at path (else the JSON one at json_path), then the journal records
+// it does not cover. With open_journal the NM then journals and snapshots to path from here on.
+static int load_state(const char *path, const char *json_path, int open_journal) {
+    unsigned long long snap_seq = 0;
+    const char *jbase = path; // journal that belongs to the snapshot we loaded
+    int have_snapshot = load_snapshot_bin(path, &snap_seq);
+    if (have_snapshot < 0) return -1; // starting empty would throw the namespace away at the next snapshot
+    if (!have_snapshot && json_path && load_snapshot_json(json_path, &snap_seq) == 0) {
+        fprintf(stderr, "[NM] No %s; imported %s\n", path, json_path);
+        have_snapshot = 1;
+        jbase = json_path;
+    }
+    // Records newer than the snapshot: first any journal a failed snapshot left behind, then the live one
+    char jpath[512], jold[600];
+    snprintf(jpath, sizeof(jpath), "%s.journal", jbase);
+    snprintf(jold, sizeof(jold), "%s.old", jpath);
+    unsigned long long last = snap_seq, m;
+    if ((m = nm_journal_replay(jold, snap_seq, journal_apply)) > last) last = m;
+    if ((m = nm_journal_replay(jpath, snap_seq, journal_apply)) > last) last = m;
+    if (last > snap_seq) fprintf(stderr, "[NM] Replayed journal records %llu..%llu\n", snap_seq + 1, last);
+    g_loaded_seq = last;
+    if (!open_journal) return 0;
+    int imported = jbase != path;
+    if (imported) snprintf(jpath, sizeof(jpath), "%s.journal", path);
+    if (nm_journal_open(jpath, last + 1) != 0) {
+        // Without a journal, fall back to full saves (nm_state_save sees no snapshot path)
+        if (!have_snapshot || imported) (void)nm_state_snapshot(path);
+        return 0;
+    }
+    snprintf(g_snap_path, sizeof(g_snap_path), "%s", path);
+    // First run, an import or a replayed journal: start from a compact snapshot
+    if (!have_snapshot || imported || last > snap_seq) {
+        if (nm_state_snapshot(path) == 0 && imported) {
+            // The JSON file's journal is folded in now; keep the JSON itself as the user left it
+            snprintf(jpath, sizeof(jpath), "%s.journal", json_path);
+            unlink(jold); unlink(jpath);
+        }
+    }
+    pthread_t th; pthread_create(&th, NULL, snapshot_thread, NULL); pthread_detach(th);
+    return 0;
+}
+
+int nm_state_load(const char *path, const char *json_path) {
+    return load_state(path, json_path, 1);
+}
+
+int nm_state_load_readonly(const char *path, const char *json_path) {
+    return load_state(path, json_path, 0);
+}
+
 // ---- Trash APIs ----
 static void ensure_trash_cap(size_t need) {
     if (g_state.cap_trash >= need) return;
@@ -934,18 +1526,17 @@ static void ensure_trash_cap(size_t need) {
     g_state.trash = p; g_state.cap_trash = nc;
 }
 
-int nm_state_trash_add(const char *file, const char *trashed_path, int ssid, const char *owner, int when) {
+static int nm_state_trash_add_nolock(const char *file, const char *trashed_path, int ssid, const char *owner, int when) {
     if (!file || !*file || !trashed_path || !*trashed_path) return 0;
     // If exists, replace
     int found = 0;
-    size_t index = trash_map_find(file, &found);
+    size_t index = index_map_find(&g_state.trash_map, file, &found);
     if (found && index < g_state.n_trash) {
         struct trash_entry *e = &g_state.trash[index];
-        if (e->trashed) free(e->trashed);
+        sfree(e->trashed);
         e->trashed = strdup(trashed_path);
         e->ssid = ssid;
-        if (e->owner) free(e->owner);
-        e->owner = owner && *owner ? strdup(owner) : NULL;
+        e->owner = uid_intern(owner);
         e->when = when;
         return 1;
     }
@@ -955,38 +1546,53 @@ int nm_state_trash_add(const char *file, const char *trashed_path, int ssid, con
     e->file = strdup(file);
     e->trashed = strdup(trashed_path);
     e->ssid = ssid;
-    e->owner = (owner && *owner) ? strdup(owner) : NULL;
+    e->owner = uid_intern(owner);
     e->when = when;
     // Add to hash map
-    trash_map_insert(file, g_state.n_trash);
+    hmap_put(&g_state.trash_map, file, g_state.n_trash);
     g_state.n_trash++;
     return 1;
 }
 
-int nm_state_trash_remove(const char *file) {
+int nm_state_trash_add(const char *file, const char *trashed_path, int ssid, const char *owner, int when) {
+    pthread_rwlock_wrlock(&g_trash_rw);
+    int r = nm_state_trash_add_nolock(file, trashed_path, ssid, owner, when);
+    if (r > 0) journal_log(J_TRASH_ADD, "ssisi", file, trashed_path, ssid, owner, when);
+    pthread_rwlock_unlock(&g_trash_rw);
+    return r;
+}
+
+static int nm_state_trash_remove_nolock(const char *file) {
     if (!file || !*file) return 0;
     int found = 0;
-    size_t index = trash_map_find(file, &found);
+    size_t index = index_map_find(&g_state.trash_map, file, &found);
     if (!found || index >= g_state.n_trash) return 0;
     
     struct trash_entry *e = &g_state.trash[index];
-    if (e->file) free(e->file);
-    if (e->trashed) free(e->trashed);
-    if (e->owner) free(e->owner);
+    sfree(e->file);
+    sfree(e->trashed);
     
     // Remove from hash map
-    trash_map_remove(file);
+    hmap_del(&g_state.trash_map, file);
     
     if (index != g_state.n_trash-1) {
         g_state.trash[index] = g_state.trash[g_state.n_trash-1];
         // Update hash map for swapped element
-        trash_map_update_index(g_state.trash[index].file, index);
+        hmap_put(&g_state.trash_map, g_state.trash[index].file, index);
     }
     g_state.n_trash--;
     return 1;
 }
 
-int nm_state_trash_find(const char *file, char *trashed_out, size_t trashed_out_sz, int *ssid_out, char *owner_out, size_t owner_out_sz, int *when_out) {
+int nm_state_trash_remove(const char *file) {
+    pthread_rwlock_wrlock(&g_trash_rw);
+    int r = nm_state_trash_remove_nolock(file);
+    if (r > 0) journal_log(J_TRASH_REMOVE, "s", file);
+    pthread_rwlock_unlock(&g_trash_rw);
+    return r;
+}
+
+static int nm_state_trash_find_nolock(const char *file, char *trashed_out, size_t trashed_out_sz, int *ssid_out, char *owner_out, size_t owner_out_sz, int *when_out) {
     if (trashed_out && trashed_out_sz) {
         trashed_out[0] = '\0';
     }
@@ -1002,216 +1608,427 @@ int nm_state_trash_find(const char *file, char *trashed_out, size_t trashed_out_
     
     // O(1) hash map lookup
     int found = 0;
-    size_t index = trash_map_find(file, &found);
+    size_t index = index_map_find(&g_state.trash_map, file, &found);
     if (!found || index >= g_state.n_trash) return -1;
     
     struct trash_entry *e = &g_state.trash[index];
     if (trashed_out && trashed_out_sz) snprintf(trashed_out, trashed_out_sz, "%s", e->trashed?e->trashed:"");
     if (ssid_out) *ssid_out = e->ssid;
-    if (owner_out && owner_out_sz) snprintf(owner_out, owner_out_sz, "%s", e->owner?e->owner:"");
+    if (owner_out && owner_out_sz) snprintf(owner_out, owner_out_sz, "%s", uid_str(e->owner));
     if (when_out) *when_out = e->when;
     return 0;
 }
 
-size_t nm_state_get_trash(char files[][128], char trashed[][128], int ssids[], char owners[][128], int whens[], size_t max_entries) {
+int nm_state_trash_find(const char *file, char *trashed_out, size_t trashed_out_sz, int *ssid_out, char *owner_out, size_t owner_out_sz, int *when_out) {
+    pthread_rwlock_rdlock(&g_trash_rw);
+    int r = nm_state_trash_find_nolock(file, trashed_out, trashed_out_sz, ssid_out, owner_out, owner_out_sz, when_out);
+    pthread_rwlock_unlock(&g_trash_rw);
+    return r;
+}
+
+static size_t nm_state_foreach_trash_nolock(nm_trash_visit_fn fn, void *arg) {
     size_t c = 0;
-    for (size_t i=0;i<g_state.n_trash && c < max_entries; ++i) {
-        snprintf(files[c], 128, "%s", g_state.trash[i].file);
-        snprintf(trashed[c], 128, "%s", g_state.trash[i].trashed?g_state.trash[i].trashed:"");
-        ssids[c] = g_state.trash[i].ssid;
-        if (owners) snprintf(owners[c], 128, "%s", g_state.trash[i].owner?g_state.trash[i].owner:"");
-        if (whens) whens[c] = g_state.trash[i].when;
+    for (size_t i = 0; i < g_state.n_trash; ++i) {
+        const struct trash_entry *t = &g_state.trash[i];
         c++;
+        if (fn && fn(t->file, t->trashed ? t->trashed : "", t->ssid, uid_str(t->owner), t->when, arg)) break;
     }
     return c;
 }
 
-static void ensure_dir_cap(size_t need) {
-    if (g_state.cap_dir >= need) return;
-    size_t newcap = g_state.cap_dir ? g_state.cap_dir * 2 : 8;
-    while (newcap < need) newcap *= 2;
-    struct dir_entry *p = (struct dir_entry *)realloc(g_state.dir, newcap * sizeof(*g_state.dir));
-    if (!p) return;
-    g_state.dir = p;
-    g_state.cap_dir = newcap;
+size_t nm_state_foreach_trash(nm_trash_visit_fn fn, void *arg) {
+    pthread_rwlock_rdlock(&g_trash_rw);
+    size_t r = nm_state_foreach_trash_nolock(fn, arg);
+    pthread_rwlock_unlock(&g_trash_rw);
+    return r;
 }
 
-int nm_state_set_dir(const char *file, int ss_id) {
+static int nm_state_set_dir_nolock(const char *file, int ss_id) {
     if (!file || !*file) return 0;
-    for (size_t i = 0; i < g_state.n_dir; ++i) {
-        if (strcmp(g_state.dir[i].file, file) == 0) {
-            if (g_state.dir[i].ss_id == ss_id) return 0;
-            g_state.dir[i].ss_id = ss_id; return 1;
-        }
+    dir_cols_t *d = &g_state.dir;
+    size_t i;
+    if (dir_find(file, &i)) {
+        if (d->ss_id[i] == ss_id) return 0;
+        ss_index_remove(d->ss_id[i], file, NM_ROLE_PRIMARY);
+        d->ss_id[i] = ss_id;
+        ss_index_add(ss_id, file, NM_ROLE_PRIMARY);
+        return 1;
     }
-    ensure_dir_cap(g_state.n_dir + 1);
-    if (g_state.cap_dir < g_state.n_dir + 1) return 0;
-    g_state.dir[g_state.n_dir].file = strdup(file);
-    if (!g_state.dir[g_state.n_dir].file) return 0;
-    g_state.dir[g_state.n_dir].ss_id = ss_id;
-    g_state.dir[g_state.n_dir].replicas = NULL; g_state.dir[g_state.n_dir].n_repl = 0; g_state.dir[g_state.n_dir].cap_repl = 0;
-    g_state.dir[g_state.n_dir].last_modified_user = NULL;
-    g_state.dir[g_state.n_dir].last_modified_time = 0;
-    g_state.dir[g_state.n_dir].last_accessed_user = NULL;
-    g_state.dir[g_state.n_dir].last_accessed_time = 0;
-    g_state.n_dir++;
+    if (dir_reserve(d->n + 1) != 0) return 0;
+    i = d->n;
+    if (hmap_put(&g_state.dir_map, file, i) < 0) return 0;
+    d->file[i] = hmap_key(&g_state.dir_map, file);
+    d->ss_id[i] = ss_id;
+    d->repl[i].v = NULL; d->repl[i].n = d->repl[i].cap = 0;
+    d->mod_uid[i] = d->acc_uid[i] = UID_NONE;
+    d->mod_time[i] = d->acc_time[i] = 0;
+    d->has_stats[i] = 0;
+    d->n++;
+    ss_index_add(ss_id, file, NM_ROLE_PRIMARY);
+    tree_add_file(file);
     return 1;
 }
 
+int nm_state_set_dir(const char *file, int ss_id) {
+    pthread_rwlock_wrlock(&g_dir_rw);
+    int r = nm_state_set_dir_nolock(file, ss_id);
+    if (r > 0) journal_log(J_SET_DIR, "si", file, ss_id);
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+static int nm_state_find_dir_nolock(const char *file, int *out_ss_id) {
+    size_t i;
+    if (!dir_find(file, &i)) return -1;
+    if (out_ss_id) *out_ss_id = g_state.dir.ss_id[i];
+    return 0;
+}
+
 int nm_state_find_dir(const char *file, int *out_ss_id) {
-    for (size_t i = 0; i < g_state.n_dir; ++i) {
-        if (strcmp(g_state.dir[i].file, file) == 0) {
-            if (out_ss_id) *out_ss_id = g_state.dir[i].ss_id;
-            return 0;
-        }
-    }
-    return -1;
+    pthread_rwlock_rdlock(&g_dir_rw);
+    int r = nm_state_find_dir_nolock(file, out_ss_id);
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
 }
 
-size_t nm_state_get_dir(char files[][128], int ss_ids[], size_t max_entries) {
-    size_t c = 0;
-    for (size_t i = 0; i < g_state.n_dir && c < max_entries; ++i) {
-        snprintf(files[c], 128, "%s", g_state.dir[i].file);
-        ss_ids[c] = g_state.dir[i].ss_id;
+// Positions are array slots; a delete moves the last entry into the hole, which is why a resumed
+// walk may skip or repeat entries that changed in between
+static size_t nm_state_foreach_dir_nolock(size_t *cursor, size_t max, nm_dir_visit_fn fn, void *arg) {
+    size_t i = cursor ? *cursor : 0, c = 0;
+    while (i < g_state.dir.n && (max == 0 || c < max)) {
         c++;
+        i++;
+        if (fn && fn(g_state.dir.file[i - 1], g_state.dir.ss_id[i - 1], arg)) break;
     }
+    if (cursor) *cursor = i < g_state.dir.n ? i : 0;
     return c;
 }
 
-int nm_state_del_dir(const char *file) {
+size_t nm_state_foreach_dir(size_t *cursor, size_t max, nm_dir_visit_fn fn, void *arg) {
+    pthread_rwlock_rdlock(&g_dir_rw);
+    size_t r = nm_state_foreach_dir_nolock(cursor, max, fn, arg);
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+size_t nm_state_dir_count(void) {
+    pthread_rwlock_rdlock(&g_dir_rw);
+    size_t r = g_state.dir.n;
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+static int nm_state_del_dir_nolock(const char *file) {
     if (!file || !*file) return 0;
-    for (size_t i = 0; i < g_state.n_dir; ++i) {
-        if (strcmp(g_state.dir[i].file, file) == 0) {
-            free(g_state.dir[i].file);
-            if (g_state.dir[i].replicas) { free(g_state.dir[i].replicas); g_state.dir[i].replicas=NULL; }
-            if (g_state.dir[i].last_modified_user) { free(g_state.dir[i].last_modified_user); g_state.dir[i].last_modified_user=NULL; }
-            if (g_state.dir[i].last_accessed_user) { free(g_state.dir[i].last_accessed_user); g_state.dir[i].last_accessed_user=NULL; }
-            // move last into i
-            if (i != g_state.n_dir - 1) g_state.dir[i] = g_state.dir[g_state.n_dir - 1];
-            g_state.n_dir--;
-            return 1;
-        }
-    }
-    return 0;
+    dir_cols_t *d = &g_state.dir;
+    size_t i;
+    if (!dir_find(file, &i)) return 0;
+    ss_index_entry(i, file, 0);
+    tree_del_file(file);
+    if (d->repl[i].cap) free(d->repl[i].v);
+    // file may be d->file[i] itself, which dies with its dir_map key: nothing reads it after this
+    hmap_del(&g_state.dir_map, file);
+    // move last into i
+    if (i != d->n - 1) {
+        dir_move(i, d->n - 1);
+        hmap_put(&g_state.dir_map, d->file[i], i);
+    }
+    d->n--;
+    return 1;
 }
 
-int nm_state_rename_dir(const char *old_file, const char *new_file) {
+int nm_state_del_dir(const char *file) {
+    pthread_rwlock_wrlock(&g_dir_rw);
+    int r = nm_state_del_dir_nolock(file);
+    if (r > 0) journal_log(J_DEL_DIR, "s", file);
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+static int nm_state_rename_dir_nolock(const char *old_file, const char *new_file) {
     if (!old_file || !*old_file || !new_file || !*new_file) return 0;
     // Ensure new_file doesn't exist
-    for (size_t i = 0; i < g_state.n_dir; ++i) {
-        if (strcmp(g_state.dir[i].file, new_file) == 0) return 0; // conflict
-    }
-    for (size_t i = 0; i < g_state.n_dir; ++i) {
-        if (strcmp(g_state.dir[i].file, old_file) == 0) {
-            free(g_state.dir[i].file);
-            g_state.dir[i].file = strdup(new_file);
-            return 1;
-        }
-    }
-    return 0;
+    size_t i;
+    if (dir_find(new_file, &i)) return 0; // conflict
+    if (!dir_find(old_file, &i)) return 0;
+    ss_index_entry(i, old_file, 0);
+    tree_del_file(old_file);
+    tree_add_file(new_file);
+    if (hmap_put(&g_state.dir_map, new_file, i) < 0) return 0;
+    g_state.dir.file[i] = hmap_key(&g_state.dir_map, new_file);
+    hmap_del(&g_state.dir_map, old_file);
+    ss_index_entry(i, new_file, 1);
+    return 1;
+}
+
+int nm_state_rename_dir(const char *old_file, const char *new_file) {
+    pthread_rwlock_wrlock(&g_dir_rw);
+    int r = nm_state_rename_dir_nolock(old_file, new_file);
+    if (r > 0) journal_log(J_RENAME_DIR, "ss", old_file, new_file);
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
 }
 
 // ---- Replicas ----
-static void ensure_repl_cap(struct dir_entry *e, size_t need) {
-    if (e->cap_repl >= need) return;
-    size_t nc = e->cap_repl ? e->cap_repl * 2 : 4;
+static void ensure_repl_cap(repl_list_t *r, size_t need) {
+    if (r->cap >= need) return;
+    size_t nc = r->cap ? r->cap * 2 : 4;
     while (nc < need) nc *= 2;
-    int *nr = (int *)realloc(e->replicas, nc * sizeof(int));
+    int *nr = (int *)grow_array(r->v, r->n, r->cap, nc, sizeof(int));
     if (!nr) return;
-    e->replicas = nr; e->cap_repl = nc;
+    r->v = nr; r->cap = (uint32_t)nc;
 }
 
-int nm_state_set_replicas(const char *file, const int *replicas, size_t n) {
+static int nm_state_set_replicas_nolock(const char *file, const int *replicas, size_t n) {
     if (!file) return -1;
-    for (size_t i=0;i<g_state.n_dir;i++) {
-        if (strcmp(g_state.dir[i].file, file)==0) {
-            struct dir_entry *e = &g_state.dir[i];
-            // Check if unchanged
-            int same = (e->n_repl == n);
-            if (same) {
-                for (size_t j=0;j<n;j++) { if (e->replicas[j] != replicas[j]) { same = 0; break; } }
-            }
-            if (same) return 0;
-            ensure_repl_cap(e, n);
-            if (e->cap_repl < n) return -1;
-            e->n_repl = n;
-            for (size_t j=0;j<n;j++) e->replicas[j] = replicas[j];
-            return 1;
-        }
-    }
-    return -1;
+    size_t i;
+    if (!dir_find(file, &i)) return -1;
+    repl_list_t *r = &g_state.dir.repl[i];
+    // Check if unchanged
+    int same = (r->n == n);
+    if (same) {
+        for (size_t j=0;j<n;j++) { if (r->v[j] != replicas[j]) { same = 0; break; } }
+    }
+    if (same) return 0;
+    ensure_repl_cap(r, n);
+    if (r->cap < n) return -1;
+    for (size_t j=0;j<r->n;j++) ss_index_remove(r->v[j], file, NM_ROLE_REPLICA);
+    r->n = (uint32_t)n;
+    for (size_t j=0;j<n;j++) { r->v[j] = replicas[j]; ss_index_add(replicas[j], file, NM_ROLE_REPLICA); }
+    return 1;
+}
+
+int nm_state_set_replicas(const char *file, const int *replicas, size_t n) {
+    pthread_rwlock_wrlock(&g_dir_rw);
+    int r = nm_state_set_replicas_nolock(file, replicas, n);
+    if (r > 0) journal_replicas(file, replicas, n);
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+static size_t nm_state_get_replicas_nolock(const char *file, int *out, size_t max) {
+    size_t i;
+    if (!dir_find(file, &i)) return 0;
+    const repl_list_t *r = &g_state.dir.repl[i];
+    size_t c = r->n < max ? r->n : max;
+    for (size_t j=0;j<c;j++) out[j] = r->v[j];
+    return r->n;
 }
 
 size_t nm_state_get_replicas(const char *file, int *out, size_t max) {
-    for (size_t i=0;i<g_state.n_dir;i++) {
-        if (strcmp(g_state.dir[i].file, file)==0) {
-            size_t n = g_state.dir[i].n_repl;
-            size_t c = n < max ? n : max;
-            for (size_t j=0;j<c;j++) out[j] = g_state.dir[i].replicas[j];
-            return n;
-        }
-    }
-    return 0;
+    pthread_rwlock_rdlock(&g_dir_rw);
+    size_t r = nm_state_get_replicas_nolock(file, out, max);
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+static int nm_state_get_primary_nolock(const char *file, int *out_ssid) {
+    return nm_state_find_dir_nolock(file, out_ssid);
 }
 
 int nm_state_get_primary(const char *file, int *out_ssid) {
-    return nm_state_find_dir(file, out_ssid);
+    pthread_rwlock_rdlock(&g_dir_rw);
+    int r = nm_state_get_primary_nolock(file, out_ssid);
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+// ---- Per-SS index ----
+static size_t nm_state_count_ss_files_nolock(int ss_id, int roles) {
+    ss_index_t *x = ss_index_find(ss_id, 0);
+    if (!x) return 0;
+    return ((roles & NM_ROLE_PRIMARY) ? x->n_primary : 0) + ((roles & NM_ROLE_REPLICA) ? x->n_replica : 0);
+}
+
+size_t nm_state_count_ss_files(int ss_id, int roles) {
+    pthread_rwlock_rdlock(&g_dir_rw);
+    size_t r = nm_state_count_ss_files_nolock(ss_id, roles);
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+static char **nm_state_get_ss_files_nolock(int ss_id, int roles, size_t *n_out) {
+    *n_out = 0;
+    ss_index_t *x = ss_index_find(ss_id, 0);
+    size_t cap = x ? x->n_primary + x->n_replica : 0;
+    if (cap == 0) return NULL;
+    char **out = (char **)malloc(cap * sizeof(char *));
+    if (!out) return NULL;
+    size_t c = 0, cur = 0, node_roles = 0;
+    const char *file = NULL;
+    while (c < cap && hmap_next(&x->files, &cur, &file, &node_roles)) {
+        if (!(node_roles & (size_t)roles)) continue;
+        out[c] = strdup(file);
+        if (out[c]) c++;
+    }
+    *n_out = c;
+    return out;
+}
+
+char **nm_state_get_ss_files(int ss_id, int roles, size_t *n_out) {
+    pthread_rwlock_rdlock(&g_dir_rw);
+    char **r = nm_state_get_ss_files_nolock(ss_id, roles, n_out);
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+void nm_state_free_list(char **list, size_t n) {
+    if (!list) return;
+    for (size_t i = 0; i < n; ++i) free(list[i]);
+    free(list);
+}
+
+static size_t nm_state_foreach_indexed_ss_nolock(nm_ss_visit_fn fn, void *arg) {
+    size_t c = 0;
+    for (ss_index_t *x = g_state.ss_index; x; x = x->next) {
+        if (x->n_primary + x->n_replica == 0) continue;
+        c++;
+        if (fn && fn(x->ss_id, arg)) break;
+    }
+    return c;
+}
+
+size_t nm_state_foreach_indexed_ss(nm_ss_visit_fn fn, void *arg) {
+    pthread_rwlock_rdlock(&g_dir_rw);
+    size_t r = nm_state_foreach_indexed_ss_nolock(fn, arg);
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
 }
 
 // ---- Metadata tracking (last modified/accessed user and time) ----
+static int nm_state_set_file_modified_nolock(const char *file, const char *user, int time) {
+    if (!file || !*file) return 0;
+    size_t i;
+    if (!dir_find(file, &i)) return 0;
+    g_state.dir.mod_uid[i] = uid_intern(user);
+    g_state.dir.mod_time[i] = time;
+    return 1;
+}
+
 int nm_state_set_file_modified(const char *file, const char *user, int time) {
+    pthread_rwlock_rdlock(&g_dir_rw); pthread_mutex_lock(&g_meta_mu);
+    int r = nm_state_set_file_modified_nolock(file, user, time);
+    if (r > 0) journal_log(J_MODIFIED, "ssi", file, user, time);
+    pthread_mutex_unlock(&g_meta_mu); pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+static int nm_state_set_file_accessed_nolock(const char *file, const char *user, int time) {
     if (!file || !*file) return 0;
-    for (size_t i = 0; i < g_state.n_dir; ++i) {
-        if (strcmp(g_state.dir[i].file, file) == 0) {
-            if (g_state.dir[i].last_modified_user) free(g_state.dir[i].last_modified_user);
-            g_state.dir[i].last_modified_user = (user && *user) ? strdup(user) : NULL;
-            g_state.dir[i].last_modified_time = time;
-            return 1;
-        }
-    }
-    return 0;
+    size_t i;
+    if (!dir_find(file, &i)) return 0;
+    g_state.dir.acc_uid[i] = uid_intern(user);
+    g_state.dir.acc_time[i] = time;
+    return 1;
 }
 
 int nm_state_set_file_accessed(const char *file, const char *user, int time) {
-    if (!file || !*file) return 0;
-    for (size_t i = 0; i < g_state.n_dir; ++i) {
-        if (strcmp(g_state.dir[i].file, file) == 0) {
-            if (g_state.dir[i].last_accessed_user) free(g_state.dir[i].last_accessed_user);
-            g_state.dir[i].last_accessed_user = (user && *user) ? strdup(user) : NULL;
-            g_state.dir[i].last_accessed_time = time;
-            return 1;
-        }
-    }
+    pthread_rwlock_rdlock(&g_dir_rw); pthread_mutex_lock(&g_meta_mu);
+    int r = nm_state_set_file_accessed_nolock(file, user, time);
+    if (r > 0) journal_log(J_ACCESSED, "ssi", file, user, time);
+    pthread_mutex_unlock(&g_meta_mu); pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+static int nm_state_get_file_metadata_nolock(const char *file, char *mod_user_out, size_t mod_user_sz, int *mod_time_out, char *acc_user_out, size_t acc_user_sz, int *acc_time_out) {
+    if (!file || !*file) return -1;
+    size_t i;
+    if (!dir_find(file, &i)) return -1;
+    const dir_cols_t *d = &g_state.dir;
+    if (mod_user_out && mod_user_sz) snprintf(mod_user_out, mod_user_sz, "%s", uid_str(d->mod_uid[i]));
+    if (mod_time_out) *mod_time_out = d->mod_time[i];
+    if (acc_user_out && acc_user_sz) snprintf(acc_user_out, acc_user_sz, "%s", uid_str(d->acc_uid[i]));
+    if (acc_time_out) *acc_time_out = d->acc_time[i];
     return 0;
 }
 
 int nm_state_get_file_metadata(const char *file, char *mod_user_out, size_t mod_user_sz, int *mod_time_out, char *acc_user_out, size_t acc_user_sz, int *acc_time_out) {
+    pthread_rwlock_rdlock(&g_dir_rw); pthread_mutex_lock(&g_meta_mu);
+    int r = nm_state_get_file_metadata_nolock(file, mod_user_out, mod_user_sz, mod_time_out, acc_user_out, acc_user_sz, acc_time_out);
+    pthread_mutex_unlock(&g_meta_mu); pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+// Content statistics are a cache of what the primary SS reported; they are not journaled or snapshotted
+int nm_state_set_file_stats(const char *file, const nm_file_stats_t *st, int only_if_unknown) {
+    if (!file || !*file || !st) return 0;
+    pthread_rwlock_rdlock(&g_dir_rw); pthread_mutex_lock(&g_meta_mu);
+    size_t i;
+    int r = 0;
+    if (dir_find(file, &i) && !(only_if_unknown && g_state.dir.has_stats[i])) { g_state.dir.stats[i] = *st; g_state.dir.has_stats[i] = 1; r = 1; }
+    pthread_mutex_unlock(&g_meta_mu); pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+int nm_state_get_file_stats(const char *file, nm_file_stats_t *out) {
     if (!file || !*file) return -1;
-    for (size_t i = 0; i < g_state.n_dir; ++i) {
-        if (strcmp(g_state.dir[i].file, file) == 0) {
-            if (mod_user_out && mod_user_sz) {
-                if (g_state.dir[i].last_modified_user) {
-                    snprintf(mod_user_out, mod_user_sz, "%s", g_state.dir[i].last_modified_user);
-                } else {
-                    mod_user_out[0] = '\0';
-                }
-            }
-            if (mod_time_out) *mod_time_out = g_state.dir[i].last_modified_time;
-            if (acc_user_out && acc_user_sz) {
-                if (g_state.dir[i].last_accessed_user) {
-                    snprintf(acc_user_out, acc_user_sz, "%s", g_state.dir[i].last_accessed_user);
-                } else {
-                    acc_user_out[0] = '\0';
-                }
-            }
-            if (acc_time_out) *acc_time_out = g_state.dir[i].last_accessed_time;
-            return 0;
-        }
-    }
-    return -1;
+    pthread_rwlock_rdlock(&g_dir_rw); pthread_mutex_lock(&g_meta_mu);
+    size_t i;
+    int r = (dir_find(file, &i) && g_state.dir.has_stats[i]) ? 0 : -1;
+    if (r == 0 && out) *out = g_state.dir.stats[i];
+    pthread_mutex_unlock(&g_meta_mu); pthread_rwlock_unlock(&g_dir_rw);
+    return r;
 }
 
 // ---- ACL helpers ----
+// Per-user index: for each user, the files it owns or holds a grant on, with bits saying which. VIEW walks
+// one user's set plus the anonymous user's instead of checking every ACL in the namespace.
+#define ACL_IDX_GRANT 4 // holds a grant; ACL_R/ACL_W carry its perm
+#define ACL_IDX_OWNER 8
+
+static hmap_t *acl_idx_files(uint32_t uid, int create) {
+    if (uid < g_state.cap_acl_idx && g_state.acl_idx[uid]) return g_state.acl_idx[uid];
+    if (!create || uid == UID_NONE) return NULL;
+    if (uid >= g_state.cap_acl_idx) {
+        size_t nc = g_state.cap_acl_idx ? g_state.cap_acl_idx * 2 : 64;
+        while (nc <= uid) nc *= 2;
+        hmap_t **p = (hmap_t **)realloc(g_state.acl_idx, nc * sizeof(hmap_t *));
+        if (!p) { fprintf(stderr, "[NM] out of memory\n"); exit(1); }
+        memset(p + g_state.cap_acl_idx, 0, (nc - g_state.cap_acl_idx) * sizeof(hmap_t *));
+        g_state.acl_idx = p; g_state.cap_acl_idx = nc;
+    }
+    if (!(g_state.acl_idx[uid] = (hmap_t *)calloc(1, sizeof(hmap_t)))) { fprintf(stderr, "[NM] out of memory\n"); exit(1); }
+    return g_state.acl_idx[uid];
+}
+
+// What uid holds on entry e
+static size_t acl_idx_bits(const struct acl_entry *e, uint32_t uid) {
+    size_t b = e->owner == uid ? ACL_IDX_OWNER : 0;
+    for (size_t i = 0; i < e->n_grants; ++i) {
+        if (e->grants[i].uid == uid) { b |= ACL_IDX_GRANT | (size_t)(e->grants[i].perm & (ACL_R | ACL_W)); break; }
+    }
+    return b;
+}
+
+static void acl_idx_drop(uint32_t uid, const char *file) {
+    hmap_t *m = acl_idx_files(uid, 0);
+    if (!m) return;
+    hmap_del(m, file);
+    if (hmap_count(m)) return;
+    hmap_free(m); free(m);
+    g_state.acl_idx[uid] = NULL;
+}
+
+// Re-index (uid, e->file) after a change to e
+static void acl_idx_update(const struct acl_entry *e, uint32_t uid) {
+    if (uid == UID_NONE) return;
+    size_t b = acl_idx_bits(e, uid);
+    if (b) hmap_put(acl_idx_files(uid, 1), e->file, b);
+    else acl_idx_drop(uid, e->file);
+}
+
+// Index (add) or unindex every user named by e
+static void acl_idx_entry(const struct acl_entry *e, int add) {
+    if (e->owner) { if (add) acl_idx_update(e, e->owner); else acl_idx_drop(e->owner, e->file); }
+    for (size_t i = 0; i < e->n_grants; ++i) {
+        if (add) acl_idx_update(e, e->grants[i].uid); else acl_idx_drop(e->grants[i].uid, e->file);
+    }
+}
+
+static void acl_idx_build(void) {
+    for (size_t i = 0; i < g_state.n_acls; ++i) acl_idx_entry(&g_state.acls[i], 1);
+}
+
 static void ensure_acl_cap(size_t need){
     if (g_state.cap_acls >= need) return;
     size_t nc = g_state.cap_acls? g_state.cap_acls*2:8;
@@ -1225,7 +2042,7 @@ static void ensure_acl_cap(size_t need){
 static struct acl_entry* find_acl(const char *file){
     // O(1) hash map lookup
     int found = 0;
-    size_t index = acl_map_find(file, &found);
+    size_t index = index_map_find(&g_state.acl_map, file, &found);
     if (found && index < g_state.n_acls) {
         return &g_state.acls[index];
     }
@@ -1241,7 +2058,7 @@ static struct acl_entry* upsert_acl(const char *file){
     memset(e, 0, sizeof(*e));
     e->file = strdup(file);
     // Add to hash map
-    acl_map_insert(file, g_state.n_acls);
+    hmap_put(&g_state.acl_map, file, g_state.n_acls);
     g_state.n_acls++;
     return e;
 }
@@ -1250,76 +2067,115 @@ static void ensure_grant_cap(struct acl_entry *e, size_t need){
     if (e->cap_grants >= need) return;
     size_t nc = e->cap_grants? e->cap_grants*2:4;
     while(nc<need) nc*=2;
-    struct acl_user *p = (struct acl_user*)realloc(e->grants, nc*sizeof(*e->grants));
+    struct acl_user *p = (struct acl_user*)grow_array(e->grants, e->n_grants, e->cap_grants, nc, sizeof(*e->grants));
     if(!p) return;
     e->grants=p;
     e->cap_grants=nc;
 }
 
-int nm_acl_set_owner(const char *file, const char *owner) {
+static int nm_acl_set_owner_nolock(const char *file, const char *owner) {
     if (!file || !*file) return 0;
     struct acl_entry *e = upsert_acl(file); if (!e) return 0;
-    if (e->owner) { free(e->owner); e->owner=NULL; }
-    if (owner && *owner) e->owner = strdup(owner);
+    uint32_t old = e->owner;
+    e->owner = uid_intern(owner);
+    if (old != e->owner) acl_idx_update(e, old);
+    acl_idx_update(e, e->owner);
     return 1;
 }
 
-int nm_acl_grant(const char *file, const char *user, int perm) {
+int nm_acl_set_owner(const char *file, const char *owner) {
+    pthread_rwlock_wrlock(&g_acl_rw);
+    int r = nm_acl_set_owner_nolock(file, owner);
+    if (r > 0) journal_log(J_ACL_OWNER, "ss", file, owner);
+    pthread_rwlock_unlock(&g_acl_rw);
+    return r;
+}
+
+static int nm_acl_grant_nolock(const char *file, const char *user, int perm) {
     if (!file || !*file || !user || !*user) return 0;
     struct acl_entry *e = upsert_acl(file); if (!e) return 0;
-    for (size_t i=0;i<e->n_grants;i++){ if (strcmp(e->grants[i].user, user)==0){ e->grants[i].perm = perm; return 1; }}
+    uint32_t uid = uid_intern(user);
+    for (size_t i=0;i<e->n_grants;i++){ if (e->grants[i].uid == uid){ e->grants[i].perm = perm; acl_idx_update(e, uid); return 1; }}
     ensure_grant_cap(e, e->n_grants+1); if (e->cap_grants < e->n_grants+1) return 0;
-    e->grants[e->n_grants].user = strdup(user);
+    e->grants[e->n_grants].uid = uid;
     e->grants[e->n_grants].perm = perm;
     e->n_grants++;
+    acl_idx_update(e, uid);
     return 1;
 }
 
-int nm_acl_revoke(const char *file, const char *user) {
+int nm_acl_grant(const char *file, const char *user, int perm) {
+    pthread_rwlock_wrlock(&g_acl_rw);
+    int r = nm_acl_grant_nolock(file, user, perm);
+    if (r > 0) journal_log(J_ACL_GRANT, "ssi", file, user, perm);
+    pthread_rwlock_unlock(&g_acl_rw);
+    return r;
+}
+
+static int nm_acl_revoke_nolock(const char *file, const char *user) {
     if (!file || !*file || !user || !*user) return 0;
     struct acl_entry *e = find_acl(file); if (!e) return 0;
-    for (size_t i=0;i<e->n_grants;i++){ if (strcmp(e->grants[i].user, user)==0){ free(e->grants[i].user); if(i!=e->n_grants-1) e->grants[i]=e->grants[e->n_grants-1]; e->n_grants--; return 1; }}
+    uint32_t uid = uid_find(user);
+    for (size_t i=0;uid && i<e->n_grants;i++){ if (e->grants[i].uid == uid){ if(i!=e->n_grants-1) e->grants[i]=e->grants[e->n_grants-1]; e->n_grants--; acl_idx_update(e, uid); return 1; }}
     return 0;
 }
 
-int nm_acl_delete(const char *file) {
+int nm_acl_revoke(const char *file, const char *user) {
+    pthread_rwlock_wrlock(&g_acl_rw);
+    int r = nm_acl_revoke_nolock(file, user);
+    if (r > 0) journal_log(J_ACL_REVOKE, "ss", file, user);
+    pthread_rwlock_unlock(&g_acl_rw);
+    return r;
+}
+
+static int nm_acl_delete_nolock(const char *file) {
     if (!file || !*file) return 0;
     int found = 0;
-    size_t index = acl_map_find(file, &found);
+    size_t index = index_map_find(&g_state.acl_map, file, &found);
     if (!found || index >= g_state.n_acls) return 0;
     
     struct acl_entry *e = &g_state.acls[index];
-    if (e->owner) { free(e->owner); e->owner=NULL; }
-    for (size_t j=0;j<e->n_grants;j++) if (e->grants[j].user) free(e->grants[j].user);
-    if (e->grants) { free(e->grants); e->grants=NULL; }
-    if (e->file) { free(e->file); e->file=NULL; }
+    acl_idx_entry(e, 0);
+    e->owner = UID_NONE;
+    if (e->cap_grants) free(e->grants);
+    e->grants=NULL;
+    sfree(e->file); e->file=NULL;
     
     // Remove from hash map
-    acl_map_remove(file);
+    hmap_del(&g_state.acl_map, file);
     
     // swap with last and update hash map
     if (index != g_state.n_acls-1) {
         g_state.acls[index] = g_state.acls[g_state.n_acls-1];
         // Update hash map for swapped element
-        acl_map_update_index(g_state.acls[index].file, index);
+        hmap_put(&g_state.acl_map, g_state.acls[index].file, index);
     }
     g_state.n_acls--;
     return 1;
 }
 
-int nm_acl_check(const char *file, const char *user, const char *op) {
+int nm_acl_delete(const char *file) {
+    pthread_rwlock_wrlock(&g_acl_rw);
+    int r = nm_acl_delete_nolock(file);
+    if (r > 0) journal_log(J_ACL_DELETE, "s", file);
+    pthread_rwlock_unlock(&g_acl_rw);
+    return r;
+}
+
+static int nm_acl_check_nolock(const char *file, const char *user, const char *op) {
     if (!file || !user || !op) return -1;
     struct acl_entry *e = find_acl(file);
     // If no ACL entry exists, default allow for READ? Conservative deny.
     if (!e) return -1;
-    if (e->owner && strcmp(e->owner, user)==0) return 0;
+    uint32_t uid = uid_find(user); // UID_NONE: holds nothing anywhere, only the anonymous grant can allow
+    if (uid && e->owner == uid) return 0;
     int need;
     if (strcmp(op, "READ") == 0 || strcmp(op, "VIEWCHECKPOINT") == 0 || strcmp(op, "LISTCHECKPOINTS") == 0) need = ACL_R; // read-like
     else need = ACL_W; // WRITE/UNDO/REVERT and others require W
-    for (size_t i=0;i<e->n_grants;i++){ if (strcmp(e->grants[i].user, user)==0){ if ((e->grants[i].perm & need) == need) return 0; else return -1; }}
+    for (size_t i=0;uid && i<e->n_grants;i++){ if (e->grants[i].uid == uid){ if ((e->grants[i].perm & need) == need) return 0; else return -1; }}
     // Fallback: if 'anonymous' has the required permission, allow any user
     for (size_t i=0;i<e->n_grants;i++) {
-        if (strcmp(e->grants[i].user, "anonymous")==0) {
+        if (e->grants[i].uid == UID_ANON) {
             if ((e->grants[i].perm & need) == need) return 0;
             break;
         }
@@ -1327,7 +2183,51 @@ int nm_acl_check(const char *file, const char *user, const char *op) {
     return -1;
 }
 
-int nm_acl_rename(const char *old_file, const char *new_file) {
+int nm_acl_check(const char *file, const char *user, const char *op) {
+    pthread_rwlock_rdlock(&g_acl_rw);
+    int r = nm_acl_check_nolock(file, user, op);
+    pthread_rwlock_unlock(&g_acl_rw);
+    return r;
+}
+
+// Same outcome as nm_acl_check(file, user, "READ") || nm_acl_check(file, user, "WRITE"): 1 visible, 0 not,
+// -1 when user holds nothing on the file and the anonymous grant decides
+static int acl_idx_visible(size_t b) {
+    if (b & ACL_IDX_OWNER) return 1;
+    if (b & ACL_IDX_GRANT) return (b & (ACL_R | ACL_W)) != 0;
+    return -1;
+}
+
+static size_t nm_acl_foreach_visible_nolock(const char *user, nm_name_visit_fn fn, void *arg) {
+    size_t c = 0, cur = 0; const char *file; size_t b;
+    uint32_t uid = uid_find(user);
+    const hmap_t *own = acl_idx_files(uid, 0);
+    while (own && hmap_next(own, &cur, &file, &b)) {
+        if (acl_idx_visible(b) != 1) continue;
+        c++;
+        if (fn && fn(file, arg)) return c;
+    }
+    const hmap_t *pub = uid != UID_ANON ? acl_idx_files(UID_ANON, 0) : NULL;
+    cur = 0;
+    while (pub && hmap_next(pub, &cur, &file, &b)) {
+        size_t mine = 0;
+        if (!(b & ACL_IDX_GRANT) || !(b & (ACL_R | ACL_W))) continue;
+        if (own && hmap_get(own, file, &mine) == 0 && acl_idx_visible(mine) >= 0) continue; // decided above
+        c++;
+        if (fn && fn(file, arg)) break;
+    }
+    return c;
+}
+
+size_t nm_acl_foreach_visible(const char *user, nm_name_visit_fn fn, void *arg) {
+    if (!user) return 0;
+    pthread_rwlock_rdlock(&g_acl_rw);
+    size_t r = nm_acl_foreach_visible_nolock(user, fn, arg);
+    pthread_rwlock_unlock(&g_acl_rw);
+    return r;
+}
+
+static int nm_acl_rename_nolock(const char *old_file, const char *new_file) {
     if (!old_file || !*old_file || !new_file || !*new_file) return 0;
     struct acl_entry *e = find_acl(old_file);
     if (!e) return 0;
@@ -1336,33 +2236,50 @@ int nm_acl_rename(const char *old_file, const char *new_file) {
     
     // Get the index of this ACL entry before updating
     int found = 0;
-    size_t index = acl_map_find(old_file, &found);
+    size_t index = index_map_find(&g_state.acl_map, old_file, &found);
     if (!found) return 0;
     
     // Remove old filename from hash map
-    acl_map_remove(old_file);
+    hmap_del(&g_state.acl_map, old_file);
     
     // Update the filename in the ACL entry
-    free(e->file);
+    acl_idx_entry(e, 0);
+    sfree(e->file);
     e->file = strdup(new_file);
+    acl_idx_entry(e, 1);
     
     // Insert new filename into hash map with same index
-    acl_map_insert(new_file, index);
+    hmap_put(&g_state.acl_map, new_file, index);
     
     return 1;
 }
 
-int nm_acl_get_owner(const char *file, char *owner_out, size_t owner_out_sz) {
+int nm_acl_rename(const char *old_file, const char *new_file) {
+    pthread_rwlock_wrlock(&g_acl_rw);
+    int r = nm_acl_rename_nolock(old_file, new_file);
+    if (r > 0) journal_log(J_ACL_RENAME, "ss", old_file, new_file);
+    pthread_rwlock_unlock(&g_acl_rw);
+    return r;
+}
+
+static int nm_acl_get_owner_nolock(const char *file, char *owner_out, size_t owner_out_sz) {
     if (owner_out && owner_out_sz) owner_out[0] = '\0';
     struct acl_entry *e = find_acl(file);
     if (!e || !e->owner) return -1;
     if (owner_out && owner_out_sz) {
-        snprintf(owner_out, owner_out_sz, "%s", e->owner);
+        snprintf(owner_out, owner_out_sz, "%s", uid_str(e->owner));
     }
     return 0;
 }
 
-size_t nm_acl_format_access(const char *file, char *dst, size_t dst_sz) {
+int nm_acl_get_owner(const char *file, char *owner_out, size_t owner_out_sz) {
+    pthread_rwlock_rdlock(&g_acl_rw);
+    int r = nm_acl_get_owner_nolock(file, owner_out, owner_out_sz);
+    pthread_rwlock_unlock(&g_acl_rw);
+    return r;
+}
+
+static size_t nm_acl_format_access_nolock(const char *file, char *dst, size_t dst_sz) {
     if (!dst || dst_sz == 0) return 0;
     dst[0] = '\0';
     struct acl_entry *e = find_acl(file);
@@ -1370,13 +2287,13 @@ size_t nm_acl_format_access(const char *file, char *dst, size_t dst_sz) {
     size_t w = 0; int first = 1;
     // Owner first
     if (e->owner) {
-        w += snprintf(dst + w, dst_sz - w, "%s%s (RW)", first?"":", ", e->owner);
+        w += snprintf(dst + w, dst_sz - w, "%s%s (RW)", first?"":", ", uid_str(e->owner));
         first = 0;
     }
     for (size_t i = 0; i < e->n_grants; ++i) {
-        const char *u = e->grants[i].user; int p = e->grants[i].perm; const char *pv = (p==3?"RW":(p==2?"W":"R"));
+        const char *u = uid_str(e->grants[i].uid); int p = e->grants[i].perm; const char *pv = (p==3?"RW":(p==2?"W":"R"));
         // Skip owner if present in grants
-        if (e->owner && strcmp(e->owner, u) == 0) continue;
+        if (e->owner == e->grants[i].uid) continue;
         w += snprintf(dst + w, dst_sz - w, "%s%s (%s)", first?"":", ", u, pv);
         first = 0;
         if (w >= dst_sz) break;
@@ -1384,6 +2301,13 @@ size_t nm_acl_format_access(const char *file, char *dst, size_t dst_sz) {
     return w;
 }
 
+size_t nm_acl_format_access(const char *file, char *dst, size_t dst_sz) {
+    pthread_rwlock_rdlock(&g_acl_rw);
+    size_t r = nm_acl_format_access_nolock(file, dst, dst_sz);
+    pthread_rwlock_unlock(&g_acl_rw);
+    return r;
+}
+
 // ---- Folders (M13) ----
 static void ensure_folder_cap(size_t need) {
     if (g_state.cap_folders >= need) return;
@@ -1397,10 +2321,10 @@ static void ensure_folder_cap(size_t need) {
 
 static int folder_exists(const char *path) {
     // O(1) hash map lookup
-    return folder_map_exists(path);
+    return (hmap_get(&g_state.folder_map, path, NULL) == 0);
 }
 
-int nm_state_add_folder(const char *path) {
+static int nm_state_add_folder_nolock(const char *path) {
     if (!path || !*path) return 0;
     if (folder_exists(path)) return 0;
     ensure_folder_cap(g_state.n_folders + 1);
@@ -1408,88 +2332,251 @@ int nm_state_add_folder(const char *path) {
     g_state.folders[g_state.n_folders] = strdup(path);
     if (!g_state.folders[g_state.n_folders]) return 0;
     // Add to hash map
-    folder_map_insert(path, g_state.n_folders);
+    hmap_put(&g_state.folder_map, path, g_state.n_folders);
     g_state.n_folders++;
+    tree_add_folder(path);
     return 1;
 }
 
-int nm_state_remove_folder(const char *path) {
+int nm_state_add_folder(const char *path) {
+    pthread_rwlock_wrlock(&g_dir_rw);
+    int r = nm_state_add_folder_nolock(path);
+    if (r > 0) journal_log(J_ADD_FOLDER, "s", path);
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+// Drop entry i from the folder list (last one moves into the hole)
+static void folder_list_del(size_t i) {
+    hmap_del(&g_state.folder_map, g_state.folders[i]);
+    sfree(g_state.folders[i]);
+    if (i != g_state.n_folders - 1) {
+        g_state.folders[i] = g_state.folders[g_state.n_folders - 1];
+        hmap_put(&g_state.folder_map, g_state.folders[i], i);
+    }
+    g_state.n_folders--;
+}
+
+static int nm_state_remove_folder_nolock(const char *path) {
     if (!path || !*path) return 0;
+    int found = 0;
+    size_t i = index_map_find(&g_state.folder_map, path, &found);
+    if (!found) return 0;
+    folder_list_del(i);
+    tree_del_folder(path);
+    return 1;
+}
+
+int nm_state_remove_folder(const char *path) {
+    pthread_rwlock_wrlock(&g_dir_rw);
+    int r = nm_state_remove_folder_nolock(path);
+    if (r > 0) journal_log(J_REMOVE_FOLDER, "s", path);
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+static size_t nm_state_foreach_folder_nolock(nm_name_visit_fn fn, void *arg) {
+    size_t c = 0;
     for (size_t i = 0; i < g_state.n_folders; ++i) {
-        if (strcmp(g_state.folders[i], path) == 0) {
-            // Remove from hash map
-            folder_map_remove(path);
-            free(g_state.folders[i]);
-            if (i != g_state.n_folders - 1) {
-                g_state.folders[i] = g_state.folders[g_state.n_folders - 1];
-                // Update hash map index for swapped element
-                folder_map_update_index(g_state.folders[i], i);
-            }
-            g_state.n_folders--;
-            return 1;
-        }
+        c++;
+        if (fn && fn(g_state.folders[i], arg)) break;
     }
-    return 0;
+    return c;
 }
 
-size_t nm_state_get_folders(char folders[][256], size_t max_entries) {
-    size_t c = 0;
-    for (size_t i = 0; i < g_state.n_folders && c < max_entries; ++i) {
-        snprintf(folders[c], 256, "%s", g_state.folders[i]);
+size_t nm_state_foreach_folder(nm_name_visit_fn fn, void *arg) {
+    pthread_rwlock_rdlock(&g_dir_rw);
+    size_t r = nm_state_foreach_folder_nolock(fn, arg);
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+static size_t nm_state_foreach_child_nolock(const char *path, int folders, nm_name_visit_fn fn, void *arg) {
+    const path_node_t *n = tree_walk(path ? path : "", path ? strlen(path) : 0, 0);
+    if (!n) return 0;
+    size_t c = 0, cur = 0; const char *key; size_t val;
+    while (hmap_next(folders ? &n->kids : &n->files, &cur, &key, &val)) {
+        if (folders && !((const path_node_t *)(uintptr_t)val)->n_decl) continue; // only holds files
         c++;
+        if (fn && fn(key, arg)) break;
     }
     return c;
 }
 
-int nm_state_move_folder_prefix(const char *old_path, const char *new_path,
-                                char files[][128], char new_files[][128], int ssids[], size_t max_files) {
-    if (!old_path || !new_path || !*old_path || !*new_path) return 0;
-    size_t moved = 0;
-    size_t oldlen = strlen(old_path);
-    // Update folders list: rename if exact match or update prefixes
-    for (size_t i = 0; i < g_state.n_folders; ++i) {
-        if (strcmp(g_state.folders[i], old_path) == 0) {
-            // Remove old path from hash map
-            folder_map_remove(g_state.folders[i]);
-            free(g_state.folders[i]);
-            g_state.folders[i] = strdup(new_path);
-            // Insert new path into hash map
-            folder_map_insert(new_path, i);
-        } else if (strncmp(g_state.folders[i], old_path, oldlen) == 0 && g_state.folders[i][oldlen] == '/') {
-            // nested folder
-            const char *rest = g_state.folders[i] + oldlen;
-            char buf[512]; snprintf(buf, sizeof(buf), "%s%s", new_path, rest);
-            // Remove old path from hash map
-            folder_map_remove(g_state.folders[i]);
-            free(g_state.folders[i]);
-            g_state.folders[i] = strdup(buf);
-            // Insert new path into hash map
-            folder_map_insert(buf, i);
-        }
+size_t nm_state_foreach_child_folder(const char *path, nm_name_visit_fn fn, void *arg) {
+    pthread_rwlock_rdlock(&g_dir_rw);
+    size_t r = nm_state_foreach_child_nolock(path, 1, fn, arg);
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+size_t nm_state_foreach_child_file(const char *path, nm_name_visit_fn fn, void *arg) {
+    pthread_rwlock_rdlock(&g_dir_rw);
+    size_t r = nm_state_foreach_child_nolock(path, 0, fn, arg);
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+int nm_state_folder_exists(const char *path) {
+    if (!path) return 0;
+    pthread_rwlock_rdlock(&g_dir_rw);
+    int r = hmap_get(&g_state.folder_map, path, NULL) == 0;
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+typedef struct { char **v; size_t n, cap; } path_list_t;
+
+static void path_list_add(path_list_t *l, const char *s) {
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 16;
+        char **p = (char **)realloc(l->v, l->cap * sizeof(char *));
+        if (!p) { fprintf(stderr, "[NM] out of memory\n"); exit(1); }
+        l->v = p;
     }
-    // Collect and update file mappings under prefix
-    for (size_t i = 0; i < g_state.n_dir; ++i) {
-        const char *fname = g_state.dir[i].file;
-        if (strncmp(fname, old_path, oldlen) == 0 && (fname[oldlen] == '/' || fname[oldlen] == '\0')) {
-            // compute new name
-            const char *rest = fname + oldlen;
-            char nbuf[256];
-            if (*rest == '/') rest++; // skip separator
-            if (*rest) snprintf(nbuf, sizeof(nbuf), "%s/%s", new_path, rest);
-            else snprintf(nbuf, sizeof(nbuf), "%s", new_path);
-            if (moved < max_files) {
-                safe_copy(files[moved], 128, fname);
-                safe_copy(new_files[moved], 128, nbuf);
-                ssids[moved] = g_state.dir[i].ss_id;
-            }
-            free(g_state.dir[i].file);
-            g_state.dir[i].file = strdup(nbuf);
-            moved++;
-        }
+    if (!(l->v[l->n++] = strdup(s))) { fprintf(stderr, "[NM] out of memory\n"); exit(1); }
+}
+
+static void path_list_free(path_list_t *l) {
+    for (size_t i = 0; i < l->n; ++i) free(l->v[i]);
+    free(l->v);
+}
+
+// What a folder move renames: the full path of every file (into files) and declared folder (into decl)
+// in n's subtree, built on the len-byte prefix already in buf
+static void tree_collect(const path_node_t *n, char *buf, size_t len, size_t sz, path_list_t *files, path_list_t *decl) {
+    if (n->is_folder) path_list_add(decl, buf);
+    size_t cur = 0; const char *key; size_t val;
+    while (hmap_next(&n->files, &cur, &key, &val)) {
+        if (snprintf(buf + len, sz - len, "/%s", key) < (int)(sz - len)) path_list_add(files, buf);
+    }
+    cur = 0;
+    while (hmap_next(&n->kids, &cur, &key, &val)) {
+        int m = snprintf(buf + len, sz - len, "/%s", key);
+        if (m < (int)(sz - len)) tree_collect((const path_node_t *)(uintptr_t)val, buf, len + (size_t)m, sz, files, decl);
+    }
+    buf[len] = '\0';
+}
+
+// fname's name after the move: new_path + the part after old_path (oldlen bytes). -1 if it does not fit
+static int move_dest(const char *fname, size_t oldlen, const char *new_path, char *buf, size_t sz) {
+    int m = snprintf(buf, sz, "%s%s", new_path, fname + oldlen);
+    return (m < 0 || (size_t)m >= sz) ? -1 : 0;
+}
+
+// Rename one directory entry to its move_dest name, which the caller has checked is free
+static void move_dir_entry(const char *fname, size_t oldlen, const char *new_path, nm_moved_file_t **out, size_t *moved, size_t *cap) {
+    int found = 0;
+    size_t i = index_map_find(&g_state.dir_map, fname, &found);
+    if (!found) return;
+    char nbuf[256];
+    if (move_dest(fname, oldlen, new_path, nbuf, sizeof(nbuf)) != 0) return;
+    if (out && *moved == *cap) {
+        *cap = *cap ? *cap * 2 : 16;
+        nm_moved_file_t *p = (nm_moved_file_t *)realloc(*out, *cap * sizeof(**out));
+        if (!p) { fprintf(stderr, "[NM] out of memory\n"); exit(1); }
+        *out = p;
+    }
+    if (out) {
+        (*out)[*moved].file = strdup(fname);
+        (*out)[*moved].new_file = strdup(nbuf);
+        (*out)[*moved].ss_id = g_state.dir.ss_id[i];
+        const repl_list_t *r = &g_state.dir.repl[i];
+        size_t nr = r->n < 16 ? r->n : 16;
+        memcpy((*out)[*moved].repls, r->v, nr * sizeof(int));
+        (*out)[*moved].n_repls = nr;
+    }
+    ss_index_entry(i, fname, 0);
+    hmap_del(&g_state.dir_map, fname);
+    if (hmap_put(&g_state.dir_map, nbuf, i) < 0) { fprintf(stderr, "[NM] out of memory\n"); exit(1); }
+    g_state.dir.file[i] = hmap_key(&g_state.dir_map, nbuf);
+    ss_index_entry(i, nbuf, 1);
+    (*moved)++;
+}
+
+// Only old_path's subtree is visited. Full names still key the directory, ACLs and SS paths, so each
+// file under it is renamed individually, but the tree itself moves by relinking one node.
+static int nm_state_move_folder_prefix_nolock(const char *old_path, const char *new_path, nm_moved_file_t **out) {
+    if (out) *out = NULL;
+    if (!old_path || !new_path || !*old_path || !*new_path) return 0;
+    size_t moved = 0, cap = 0, oldlen = strlen(old_path);
+    // Refuse before touching anything: a move into its own subtree, or one that lands a file on an existing one
+    if (strncmp(new_path, old_path, oldlen) == 0 && new_path[oldlen] == '/') return -1;
+    size_t at;
+    int self = dir_find(old_path, &at);
+    path_node_t *src = tree_walk(old_path, oldlen, 0), *into = tree_walk(new_path, strlen(new_path), 0);
+    int subtree = (src && src != g_state.tree);
+    if (subtree && into && tree_conflicts(into, src)) return -1;
+    path_list_t files = { NULL, 0, 0 }, decl = { NULL, 0, 0 };
+    char buf[512];
+    if (subtree) { snprintf(buf, sizeof(buf), "%s", old_path); tree_collect(src, buf, strlen(buf), sizeof(buf), &files, &decl); }
+    // Every destination must be free and fit: an entry renamed onto a live key would share that key's
+    // string as its name column, and lose it when the other entry is deleted
+    int clash = self && dir_find(new_path, &at);
+    for (size_t i = 0; i < files.n && !clash; ++i) {
+        char nbuf[256];
+        clash = move_dest(files.v[i], oldlen, new_path, nbuf, sizeof(nbuf)) != 0 || dir_find(nbuf, &at);
+    }
+    if (clash) { path_list_free(&files); path_list_free(&decl); return -1; }
+    // A file named exactly old_path moves too
+    if (self) {
+        move_dir_entry(old_path, oldlen, new_path, out, &moved, &cap);
+        tree_del_file(old_path);
+        tree_add_file(new_path);
+    }
+    if (!subtree) return (int)moved;
+    for (size_t i = 0; i < files.n; ++i) move_dir_entry(files.v[i], oldlen, new_path, out, &moved, &cap);
+    // Declared folders keep their list slot; one landing on an existing folder is dropped instead
+    for (size_t i = 0; i < decl.n; ++i) {
+        int found = 0;
+        size_t k = index_map_find(&g_state.folder_map, decl.v[i], &found);
+        if (!found) continue;
+        snprintf(buf, sizeof(buf), "%s%s", new_path, decl.v[i] + oldlen);
+        if (folder_exists(buf)) { folder_list_del(k); continue; }
+        hmap_del(&g_state.folder_map, decl.v[i]);
+        sfree(g_state.folders[k]);
+        g_state.folders[k] = strdup(buf);
+        hmap_put(&g_state.folder_map, buf, k);
+    }
+    path_list_free(&files); path_list_free(&decl);
+    // Relink src under new_path's parent (merging into a node already there), then drop emptied ancestors
+    path_node_t *up = src->parent;
+    size_t nd = src->n_decl;
+    hmap_del(&up->kids, src->name);
+    tree_count_decl(up, -(long)nd);
+    src->parent = NULL;
+    tree_prune(up);
+    const char *leaf;
+    path_node_t *dst_up = tree_file_node(new_path, 1, &leaf);
+    path_node_t *dst = dst_up ? tree_kid(dst_up, leaf) : tree_walk(new_path, strlen(new_path), 1);
+    if (!dst) {
+        free(src->name);
+        if (!(src->name = strdup(leaf))) { fprintf(stderr, "[NM] out of memory\n"); exit(1); }
+        src->parent = dst_up;
+        hmap_put(&dst_up->kids, leaf, (size_t)(uintptr_t)src);
+        tree_count_decl(dst_up, (long)nd);
+    } else {
+        size_t before = dst->n_decl;
+        tree_merge(dst, src);
+        tree_count_decl(dst->parent, (long)tree_recount(dst) - (long)before);
     }
     return (int)moved;
 }
 
+int nm_state_move_folder_prefix(const char *old_path, const char *new_path, nm_moved_file_t **moved) {
+    pthread_rwlock_wrlock(&g_dir_rw);
+    int r = nm_state_move_folder_prefix_nolock(old_path, new_path, moved);
+    if (r >= 0 && old_path && new_path) journal_log(J_MOVE_FOLDER, "ss", old_path, new_path);
+    pthread_rwlock_unlock(&g_dir_rw);
+    return r;
+}
+
+void nm_state_free_moves(nm_moved_file_t *moved, int n) {
+    if (!moved) return;
+    for (int i = 0; i < n; ++i) { free(moved[i].file); free(moved[i].new_file); }
+    free(moved);
+}
+
 // ---- JSON load for folders ----
 static void parse_folders_array(const char *json) {
     const char *p = strstr(json, "\"folders\"");
@@ -1554,16 +2641,15 @@ static void ensure_req_cap(size_t need) {
 static struct req_entry *find_req_entry(const char *file) {
     // O(1) hash map lookup
     int found = 0;
-    size_t index = req_map_find(file, &found);
+    size_t index = index_map_find(&g_state.req_map, file, &found);
     if (found && index < g_state.n_requests) {
         return &g_state.requests[index];
     }
     return NULL;
 }
 
-int nm_state_add_request(const char *file, const char *user, char mode) {
+static int nm_state_add_request_nolock(const char *file, const char *user, char mode) {
     if (!file || !user || !*user) return 0;
-    if (nm_state_find_dir(file, NULL) != 0) return 0; // only for known files
     struct req_entry *e = find_req_entry(file);
     if (!e) {
         ensure_req_cap(g_state.n_requests + 1);
@@ -1572,38 +2658,56 @@ int nm_state_add_request(const char *file, const char *user, char mode) {
         memset(e, 0, sizeof(*e));
         e->file = strdup(file);
         // Add to hash map
-        req_map_insert(file, g_state.n_requests);
+        hmap_put(&g_state.req_map, file, g_state.n_requests);
         g_state.n_requests++;
     }
     // check duplicate
-    for (size_t i=0;i<e->n_users;i++) if (strcmp(e->users[i], user)==0) return 0;
+    uint32_t uid = uid_intern(user);
+    for (size_t i=0;i<e->n_users;i++) if (e->uids[i] == uid) return 0;
     size_t need = e->n_users + 1;
     if (e->cap_users < need) {
         size_t nc = e->cap_users ? e->cap_users * 2 : 4; while (nc < need) nc *= 2;
-        char **nu = (char **)realloc(e->users, nc * sizeof(char *)); if (!nu) return 0; e->users = nu; e->cap_users = nc;
-        char *nm = (char *)realloc(e->modes, nc * sizeof(char)); if (!nm) return 0; e->modes = nm;
+        uint32_t *nu = (uint32_t *)grow_array(e->uids, e->n_users, e->cap_users, nc, sizeof(uint32_t)); if (!nu) return 0; e->uids = nu;
+        char *nm = (char *)grow_array(e->modes, e->n_users, e->cap_users, nc, sizeof(char)); if (!nm) return 0; e->modes = nm;
+        e->cap_users = nc;
     }
-    e->users[e->n_users] = strdup(user); if (!e->users[e->n_users]) return 0;
+    e->uids[e->n_users] = uid;
     e->modes[e->n_users] = (mode=='W'?'W':'R');
     e->n_users++;
     return 1;
 }
 
-size_t nm_state_list_requests(const char *file, char users[][128], char modes[], size_t max_users) {
+int nm_state_add_request(const char *file, const char *user, char mode) {
+    if (!file || nm_state_find_dir(file, NULL) != 0) return 0; // only for known files (checked before taking g_req_rw)
+    pthread_rwlock_wrlock(&g_req_rw);
+    int r = nm_state_add_request_nolock(file, user, mode);
+    if (r > 0) journal_log(J_ADD_REQUEST, "ssi", file, user, (int)mode);
+    pthread_rwlock_unlock(&g_req_rw);
+    return r;
+}
+
+static size_t nm_state_list_requests_nolock(const char *file, char users[][128], char modes[], size_t max_users) {
     struct req_entry *e = find_req_entry(file);
     if (!e) return 0;
     size_t c = e->n_users < max_users ? e->n_users : max_users;
-    for (size_t i=0;i<c;i++) { snprintf(users[i], 128, "%s", e->users[i]); modes[i] = e->modes ? e->modes[i] : 'R'; }
+    for (size_t i=0;i<c;i++) { snprintf(users[i], 128, "%s", uid_str(e->uids[i])); modes[i] = e->modes ? e->modes[i] : 'R'; }
     return c;
 }
 
-int nm_state_remove_request(const char *file, const char *user) {
+size_t nm_state_list_requests(const char *file, char users[][128], char modes[], size_t max_users) {
+    pthread_rwlock_rdlock(&g_req_rw);
+    size_t r = nm_state_list_requests_nolock(file, users, modes, max_users);
+    pthread_rwlock_unlock(&g_req_rw);
+    return r;
+}
+
+static int nm_state_remove_request_nolock(const char *file, const char *user) {
     struct req_entry *e = find_req_entry(file);
-    if (!e) return 0;
+    uint32_t uid = uid_find(user);
+    if (!e || !uid) return 0;
     for (size_t i=0;i<e->n_users;i++) {
-        if (strcmp(e->users[i], user)==0) {
-            free(e->users[i]);
-            if (i != e->n_users - 1) { e->users[i] = e->users[e->n_users - 1]; if (e->modes) e->modes[i] = e->modes[e->n_users - 1]; }
+        if (e->uids[i] == uid) {
+            if (i != e->n_users - 1) { e->uids[i] = e->uids[e->n_users - 1]; if (e->modes) e->modes[i] = e->modes[e->n_users - 1]; }
             e->n_users--;
             return 1;
         }
@@ -1611,35 +2715,50 @@ int nm_state_remove_request(const char *file, const char *user) {
     return 0;
 }
 
-int nm_state_clear_requests_for(const char *file) {
+int nm_state_remove_request(const char *file, const char *user) {
+    pthread_rwlock_wrlock(&g_req_rw);
+    int r = nm_state_remove_request_nolock(file, user);
+    if (r > 0) journal_log(J_REMOVE_REQUEST, "ss", file, user);
+    pthread_rwlock_unlock(&g_req_rw);
+    return r;
+}
+
+static int nm_state_clear_requests_for_nolock(const char *file) {
     struct req_entry *e = find_req_entry(file);
     if (!e) return 0;
     
     // Get index for swap-with-last
     int found = 0;
-    size_t index = req_map_find(file, &found);
+    size_t index = index_map_find(&g_state.req_map, file, &found);
     if (!found) return 0;
     
-    for (size_t i=0;i<e->n_users;i++) if (e->users[i]) free(e->users[i]);
-    free(e->users); e->users=NULL; e->n_users=0; e->cap_users=0;
-    if (e->modes) { free(e->modes); e->modes=NULL; }
+    if (e->cap_users) { free(e->uids); free(e->modes); }
+    e->uids=NULL; e->modes=NULL; e->n_users=0; e->cap_users=0;
     
     // Remove from hash map
-    req_map_remove(file);
+    hmap_del(&g_state.req_map, file);
     
     // remove entry itself
-    free(e->file);
+    sfree(e->file);
     if (e != &g_state.requests[g_state.n_requests-1]) {
         *e = g_state.requests[g_state.n_requests-1];
         // Update hash map index for swapped element
         if (index != g_state.n_requests - 1) {
-            req_map_update_index(g_state.requests[index].file, index);
+            hmap_put(&g_state.req_map, g_state.requests[index].file, index);
         }
     }
     g_state.n_requests--;
     return 1;
 }
 
+int nm_state_clear_requests_for(const char *file) {
+    pthread_rwlock_wrlock(&g_req_rw);
+    int r = nm_state_clear_requests_for_nolock(file);
+    if (r > 0) journal_log(J_CLEAR_REQUESTS, "s", file);
+    pthread_rwlock_unlock(&g_req_rw);
+    return r;
+}
+
 static void parse_requests_object(const char *json) {
     const char *p = strstr(json, "\"requests\"");
     if (!p) return;
@@ -6,12 +6,29 @@
 // Initialize in-memory NM state
 void nm_state_init(void);
 
-// Load state from JSON file; returns 0 on success, -1 on error (non-fatal)
-int nm_state_load(const char *path);
-
-// Save state to JSON file atomically (write+rename); returns 0 on success
+// Load the binary snapshot at path (if there is none yet, import the JSON snapshot at json_path, which
+// may be NULL), replay the journal records it does not cover, then open <path>.journal for appending
+// and start background snapshots. Returns 0 on success (also when there is no state yet), -1 if the
+// snapshot exists but cannot be used; the NM must not start from empty state then.
+int nm_state_load(const char *path, const char *json_path);
+
+// Same load without opening the journal or writing a snapshot: files on disk are left untouched.
+// For offline tools (JSON export) that may run next to a live NM.
+int nm_state_load_readonly(const char *path, const char *json_path);
+
+// Make every mutation so far durable. Mutations are journaled as they happen, so this only waits
+// for the group-committed fsync that carries them (a full snapshot if no journal is open).
+// Returns 0 on success
 int nm_state_save(const char *path);
 
+// Write a full binary snapshot of the state to path atomically (write+rename) and retire the journal
+// records it covers. Runs periodically in the background; returns 0 on success
+int nm_state_snapshot(const char *path);
+
+// Write the whole state to path as human-readable JSON (the format nm_state_load can import).
+// Returns 0 on success
+int nm_state_export_json(const char *path);
+
 // Add a user to active sessions set; returns 1 if added, 0 if already existed
 int nm_state_add_user(const char *user);
 
@@ -21,13 +38,23 @@ int nm_state_user_is_active(const char *user);
 // Set a user's active status; if active=1 ensures user exists in users list. Returns 1 on change, 0 if unchanged
 int nm_state_set_user_active(const char *user, int active);
 
-// Snapshot users into caller-provided buffer of fixed-size strings
-// Returns number of users copied (<= max_users)
-size_t nm_state_get_users(char users[][128], size_t max_users);
+/* ITERATION
+ * ---------
+ * The nm_state_foreach_* walks hand each entry to a callback in place: nothing is copied and there is
+ * no size cap. The walk holds the read lock of the part it visits while callbacks run, so a callback
+ * may read parts later in the lock order (users, directory/folders, ACLs, requests, trash) but must
+ * not mutate state or block on I/O; collect what it needs and act after the walk returns.
+ * A callback returns nonzero to stop the walk; fn may be NULL to just count.
+ * Each walk returns the number of entries visited.
+ */
+typedef int (*nm_user_visit_fn)(const char *user, int active, void *arg);
+typedef int (*nm_dir_visit_fn)(const char *file, int ss_id, void *arg);
+typedef int (*nm_name_visit_fn)(const char *name, void *arg);
+typedef int (*nm_ss_visit_fn)(int ss_id, void *arg);
+typedef int (*nm_trash_visit_fn)(const char *file, const char *trashed, int ssid, const char *owner, int when, void *arg);
 
-// Snapshot active (logged-in) users into caller-provided buffer of fixed-size strings
-// Returns number of active users copied (<= max_users)
-size_t nm_state_get_active_users(char users[][128], size_t max_users);
+// Visit every known user with its active flag
+size_t nm_state_foreach_user(nm_user_visit_fn fn, void *arg);
 
 // Directory mapping persistence (file -> ssId)
 // Upsert a mapping; returns 1 if added or changed, 0 if unchanged
@@ -36,8 +63,14 @@ int nm_state_set_dir(const char *file, int ss_id);
 // Find mapping; returns 0 on success, -1 if not found
 int nm_state_find_dir(const char *file, int *out_ss_id);
 
-// Snapshot directory into arrays; returns number of entries copied
-size_t nm_state_get_dir(char files[][128], int ss_ids[], size_t max_entries);
+// Visit up to max directory entries (0 = no limit) starting at *cursor (0 = the beginning; cursor
+// may be NULL for a full walk). *cursor is left where the next call resumes, or 0 once the walk reached
+// the end. Between calls the lock is released; entries deleted or added meanwhile may be skipped or
+// visited twice.
+size_t nm_state_foreach_dir(size_t *cursor, size_t max, nm_dir_visit_fn fn, void *arg);
+
+// Number of directory entries; O(1)
+size_t nm_state_dir_count(void);
 
 // Remove mapping; returns 1 if removed, 0 if not found
 int nm_state_del_dir(const char *file);
@@ -55,6 +88,21 @@ size_t nm_state_get_replicas(const char *file, int *out, size_t max);
 // Convenience: get primary ssId for a file (wraps directory mapping). Returns 0 on success, -1 if not found.
 int nm_state_get_primary(const char *file, int *out_ssid);
 
+// --- Per-SS file index (kept in step with the directory and replica lists) ---
+#define NM_ROLE_PRIMARY 1
+#define NM_ROLE_REPLICA 2
+
+// Number of files ss_id serves in the given roles (bitmask of NM_ROLE_*); O(1)
+size_t nm_state_count_ss_files(int ss_id, int roles);
+
+// Snapshot files ss_id serves in the given roles. Returns a malloc'd array of *n_out malloc'd names
+// (release with nm_state_free_list), or NULL when there are none. Cost is O(files on that SS).
+char **nm_state_get_ss_files(int ss_id, int roles, size_t *n_out);
+void nm_state_free_list(char **list, size_t n);
+
+// Visit every ssId that serves at least one file
+size_t nm_state_foreach_indexed_ss(nm_ss_visit_fn fn, void *arg);
+
 // --- Metadata tracking (last modified/accessed user and time) ---
 // Set last modified user and time for a file; returns 1 on success, 0 if file not found
 int nm_state_set_file_modified(const char *file, const char *user, int time);
@@ -65,6 +113,17 @@ int nm_state_set_file_accessed(const char *file, const char *user, int time);
 // Get file metadata (last modified/accessed user and time); returns 0 on success, -1 if file not found
 int nm_state_get_file_metadata(const char *file, char *mod_user_out, size_t mod_user_sz, int *mod_time_out, char *acc_user_out, size_t acc_user_sz, int *acc_time_out);
 
+// --- Content statistics (pushed by the primary SS with each SS_COMMIT) ---
+// Kept in memory only: after an NM restart they are unknown until the next commit or SS INFO refills them.
+typedef struct { int size; int words; int chars; int mtime; } nm_file_stats_t;
+
+// Store stats for a file; with only_if_unknown set, stats already known are kept (an SS INFO answer
+// may predate a commit reported meanwhile). Returns 1 if stored, 0 if not (file unknown or kept)
+int nm_state_set_file_stats(const char *file, const nm_file_stats_t *st, int only_if_unknown);
+
+// Copy the file's stats into out; returns 0 on success, -1 if the file or its stats are unknown
+int nm_state_get_file_stats(const char *file, nm_file_stats_t *out);
+
 // --- ACLs (M7) ---
 // Permissions bitmask
 #define ACL_R 1
@@ -74,15 +133,17 @@ int nm_state_get_file_metadata(const char *file, char *mod_user_out, size_t mod_
  * --------------------
  * Permissions are stored per FILE, not per USER.
  * Each file has:
- *   - owner: single username with implicit RW
+ *   - owner: single user with implicit RW
  *   - grants[]: dynamic array of (user, perm) where perm bitmask uses ACL_R (1) | ACL_W (2)
+ * Users are held as interned ids, so a check is integer comparisons; names only cross this API.
  * Anonymous/public access is represented by a grant with user="anonymous" (perm may include R and/or W).
  * All authorization checks call nm_acl_check(file, user, op), which:
  *   - Allows owner automatically
  *   - Maps op to required perm (READ-like => R; WRITE/UNDO/REVERT/etc => W; W implies R when granted)
  *   - Searches grants for exact user or falls back to the anonymous grant
- * There is intentionally NO global user-centric permission index; all lookups traverse the file's grants.
- * This file-centric design simplifies rename/move operations and persistence.
+ * Checks traverse the file's grants; that file-centric record is what rename/move and persistence use.
+ * A derived user-centric index (user -> files it owns or holds a grant on) is kept in step with it, so
+ * listing what one user can see walks that user's files and the public (anonymous) ones, not every ACL.
  */
 
 // Set or update owner for a file (owner always has RW)
@@ -100,6 +161,10 @@ int nm_acl_delete(const char *file);
 // Check if user is allowed for op ("READ" requires R, "WRITE"/"UNDO" require W). Owner is always allowed.
 int nm_acl_check(const char *file, const char *user, const char *op);
 
+// Visit every file user may READ or WRITE per nm_acl_check, in no particular order. Costs the files user
+// owns or holds grants on plus the publicly granted ones. Files without an ACL entry are never visited.
+size_t nm_acl_foreach_visible(const char *user, nm_name_visit_fn fn, void *arg);
+
 // Rename ACL entry for a file to a new name (owner/grants preserved); returns 1 if renamed
 int nm_acl_rename(const char *old_file, const char *new_file);
 
@@ -116,13 +181,25 @@ int nm_state_add_folder(const char *path);
 // Remove a folder path; returns 1 if removed
 int nm_state_remove_folder(const char *path);
 
-// Snapshot folders into caller buffer; returns number of entries copied
-size_t nm_state_get_folders(char folders[][256], size_t max_entries);
+// Visit every folder path
+size_t nm_state_foreach_folder(nm_name_visit_fn fn, void *arg);
+
+// Visit the immediate children of folder path ("" = root) by segment name: subfolders that lead to a
+// declared folder, and files. Costs the number of children, not the size of the namespace.
+size_t nm_state_foreach_child_folder(const char *path, nm_name_visit_fn fn, void *arg);
+size_t nm_state_foreach_child_file(const char *path, nm_name_visit_fn fn, void *arg);
+
+// Whether path is a known folder (1) or not (0); O(1)
+int nm_state_folder_exists(const char *path);
 
-// Rename/move a folder prefix old_path -> new_path in folder list and directory mappings
-// Returns number of files remapped (>=0). Does not contact SS (caller must orchestrate renames).
-int nm_state_move_folder_prefix(const char *old_path, const char *new_path,
-								char files[][128], char new_files[][128], int ssids[], size_t max_files);
+// Rename/move a folder prefix old_path -> new_path in folder list and directory mappings; visits only
+// the files under old_path. Returns number of files remapped (>=0), or -1 without changing anything when
+// new_path lies under old_path or a moved file would land on an existing one. If moved is non-NULL it receives a malloc'd array with one
+// entry per remapped file, with the primary and up to 16 replicas it had (release with nm_state_free_moves).
+// Does not contact SS (caller must orchestrate renames).
+typedef struct { char *file; char *new_file; int ss_id; int repls[16]; size_t n_repls; } nm_moved_file_t;
+int nm_state_move_folder_prefix(const char *old_path, const char *new_path, nm_moved_file_t **moved);
+void nm_state_free_moves(nm_moved_file_t *moved, int n);
 
 // --- Access Requests (bonus) ---
 // Add a pending access request for file by username with mode ('R' or 'W');
@@ -148,7 +225,7 @@ int nm_state_trash_remove(const char *file);
 // Find a trashed entry by original file; returns 0 on success and fills outputs
 int nm_state_trash_find(const char *file, char *trashed_out, size_t trashed_out_sz, int *ssid_out, char *owner_out, size_t owner_out_sz, int *when_out);
 
-// Snapshot trash into caller-provided fixed arrays; returns number of entries
-size_t nm_state_get_trash(char files[][128], char trashed[][128], int ssids[], char owners[][128], int whens[], size_t max_entries);
+// Visit every trashed entry (owner is "" when unknown)
+size_t nm_state_foreach_trash(nm_trash_visit_fn fn, void *arg);
 
 #endif // NM_PERSIST_H
\ No newline at end of file
@@ -0,0 +1,64 @@
+#define _POSIX_C_SOURCE 200809L
+#include "nm_watch.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "../common/net_proto.h"
+
+static pthread_mutex_t g_wmu = PTHREAD_MUTEX_INITIALIZER;
+static int *g_watch = NULL;
+static size_t g_nwatch = 0, g_watch_cap = 0;
+
+int nm_watch_add(int fd) {
+    const char *ok = "{\"status\":\"OK\"}";
+    pthread_mutex_lock(&g_wmu);
+    if (g_nwatch == g_watch_cap) {
+        size_t nc = g_watch_cap ? g_watch_cap * 2 : 16;
+        int *p = (int *)realloc(g_watch, nc * sizeof(*p));
+        if (!p) { pthread_mutex_unlock(&g_wmu); return -1; }
+        g_watch = p; g_watch_cap = nc;
+    }
+    if (send_msg(fd, ok, (uint32_t)strlen(ok)) != 0) { pthread_mutex_unlock(&g_wmu); return -1; }
+    g_watch[g_nwatch++] = fd;
+    pthread_mutex_unlock(&g_wmu);
+    return 0;
+}
+
+void nm_watch_remove(int fd) {
+    pthread_mutex_lock(&g_wmu);
+    for (size_t i = 0; i < g_nwatch; ++i) if (g_watch[i] == fd) { g_watch[i] = g_watch[--g_nwatch]; break; }
+    pthread_mutex_unlock(&g_wmu);
+}
+
+void nm_watch_route_changed(const char *file, int scope) {
+    pthread_mutex_lock(&g_wmu);
+    if (!g_nwatch) { pthread_mutex_unlock(&g_wmu); return; }
+    // Whole frame (length prefix included) in one buffer, so each watcher gets one non-blocking send
+    char frame[4 + 512]; char *js = frame + 4; js[0] = '\0';
+    json_put_string_field(js, 512, "type", "ROUTE", 1);
+    if (file) {
+        json_put_string_field(js, 512, "file", file, 0);
+        json_put_string_field(js, 512, "scope", scope == NM_ROUTE_READS ? "R" : "A", 0);
+    } else {
+        json_put_int_field(js, 512, "all", 1, 0);
+    }
+    strncat(js, "}", 512 - strlen(js) - 1);
+    uint32_t len = (uint32_t)strlen(js), be = htonl(len);
+    memcpy(frame, &be, 4);
+    for (size_t i = 0; i < g_nwatch; ) {
+        ssize_t w = send(g_watch[i], frame, 4 + (size_t)len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (w == (ssize_t)(4 + len)) { ++i; continue; }
+        // Full socket or a torn frame: cut the watcher off. Its connection thread sees EOF and closes
+        // the fd; the client sees the watch close and drops its whole cache.
+        fprintf(stderr, "[NM] route watcher fd=%d not keeping up; dropping it\n", g_watch[i]);
+        shutdown(g_watch[i], SHUT_RDWR);
+        g_watch[i] = g_watch[--g_nwatch];
+    }
+    pthread_mutex_unlock(&g_wmu);
+}
@@ -0,0 +1,23 @@
+#ifndef NM_WATCH_H
+#define NM_WATCH_H
+
+// Route-change notices for clients that cache LOOKUP results (file -> SS address and ticket).
+// Such a client keeps one extra NM connection as a watch: after WATCH it only receives, and the NM
+// pushes {"type":"ROUTE","file":...,"scope":...} frames on it whenever a cached route may have gone
+// stale ({"type":"ROUTE","all":1} when every route may have). Pushes never block the NM: a watcher
+// whose socket is full is cut off, and the client treats the closed watch as "forget everything".
+
+#define NM_ROUTE_READS 1 // only read routes are stale (a replica fell behind); write routes still hold
+#define NM_ROUTE_ALL   2 // every route for the file is stale (moved, renamed, deleted, access changed)
+
+// Acknowledge a WATCH request on fd and start pushing notices to it. The ack goes out under the
+// registry lock, so no change that happens after the client saw it can be missed. Returns 0 on success
+int nm_watch_add(int fd);
+
+// Stop pushing to fd; call before closing any client connection (no-op if fd is not a watcher)
+void nm_watch_remove(int fd);
+
+// Notify every watcher that routes for file changed; file NULL means all routes
+void nm_watch_route_changed(const char *file, int scope);
+
+#endif // NM_WATCH_H
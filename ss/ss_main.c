@@ -1,9 +1,11 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <pthread.h>
 #include <sys/select.h>
 
@@ -13,9 +15,12 @@
 
 #include "../common/net_proto.h"
 #include "ss_tokenize.h"
+#include "ss_merkle.h"
 #include "../common/tickets.h"
+#include "../common/hmap.h"
 
 #define SS_PATH_MAX 1024
+#define SS_MAX_PATCH 256 // sentences per SENTENCES/PATCH_SENTENCES request
 
 static volatile int g_run = 1;
 static int g_data_lfd = -1;
@@ -24,13 +29,10 @@ static char g_nm_host[64] = {0};
 static uint16_t g_nm_port = 0;
 static char g_store_root[512] = "ss_data"; // base per-SS store under project dir
 
-// Simple per-file sentence lock table (linked list)
-typedef struct lock_node {
-    char file[128];
-    int sentence_idx;
-    struct lock_node *next;
-} lock_node_t;
-static lock_node_t *g_locks = NULL;
+// Per-file sentence lock table: "file\nsentence" -> 1, plus file -> number of locked sentences
+static hmap_t g_locks = HMAP_INIT;
+static hmap_t g_lock_files = HMAP_INIT;
+static int g_lock_count = 0; // open write sessions (one lock each), reported on heartbeats
 static pthread_mutex_t g_lock_mu = PTHREAD_MUTEX_INITIALIZER;
 
 // Forward declaration (defined later in file)
@@ -38,40 +40,108 @@ static void ensure_parent_dirs_for(const char *path);
 
 // Snapshot-based read isolation removed; readers always see the latest committed file.
 
+static void lock_key(char *out, size_t out_sz, const char *file, int sidx) {
+    snprintf(out, out_sz, "%s\n%d", file, sidx);
+}
+
 static int lock_acquire(const char *file, int sidx) {
+    char key[160]; lock_key(key, sizeof(key), file, sidx);
     pthread_mutex_lock(&g_lock_mu);
-    for (lock_node_t *n = g_locks; n; n = n->next) {
-        if (n->sentence_idx == sidx && strcmp(n->file, file) == 0) {
-            // Debug: log current locks when denying
-            fprintf(stderr, "[SS] lock_acquire DENY file=%s sidx=%d (existing lock)\n", file, sidx);
-            for (lock_node_t *m = g_locks; m; m = m->next) {
-                fprintf(stderr, "[SS]   held: file=%s sidx=%d\n", m->file, m->sentence_idx);
-            }
-            pthread_mutex_unlock(&g_lock_mu);
-            return -1; // already locked
-        }
+    if (hmap_get(&g_locks, key, NULL) == 0) {
+        // Debug: log current locks when denying
+        fprintf(stderr, "[SS] lock_acquire DENY file=%s sidx=%d (existing lock)\n", file, sidx);
+        size_t cur = 0; const char *held = NULL;
+        while (hmap_next(&g_locks, &cur, &held, NULL)) fprintf(stderr, "[SS]   held: %s\n", held);
+        pthread_mutex_unlock(&g_lock_mu);
+        return -1; // already locked
     }
-    lock_node_t *n = (lock_node_t *)calloc(1, sizeof(lock_node_t));
-    if (!n) { pthread_mutex_unlock(&g_lock_mu); return -1; }
-    snprintf(n->file, sizeof(n->file), "%s", file);
-    n->sentence_idx = sidx;
-    n->next = g_locks; g_locks = n;
+    if (hmap_put(&g_locks, key, 1) < 0) { pthread_mutex_unlock(&g_lock_mu); return -1; }
+    size_t held = 0; hmap_get(&g_lock_files, file, &held);
+    hmap_put(&g_lock_files, file, held + 1);
+    g_lock_count++;
     pthread_mutex_unlock(&g_lock_mu);
     return 0;
 }
 
+// Number of sentences of file currently locked by writers
+static int lock_count_file(const char *file) {
+    pthread_mutex_lock(&g_lock_mu);
+    size_t held = 0;
+    hmap_get(&g_lock_files, file, &held);
+    pthread_mutex_unlock(&g_lock_mu);
+    return (int)held;
+}
+
 static void lock_release(const char *file, int sidx) {
+    char key[160]; lock_key(key, sizeof(key), file, sidx);
     pthread_mutex_lock(&g_lock_mu);
-    lock_node_t **pp = &g_locks; lock_node_t *cur = g_locks;
-    while (cur) {
-        if (cur->sentence_idx == sidx && strcmp(cur->file, file) == 0) {
-            *pp = cur->next; free(cur); break;
-        }
-        pp = &cur->next; cur = cur->next;
+    if (hmap_del(&g_locks, key)) {
+        g_lock_count--;
+        size_t held = 0; hmap_get(&g_lock_files, file, &held);
+        if (held <= 1) hmap_del(&g_lock_files, file);
+        else hmap_put(&g_lock_files, file, held - 1);
     }
     pthread_mutex_unlock(&g_lock_mu);
 }
 
+// Files fenced by the NM while it migrates them away: file -> unix time the fence lapses. Tickets issued
+// before the cutover still name this SS, so the fence outlives them. Client commits hold g_fence_rw shared
+// from their check through the file replace and FENCE takes it exclusively: once FENCE is answered, no
+// commit on that file lands here.
+static hmap_t g_fences = HMAP_INIT;
+static pthread_rwlock_t g_fence_rw = PTHREAD_RWLOCK_INITIALIZER;
+
+// Start a client commit on file: 0 with the fence lock held (release with fence_leave), -1 if fenced
+static int fence_enter(const char *file) {
+    pthread_rwlock_rdlock(&g_fence_rw);
+    size_t until = 0;
+    if (hmap_get(&g_fences, file, &until) == 0 && (time_t)until > time(NULL)) { pthread_rwlock_unlock(&g_fence_rw); return -1; }
+    return 0;
+}
+
+static void fence_leave(void) { pthread_rwlock_unlock(&g_fence_rw); }
+
+// Fence file for secs seconds; 0 lifts the fence. Returns -1 on OOM
+static int fence_set(const char *file, int secs) {
+    pthread_rwlock_wrlock(&g_fence_rw);
+    int rc = 0;
+    if (secs > 0) rc = hmap_put(&g_fences, file, (size_t)(time(NULL) + secs)) < 0 ? -1 : 0;
+    else hmap_del(&g_fences, file);
+    pthread_rwlock_unlock(&g_fence_rw);
+    return rc;
+}
+
+// Load figure reported on each heartbeat so the NM can spread READs across replicas
+static int g_req_inflight = 0;
+static int g_req_served = 0; // since the previous heartbeat
+static pthread_mutex_t g_load_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static void load_begin(void) { pthread_mutex_lock(&g_load_mu); g_req_inflight++; pthread_mutex_unlock(&g_load_mu); }
+static void load_end(void) { pthread_mutex_lock(&g_load_mu); g_req_inflight--; g_req_served++; pthread_mutex_unlock(&g_load_mu); }
+static int load_take(void) { pthread_mutex_lock(&g_load_mu); int v = g_req_inflight + g_req_served; g_req_served = 0; pthread_mutex_unlock(&g_load_mu); return v; }
+
+// Bytes held under files/, kept current by every path that replaces or removes a file (placement input on the NM)
+static long long g_bytes_stored = 0;
+
+static long long store_size(const char *path) { struct stat st; return stat(path, &st) == 0 ? (long long)st.st_size : 0; }
+static void store_adjust(long long delta) { pthread_mutex_lock(&g_load_mu); g_bytes_stored += delta; if (g_bytes_stored < 0) g_bytes_stored = 0; pthread_mutex_unlock(&g_load_mu); }
+// path was replaced; before is its size prior to the write
+static void store_account(const char *path, long long before) { store_adjust(store_size(path) - before); }
+
+// Startup: one walk to seed the counter
+static long long store_scan(const char *dir) {
+    long long total = 0; DIR *d = opendir(dir); if (!d) return 0;
+    struct dirent *de; char p[SS_PATH_MAX];
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        snprintf(p, sizeof(p), "%s/%s", dir, de->d_name);
+        struct stat st; if (stat(p, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) total += store_scan(p); else if (S_ISREG(st.st_mode)) total += (long long)st.st_size;
+    }
+    closedir(d);
+    return total;
+}
+
 static void on_sigint(int sig){ (void)sig; g_run = 0; }
 
 static void ensure_dirs(void) {
@@ -92,7 +162,13 @@ static void *heartbeat_thread(void *arg) {
     while (g_run) {
         int hfd = tcp_connect(g_nm_host[0]?g_nm_host:"127.0.0.1", g_nm_port);
         if (hfd >= 0) {
-            char hb[128]; hb[0]='\0'; json_put_string_field(hb, sizeof(hb), "type", "SS_HEARTBEAT", 1); json_put_int_field(hb, sizeof(hb), "ssId", g_ss_id, 0); strncat(hb, "}", sizeof(hb)-strlen(hb)-1);
+            pthread_mutex_lock(&g_load_mu); long long stored = g_bytes_stored; pthread_mutex_unlock(&g_load_mu);
+            pthread_mutex_lock(&g_lock_mu); int sessions = g_lock_count; pthread_mutex_unlock(&g_lock_mu);
+            struct statvfs vfs; long long free_mb = -1; // -1: unknown
+            if (statvfs(g_store_root, &vfs) == 0) free_mb = (long long)vfs.f_bavail * (long long)vfs.f_frsize / (1024 * 1024);
+            char hb[256]; hb[0]='\0'; json_put_string_field(hb, sizeof(hb), "type", "SS_HEARTBEAT", 1); json_put_int_field(hb, sizeof(hb), "ssId", g_ss_id, 0); json_put_int_field(hb, sizeof(hb), "load", load_take(), 0);
+            json_put_int_field(hb, sizeof(hb), "storedKB", (int)(stored / 1024 > 0x7fffffff ? 0x7fffffff : stored / 1024), 0); json_put_int_field(hb, sizeof(hb), "sessions", sessions, 0);
+            json_put_int_field(hb, sizeof(hb), "freeMB", (int)(free_mb > 0x7fffffff ? 0x7fffffff : free_mb), 0); strncat(hb, "}", sizeof(hb)-strlen(hb)-1);
             (void)send_msg(hfd, hb, (uint32_t)strlen(hb)); char *hr=NULL; uint32_t hrl=0; (void)recv_msg(hfd, &hr, &hrl); if (hr) free(hr); close(hfd);
         }
         sleep(1);
@@ -152,6 +228,106 @@ static int read_file_into(const char *path, char **out_buf, size_t *out_len) {
     *out_buf = buf; if (out_len) *out_len = n; return 0;
 }
 
+// Write data to path via a sibling temp file and rename, so readers never see a partial file
+static int write_file_atomic(const char *path, const char *data, size_t len) {
+    char tmppath[SS_PATH_MAX];
+    if (strlen(path) + 6 > sizeof(tmppath)) return -1;
+    snprintf(tmppath, sizeof(tmppath), "%s.stmp", path);
+    ensure_parent_dirs_for(path);
+    FILE *f = fopen(tmppath, "wb"); if (!f) return -1;
+    size_t n = fwrite(data, 1, len, f); fflush(f); fclose(f);
+    if (n != len || rename(tmppath, path) != 0) { unlink(tmppath); return -1; }
+    return 0;
+}
+
+// Words as INFO counts them: runs of anything but space, tab, CR and LF
+static int count_words(const char *s, size_t n) {
+    int words = 0, in_word = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == ' ' || c == '\n' || c == '\t' || c == '\r') { if (in_word) { words++; in_word = 0; } }
+        else in_word = 1;
+    }
+    return words + in_word;
+}
+
+// Tell the NM that file (now content[0..len)) was committed, so it replicates the change. Size, word and
+// char counts and mtime ride along, which lets the NM answer INFO and VIEW -l without asking back.
+// Waits for the NM's ack; callers answer their client only afterwards, so the NM has taken replicas off
+// the read path for this version before the client's next LOOKUP.
+static void notify_commit(const char *file, const char *content, size_t len) {
+    char path[SS_PATH_MAX]; snprintf(path, sizeof(path), "%s/files/%s", g_store_root, file);
+    struct stat st; int mtime = stat(path, &st) == 0 ? (int)st.st_mtime : (int)time(NULL);
+    int nfd = tcp_connect(g_nm_host[0]?g_nm_host:"127.0.0.1", g_nm_port);
+    if (nfd < 0) return;
+    char note[384]; note[0]='\0'; json_put_string_field(note, sizeof(note), "type", "SS_COMMIT", 1); json_put_string_field(note, sizeof(note), "file", file, 0); json_put_int_field(note, sizeof(note), "ssId", g_ss_id, 0);
+    json_put_int_field(note, sizeof(note), "size", (int)len, 0); json_put_int_field(note, sizeof(note), "words", count_words(content, len), 0);
+    json_put_int_field(note, sizeof(note), "chars", (int)len, 0); json_put_int_field(note, sizeof(note), "mtime", mtime, 0);
+    strncat(note, "}", sizeof(note)-strlen(note)-1);
+    (void)send_msg(nfd, note, (uint32_t)strlen(note)); char *nr=NULL; uint32_t nrl=0; (void)recv_msg(nfd, &nr, &nrl); if (nr) free(nr); close(nfd);
+}
+
+// Parse a comma-separated list of sentence indices ("3,7,9"); returns count, -1 on malformed input
+static int parse_idx_list(const char *s, int *out, int max) {
+    int n = 0;
+    while (*s) {
+        char *end = NULL; long v = strtol(s, &end, 10);
+        if (end == s || v < 0 || n >= max) return -1;
+        out[n++] = (int)v;
+        if (*end == ',') end++;
+        else if (*end) return -1;
+        s = end;
+    }
+    return n;
+}
+
+// Append s to a growable heap buffer (*buf has *cap bytes, *w used); returns -1 on OOM
+static int buf_append(char **buf, size_t *cap, size_t *w, const char *s) {
+    size_t n = strlen(s);
+    if (*w + n + 1 > *cap) {
+        size_t nc = *cap ? *cap : 256; while (*w + n + 1 > nc) nc *= 2;
+        char *nb = (char *)realloc(*buf, nc); if (!nb) return -1;
+        *buf = nb; *cap = nc;
+    }
+    memcpy(*buf + *w, s, n + 1); *w += n;
+    return 0;
+}
+
+// One MANIFEST entry for file: "<content root>:<undo digest>:<hexname>=<digest>+..." ("-" when absent)
+static int manifest_append(const char *file, char **buf, size_t *cap, size_t *w) {
+    char path[SS_PATH_MAX]; char hex[17]; char *content = NULL; size_t clen = 0; int rc = 0;
+    snprintf(path, sizeof(path), "%s/files/%s", g_store_root, file);
+    ss_merkle_t m;
+    if (read_file_into(path, &content, &clen) == 0 && ss_merkle_build(content, clen, &m) == 0) { ss_merkle_hex(m.root, hex); ss_merkle_free(&m); rc |= buf_append(buf, cap, w, hex); }
+    else rc |= buf_append(buf, cap, w, "-");
+    free(content); content = NULL;
+    rc |= buf_append(buf, cap, w, ":");
+    snprintf(path, sizeof(path), "%s/undo/%s.undo", g_store_root, file);
+    if (read_file_into(path, &content, &clen) == 0) { ss_merkle_hex(ss_merkle_bytes(content, clen), hex); rc |= buf_append(buf, cap, w, hex); }
+    else rc |= buf_append(buf, cap, w, "-");
+    free(content); content = NULL;
+    rc |= buf_append(buf, cap, w, ":");
+    char dpath[SS_PATH_MAX]; snprintf(dpath, sizeof(dpath), "%s/checkpoints/%s", g_store_root, file);
+    DIR *d = opendir(dpath); int first = 1;
+    if (d) {
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            size_t ln = strlen(de->d_name);
+            if (ln <= 4 || strcmp(de->d_name + ln - 4, ".chk") != 0) continue;
+            char cpath[SS_PATH_MAX + 256]; snprintf(cpath, sizeof(cpath), "%s/%s", dpath, de->d_name);
+            if (read_file_into(cpath, &content, &clen) != 0) continue;
+            ss_merkle_hex(ss_merkle_bytes(content, clen), hex); free(content); content = NULL;
+            char *hname = hex_encode(de->d_name, ln - 4); if (!hname) { rc = -1; break; }
+            if (!first) rc |= buf_append(buf, cap, w, "+");
+            first = 0;
+            rc |= buf_append(buf, cap, w, hname); rc |= buf_append(buf, cap, w, "="); rc |= buf_append(buf, cap, w, hex);
+            free(hname);
+        }
+        closedir(d);
+    }
+    return rc ? -1 : 0;
+}
+
 typedef struct { int data_port; int listen_fd; } data_server_args_t;
 
 // Per-connection write session (single sentence at a time)
@@ -178,6 +354,7 @@ static void *ss_conn_handler(void *varg) {
         if (recv_msg(cfd, &buf, &len) != 0) { fprintf(stderr, "[SS] recv_msg error or EOF\n"); free(buf); break; }
         if (!buf || len == 0) { fprintf(stderr, "[SS] empty msg\n"); free(buf); break; }
         fprintf(stderr, "[SS] recv %u bytes: %.*s\n", len, (int)len, buf); fflush(stderr);
+        load_begin();
         char type[32];
         if (json_get_string_field(buf, "type", type, sizeof(type)) == 0) {
             fprintf(stderr, "[SS] type=%s\n", type); fflush(stderr);
@@ -216,7 +393,11 @@ static void *ss_conn_handler(void *varg) {
                     else {
                         FILE *f = fopen(path, "wb");
                         if (!f) { const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
-                        else { fclose(f); const char *resp = "{\"status\":\"OK\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                        else {
+                            fclose(f);
+                            (void)fence_set(file, 0); // a new file by this name; a fence left from migrating the old one is stale
+                            const char *resp = "{\"status\":\"OK\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp));
+                        }
                     }
                 } else { const char *resp = "{\"status\":\"ERR_BADREQ\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
             } else if (strcmp(type, "DELETE") == 0) {
@@ -224,7 +405,9 @@ static void *ss_conn_handler(void *varg) {
                 if (json_get_string_field(buf, "file", file, sizeof(file)) == 0) {
                     char path[SS_PATH_MAX]; snprintf(path, sizeof(path), "%s/files/%s", g_store_root, file);
                     fprintf(stderr, "[SS] DELETE file=%s path=%s\n", file, path); fflush(stderr);
+                    long long before = store_size(path);
                     int ok = (unlink(path) == 0);
+                    if (ok) store_adjust(-before);
                     // Best-effort: remove undo snapshot
                     char undopath[SS_PATH_MAX]; snprintf(undopath, sizeof(undopath), "%s/undo/%s.undo", g_store_root, file);
                     (void)unlink(undopath);
@@ -267,7 +450,9 @@ static void *ss_conn_handler(void *varg) {
                 if (!okf) { const char *resp = "{\"status\":\"ERR_BADREQ\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
                 else if (!(okt && ticket_validate(ticket, file, "WRITE", g_ss_id) == 0)) { const char *resp = "{\"status\":\"ERR_NOAUTH\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
                 else if (ws.active) { const char *resp = "{\"status\":\"ERR_BADREQ\",\"msg\":\"session-active\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                else if (fence_enter(file) != 0) { const char *resp = "{\"status\":\"ERR_LOCKED\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
                 else {
+                    fence_leave(); // END_WRITE checks again before it commits
                     int lrc = lock_acquire(file, sidx);
                     fprintf(stderr, "[SS] lock_acquire rc=%d\n", lrc); fflush(stderr);
                     if (lrc != 0) { const char *resp = "{\"status\":\"ERR_LOCKED\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
@@ -429,8 +614,10 @@ static void *ss_conn_handler(void *varg) {
                             strncat(tmppath, "/commit.tmp", sizeof(tmppath) - strlen(tmppath) - 1);
                         }
                         fprintf(stderr, "[SS] END_WRITE write temp=%s final=%s\n", tmppath, path); fflush(stderr);
-                        FILE *f = fopen(tmppath, "wb");
-                        if (!f) { free(new_text); const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                        int fenced = (fence_enter(ws.file) != 0);
+                        FILE *f = fenced ? NULL : fopen(tmppath, "wb");
+                        if (fenced) { free(new_text); const char *resp = "{\"status\":\"ERR_LOCKED\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                        else if (!f) { fence_leave(); free(new_text); const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
                         else {
                             size_t n = fwrite(new_text, 1, strlen(new_text), f);
                             (void)n; fflush(f);
@@ -439,19 +626,19 @@ static void *ss_conn_handler(void *varg) {
                             ensure_parent_dirs_for(undopath);
                             FILE *uf = fopen(undopath, "wb");
                             if (uf) { if (ws.pre_image && ws.pre_image_len > 0) fwrite(ws.pre_image, 1, ws.pre_image_len, uf); fflush(uf); fclose(uf); fprintf(stderr, "[SS] undo snapshot saved from session: %s (len=%zu)\n", undopath, ws.pre_image_len);} else { perror("[SS] undo fopen"); }
-                            if (rename(tmppath, path) != 0) {
+                            long long before = store_size(path);
+                            int rrc = rename(tmppath, path);
+                            fence_leave();
+                            if (rrc != 0) {
                                 perror("[SS] rename");
                                 unlink(tmppath); free(new_text); const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp));
                             } else {
+                                store_account(path, before);
                                 fprintf(stderr, "[SS] END_WRITE commit OK\n"); fflush(stderr);
-                                free(new_text);
+                                // Notify NM about commit for replication, before the client can LOOKUP again
+                                notify_commit(ws.file, new_text, strlen(new_text));
                                 const char *resp = "{\"status\":\"OK\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp));
-                                // Notify NM about commit for replication
-                                int nfd = tcp_connect(g_nm_host[0]?g_nm_host:"127.0.0.1", g_nm_port);
-                                if (nfd >= 0) {
-                                    char note[256]; note[0]='\0'; json_put_string_field(note, sizeof(note), "type", "SS_COMMIT", 1); json_put_string_field(note, sizeof(note), "file", ws.file, 0); json_put_int_field(note, sizeof(note), "ssId", g_ss_id, 0); strncat(note, "}", sizeof(note)-strlen(note)-1);
-                                    (void)send_msg(nfd, note, (uint32_t)strlen(note)); char *nr=NULL; uint32_t nrl=0; (void)recv_msg(nfd, &nr, &nrl); if (nr) free(nr); close(nfd);
-                                }
+                                free(new_text);
                             }
                         }
                     }
@@ -488,24 +675,26 @@ static void *ss_conn_handler(void *varg) {
                             strncat(tmppath, "/undo.tmp", sizeof(tmppath) - strlen(tmppath) - 1);
                         }
                     char path2[SS_PATH_MAX]; snprintf(path2, sizeof(path2), "%s/files/%s", g_store_root, file);
-                        FILE *f = fopen(tmppath, "wb");
-                        if (!f) { free(undo_content); const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                        int fenced = (fence_enter(file) != 0);
+                        FILE *f = fenced ? NULL : fopen(tmppath, "wb");
+                        if (fenced) { free(undo_content); const char *resp = "{\"status\":\"ERR_LOCKED\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                        else if (!f) { fence_leave(); free(undo_content); const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
                         else {
                             size_t n = fwrite(undo_content, 1, ulen, f); (void)n; fflush(f); fclose(f);
-                            free(undo_content);
+                            long long before = store_size(path2);
                             if (rename(tmppath, path2) != 0) {
+                                fence_leave();
                                 perror("[SS] undo rename"); unlink(tmppath); const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp));
                             } else {
+                                store_account(path2, before);
                                 // Consume the undo snapshot after successful restore
                                 unlink(undopath);
+                                fence_leave();
+                                // Notify NM about commit for replication, before the client can LOOKUP again
+                                notify_commit(file, undo_content, ulen);
                                 const char *resp = "{\"status\":\"OK\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp));
-                                // Notify NM about commit for replication
-                                int nfd = tcp_connect(g_nm_host[0]?g_nm_host:"127.0.0.1", g_nm_port);
-                                if (nfd >= 0) {
-                                    char note[256]; note[0]='\0'; json_put_string_field(note, sizeof(note), "type", "SS_COMMIT", 1); json_put_string_field(note, sizeof(note), "file", file, 0); json_put_int_field(note, sizeof(note), "ssId", g_ss_id, 0); strncat(note, "}", sizeof(note)-strlen(note)-1);
-                                    (void)send_msg(nfd, note, (uint32_t)strlen(note)); char *nr=NULL; uint32_t nrl=0; (void)recv_msg(nfd, &nr, &nrl); if (nr) free(nr); close(nfd);
-                                }
                             }
+                            free(undo_content);
                         }
                     }
                 }
@@ -526,15 +715,15 @@ static void *ss_conn_handler(void *varg) {
                         char path[SS_PATH_MAX]; snprintf(path, sizeof(path), "%s/files/%s", g_store_root, file);
                         char tmppath[SS_PATH_MAX]; size_t pl=strlen(path);
                         if (pl + 6 + 1 <= sizeof(tmppath)) snprintf(tmppath, sizeof(tmppath), "%s.rvtmp", path); else { char mp[SS_PATH_MAX]; snprintf(mp, sizeof(mp), "%s/meta", g_store_root); mkdir(mp,0755); snprintf(tmppath, sizeof(tmppath), "%s", mp); strncat(tmppath, "/revert.tmp", sizeof(tmppath)-strlen(tmppath)-1);} 
-                        FILE *f = fopen(tmppath, "wb"); if (!f) { free(snap); const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
-                        else { fwrite(snap, 1, slen, f); fflush(f); fclose(f); free(snap); if (rename(tmppath, path)!=0) { perror("[SS] revert rename"); unlink(tmppath); const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); } else { const char *resp = "{\"status\":\"OK\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); 
-                                // Notify NM about commit for replication
-                                int nfd = tcp_connect(g_nm_host[0]?g_nm_host:"127.0.0.1", g_nm_port);
-                                if (nfd >= 0) {
-                                    char note[256]; note[0]='\0'; json_put_string_field(note, sizeof(note), "type", "SS_COMMIT", 1); json_put_string_field(note, sizeof(note), "file", file, 0); json_put_int_field(note, sizeof(note), "ssId", g_ss_id, 0); strncat(note, "}", sizeof(note)-strlen(note)-1);
-                                    (void)send_msg(nfd, note, (uint32_t)strlen(note)); char *nr=NULL; uint32_t nrl=0; (void)recv_msg(nfd, &nr, &nrl); if (nr) free(nr); close(nfd);
-                                }
-                            } }
+                        int fenced = (fence_enter(file) != 0);
+                        FILE *f = fenced ? NULL : fopen(tmppath, "wb");
+                        if (fenced) { free(snap); const char *resp = "{\"status\":\"ERR_LOCKED\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                        else if (!f) { fence_leave(); free(snap); const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                        else { fwrite(snap, 1, slen, f); fflush(f); fclose(f); long long before = store_size(path); int rrc = rename(tmppath, path); fence_leave(); if (rrc!=0) { perror("[SS] revert rename"); unlink(tmppath); const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); } else { store_account(path, before);
+                                // Notify NM about commit for replication, before the client can LOOKUP again
+                                notify_commit(file, snap, slen);
+                                const char *resp = "{\"status\":\"OK\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp));
+                            } free(snap); }
                     }
                 }
             } else if (strcmp(type, "CHECKPOINT") == 0) {
@@ -550,8 +739,11 @@ static void *ss_conn_handler(void *varg) {
                     else {
                         char cpath[SS_PATH_MAX]; snprintf(cpath, sizeof(cpath), "%s/checkpoints/%s/%s.chk", g_store_root, file, name);
                         ensure_parent_dirs_for(cpath);
-                        FILE *f = fopen(cpath, "wb"); if (!f) { free(cur); const char *er = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, er, (uint32_t)strlen(er)); }
-                        else { fwrite(cur, 1, clen, f); fflush(f); fclose(f); free(cur); const char *ok="{\"status\":\"OK\"}"; send_msg(cfd, ok, (uint32_t)strlen(ok));
+                        int fenced = (fence_enter(file) != 0);
+                        FILE *f = fenced ? NULL : fopen(cpath, "wb");
+                        if (fenced) { free(cur); const char *er = "{\"status\":\"ERR_LOCKED\"}"; send_msg(cfd, er, (uint32_t)strlen(er)); }
+                        else if (!f) { fence_leave(); free(cur); const char *er = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, er, (uint32_t)strlen(er)); }
+                        else { fwrite(cur, 1, clen, f); fflush(f); fclose(f); fence_leave(); free(cur); const char *ok="{\"status\":\"OK\"}"; send_msg(cfd, ok, (uint32_t)strlen(ok));
                             // Notify NM about checkpoint for replication
                             int nfd = tcp_connect(g_nm_host[0]?g_nm_host:"127.0.0.1", g_nm_port);
                             if (nfd >= 0) {
@@ -598,7 +790,7 @@ static void *ss_conn_handler(void *varg) {
                 int okf = (json_get_string_field(buf, "file", file, sizeof(file)) == 0);
                 int okt = (json_get_string_field(buf, "ticket", ticket, sizeof(ticket)) == 0);
                 if (!okf || !okt) { const char *resp = "{\"status\":\"ERR_BADREQ\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
-                else if (ticket_validate(ticket, file, "LISTCHECKPOINTS", g_ss_id) != 0 && ticket_validate(ticket, file, "VIEWCHECKPOINT", g_ss_id) != 0) { const char *resp = "{\"status\":\"ERR_NOAUTH\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                else if (ticket_check(ticket, file, TICKET_LISTCHECKPOINTS | TICKET_VIEWCHECKPOINT, g_ss_id) != 0) { const char *resp = "{\"status\":\"ERR_NOAUTH\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
                 else {
                     char dpath[SS_PATH_MAX]; snprintf(dpath, sizeof(dpath), "%s/checkpoints/%s", g_store_root, file);
                     DIR *d = opendir(dpath);
@@ -693,24 +885,212 @@ static void *ss_conn_handler(void *varg) {
                     if (!f) { perror("[SS] put fopen"); const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
                     else {
                         fwrite(body, 1, strlen(body), f); fflush(f); fclose(f);
+                        long long before = store_size(path);
                         if (rename(tmppath, path) != 0) {
                             perror("[SS] put rename");
                             unlink(tmppath);
                             const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp));
                         } else {
+                            store_account(path, before);
                             char cwd[512]; if (getcwd(cwd, sizeof(cwd))) fprintf(stderr, "[SS] PUT commit OK at %s -> %s\n", cwd, path);
                             else fprintf(stderr, "[SS] PUT commit OK -> %s\n", path);
                             const char *resp = "{\"status\":\"OK\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp));
                         }
                     }
                 }
+            } else if (strcmp(type, "HASH") == 0) {
+                // Anti-entropy digest (NM scrubber): root hash, sentence count and, unless rootOnly, per-sentence leaves
+                char file[128]; int root_only = 0;
+                int okf = (json_get_string_field(buf, "file", file, sizeof(file)) == 0);
+                json_get_int_field(buf, "rootOnly", &root_only);
+                if (!okf) { const char *resp = "{\"status\":\"ERR_BADREQ\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                else {
+                    char path[SS_PATH_MAX]; snprintf(path, sizeof(path), "%s/files/%s", g_store_root, file);
+                    char *content=NULL; size_t clen=0; ss_merkle_t m;
+                    if (read_file_into(path, &content, &clen) != 0) { const char *resp = "{\"status\":\"ERR_NOTFOUND\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                    else if (ss_merkle_build(content, clen, &m) != 0) { free(content); const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                    else {
+                        free(content);
+                        size_t rsz = 128 + (root_only ? 0 : (size_t)m.n_leaves * 16);
+                        char *resp = (char *)malloc(rsz);
+                        if (!resp) { const char *er = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, er, (uint32_t)strlen(er)); }
+                        else {
+                            char hex[17]; ss_merkle_hex(m.root, hex);
+                            int w = snprintf(resp, rsz, "{\"status\":\"OK\",\"rootHash\":\"%s\",\"sentCount\":%d", hex, m.n_leaves);
+                            if (!root_only) {
+                                w += snprintf(resp + w, rsz - (size_t)w, ",\"leafHashes\":\"");
+                                for (int i = 0; i < m.n_leaves; ++i) { ss_merkle_hex(m.leaves[i], resp + w); w += 16; }
+                                w += snprintf(resp + w, rsz - (size_t)w, "\"");
+                            }
+                            snprintf(resp + w, rsz - (size_t)w, "}");
+                            send_msg(cfd, resp, (uint32_t)strlen(resp));
+                            free(resp);
+                        }
+                        ss_merkle_free(&m);
+                    }
+                }
+            } else if (strcmp(type, "SENTENCES") == 0) {
+                // Canonical text of selected sentences, hex-encoded and comma-separated (source side of a scrub repair)
+                char file[128]; char *idxs = (char *)malloc(len + 1); int idx[SS_MAX_PATCH];
+                int okf = (json_get_string_field(buf, "file", file, sizeof(file)) == 0);
+                int n = (idxs && json_get_string_field(buf, "sentIdx", idxs, len + 1) == 0) ? parse_idx_list(idxs, idx, SS_MAX_PATCH) : -1;
+                free(idxs);
+                if (!okf || n < 0) { const char *resp = "{\"status\":\"ERR_BADREQ\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                else {
+                    char path[SS_PATH_MAX]; snprintf(path, sizeof(path), "%s/files/%s", g_store_root, file);
+                    char *content=NULL; size_t clen=0; ss_doc_tokens_t doc;
+                    if (read_file_into(path, &content, &clen) != 0) { const char *resp = "{\"status\":\"ERR_NOTFOUND\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                    else if (ss_tokenize(content, &doc) != 0) { free(content); const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                    else {
+                        free(content);
+                        char *enc[SS_MAX_PATCH]; size_t total = 0;
+                        for (int k = 0; k < n; ++k) {
+                            char *t = ss_sentence_text(&doc, idx[k]);
+                            enc[k] = hex_encode(t ? t : "", t ? strlen(t) : 0);
+                            free(t);
+                            total += (enc[k] ? strlen(enc[k]) : 0) + 1;
+                        }
+                        size_t rsz = total + 96;
+                        char *resp = (char *)malloc(rsz);
+                        if (resp) {
+                            int w = snprintf(resp, rsz, "{\"status\":\"OK\",\"sentCount\":%d,\"sentHex\":\"", doc.num_sentences);
+                            for (int k = 0; k < n; ++k) w += snprintf(resp + w, rsz - (size_t)w, "%s%s", k ? "," : "", enc[k] ? enc[k] : "");
+                            snprintf(resp + w, rsz - (size_t)w, "\"}");
+                            send_msg(cfd, resp, (uint32_t)strlen(resp));
+                            free(resp);
+                        } else { const char *er = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, er, (uint32_t)strlen(er)); }
+                        for (int k = 0; k < n; ++k) free(enc[k]);
+                        ss_tokens_free(&doc);
+                    }
+                }
+            } else if (strcmp(type, "PATCH_SENTENCES") == 0) {
+                // Replica side of a scrub repair: overwrite only the listed sentences and resize to sentCount
+                char file[128]; int count = -1; int idx[SS_MAX_PATCH];
+                char *idxs = (char *)malloc(len + 1); char *hexs = (char *)malloc(len + 1);
+                int okf = (json_get_string_field(buf, "file", file, sizeof(file)) == 0);
+                int okc = (json_get_int_field(buf, "sentCount", &count) == 0 && count >= 0);
+                int n = (idxs && json_get_string_field(buf, "sentIdx", idxs, len + 1) == 0) ? parse_idx_list(idxs, idx, SS_MAX_PATCH) : -1;
+                int okh = (hexs && json_get_string_field(buf, "sentHex", hexs, len + 1) == 0);
+                char *repl[SS_MAX_PATCH]; int nrepl = 0;
+                // Split hexs in place; one decoded sentence per index
+                for (char *p = hexs; okh && n >= 0 && nrepl < n; ) {
+                    char *comma = strchr(p, ',');
+                    size_t hl = comma ? (size_t)(comma - p) : strlen(p);
+                    char *d = (char *)malloc(hl / 2 + 1);
+                    if (!d || hex_decode(p, hl, d) < 0) { free(d); okh = 0; break; }
+                    repl[nrepl++] = d;
+                    if (!comma) break;
+                    p = comma + 1;
+                }
+                if (nrepl != n) okh = 0;
+                if (!okf || !okc || n < 0 || !okh) { const char *resp = "{\"status\":\"ERR_BADREQ\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                else {
+                    char path[SS_PATH_MAX]; snprintf(path, sizeof(path), "%s/files/%s", g_store_root, file);
+                    char *content=NULL; size_t clen=0; ss_doc_tokens_t doc;
+                    if (read_file_into(path, &content, &clen) != 0) { const char *resp = "{\"status\":\"ERR_NOTFOUND\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                    else if (ss_tokenize(content, &doc) != 0) { free(content); const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                    else {
+                        free(content);
+                        char *out = ss_merkle_splice(&doc, count, idx, repl, n);
+                        ss_tokens_free(&doc);
+                        long long before = store_size(path);
+                        if (!out || write_file_atomic(path, out, strlen(out)) != 0) { const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                        else {
+                            store_account(path, before);
+                            fprintf(stderr, "[SS] PATCH_SENTENCES %s: %d sentence(s) repaired, now %d\n", file, n, count);
+                            const char *resp = "{\"status\":\"OK\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp));
+                        }
+                        free(out);
+                    }
+                }
+                for (int k = 0; k < nrepl; ++k) free(repl[k]);
+                free(idxs); free(hexs);
+            } else if (strcmp(type, "MERGE_TAIL") == 0) {
+                // Failover reconciliation (NM): fold the returning old primary's unreplicated edits (theirs) into this
+                // primary's copy, using the content this SS held when it was promoted (base) as the common ancestor
+                char file[128]; char *bhex = (char *)malloc(len + 1); char *thex = (char *)malloc(len + 1);
+                char *bdec = NULL, *tdec = NULL;
+                int okf = (json_get_string_field(buf, "file", file, sizeof(file)) == 0);
+                int okb = (bhex && json_get_string_field(buf, "baseHex", bhex, len + 1) == 0 && (bdec = (char *)malloc(strlen(bhex) / 2 + 1)) && hex_decode(bhex, strlen(bhex), bdec) >= 0);
+                int okt = (thex && json_get_string_field(buf, "theirsHex", thex, len + 1) == 0 && (tdec = (char *)malloc(strlen(thex) / 2 + 1)) && hex_decode(thex, strlen(thex), tdec) >= 0);
+                free(bhex); free(thex);
+                if (!okf || !okb || !okt) { const char *resp = "{\"status\":\"ERR_BADREQ\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                else if (lock_count_file(file) > 0) { const char *resp = "{\"status\":\"ERR_LOCKED\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                else {
+                    char path[SS_PATH_MAX]; snprintf(path, sizeof(path), "%s/files/%s", g_store_root, file);
+                    char *content=NULL; size_t clen=0; ss_doc_tokens_t bd, od, td;
+                    if (read_file_into(path, &content, &clen) != 0) { const char *resp = "{\"status\":\"ERR_NOTFOUND\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                    else if (ss_tokenize(bdec, &bd) != 0) { free(content); const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                    else if (ss_tokenize(content, &od) != 0) { ss_tokens_free(&bd); free(content); const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                    else if (ss_tokenize(tdec, &td) != 0) { ss_tokens_free(&bd); ss_tokens_free(&od); free(content); const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                    else {
+                        int merged = 0, conflicts = 0;
+                        char *out = ss_merkle_merge3(&bd, &od, &td, &merged, &conflicts);
+                        ss_tokens_free(&bd); ss_tokens_free(&od); ss_tokens_free(&td);
+                        int wrc = 0;
+                        if (out && merged > 0) {
+                            // Same one-level undo as a client commit, so the merge itself can be rolled back
+                            char undopath[SS_PATH_MAX]; snprintf(undopath, sizeof(undopath), "%s/undo/%s.undo", g_store_root, file);
+                            ensure_parent_dirs_for(undopath);
+                            (void)write_file_atomic(undopath, content, clen);
+                            wrc = write_file_atomic(path, out, strlen(out));
+                            if (wrc == 0) store_adjust((long long)strlen(out) - (long long)clen);
+                        }
+                        free(content);
+                        if (!out || wrc != 0) { const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                        else {
+                            fprintf(stderr, "[SS] MERGE_TAIL %s: %d sentence(s) recovered, %d conflict(s)\n", file, merged, conflicts);
+                            if (merged > 0) {
+                                // Replicate the merged copy like any other commit
+                                notify_commit(file, out, strlen(out));
+                            }
+                            char resp[128]; snprintf(resp, sizeof(resp), "{\"status\":\"OK\",\"mergedCount\":%d,\"conflictCount\":%d}", merged, conflicts);
+                            send_msg(cfd, resp, (uint32_t)strlen(resp));
+                        }
+                        free(out);
+                    }
+                }
+                free(bdec); free(tdec);
+            } else if (strcmp(type, "LOCKS") == 0) {
+                // Migration cutover (NM): how many write sessions hold sentences of this file
+                char file[128];
+                if (json_get_string_field(buf, "file", file, sizeof(file)) != 0) { const char *resp = "{\"status\":\"ERR_BADREQ\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                else { char resp[64]; snprintf(resp, sizeof(resp), "{\"status\":\"OK\",\"lockCount\":%d}", lock_count_file(file)); send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+            } else if (strcmp(type, "FENCE") == 0) {
+                // Migration cutover (NM): refuse client commits on file for ttl seconds (0 lifts the fence)
+                char file[128]; int ttl = 0;
+                if (json_get_string_field(buf, "file", file, sizeof(file)) != 0 || json_get_int_field(buf, "ttl", &ttl) != 0) { const char *resp = "{\"status\":\"ERR_BADREQ\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                else if (fence_set(file, ttl) != 0) { const char *resp = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                else { const char *ok = "{\"status\":\"OK\"}"; send_msg(cfd, ok, (uint32_t)strlen(ok)); }
+            } else if (strcmp(type, "MANIFEST") == 0) {
+                // Bulk-resync manifest (NM): one entry per requested file, in request order; names arrive hex-encoded
+                char *names = (char *)malloc(len + 1); char *out = NULL; size_t cap = 0, w = 0; int rc = 0;
+                if (!names || json_get_string_field(buf, "files", names, len + 1) != 0) { const char *resp = "{\"status\":\"ERR_BADREQ\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                else {
+                    rc |= buf_append(&out, &cap, &w, "{\"status\":\"OK\",\"manifest\":\"");
+                    int first = 1;
+                    for (char *p = names; *p && rc == 0; ) {
+                        char *comma = strchr(p, ',');
+                        size_t hl = comma ? (size_t)(comma - p) : strlen(p);
+                        char file[128];
+                        if (!first) rc |= buf_append(&out, &cap, &w, ",");
+                        first = 0;
+                        if (hl / 2 < sizeof(file) && hex_decode(p, hl, file) > 0 && !strstr(file, "..")) rc |= manifest_append(file, &out, &cap, &w);
+                        else rc |= buf_append(&out, &cap, &w, "-:-:");
+                        p = comma ? comma + 1 : p + hl;
+                    }
+                    rc |= buf_append(&out, &cap, &w, "\"}");
+                    if (rc) { const char *er = "{\"status\":\"ERR_INTERNAL\"}"; send_msg(cfd, er, (uint32_t)strlen(er)); }
+                    else send_msg(cfd, out, (uint32_t)w);
+                }
+                free(names); free(out);
             } else if (strcmp(type, "INFO") == 0) {
                 // Return file metadata: size (bytes), mtime, word count, char count
                 char file[128]; char ticket[256];
                 int okf = (json_get_string_field(buf, "file", file, sizeof(file)) == 0);
                 int okt = (json_get_string_field(buf, "ticket", ticket, sizeof(ticket)) == 0);
                 if (!okf || !okt) { const char *resp = "{\"status\":\"ERR_BADREQ\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
-                else if (ticket_validate(ticket, file, "READ", g_ss_id) != 0 && ticket_validate(ticket, file, "WRITE", g_ss_id) != 0) { const char *resp = "{\"status\":\"ERR_NOAUTH\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
+                else if (ticket_check(ticket, file, TICKET_READ | TICKET_WRITE, g_ss_id) != 0) { const char *resp = "{\"status\":\"ERR_NOAUTH\"}"; send_msg(cfd, resp, (uint32_t)strlen(resp)); }
                 else {
                     char path[SS_PATH_MAX]; snprintf(path, sizeof(path), "%s/files/%s", g_store_root, file);
                     struct stat st;
@@ -719,9 +1099,7 @@ static void *ss_conn_handler(void *varg) {
                         // Read content to count words (best-effort)
                         char *content=NULL; size_t clen=0; int words=0;
                         if (read_file_into(path, &content, &clen) == 0 && content) {
-                            // Count words by splitting on spaces/newlines
-                            int in_word = 0; for (size_t i=0;i<clen;i++){ unsigned char c=(unsigned char)content[i]; if (c==' '||c=='\n' || c=='\t' || c=='\r'){ if (in_word){ words++; in_word=0; } } else { in_word=1; } }
-                            if (in_word) words++;
+                            words = count_words(content, clen);
                             free(content);
                         }
                         char resp[512];
@@ -771,6 +1149,7 @@ static void *ss_conn_handler(void *varg) {
             const char *resp = "{\"status\":\"ERR_BADREQ\"}";
             send_msg(cfd, resp, (uint32_t)strlen(resp));
         }
+        load_end();
         free(buf);
     }
     if (ws.active) { lock_release(ws.file, ws.sentence_idx); ss_tokens_free(&ws.doc); if (ws.pre_image) free(ws.pre_image); }
@@ -822,8 +1201,11 @@ int main(int argc, char **argv) {
 
     signal(SIGINT, on_sigint);
     signal(SIGTERM, on_sigint);
+    // A reply to a peer that already hung up (say, past the NM's fan-out deadline) just fails with EPIPE
+    signal(SIGPIPE, SIG_IGN);
 
     ensure_dirs();
+    { char fdir[SS_PATH_MAX]; snprintf(fdir, sizeof(fdir), "%s/files", g_store_root); g_bytes_stored = store_scan(fdir); }
 
     // cache NM endpoint for heartbeats/commit
     snprintf(g_nm_host, sizeof(g_nm_host), "%s", nm_host);
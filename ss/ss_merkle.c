@@ -0,0 +1,142 @@
+#define _POSIX_C_SOURCE 200809L
+#include "ss_merkle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FNV64_OFFSET 1469598103934665603ULL
+#define FNV64_PRIME 1099511628211ULL
+
+static uint64_t fnv64_update(uint64_t h, const void *data, size_t n) {
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < n; ++i) { h ^= p[i]; h *= FNV64_PRIME; }
+    return h;
+}
+
+int ss_merkle_build(const char *text, size_t len, ss_merkle_t *out) {
+    if (!text || !out) return -1;
+    memset(out, 0, sizeof(*out));
+    ss_doc_tokens_t doc;
+    if (ss_tokenize(text, &doc) != 0) return -1;
+    uint64_t *leaves = (uint64_t *)calloc(doc.num_sentences > 0 ? (size_t)doc.num_sentences : 1, sizeof(uint64_t));
+    if (!leaves) { ss_tokens_free(&doc); return -1; }
+    uint64_t root = FNV64_OFFSET;
+    for (int i = 0; i < doc.num_sentences; ++i) {
+        uint64_t h = FNV64_OFFSET;
+        for (int j = 0; j < doc.word_counts[i]; ++j) {
+            if (j) h = fnv64_update(h, " ", 1);
+            h = fnv64_update(h, doc.sent_words[i][j], strlen(doc.sent_words[i][j]));
+        }
+        leaves[i] = h;
+        root = fnv64_update(root, &h, sizeof(h));
+    }
+    (void)len; // whitespace between words is not content; only tokens feed the hashes
+    out->root = root; out->leaves = leaves; out->n_leaves = doc.num_sentences;
+    ss_tokens_free(&doc);
+    return 0;
+}
+
+uint64_t ss_merkle_bytes(const char *data, size_t n) {
+    return fnv64_update(FNV64_OFFSET, data, n);
+}
+
+void ss_merkle_free(ss_merkle_t *m) {
+    if (!m) return;
+    free(m->leaves); m->leaves = NULL; m->n_leaves = 0;
+}
+
+void ss_merkle_hex(uint64_t h, char out[17]) {
+    snprintf(out, 17, "%016llx", (unsigned long long)h);
+}
+
+char *ss_sentence_text(const ss_doc_tokens_t *doc, int sidx) {
+    if (!doc || sidx < 0 || sidx >= doc->num_sentences) return NULL;
+    size_t total = 0;
+    for (int j = 0; j < doc->word_counts[sidx]; ++j) total += strlen(doc->sent_words[sidx][j]) + 1;
+    char *out = (char *)malloc(total + 1);
+    if (!out) return NULL;
+    size_t w = 0;
+    for (int j = 0; j < doc->word_counts[sidx]; ++j) {
+        if (j) out[w++] = ' ';
+        size_t n = strlen(doc->sent_words[sidx][j]);
+        memcpy(out + w, doc->sent_words[sidx][j], n); w += n;
+    }
+    out[w] = '\0';
+    return out;
+}
+
+char *ss_merkle_splice(const ss_doc_tokens_t *cur, int count, const int *idx, char *const *repl, int nrepl) {
+    if (!cur || count < 0) return NULL;
+    char **parts = (char **)calloc(count > 0 ? (size_t)count : 1, sizeof(char *));
+    if (!parts) return NULL;
+    size_t total = 0; int ok = 1;
+    for (int i = 0; i < count && ok; ++i) {
+        const char *r = NULL;
+        for (int k = 0; k < nrepl; ++k) if (idx[k] == i) { r = repl[k]; break; }
+        if (r) parts[i] = strdup(r);
+        else if (i < cur->num_sentences) parts[i] = ss_sentence_text(cur, i);
+        else parts[i] = strdup("");
+        if (!parts[i]) ok = 0;
+        else total += strlen(parts[i]) + 1;
+    }
+    char *out = ok ? (char *)malloc(total + 1) : NULL;
+    if (out) {
+        size_t w = 0;
+        for (int i = 0; i < count; ++i) {
+            size_t n = strlen(parts[i]);
+            if (n == 0) continue; // empty (trailing) sentences re-tokenize the same without a separator
+            if (w) out[w++] = ' ';
+            memcpy(out + w, parts[i], n); w += n;
+        }
+        out[w] = '\0';
+    }
+    for (int i = 0; i < count; ++i) free(parts[i]);
+    free(parts);
+    return out;
+}
+
+static int sent_eq(const char *a, const char *b) {
+    if (!a || !b) return a == b;
+    return strcmp(a, b) == 0;
+}
+
+char *ss_merkle_merge3(const ss_doc_tokens_t *base, const ss_doc_tokens_t *ours, const ss_doc_tokens_t *theirs, int *merged, int *conflicts) {
+    if (!base || !ours || !theirs) return NULL;
+    int count = ours->num_sentences;
+    if (theirs->num_sentences > count) count = theirs->num_sentences;
+    if (base->num_sentences > count) count = base->num_sentences;
+    int nm = 0, nc = 0;
+    char **parts = (char **)calloc(count > 0 ? (size_t)count : 1, sizeof(char *));
+    if (!parts) return NULL;
+    size_t total = 0;
+    for (int i = 0; i < count; ++i) {
+        // NULL stands for "no sentence i on this side"
+        char *b = ss_sentence_text(base, i), *o = ss_sentence_text(ours, i), *t = ss_sentence_text(theirs, i);
+        char *pick = o;
+        if (!sent_eq(t, b)) {
+            if (sent_eq(o, b)) { pick = t; nm++; }
+            else if (!sent_eq(o, t)) nc++;
+        }
+        if (pick) { parts[i] = pick; total += strlen(pick) + 1; }
+        if (b) free(b);
+        if (o && o != pick) free(o);
+        if (t && t != pick) free(t);
+    }
+    char *out = (char *)malloc(total + 1);
+    if (out) {
+        size_t w = 0;
+        for (int i = 0; i < count; ++i) {
+            size_t n = parts[i] ? strlen(parts[i]) : 0;
+            if (n == 0) continue;
+            if (w) out[w++] = ' ';
+            memcpy(out + w, parts[i], n); w += n;
+        }
+        out[w] = '\0';
+    }
+    for (int i = 0; i < count; ++i) free(parts[i]);
+    free(parts);
+    if (merged) *merged = nm;
+    if (conflicts) *conflicts = nc;
+    return out;
+}
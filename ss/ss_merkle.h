@@ -0,0 +1,44 @@
+#ifndef SS_MERKLE_H
+#define SS_MERKLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ss_tokenize.h"
+
+// Content hashes used by the NM anti-entropy scrubber.
+// Leaves: one 64-bit FNV-1a hash per sentence, taken over the sentence's words joined by single spaces
+// (the canonical form ss_tokens_compose writes). Root: hash over the leaves in order, so two copies share a
+// root when they hold the same sentences regardless of whitespace, and leaves pinpoint which sentences differ.
+
+typedef struct {
+    uint64_t root;
+    uint64_t *leaves;   // [n_leaves], malloc'd
+    int n_leaves;
+} ss_merkle_t;
+
+// Build hashes for text of length len. Returns 0 on success.
+int ss_merkle_build(const char *text, size_t len, ss_merkle_t *out);
+
+// Free leaves inside m
+void ss_merkle_free(ss_merkle_t *m);
+
+// Format a hash as 16 lowercase hex digits plus NUL
+void ss_merkle_hex(uint64_t h, char out[17]);
+
+// Plain FNV-1a over raw bytes (undo snapshots and checkpoints, which are compared as opaque blobs)
+uint64_t ss_merkle_bytes(const char *data, size_t n);
+
+// Canonical text of sentence sidx (words joined by single spaces); caller frees. NULL on bad index/OOM.
+char *ss_sentence_text(const ss_doc_tokens_t *doc, int sidx);
+
+// Rebuild a document of count sentences, non-empty ones joined by single spaces: sentence i is
+// repl[k] when idx[k] == i, otherwise cur's sentence i (empty past its end). Caller frees.
+char *ss_merkle_splice(const ss_doc_tokens_t *cur, int count, const int *idx, char *const *repl, int nrepl);
+
+// Three-way sentence merge for failover reconciliation. Sentence i of theirs is taken when it differs from
+// base and ours still matches base; where both sides changed the same sentence ours wins and it counts as a
+// conflict. Returns the merged text (caller frees) or NULL on OOM; *merged/*conflicts receive the counts.
+char *ss_merkle_merge3(const ss_doc_tokens_t *base, const ss_doc_tokens_t *ours, const ss_doc_tokens_t *theirs, int *merged, int *conflicts);
+
+#endif // SS_MERKLE_H
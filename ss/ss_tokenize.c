@@ -111,6 +111,7 @@ int ss_tokenize(const char *text, ss_doc_tokens_t *out) {
             }
             cur_s = num_sent;
             num_sent++;
+            word_counts[cur_s] = 0; // slots past the first 8 come from realloc, uninitialised
             word_caps[cur_s] = 8;
             sent_words[cur_s] = (char **)calloc((size_t)word_caps[cur_s], sizeof(char *));
             if (!sent_words[cur_s]) goto oom;